@@ -5,6 +5,7 @@
 #include "mutex.h"
 #include "debug.h"
 #include "mm/malloc.h"
+#include "mm/vmalloc.h"
 #include "device.h"
 #include "pci.h"
 
@@ -238,6 +239,65 @@ void pci_cfg_write32(struct pci_dev *dev, uint8_t reg, uint32_t val)
 	platform_pci_cfg_write32(dev->bus, dev->dev, dev->func, reg, val);
 }
 
+/**
+ * Map a memory BAR of a device uncached into the kernel virtual range area
+ * @dev		- PCI device
+ * @bar		- index of the BAR
+ * @sizep	- where to store the size of the BAR
+ */
+void *pci_map_bar(struct pci_dev *dev, int bar, size_t *sizep)
+{
+	uint8_t reg;
+	uint16_t cmd;
+	uint32_t val, mask;
+	size_t size;
+	void *ret = NULL;
+
+	ASSERT((bar >= 0) && (bar < 6));
+
+	reg = PCI_CFG_BAR0 + bar * 4;
+	val = pci_cfg_read32(dev, reg);
+	if (FLAG_ON(val, PCI_BAR_IO)) {
+		DEBUG(DL_DBG, ("pci: BAR%d is in I/O space.\n", bar));
+		goto out;
+	}
+
+	/* Memory above 4GB can not be mapped */
+	if (((val & 0x6) == PCI_BAR_TYPE_64) && (bar < 5) &&
+	    pci_cfg_read32(dev, reg + 4)) {
+		DEBUG(DL_WRN, ("pci: BAR%d is above 4GB.\n", bar));
+		goto out;
+	}
+
+	/* Size the BAR by writing all ones to it, with the memory decoding
+	 * disabled meanwhile
+	 */
+	cmd = pci_cfg_read16(dev, PCI_CFG_COMMAND);
+	pci_cfg_write16(dev, PCI_CFG_COMMAND, cmd & ~PCI_CMD_MEM);
+	pci_cfg_write32(dev, reg, 0xFFFFFFFF);
+	mask = pci_cfg_read32(dev, reg);
+	pci_cfg_write32(dev, reg, val);
+	pci_cfg_write16(dev, PCI_CFG_COMMAND, cmd);
+
+	size = ~(mask & PCI_BAR_MEM_MASK) + 1;
+	if (!(mask & PCI_BAR_MEM_MASK) || !(val & PCI_BAR_MEM_MASK)) {
+		goto out;
+	}
+
+	ret = ioremap(val & PCI_BAR_MEM_MASK, size);
+	if (ret && sizep) {
+		*sizep = size;
+	}
+
+ out:
+	return ret;
+}
+
+void pci_unmap_bar(void *addr)
+{
+	iounmap(addr);
+}
+
 int pci_driver_register()
 {
 	int rc = 0;
@@ -32,6 +32,11 @@
 #define PCI_CFG_MIN_GRANT	0x3E	// Min grant
 #define PCI_CFG_MAX_LATENCY	0x3F	// Max latency
 
+#define PCI_CMD_MEM		(1<<1)		// Memory space decoding enabled
+#define PCI_BAR_IO		(1<<0)		// BAR is in the I/O space
+#define PCI_BAR_TYPE_64		(2<<1)		// Memory BAR is 64-bit
+#define PCI_BAR_MEM_MASK	0xFFFFFFF0	// Address of a memory BAR
+
 struct dev;
 
 struct pci_dev {
@@ -64,5 +69,7 @@ extern uint16_t pci_cfg_read16(struct pci_dev *dev, uint8_t reg);
 extern void pci_cfg_write16(struct pci_dev *dev, uint8_t reg, uint16_t val);
 extern uint32_t pci_cfg_read32(struct pci_dev *dev, uint8_t reg);
 extern void pci_cfg_write32(struct pci_dev *dev, uint8_t reg, uint32_t val);
+extern void *pci_map_bar(struct pci_dev *dev, int bar, size_t *sizep);
+extern void pci_unmap_bar(void *addr);
 
 #endif	/* __PCI_H__ */
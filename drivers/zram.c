@@ -0,0 +1,453 @@
+#include <types.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "debug.h"
+#include "mutex.h"
+#include "pit.h"
+#include "div64.h"
+#include "fs.h"
+#include "device.h"
+#include "devfs.h"
+#include "procfs.h"
+#include "mm/malloc.h"
+#include "mm/slab.h"
+#include "mm/vmalloc.h"
+#include "mm/swap.h"
+#include "rtl/lz4.h"
+
+#define ZRAM_MAJOR	6
+
+/* Size of the RAM disk, its pages only take memory once written */
+#define ZRAM_DISK_SIZE	(16 * 1024 * 1024)
+
+/* The pool has a slab cache for each 64 bytes of compressed size */
+#define ZRAM_CLASS_SHIFT	6
+#define ZRAM_NR_CLASSES		(PAGE_SIZE >> ZRAM_CLASS_SHIFT)
+
+/* Pages compressed to more than this are stored as they are */
+#define ZRAM_MAX_COMP	(PAGE_SIZE / 4 * 3)
+
+/* Flags of a page of the disk */
+#define ZRAM_ZERO	(1<<0)	// Page is zero-filled, no data is stored
+
+/*
+ * A page of the disk, the data is an object of the size class cache
+ */
+struct zram_slot {
+	void *obj;		// Compressed data of the page
+	uint16_t size;		// Size of the data, PAGE_SIZE if not compressed
+	uint16_t flags;		// Flags of the page
+};
+
+/*
+ * Counters of a RAM disk
+ */
+struct zram_stats {
+	size_t nr_reads;		// Pages read
+	size_t nr_writes;		// Pages written
+	size_t nr_stored;		// Pages holding compressed data
+	size_t nr_zero;			// Zero-filled pages
+	size_t nr_raw;			// Pages which did not compress
+	size_t compr_size;		// Compressed size of the stored pages
+	size_t pool_size;		// Pool memory used by the stored pages
+	useconds_t read_time;		// Time spent reading pages
+	useconds_t write_time;		// Time spent writing pages
+};
+
+/*
+ * RAM disk which compresses its pages
+ */
+struct zram {
+	struct mutex lock;		// Lock for the pages and the buffers
+	size_t nr_pages;		// Number of pages of the disk
+	struct zram_slot *slots;	// Pages of the disk
+	uint8_t *buf;			// Output of the compressor
+	uint8_t *page;			// Page for the partial writes
+	void *wrkmem;			// Work memory of the compressor
+	struct zram_stats stats;
+};
+
+static slab_cache_t _zram_classes[ZRAM_NR_CLASSES];
+static struct zram *_zram = NULL;
+static struct dev_ops _zram_ops;
+
+static boolean_t zram_page_zero(const uint8_t *data)
+{
+	size_t i;
+	const u_long *w = (const u_long *)data;
+
+	for (i = 0; i < (PAGE_SIZE / sizeof(u_long)); i++) {
+		if (w[i]) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Size of the pool object holding data of a size */
+static INLINE size_t zram_class_size(size_t size)
+{
+	return ROUND_UP(size, 1 << ZRAM_CLASS_SHIFT);
+}
+
+/* Free the data of a page, lock must be held */
+static void zram_slot_free(struct zram *z, size_t index)
+{
+	struct zram_slot *s = &z->slots[index];
+
+	if (FLAG_ON(s->flags, ZRAM_ZERO)) {
+		z->stats.nr_zero--;
+	} else if (s->obj) {
+		slab_cache_free(&_zram_classes[(s->size - 1) >> ZRAM_CLASS_SHIFT],
+				s->obj);
+		z->stats.nr_stored--;
+		z->stats.compr_size -= s->size;
+		z->stats.pool_size -= zram_class_size(s->size);
+		if (s->size == PAGE_SIZE) {
+			z->stats.nr_raw--;
+		}
+	}
+
+	s->obj = NULL;
+	s->size = 0;
+	s->flags = 0;
+}
+
+/* Compress a page and store it, lock must be held */
+static int zram_store(struct zram *z, size_t index, const uint8_t *data)
+{
+	size_t size;
+	void *obj;
+	struct zram_slot *s = &z->slots[index];
+
+	if (zram_page_zero(data)) {
+		zram_slot_free(z, index);
+		s->flags = ZRAM_ZERO;
+		z->stats.nr_zero++;
+		return 0;
+	}
+
+	size = lz4_compress(data, PAGE_SIZE, z->buf, ZRAM_MAX_COMP, z->wrkmem);
+	if (!size) {
+		size = PAGE_SIZE;
+	}
+
+	/* The old data is kept if there is no memory for the new one */
+	obj = slab_cache_alloc(&_zram_classes[(size - 1) >> ZRAM_CLASS_SHIFT]);
+	if (!obj) {
+		return ENOMEM;
+	}
+	memcpy(obj, (size == PAGE_SIZE) ? data : z->buf, size);
+
+	zram_slot_free(z, index);
+	s->obj = obj;
+	s->size = size;
+	z->stats.nr_stored++;
+	z->stats.compr_size += size;
+	z->stats.pool_size += zram_class_size(size);
+	if (size == PAGE_SIZE) {
+		z->stats.nr_raw++;
+	}
+
+	return 0;
+}
+
+/* Decompress a page, pages never written read as zeroes. Lock must be held */
+static int zram_load(struct zram *z, size_t index, uint8_t *data)
+{
+	struct zram_slot *s = &z->slots[index];
+
+	if (!s->obj) {
+		memset(data, 0, PAGE_SIZE);
+	} else if (s->size == PAGE_SIZE) {
+		memcpy(data, s->obj, PAGE_SIZE);
+	} else if (lz4_decompress(s->obj, s->size, data, PAGE_SIZE) != PAGE_SIZE) {
+		DEBUG(DL_WRN, ("page(%d) corrupted.\n", index));
+		return EIO;
+	}
+
+	return 0;
+}
+
+int zram_open()
+{
+	return 0;
+}
+
+int zram_close(struct dev *d)
+{
+	return 0;
+}
+
+int zram_read(struct dev *d, off_t off, size_t size, uint8_t *buf)
+{
+	int rc = 0;
+	size_t index, pos, len;
+	useconds_t start;
+	struct zram *z = d->data;
+
+	if ((off + size) < off || (off + size) > (z->nr_pages * PAGE_SIZE)) {
+		return EINVAL;
+	}
+
+	mutex_acquire(&z->lock);
+	start = sys_time();
+
+	while (size) {
+		index = off / PAGE_SIZE;
+		pos = off % PAGE_SIZE;
+		len = MIN(size, PAGE_SIZE - pos);
+
+		/* Whole pages are decompressed in place */
+		if (len == PAGE_SIZE) {
+			rc = zram_load(z, index, buf);
+		} else {
+			rc = zram_load(z, index, z->page);
+			memcpy(buf, z->page + pos, len);
+		}
+		if (rc != 0) {
+			break;
+		}
+
+		z->stats.nr_reads++;
+		off += len;
+		buf += len;
+		size -= len;
+	}
+
+	z->stats.read_time += sys_time() - start;
+	mutex_release(&z->lock);
+
+	return rc;
+}
+
+int zram_write(struct dev *d, off_t off, size_t size, uint8_t *buf)
+{
+	int rc = 0;
+	size_t index, pos, len;
+	useconds_t start;
+	struct zram *z = d->data;
+
+	if ((off + size) < off || (off + size) > (z->nr_pages * PAGE_SIZE)) {
+		return EINVAL;
+	}
+
+	mutex_acquire(&z->lock);
+	start = sys_time();
+
+	while (size) {
+		index = off / PAGE_SIZE;
+		pos = off % PAGE_SIZE;
+		len = MIN(size, PAGE_SIZE - pos);
+
+		/* Partial pages are merged with their current data */
+		if (len == PAGE_SIZE) {
+			rc = zram_store(z, index, buf);
+		} else {
+			rc = zram_load(z, index, z->page);
+			if (rc == 0) {
+				memcpy(z->page + pos, buf, len);
+				rc = zram_store(z, index, z->page);
+			}
+		}
+		if (rc != 0) {
+			break;
+		}
+
+		z->stats.nr_writes++;
+		off += len;
+		buf += len;
+		size -= len;
+	}
+
+	z->stats.write_time += sys_time() - start;
+	mutex_release(&z->lock);
+
+	return rc;
+}
+
+void zram_destroy(struct dev *d)
+{
+	;
+}
+
+/* Throughput in KB per millisecond, about the same as MB per second */
+static INLINE size_t zram_throughput(size_t nr_pages, useconds_t time)
+{
+	do_div(time, 1000);
+	return (nr_pages * (PAGE_SIZE / 1024)) / MAX((size_t)time, 1);
+}
+
+/* Compression ratio and throughput of the RAM disk */
+static void zram_show(struct procfs_buf *b)
+{
+	size_t orig, pool, ratio;
+	struct zram_stats st;
+
+	mutex_acquire(&_zram->lock);
+	memcpy(&st, &_zram->stats, sizeof(st));
+	mutex_release(&_zram->lock);
+
+	/* Sizes in KB, the ratio is the original size over the pool size */
+	orig = (st.nr_stored + st.nr_zero) * (PAGE_SIZE / 1024);
+	pool = (st.pool_size + 1023) / 1024;
+	ratio = pool ? ((orig * 100) / pool) : 0;
+
+	procfs_printf(b, "disksize:      %d KB\n",
+		      (_zram->nr_pages * PAGE_SIZE) / 1024);
+	procfs_printf(b, "pages_stored:  %d\n", st.nr_stored);
+	procfs_printf(b, "pages_zero:    %d\n", st.nr_zero);
+	procfs_printf(b, "pages_raw:     %d\n", st.nr_raw);
+	procfs_printf(b, "orig_size:     %d KB\n", orig);
+	procfs_printf(b, "compr_size:    %d KB\n", (st.compr_size + 1023) / 1024);
+	procfs_printf(b, "pool_size:     %d KB\n", pool);
+	procfs_printf(b, "ratio:         %d.%02d\n", ratio / 100, ratio % 100);
+	procfs_printf(b, "reads:         %d pages, %d MB/s\n", st.nr_reads,
+		      zram_throughput(st.nr_reads, st.read_time));
+	procfs_printf(b, "writes:        %d pages, %d MB/s\n", st.nr_writes,
+		      zram_throughput(st.nr_writes, st.write_time));
+}
+
+static void zram_free(struct zram *z)
+{
+	if (z->slots) {
+		vfree(z->slots);
+	}
+	if (z->buf) {
+		kfree(z->buf);
+	}
+	if (z->page) {
+		kfree(z->page);
+	}
+	if (z->wrkmem) {
+		kfree(z->wrkmem);
+	}
+	kfree(z);
+}
+
+static struct zram *zram_create(size_t size)
+{
+	struct zram *z;
+
+	z = kmalloc(sizeof(struct zram), MM_ZERO);
+	if (!z) {
+		goto out;
+	}
+
+	mutex_init(&z->lock, "zram-mutex", 0);
+	z->nr_pages = size / PAGE_SIZE;
+	z->slots = vmalloc(z->nr_pages * sizeof(struct zram_slot), MM_ZERO);
+	z->buf = kmalloc(PAGE_SIZE, 0);
+	z->page = kmalloc(PAGE_SIZE, 0);
+	z->wrkmem = kmalloc(LZ4_WORKMEM_SIZE, 0);
+	if (!z->slots || !z->buf || !z->page || !z->wrkmem) {
+		zram_free(z);
+		z = NULL;
+	}
+
+ out:
+	return z;
+}
+
+int zram_init(void)
+{
+	int rc = 0, i, nr_classes = 0;
+	char name[SLAB_NAME_MAX];
+	struct vfs_node *n = NULL;
+	struct dev *d = NULL;
+	dev_t devno = 0;
+
+	/* Register ZRAM device class */
+	rc = dev_register(ZRAM_MAJOR, "zram");
+	if (rc != 0) {
+		DEBUG(DL_ERR, ("register ZRAM device class failed.\n"));
+		goto out;
+	}
+
+	/* Open the root of devfs */
+	n = vfs_lookup("/dev", VFS_DIRECTORY);
+	if (!n) {
+		rc = EGENERIC;
+		DEBUG(DL_ERR, ("devfs not mounted.\n"));
+		goto out;
+	}
+
+	for (i = 0; i < ZRAM_NR_CLASSES; i++) {
+		snprintf(name, SLAB_NAME_MAX, "zram-%d",
+			 (i + 1) << ZRAM_CLASS_SHIFT);
+		slab_cache_init(&_zram_classes[i], name,
+				(i + 1) << ZRAM_CLASS_SHIFT, NULL, NULL, 0);
+		nr_classes++;
+	}
+
+	_zram = zram_create(ZRAM_DISK_SIZE);
+	if (!_zram) {
+		rc = ENOMEM;
+		goto out;
+	}
+
+	devno = MKDEV(ZRAM_MAJOR, 0);
+	rc = dev_create(devno, DEV_CREATE, _zram, &d);
+	if (rc != 0) {
+		DEBUG(DL_ERR, ("create device failed.\n"));
+		goto out;
+	}
+
+	/* Initialize the entry point of all requests */
+	memset(&_zram_ops, 0, sizeof(_zram_ops));
+	_zram_ops.open = zram_open;
+	_zram_ops.close = zram_close;
+	_zram_ops.read = zram_read;
+	_zram_ops.write = zram_write;
+	_zram_ops.destroy = zram_destroy;
+	d->ops = &_zram_ops;
+
+	/* Register a node in devfs */
+	rc = devfs_register((devfs_handle_t)n, "zram0", 0, NULL, devno);
+	if (rc != 0) {
+		DEBUG(DL_ERR, ("register device(zram0) failed, err:%x\n", rc));
+		goto out;
+	}
+
+	procfs_register("zram", zram_show);
+
+	/* Cold pages are compressed in memory before they go to a disk */
+	rc = swap_on(devno, ZRAM_DISK_SIZE);
+	if (rc != 0) {
+		DEBUG(DL_INF, ("swap on zram0 failed, err:%x\n", rc));
+		rc = 0;
+	}
+
+ out:
+	if (n) {
+		vfs_node_deref(n);
+	}
+
+	if (rc != 0) {
+		if (devno != 0) {
+			dev_destroy(devno);
+		}
+		if (_zram) {
+			zram_free(_zram);
+			_zram = NULL;
+		}
+		/* Nothing was stored yet, so the caches hold no slabs */
+		for (i = 0; i < nr_classes; i++) {
+			slab_cache_delete(&_zram_classes[i]);
+		}
+		dev_unregister(ZRAM_MAJOR);
+	}
+
+	return rc;
+}
+
+int zram_unload(void)
+{
+	int rc = -1;
+
+	return rc;
+}
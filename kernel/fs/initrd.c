@@ -3,6 +3,7 @@
 #include <errno.h>
 #include "hal/hal.h"
 #include "mm/malloc.h"
+#include "mm/page.h"
 #include "fs.h"
 #include "dirent.h"
 #include "initrd.h"
@@ -124,6 +125,39 @@ static int initrd_read(struct vfs_node *node, uint32_t offset,
 	return size;
 }
 
+/*
+ * The file data of the ramdisk is page aligned, so the pages of a file can
+ * be mapped without copying them
+ */
+static int initrd_map(struct vfs_node *node, uint32_t offset, phys_addr_t *physp)
+{
+	int i;
+	phys_addr_t phys;
+
+	/* Find the coresponding initrd node */
+	for (i = 0; i < _nr_initrd_nodes; i++) {
+		if (_initrd_nodes[i].ino == node->ino) {
+			break;
+		}
+	}
+
+	/* Only whole pages of the file can be mapped */
+	if ((i == _nr_initrd_nodes) ||
+	    ((offset + PAGE_SIZE) > _initrd_nodes[i].length)) {
+		return EINVAL;
+	}
+
+	/* Images made by an older make_initrd are not aligned */
+	phys = (ptr_t)(_initrd_nodes[i].data + offset);
+	if (phys % PAGE_SIZE) {
+		return EINVAL;
+	}
+
+	*physp = phys;
+
+	return 0;
+}
+
 /*
  * Caller should free the returned dirent by kfree
  */
@@ -195,6 +229,7 @@ static struct vfs_node_ops _ramfs_node_ops = {
 	.close = initrd_close,
 	.readdir = initrd_readdir,
 	.finddir = initrd_finddir,
+	.map = initrd_map,
 };
 
 static int initrd_read_node(struct vfs_mount *mnt, ino_t id, struct vfs_node **np)
@@ -1,13 +1,40 @@
 #include <types.h>
 #include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include "matrix/matrix.h"
 #include "mm/malloc.h"
+#include "mm/va.h"
+#include "mm/ksm.h"
+#include "proc/process.h"
 #include "fs.h"
+#include "procfs.h"
 #include "dirent.h"
 #include "debug.h"
 
+/* Size of the buffer the contents of a file are generated in */
+#define PROCFS_BUF_SIZE		4096
+
+#define NR_MAX_PROCFS_NODES	16
+
+/*
+ * A file of the process file system, its contents are generated each time
+ * it is read
+ */
+struct procfs_entry {
+	const char *name;
+	ino_t ino;
+	procfs_show_func_t show;
+};
+
+static void procfs_ksm_show(struct procfs_buf *b);
+
+static struct procfs_entry _procfs_entries[NR_MAX_PROCFS_NODES] = {
+	{ "ksm", 1, procfs_ksm_show },
+};
+
 int _nr_procfs_nodes = 1;
 
 static int procfs_mount(struct vfs_mount *mnt, int flags, const void *data);
@@ -19,6 +46,91 @@ struct vfs_type _procfs_type = {
 	.mount = procfs_mount
 };
 
+/**
+ * Register a file in the root of the process file system, the files are
+ * never removed
+ */
+int procfs_register(const char *name, procfs_show_func_t show)
+{
+	int rc = -1;
+	struct procfs_entry *e;
+
+	ASSERT((name != NULL) && (show != NULL));
+
+	if (_nr_procfs_nodes >= NR_MAX_PROCFS_NODES) {
+		rc = ENOMEM;
+		DEBUG(DL_WRN, ("no room for procfs node(%s).\n", name));
+		goto out;
+	}
+
+	/* The entry is filled in before readers can see it */
+	e = &_procfs_entries[_nr_procfs_nodes];
+	e->name = name;
+	e->ino = _nr_procfs_nodes + 1;
+	e->show = show;
+	_nr_procfs_nodes++;
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/**
+ * Append formatted output to the contents of a file, the output is
+ * truncated when the buffer is full
+ */
+void procfs_printf(struct procfs_buf *b, const char *fmt, ...)
+{
+	int n;
+	va_list args;
+
+	va_start(args, fmt);
+	n = vsnprintf(b->data + b->len, b->size - b->len, fmt, args);
+	va_end(args);
+
+	if (n > 0) {
+		b->len = MIN(b->len + n, b->size - 1);
+	}
+}
+
+static void procfs_ksm_proc(struct process *p, void *ctx)
+{
+	size_t merged;
+
+	if (p->vas && ksm_space_merged(p->vas, &merged)) {
+		procfs_printf(ctx, "%-8d%-16s%d\n", p->id, p->name, merged);
+	}
+}
+
+/* Same-page merging statistics, globally and for each process */
+static void procfs_ksm_show(struct procfs_buf *b)
+{
+	struct ksm_stats st;
+
+	ksm_get_stats(&st);
+	procfs_printf(b, "pages_shared:  %d\n", st.pages_shared);
+	procfs_printf(b, "pages_sharing: %d\n", st.pages_sharing);
+	procfs_printf(b, "pages_zero:    %d\n", st.pages_zero);
+	procfs_printf(b, "pages_scanned: %d\n", st.pages_scanned);
+	procfs_printf(b, "full_scans:    %d\n", st.full_scans);
+
+	procfs_printf(b, "\n%-8s%-16s%s\n", "PID", "NAME", "MERGED");
+	process_walk(procfs_ksm_proc, b);
+}
+
+static struct procfs_entry *procfs_entry_lookup(ino_t ino)
+{
+	int i;
+
+	for (i = 0; i < _nr_procfs_nodes; i++) {
+		if (_procfs_entries[i].ino == ino) {
+			return &_procfs_entries[i];
+		}
+	}
+
+	return NULL;
+}
+
 static int procfs_create(struct vfs_node *parent, const char *name,
 			 uint32_t type, struct vfs_node **np)
 {
@@ -40,6 +152,42 @@ static int procfs_close(struct vfs_node *node)
 	return rc;
 }
 
+static int procfs_read(struct vfs_node *node, uint32_t offset,
+		       uint32_t size, uint8_t *buffer)
+{
+	int rc = -1;
+	struct procfs_entry *e;
+	struct procfs_buf b;
+
+	e = procfs_entry_lookup(node->ino);
+	if (!e) {
+		DEBUG(DL_DBG, ("node(%s:%d) not found.\n", node->name, node->ino));
+		goto out;
+	}
+
+	b.data = kmalloc(PROCFS_BUF_SIZE, 0);
+	if (!b.data) {
+		goto out;
+	}
+	b.size = PROCFS_BUF_SIZE;
+	b.len = 0;
+	b.data[0] = 0;
+
+	e->show(&b);
+
+	if (offset >= b.len) {
+		rc = 0;
+	} else {
+		rc = MIN(size, b.len - offset);
+		memcpy(buffer, b.data + offset, rc);
+	}
+
+	kfree(b.data);
+
+ out:
+	return rc;
+}
+
 static int procfs_readdir(struct vfs_node *node, uint32_t index, struct dirent **dentry)
 {
 	int rc = -1;
@@ -59,8 +207,8 @@ static int procfs_readdir(struct vfs_node *node, uint32_t index, struct dirent *
 	}
 
 	memset(new_dentry, 0, sizeof(struct dirent));
-	strncpy(new_dentry->d_name, "cmdline", 128);
-	new_dentry->d_ino = 1;
+	strncpy(new_dentry->d_name, _procfs_entries[index].name, 128);
+	new_dentry->d_ino = _procfs_entries[index].ino;
 	*dentry = new_dentry;
 	rc = 0;
 
@@ -70,15 +218,23 @@ static int procfs_readdir(struct vfs_node *node, uint32_t index, struct dirent *
 
 static int procfs_finddir(struct vfs_node *node, const char *name, ino_t *id)
 {
-	int rc = -1;
+	int rc = -1, i;
 
-	ASSERT(id != NULL);
+	ASSERT((id != NULL) && (name != NULL));
+
+	for (i = 0; i < _nr_procfs_nodes; i++) {
+		if (strcmp(name, _procfs_entries[i].name) == 0) {
+			*id = _procfs_entries[i].ino;
+			rc = 0;
+			break;
+		}
+	}
 
 	return rc;
 }
 
 static struct vfs_node_ops _procfs_node_ops = {
-	.read = NULL,
+	.read = procfs_read,
 	.write = NULL,
 	.create = procfs_create,
 	.close = procfs_close,
@@ -89,9 +245,31 @@ static struct vfs_node_ops _procfs_node_ops = {
 static int procfs_read_node(struct vfs_mount *mnt, ino_t id, struct vfs_node **np)
 {
 	int rc = -1;
+	struct vfs_node *node;
+	struct procfs_entry *e;
 
 	ASSERT(np != NULL);
 
+	e = procfs_entry_lookup(id);
+	if (!e) {
+		goto out;
+	}
+
+	node = vfs_node_alloc(mnt, VFS_FILE, &_procfs_node_ops, NULL);
+	if (!node) {
+		rc = ENOMEM;
+		goto out;
+	}
+
+	node->ino = id;
+	node->mask = 0444;
+	node->length = 0;
+	strncpy(node->name, e->name, 128);
+
+	*np = node;
+	rc = 0;
+
+ out:
 	return rc;
 }
 
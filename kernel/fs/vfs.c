@@ -3,6 +3,7 @@
 #include <errno.h>
 #include "matrix/matrix.h"
 #include "mm/malloc.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 #include "mutex.h"
 #include "proc/process.h"
@@ -165,6 +166,34 @@ int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *bu
 	return rc;
 }
 
+/**
+ * Get the physical address of the file data at a page aligned offset, only
+ * file systems which keep the whole file in memory support this
+ */
+int vfs_map(struct vfs_node *node, uint32_t offset, phys_addr_t *physp)
+{
+	int rc = -1;
+
+	if (!node || !physp || (offset % PAGE_SIZE)) {
+		goto out;
+	}
+
+	if (!node->ops) {
+		rc = EGENERIC;
+		DEBUG(DL_INF, ("no ops on node %s.\n", node->name));
+		goto out;
+	}
+
+	if (node->ops->map != NULL) {
+		rc = node->ops->map(node, offset, physp);
+	} else {
+		rc = ENOSYS;
+	}
+
+ out:
+	return rc;
+}
+
 int vfs_create(const char *path, uint32_t type, struct vfs_node **np)
 {
 	int rc = -1;
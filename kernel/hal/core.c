@@ -8,6 +8,7 @@
 #include "mm/mlayout.h"
 #include "mm/page.h"
 #include "mm/malloc.h"
+#include "mm/numa.h"
 #include "div64.h"
 
 #define FREQ_ATTEMPTS	9
@@ -67,6 +68,12 @@ static void core_ctor(struct core *c, core_id_t id, int state)
 	/* Initialize timer information */
 	spinlock_init(&c->timer_lock, "tmr-lock");
 	LIST_INIT(&c->timers);
+
+	/* Initialize the free frames cache */
+	page_cache_init(&c->page_cache);
+
+	/* The nodes are known once the SRAT was parsed */
+	c->node = numa_core_node(id);
 }
 
 void dump_core(struct core *c)
@@ -98,6 +105,12 @@ static void detect_core_features(struct core *c, struct core_features *f)
 	/* Get the highest supported extended level */
 	x86_coreid(X86_COREID_EXT_MAX, &f->highest_extended, &ebx, &ecx, &edx);
 	if (f->highest_extended & (1<<31)) {
+		if (f->highest_extended >= X86_COREID_EXT_FEATURE) {
+			/* Get extended feature information */
+			x86_coreid(X86_COREID_EXT_FEATURE, &eax, &ebx,
+				   &f->extended_ecx, &f->extended_edx);
+		}
+
 		if (f->highest_extended >= X86_COREID_BRAND_STRING3) {
 			/* Get vendor information */
 			ptr = (uint32_t *)c->arch.vendor_str;
@@ -6,7 +6,7 @@
 #include "div64.h"
 #include "debug.h"
 #include "mm/page.h"
-#include "mm/phys.h"
+#include "mm/vmalloc.h"
 #include "smp.h"
 
 #define LAPIC_TIMER_PERIODIC	0x20000
@@ -128,11 +128,12 @@ void init_lapic()
 			PANIC("Core has different LAPIC address from boot core");
 		}
 	} else {
-		/* This is the boot core. Map the LAPIC into virtual memory and
-		 * register interrupt handlers.
+		/* This is the boot core. Map the LAPIC registers uncached into
+		 * virtual memory and register interrupt handlers.
 		 */
 		_lapic_base = base;
-		_lapic_mapping = phys_map((phys_addr_t)base, PAGE_SIZE, 0);
+		_lapic_mapping = ioremap((phys_addr_t)base, PAGE_SIZE);
+		ASSERT(_lapic_mapping != NULL);
 		kprintf("lapic: physical location 0x%llx mapped to %p\n",
 			base, _lapic_mapping);
 
@@ -5,6 +5,7 @@
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/spinlock.h"
+#include "smp.h"
 #include "debug.h"
 
 static INLINE void spinlock_lock_internal(struct spinlock *lock)
@@ -16,8 +17,11 @@ static INLINE void spinlock_lock_internal(struct spinlock *lock)
 		 */
 		if (_nr_cores > 1) {
 			while (TRUE) {
-				/* Wait for the lock to be released */
+				/* Wait for the lock to be released, the holder
+				 * may be shooting down our TLB meanwhile.
+				 */
 				while (lock->value != 1) {
+					smp_tlb_poll();
 					core_spin_hint();
 				}
 
@@ -70,6 +74,25 @@ void spinlock_release(struct spinlock *lock)
 	local_irq_restore(state);
 }
 
+/**
+ * Acquire a spinlock only if it is free, returns TRUE if it was acquired
+ */
+boolean_t spinlock_try_acquire(struct spinlock *lock)
+{
+	boolean_t state;
+
+	state = local_irq_disable();
+
+	if (!atomic_tas(&lock->value, 1, 0)) {
+		local_irq_restore(state);
+		return FALSE;
+	}
+	lock->state = state;
+	enter_cs_barrier();
+
+	return TRUE;
+}
+
 void spinlock_acquire_noirq(struct spinlock *lock)
 {
 	ASSERT(!local_irq_state());
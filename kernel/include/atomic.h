@@ -82,6 +82,32 @@ static INLINE int atomic_tas64(atomic64_t *var, int64_t test, int64_t val)
 	return res;
 }
 
+#else
+
+/* 64 bit variables are changed with CMPXCHG8B, the halves never tear */
+static INLINE int atomic_tas64(atomic64_t *var, int64_t test, int64_t val)
+{
+	uint8_t res;
+
+	asm volatile("lock; \
+		      cmpxchg8b %1; \
+		      setz %0"
+		      : "=q"(res), "+m"(*var), "+A"(test)
+		      : "b"((uint32_t)val), "c"((uint32_t)(val >> 32))
+		      : "memory", "cc");
+
+	return res;
+}
+
+static INLINE void atomic_set64(atomic64_t *var, int64_t val)
+{
+	int64_t old;
+
+	do {
+		old = *var;
+	} while (!atomic_tas64(var, old, val));
+}
+
 #endif
 
 #endif	/* __ATOMIC_H__ */
@@ -21,4 +21,24 @@ static INLINE int bitops_fls(u_long value)
 	return (int)value;
 }
 
+/* Atomically set a bit and return its old value */
+static INLINE int bitops_test_and_set(volatile u_long *addr, int bit)
+{
+	int old;
+
+	asm volatile("lock btsl %2, %1; sbbl %0, %0"
+		     : "=r"(old), "+m"(*addr) : "Ir"(bit) : "memory", "cc");
+	return old ? 1 : 0;
+}
+
+/* Atomically clear a bit and return its old value */
+static INLINE int bitops_test_and_clear(volatile u_long *addr, int bit)
+{
+	int old;
+
+	asm volatile("lock btrl %2, %1; sbbl %0, %0"
+		     : "=r"(old), "+m"(*addr) : "Ir"(bit) : "memory", "cc");
+	return old ? 1 : 0;
+}
+
 #endif	/* __BITOPS_H__ */
@@ -98,6 +98,7 @@ typedef struct {
 	Elf32_Addr p_vaddr;
 	Elf32_Addr p_paddr;
 	Elf32_Word p_filesz;
+	Elf32_Word p_memsz;
 	Elf32_Word p_flags;
 	Elf32_Word p_align;
 } Elf32_Phdr;
@@ -115,6 +116,13 @@ typedef struct {
 #define ELF_PT_LOPROC	0x70000000
 #define ELF_PT_HIPROC	0x7FFFFFFF
 
+/**
+ * p_flags
+ */
+#define ELF_PF_X	0x1		// Execute
+#define ELF_PF_W	0x2		// Write
+#define ELF_PF_R	0x4		// Read
+
 /* Section Header */
 typedef struct {
 	Elf32_Word sh_name;
@@ -145,5 +153,6 @@ typedef Elf32_Phdr elf_phdr_t;
 
 extern int elf_load_binary(struct vfs_node *n, struct va_space *vas, void **datap);
 extern ptr_t elf_finish_binary(void *data);
+extern void init_elf();
 
 #endif	/* __ELF_H__ */
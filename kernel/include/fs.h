@@ -52,6 +52,7 @@ struct vfs_node_ops {
 	int (*finddir)(struct vfs_node *, const char *, ino_t *id);
 	int (*readdir)(struct vfs_node *, uint32_t, struct dirent **);
 	int (*close)(struct vfs_node *);
+	int (*map)(struct vfs_node *, uint32_t, phys_addr_t *);
 };
 
 /* Structure contains detail of a File System node */
@@ -94,6 +95,7 @@ extern struct vfs_node *vfs_node_clone(struct vfs_node *src);
 extern struct vfs_node *vfs_lookup(const char *path, int flags);
 extern int vfs_read(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer);
 extern int vfs_write(struct vfs_node *node, uint32_t offset, uint32_t size, uint8_t *buffer);
+extern int vfs_map(struct vfs_node *node, uint32_t offset, phys_addr_t *physp);
 extern int vfs_finddir(struct vfs_node *node, const char *name, ino_t *id);
 extern int vfs_create(const char *path, uint32_t type, struct vfs_node **node);
 extern int vfs_close(struct vfs_node *node);
@@ -7,6 +7,7 @@
 #include "list.h"
 #include "debug.h"
 #include "hal/hal.h"
+#include "mm/page.h"
 
 /* Model Specific Register */
 #define X86_MSR_TSC		0x10		// Time Stamp Counter (TSC)
@@ -33,6 +34,14 @@
 #define X86_CR0_WP		(1<<16)		// Write Protect
 #define X86_CR0_PG		(1<<31)		// Paging Enabled
 
+/* Flags in CR4 */
+#define X86_CR4_PSE		(1<<4)		// Page Size Extensions
+#define X86_CR4_PAE		(1<<5)		// Physical Address Extension
+#define X86_CR4_PGE		(1<<7)		// Page Global Enable
+
+/* Flags in EFER */
+#define X86_EFER_NXE		(1<<11)		// No-Execute Enable
+
 /* Flags in DR6 (Debug Status Register) */
 #define X86_DR6_B0		(1<<0)		// Breakpoint 0 condition detected
 #define X86_DR6_B1		(1<<1)		// Breakpoint 1 condition detected
@@ -204,6 +213,7 @@ typedef uint32_t core_id_t;
 struct va_space;
 struct thread;
 struct sched_core;
+struct kmem_arena;
 
 struct core {
 	struct list link;		// Link to running COREs list
@@ -221,8 +231,14 @@ struct core {
 	struct sched_core *sched;	// Scheduler run queues/timers
 	struct thread *thread;		// Currently executing thread
 	struct va_space *aspace;	// Address space currently in use
+	volatile boolean_t tlb_lazy;	// Kernel thread running on a borrowed aspace
 	struct spinlock timer_lock;	// Lock to protect timers list
 	struct list timers;		// List of active timers
+
+	/* Memory management information */
+	struct kmem_arena *arena;	// Kernel heap arena of this CORE
+	struct page_cache page_cache;	// Free frames cache of this CORE
+	int node;			// NUMA node this CORE is on
 };
 typedef struct core core_t;
 
@@ -355,6 +371,21 @@ static INLINE void x86_write_cr3(uint32_t val)
 	asm volatile("mov %0, %%cr3" :: "r"(val));
 }
 
+/* Read CR4 */
+static INLINE uint32_t x86_read_cr4()
+{
+	uint32_t r;
+
+	asm volatile("mov %%cr4, %0" : "=r"(r));
+	return r;
+}
+
+/* Write CR4 */
+static INLINE void x86_write_cr4(uint32_t val)
+{
+	asm volatile("mov %0, %%cr4" :: "r"(val));
+}
+
 /* Read an MSR */
 static INLINE uint64_t x86_read_msr(uint32_t msr)
 {
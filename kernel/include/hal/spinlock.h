@@ -21,6 +21,7 @@ static INLINE boolean_t spinlock_held(struct spinlock *lock)
 
 extern void spinlock_init(struct spinlock *lock, const char *name);
 extern void spinlock_acquire(struct spinlock *lock);
+extern boolean_t spinlock_try_acquire(struct spinlock *lock);
 extern void spinlock_acquire_noirq(struct spinlock *lock);
 extern void spinlock_release(struct spinlock *lock);
 extern void spinlock_release_noirq(struct spinlock *lock);
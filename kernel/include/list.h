@@ -2,6 +2,7 @@
 #define __LIST_H__
 
 #include <types.h>
+#include "matrix/matrix.h"
 
 /* Doubly linked list node structure */
 struct list {
@@ -3,9 +3,7 @@
 
 #include <stddef.h>
 
-#define POOL_INDEX_SIZE		0x20000
 #define POOL_MAGIC		0x123890AB
-#define POOL_MIN_SIZE		0x70000
 
 extern boolean_t _kmem_init_done;
 
@@ -14,6 +12,8 @@ extern boolean_t _kmem_init_done;
  */
 extern void *kmem_alloc(size_t size, int mmflag);
 extern void kmem_free(void *p);
+extern size_t kmem_size(void *p);
+extern boolean_t kmem_resize(void *p, size_t size);
 extern void *kmem_map(phys_addr_t base, size_t size, int mmflag);
 extern void kmem_unmap(void *addr, size_t size, boolean_t shared);
 extern void init_kmem();
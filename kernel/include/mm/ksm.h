@@ -0,0 +1,35 @@
+#ifndef __KSM_H__
+#define __KSM_H__
+
+#include <types.h>
+
+struct va_space;
+
+/* Number of buckets of the stable and unstable tables */
+#define KSM_BUCKETS		64
+
+/* Pages the scanner looks at each time it wakes up */
+#define KSM_SCAN_BATCH		128
+
+/* Time the scanner sleeps between two batches, in microseconds */
+#define KSM_SLEEP_USEC		20000
+
+/*
+ * Statistics of the same-page merging
+ */
+struct ksm_stats {
+	size_t pages_shared;	// Stable frames shared by identical pages
+	size_t pages_sharing;	// Pages mapping a stable frame, less one per frame
+	size_t pages_zero;	// Pages merged into the zero page
+	size_t pages_scanned;	// Pages looked at by the scanner
+	size_t full_scans;	// Passes over all the address spaces
+};
+
+extern void ksm_enter(struct va_space *vas);
+extern void ksm_exit(struct va_space *vas);
+extern void ksm_scan_pass();
+extern void ksm_get_stats(struct ksm_stats *st);
+extern boolean_t ksm_space_merged(struct va_space *vas, size_t *mergedp);
+extern void init_ksm();
+
+#endif	/* __KSM_H__ */
@@ -9,6 +9,7 @@ extern void *kmalloc(size_t size, int mmflag);
 extern void *kcalloc(size_t nmemb, size_t size, int mmflag);
 extern void *krealloc(void *addr, size_t size, int mmflag);
 extern void kfree(void *addr);
+extern size_t kmalloc_size(void *addr);
 extern void init_malloc();
 
 #endif	/* __MALLOC_H__ */
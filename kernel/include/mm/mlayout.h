@@ -2,6 +2,8 @@
 #define __MLAYOUT_H__
 
 /* Memory layout definition
+ * +------------+
+ * | 0x00000000 | Physical map area
  * +------------+
  * | 0x00100000 | Kernel multiboot header
  * +------------+
@@ -11,16 +13,46 @@
  * +------------+
  * | 0xC0000000 | Kernel memory pool started address
  * +------------+
+ * | 0xD0000000 | Kernel virtual range area (vmalloc/ioremap)
+ * +------------+
+ * | 0xDF000000 | Temporary mapping slots of the COREs
+ * +------------+
  */
 
 /* Our kernel stack size is 8192 bytes */
 #define KSTACK_SIZE		0x2000
 /* Our user stack size is 16384 bytes */
 #define USTACK_SIZE		0x4000
+/* Our user stack may grow down up to 1MB */
+#define USTACK_MAX_SIZE		0x100000
+
+/* End address of the physical map area, physical memory below it is
+ * mapped at the same virtual address in every address space
+ */
+#define KERNEL_PHYS_MAP_END	0x10000000
+
+/* Start address of the user part of an address space */
+#define USER_START		0x10000000
+/* End address of the user part of an address space */
+#define USER_END		0xC0000000
 
 /* Start address of the kernel memory pool */
 #define KERNEL_KMEM_START	0xC0000000
 /* Minimum size of the kernel memory pool */
 #define KERNEL_KMEM_SIZE	0x00800000
+/* End address of the kernel memory pool */
+#define KERNEL_KMEM_END		0xCFFFF000
+
+/* Start address of the kernel virtual range area */
+#define KERNEL_VMAP_START	0xD0000000
+/* End address of the kernel virtual range area, the temporary mapping slots
+ * follow
+ */
+#define KERNEL_VMAP_END		0xDF000000
+
+/* Start address of the temporary mapping slots, two pages for each CORE */
+#define KERNEL_KMAP_START	0xDF000000
+/* End address of the temporary mapping slots */
+#define KERNEL_KMAP_END		0xDF040000
 
 #endif	/* __MLAYOUT_H__ */
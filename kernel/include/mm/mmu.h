@@ -5,6 +5,7 @@
 #ifndef __MMU_H__
 #define __MMU_H__
 
+#include "atomic.h"
 #include "hal/isr.h"	// For struct registers
 #include "page.h"
 #include "mutex.h"
@@ -15,17 +16,107 @@ struct pdir;
  * MMU context
  */
 struct mmu_ctx {
-	/* Virtual address of the page directory */
+	/* Virtual address of the page directories */
 	struct pdir *pdir;
 
-	/* Physical address of the page directory */
+	/* Page directory pointer table with PAE, NULL without it */
+	uint64_t *pdpt;
+
+	/* Physical address loaded into CR3 */
 	phys_addr_t pdbr;
 
 	/* MMU context lock */
 	struct mutex lock;
+
+	/* COREs which have this context loaded, lazy COREs may be cleared */
+	volatile u_long cores;
+
+	/* Link to the contexts list */
+	struct list link;
+};
+
+/* Ranges gathered before a TLB flush falls back to flushing everything */
+#define MMU_GATHER_MAX	8
+
+/* TLB flush flags */
+#define MMU_FLUSH_ALL	(1<<0)	// Flush the whole context
+#define MMU_FLUSH_DROP	(1<<1)	// Lazy COREs must stop using the context
+#define MMU_FLUSH_GLOBAL (1<<2)	// Ranges may have global kernel pages
+
+/*
+ * TLB invalidations of a context gathered to be flushed on all the COREs
+ * with a single IPI for each CORE
+ */
+struct mmu_gather {
+	struct mmu_ctx *ctx;		// Context the ranges belong to
+	int flags;			// Flush flags
+	size_t nr;			// Number of gathered ranges
+	struct {
+		ptr_t virt;		// Start of the range
+		size_t size;		// Size of the range
+	} range[MMU_GATHER_MAX];
 };
 
 extern struct mmu_ctx _kernel_mmu_ctx;
+extern boolean_t _mmu_pae;
+extern boolean_t _mmu_large_pages;
+extern boolean_t _mmu_nx;
+extern phys_addr_t _mmu_phys_map_end;
+
+/* Size of a large page, also the memory mapped by a page table. It is 2MB
+ * in PAE mode and 4MB otherwise.
+ */
+#define LARGE_PAGE_SIZE	(_mmu_pae ? 0x200000 : 0x400000)
+
+/* Size of a page table entry, the non-PAE entries are 32 bits wide */
+#define MMU_PTE_SIZE	(_mmu_pae ? sizeof(struct page) : sizeof(uint32_t))
+
+/* The page table entry i entries after p */
+#define MMU_PTE(p, i)	((struct page *)((u_char *)(p) + (i) * MMU_PTE_SIZE))
+
+/* A page table entry as a whole, to replace it atomically */
+union pte {
+	struct page page;
+	int64_t value;
+};
+
+/* Get the frame of a page table entry */
+static INLINE page_num_t mmu_pte_frame(struct page *p)
+{
+	return _mmu_pae ? ((p->frame_high << 20) | p->frame_low) : p->frame_low;
+}
+
+/* Set the frame of a page table entry */
+static INLINE void mmu_pte_set_frame(struct page *p, page_num_t frame)
+{
+	p->frame_low = frame;
+	if (_mmu_pae) {
+		p->frame_high = frame >> 20;
+	}
+}
+
+/* Set the NX bit of a page table entry, non-PAE entries have none */
+static INLINE void mmu_pte_set_nx(struct page *p, boolean_t nx)
+{
+	if (_mmu_pae) {
+		p->nx = nx ? 1 : 0;
+	}
+}
+
+/* Read a page table entry as a whole, only its low half without PAE */
+static INLINE int64_t mmu_pte_read(struct page *p)
+{
+	return _mmu_pae ? *((volatile int64_t *)p) : *((volatile uint32_t *)p);
+}
+
+/* Replace a page table entry if it is still test, returns TRUE if it was */
+static INLINE boolean_t mmu_pte_tas(struct page *p, int64_t test, int64_t val)
+{
+	if (_mmu_pae) {
+		return atomic_tas64((atomic64_t *)p, test, val);
+	}
+	return atomic_tas((atomic_t *)p, (int32_t)test, (int32_t)val);
+}
 
 /* Macro that expands to a pointer to the current address space */
 #define CURR_ASPACE	(CURR_CORE->aspace)
@@ -37,16 +128,37 @@ extern struct mmu_ctx _kernel_mmu_ctx;
 #define MMU_MAP_READ	(1<<0)
 #define MMU_MAP_WRITE	(1<<1)
 #define MMU_MAP_EXEC	(1<<2)
+#define MMU_MAP_ALLOC	(1<<3)	// Allocate a frame for each page
+#define MMU_MAP_LARGE	(1<<4)	// Use large pages for the aligned parts
+#define MMU_MAP_NOCACHE	(1<<5)	// Disable caching, for device memory
+#define MMU_MAP_ZERO	(1<<6)	// Allocated frames are zeroed
+
+/* Temporary mapping slots of each CORE */
+#define MMU_KMAP_SLOTS	2
 
 extern void page_fault(struct registers *regs);
 extern struct mmu_ctx *mmu_create_ctx();
 extern struct page *mmu_get_page(struct mmu_ctx *ctx, ptr_t addr, boolean_t make, int mmflag);
+extern int mmu_translate(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t *physp);
 extern int mmu_map(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t phys, int flags);
 extern int mmu_unmap(struct mmu_ctx *ctx, ptr_t virt, boolean_t shared, phys_addr_t *physp);
+extern int mmu_map_range(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t phys, size_t size,
+			 int flags);
+extern int mmu_unmap_range(struct mmu_ctx *ctx, ptr_t virt, size_t size, boolean_t free);
+extern void mmu_flush_range(struct mmu_ctx *ctx, ptr_t virt, size_t size);
+extern void mmu_gather_init(struct mmu_gather *g, struct mmu_ctx *ctx, int flags);
+extern void mmu_gather_add(struct mmu_gather *g, ptr_t virt, size_t size);
+extern void mmu_gather_flush(struct mmu_gather *g);
+extern void mmu_flush_local(struct mmu_gather *g);
+extern void *mmu_kmap(phys_addr_t phys, int slot, boolean_t *statep);
+extern void mmu_kunmap(void *virt, boolean_t state);
+extern void mmu_switch_ctx(struct mmu_ctx *prev, struct mmu_ctx *next);
+extern void mmu_lazy_ctx();
 extern void mmu_load_ctx(struct mmu_ctx *ctx);
-extern void mmu_clone_ctx(struct mmu_ctx *dst, struct mmu_ctx *src);
+extern int mmu_clone_ctx(struct mmu_ctx *dst, struct mmu_ctx *src);
 extern void mmu_destroy_ctx(struct mmu_ctx *ctx);
 extern void init_mmu_percore();
 extern void init_mmu();
+extern void init_mmu_cache();
 
 #endif	/* __MMU_H__ */
@@ -0,0 +1,31 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <types.h>
+
+/* Maximum number of memory nodes we support */
+#define NUMA_MAX_NODES		8
+
+/* Maximum number of memory ranges of all nodes */
+#define NUMA_MAX_RANGES		32
+
+/* Maximum local APIC ID of a CORE we can place on a node */
+#define NUMA_MAX_CORES		256
+
+/* Relative distances as defined by the ACPI SLIT */
+#define NUMA_LOCAL_DISTANCE	10
+#define NUMA_REMOTE_DISTANCE	20
+
+extern size_t _nr_numa_nodes;
+
+extern int numa_node_add(uint32_t domain);
+extern int numa_add_memory(uint32_t domain, uint64_t base, uint64_t size);
+extern int numa_add_core(uint32_t domain, uint32_t apic_id);
+extern void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance);
+extern int numa_phys_node(phys_addr_t addr);
+extern int numa_core_node(uint32_t apic_id);
+extern uint8_t numa_distance(int from, int to);
+extern const uint8_t *numa_fallback(int node);
+extern void init_numa();
+
+#endif	/* __NUMA_H__ */
@@ -1,14 +1,21 @@
 #ifndef __PAGE_H__
 #define __PAGE_H__
 
+#include "list.h"
+#include "hal/spinlock.h"
+
 #ifdef _X86_
 #define PAGE_SIZE	(4096)	// Size of a page (4KB)
 #endif	/* _X86_ */
 
 typedef uint32_t page_num_t;
 
+struct va_space;
+
 /*
- * X86 Page Table Entry
+ * X86 Page Table Entry. PAE entries are 64 bits wide, the entries of the
+ * non-PAE page tables are only the low half and map frames below 4GB. The
+ * frame and the NX bit are reached through the mmu_pte_* helpers.
  */
 struct page {
 	uint32_t present:1;	// Page present in memory
@@ -30,16 +37,89 @@ struct page {
 	uint32_t global:1;	// Global; if CR4.PGE = 1, determines whether
 				// the translation is global
 	
-	uint32_t reserved:3;	// Reserved bits
-	uint32_t frame:20;	// Frame address
+	uint32_t cow:1;		// Copy-on-write; available to software, the
+				// frame is shared and must be copied on write
+	
+	uint32_t swap:1;	// Swapped out; available to software, the
+				// frame is the swap slot of a page which is
+				// not present
+	
+	uint32_t reserved:1;	// Reserved bits
+	uint32_t frame_low:20;	// Frame address below 4GB
+	uint32_t frame_high:4;	// Frame address above 4GB, PAE only
+	uint32_t reserved_high:27;	// Reserved bits, must be 0
+	uint32_t nx:1;		// No execute; if EFER.NXE = 1, instructions
+				// may not be fetched from the page
 };
 
+/* Number of the buddy allocator free lists, the largest block is 4MB */
+#define PAGE_MAX_ORDER	11
+
+/* Physical frame flags */
+#define FRAME_FREE	(1<<0)	// Frame starts a free block
+#define FRAME_RESERVED	(1<<1)	// Frame is never managed by the allocator
+#define FRAME_CACHED	(1<<2)	// Frame is in a per-CORE frame cache
+#define FRAME_ZEROED	(1<<3)	// Frame is in the pre-zeroed frame pool
+#define FRAME_LRU	(1<<4)	// Frame is on an LRU list of anonymous frames
+#define FRAME_ACTIVE	(1<<5)	// Frame is on the active LRU list
+#define FRAME_ISOLATED	(1<<6)	// Frame is being written out to swap
+
+/* Per-CORE free frame cache settings */
+#define PAGE_CACHE_BATCH	16	// Frames moved from/to the buddy at once
+#define PAGE_CACHE_HIGH		64	// Maximum frames in a per-CORE cache
+
+/* Pre-zeroed frame pool settings */
+#define PAGE_ZERO_BATCH		16	// Frames zeroed by an idle CORE at once
+#define PAGE_ZERO_HIGH		256	// Maximum frames in the pool
+
+/*
+ * Physical frame descriptor, there is one for each frame in the system
+ */
+struct frame {
+	struct list link;	// Link to the free list or an LRU list
+	uint8_t order;		// Order of the free block this frame starts
+	uint8_t flags;		// Frame flags
+	uint8_t node;		// NUMA node the frame is on
+	atomic_t ref;		// Number of mappings of an allocated frame
+	struct va_space *vas;	// Address space mapping an anonymous frame
+	ptr_t virt;		// Address the anonymous frame is mapped at
+};
+
+/*
+ * Per-CORE cache of free frames in front of the buddy allocator. The lock
+ * is only contended when another CORE drains the cache.
+ */
+struct page_cache {
+	struct spinlock lock;	// Lock for this cache
+	struct list hot;	// Recently freed frames, likely still in CPU cache
+	struct list cold;	// Frames refilled from the buddy allocator
+	page_num_t count;	// Number of frames in the cache
+};
+
+extern page_num_t _zero_frame;
+extern page_num_t _page_wmark_low;
+extern page_num_t _page_wmark_high;
+
 extern void page_early_alloc(phys_addr_t *phys, size_t size, boolean_t align);
-extern void page_alloc(struct page *p, int flags);
+extern int page_alloc(struct page *p, int flags);
+extern int page_alloc_batch(struct page *p, size_t count, int flags);
 extern void page_free(struct page *p);
 extern void page_copy(phys_addr_t dst, phys_addr_t src);
-extern void phys_alloc(phys_size_t size, phys_addr_t align, phys_addr_t minaddr,
-		       phys_addr_t maxaddr, int flags, phys_addr_t *basep);
+extern void page_ref(page_num_t pfn);
+extern int page_refcount(page_num_t pfn);
+extern page_num_t page_total();
+extern struct frame *page_frame(page_num_t pfn);
+extern page_num_t page_free_count();
+extern page_num_t page_node_free_count(int node);
+extern int phys_alloc(phys_size_t size, phys_addr_t align, phys_addr_t minaddr,
+		      phys_addr_t maxaddr, int flags, phys_addr_t *basep);
+extern void phys_free(phys_addr_t base, phys_size_t size);
+extern void page_cache_init(struct page_cache *pc);
+extern void page_drain_percore();
+extern void page_drain_all();
+extern void page_zero_refill();
+extern void page_init_free(phys_addr_t end);
+extern void page_init_zones();
 extern void init_page();
 
 #endif	/* __PAGE_H__ */
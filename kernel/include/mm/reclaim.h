@@ -0,0 +1,32 @@
+#ifndef __RECLAIM_H__
+#define __RECLAIM_H__
+
+#include "list.h"
+
+/* Number of times a faulting thread waits for the reclaim thread */
+#define RECLAIM_RETRIES		3
+
+/* Shrinker callback, frees at most count objects and returns the number
+ * of objects freed. It is called from the reclaim thread and may sleep.
+ */
+typedef size_t (*shrink_func_t)(size_t count);
+
+/*
+ * A cache which can give memory back when free frames run low
+ */
+struct shrinker {
+	struct list link;	// Link to the shrinker list
+	const char *name;	// Name of the cache
+	shrink_func_t shrink;	// Callback to free objects of the cache
+	int busy;		// Number of shrink calls in progress
+};
+
+extern void shrinker_register(struct shrinker *s);
+extern void shrinker_unregister(struct shrinker *s);
+extern size_t reclaim_shrink(size_t count);
+extern void reclaim_wakeup();
+extern boolean_t reclaim_wait();
+extern void preinit_reclaim();
+extern void init_reclaim();
+
+#endif	/* __RECLAIM_H__ */
@@ -8,6 +8,11 @@
 
 /* Allocator limitation/settings */
 #define SLAB_NAME_MAX		24	// Maximum slab cache name length
+#define SLAB_MAGAZINE_SIZE	16	// Maximum objects in a magazine
+#define SLAB_MAX_CORES		8	// Maximum COREs which have magazines
+
+/* Slab cache flags */
+#define SLAB_ALIGN_SIZE		(1<<0)	// Align the objects to their size
 
 /* Slab constructor callback function */
 typedef void (*slab_ctor_t)(void *obj);
@@ -15,20 +20,35 @@ typedef void (*slab_ctor_t)(void *obj);
 /* Slab destructor callback function */
 typedef void (*slab_dtor_t)(void *obj);
 
+/* Per-CORE cache of free objects in front of the slab lists */
+struct slab_magazine {
+	size_t rounds;			// Number of objects in the magazine
+	uint32_t drain;			// Last drain request it was flushed for
+	void *objs[SLAB_MAGAZINE_SIZE];	// Objects in the magazine
+};
+
 /* Slab cache structure */
 struct slab_cache {
 	size_t nr_slabs;		// Number of allocated slabs
 
 	/* Slab lists/cache coloring settings */
 	struct spinlock lock;		// Lock for this slab cache
-	struct list slab_head;		// List of allocated slabs
+	struct list slab_partial;	// List of partially allocated slabs
+	struct list slab_full;		// List of fully allocated slabs
+	struct list slab_free;		// List of free slabs
+	size_t nr_free;			// Number of free slabs
 	
 	uint16_t color_next;		// Next cache color
 	uint16_t color_max;		// Maximum cache color
 
+	/* Per-CORE magazines, indexed by CORE ID */
+	struct slab_magazine magazines[SLAB_MAX_CORES];
+
 	/* Cache settings */
 	int flags;			// Cache behaviour flags
 	size_t obj_size;		// Size of an object
+	size_t obj_count;		// Number of objects in a slab
+	size_t slab_size;		// Size of a slab
 
 	/* Callback functions */
 	slab_ctor_t ctor;		// Object constructor function
@@ -42,10 +62,12 @@ typedef struct slab_cache slab_cache_t;
 
 extern void *slab_cache_alloc(slab_cache_t *cache);
 extern void slab_cache_free(slab_cache_t *cache, void *obj);
+extern slab_cache_t *slab_object_cache(void *obj);
 extern void slab_cache_init(slab_cache_t *c, const char *name,
 			    size_t size, slab_ctor_t ctor,
 			    slab_dtor_t dtor, int flags);
 extern void slab_cache_delete(slab_cache_t *cache);
+extern void slab_drain_percore();
 extern void init_slab();
 
 #endif	/* __SLAB_H__ */
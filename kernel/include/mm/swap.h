@@ -0,0 +1,31 @@
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include <types.h>
+#include "mm/page.h"
+
+struct va_space;
+
+/* The swap slot of a page is kept in the frame of its page table entry,
+ * slot 0 is never used so a swap entry always has a frame
+ */
+#define SWAP_MAX_SLOTS	(1 << 20)
+
+/* Maximum number of swap entries sharing a slot */
+#define SWAP_MAP_MAX	0xFFFE
+
+/* Frames moved from the active to the inactive list at once */
+#define SWAP_AGE_BATCH	32
+
+extern void swap_lru_add(page_num_t pfn, struct va_space *vas, ptr_t virt);
+extern boolean_t swap_lru_put(struct frame *f);
+extern void swap_lru_ref(struct frame *f);
+extern int swap_out_page(struct va_space *vas, ptr_t virt);
+extern int swap_in(uint32_t slot, page_num_t *pfnp);
+extern void swap_dup(uint32_t slot);
+extern void swap_free(uint32_t slot);
+extern int swap_on(dev_t dev, size_t size);
+extern int swap_off();
+extern void init_swap();
+
+#endif	/* __SWAP_H__ */
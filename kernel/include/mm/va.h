@@ -1,10 +1,63 @@
 #ifndef __VA_H__
 #define __VA_H__
 
+#include "list.h"
+#include "hal/spinlock.h"
+#include "rtl/avltree.h"
 #include "mm/mmu.h"
 
+struct vfs_node;
+
+/*
+ * Frames of a range of a file shared by the regions mapping it. The frames
+ * are mapped read-only and copied on the first write.
+ */
+struct va_cache {
+	struct spinlock lock;		// Lock for the frames
+	atomic_t ref;			// Number of users of the cache
+	uint32_t offset;		// Offset of the first page in the file
+	size_t nr_pages;		// Number of pages in the cache
+	page_num_t *frames;		// Frames of the pages, 0 if not cached yet
+};
+
+/* Types of the address space regions */
+#define VA_REGION_ANON	0	// Private memory, a zeroed frame on first touch
+#define VA_REGION_ZERO	1	// Zero-fill memory, reads share the zero page
+#define VA_REGION_FILE	2	// Memory backed by a file, read in on first touch
+#define VA_REGION_GUARD	3	// Guard region, any access to it faults
+#define VA_REGION_FREE	4	// Free space between the other regions
+
+/* Number of free region lists, list n holds the gaps of 2^n to 2^(n+1) pages */
+#define VA_FREELISTS	32
+
+/*
+ * Region of an address space, frames are only allocated for the pages of
+ * a region when they are first touched. The free space of an address space
+ * is also described by regions, so the regions cover the whole user part
+ * of the address space.
+ */
+struct va_region {
+	struct list link;		// Link to the region list of the address space
+	struct avl_tree_node tree_link;	// Link to the region tree
+	struct list free_link;		// Link to a free list, free regions only
+	ptr_t start;			// Start address of the region
+	ptr_t end;			// End address of the region
+	int type;			// Type of the region
+	int flags;			// Map flags of the region
+	struct vfs_node *node;		// File backing the region
+	uint32_t offset;		// Offset of the region start in the file
+	size_t file_size;		// Size of the file data, the rest is zeroed
+	struct va_cache *cache;		// Frames of the file shared with others
+};
+
 struct va_space {
 	struct mmu_ctx *mmu;
+	struct spinlock lock;		// Lock for the regions
+	struct list regions;		// Regions of the address space sorted by address
+	struct avl_tree tree;		// Regions of the address space keyed by address
+	struct list free[VA_FREELISTS];	// Free regions by size
+	struct list ksm_link;		// Link to the address spaces scanned by KSM
+	size_t nr_merged;		// Pages merged with identical ones by KSM
 };
 
 /* Map flags for va_map */
@@ -12,12 +65,29 @@ struct va_space {
 #define VA_MAP_WRITE	(1<<1)
 #define VA_MAP_EXEC	(1<<2)
 #define VA_MAP_FIXED	(1<<3)
+#define VA_MAP_ZERO	(1<<4)	// Zero-fill region
+#define VA_MAP_GUARD	(1<<5)	// Guard region
+#define VA_MAP_STACK	(1<<6)	// Region grows down on faults below it
+#define VA_MAP_MERGE	(1<<7)	// Identical pages may be merged by KSM
+#define VA_MAP_REPLACE	(1<<8)	// Fixed mapping replaces the mappings in its way
+
+/* Protection flags of a region */
+#define VA_MAP_PROT	(VA_MAP_READ | VA_MAP_WRITE | VA_MAP_EXEC)
 
 extern struct va_space *va_create();
 extern void va_destroy(struct va_space *vas);
 extern int va_map(struct va_space *vas, ptr_t start, size_t size, int flags, ptr_t *addrp);
+extern int va_map_file(struct va_space *vas, ptr_t start, size_t size, int flags,
+		       struct vfs_node *n, uint32_t offset, size_t file_size,
+		       struct va_cache *cache, ptr_t *addrp);
 extern int va_unmap(struct va_space *vas, ptr_t start, size_t size);
+extern int va_protect(struct va_space *vas, ptr_t start, size_t size, int flags);
+extern int va_fault(struct va_space *vas, ptr_t addr, int access);
 extern void va_switch(struct va_space *vas);
+extern int va_clone(struct va_space *dst, struct va_space *src);
+extern struct va_cache *va_cache_create(uint32_t offset, size_t size);
+extern void va_cache_get(struct va_cache *cache);
+extern void va_cache_put(struct va_cache *cache);
 extern void init_va();
 
 #endif	/* __VA_H__ */
@@ -0,0 +1,13 @@
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+#include <stddef.h>
+
+extern void *vmalloc(size_t size, int mmflag);
+extern void *vm_map(phys_addr_t phys, size_t size, int flags);
+extern void vfree(void *addr);
+extern void *ioremap(phys_addr_t phys, size_t size);
+extern void iounmap(void *addr);
+extern void init_vmalloc();
+
+#endif	/* __VMALLOC_H__ */
@@ -9,6 +9,7 @@
 #define KMOD_FLPY	6
 #define KMOD_NULL	7
 #define KMOD_ZERO	8
+#define KMOD_ZRAM	9
 
 typedef int (*module_init_func_t)(void);
 
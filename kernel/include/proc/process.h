@@ -65,10 +65,14 @@ typedef struct process process_t;
 /* Internal flags for process creation */
 #define PROCESS_CLONE_F		(1<<0)
 
+/* Callback of process_walk */
+typedef void (*process_walk_func_t)(struct process *p, void *ctx);
+
 /* Pointer to the kernel process */
 extern struct process *_kernel_proc;
 
 extern struct process *process_lookup(pid_t pid);
+extern void process_walk(process_walk_func_t func, void *ctx);
 
 extern void process_attach(struct process *p, struct thread *t);
 extern void process_detach(struct thread *t);
@@ -0,0 +1,17 @@
+#ifndef __PROCFS_H__
+#define __PROCFS_H__
+
+/* Buffer the contents of a file are generated in */
+struct procfs_buf {
+	char *data;		// Start of the buffer
+	size_t size;		// Size of the buffer
+	size_t len;		// Length of the contents
+};
+
+/* Callback generating the contents of a file each time it is read */
+typedef void (*procfs_show_func_t)(struct procfs_buf *b);
+
+extern int procfs_register(const char *name, procfs_show_func_t show);
+extern void procfs_printf(struct procfs_buf *b, const char *fmt, ...);
+
+#endif	/* __PROCFS_H__ */
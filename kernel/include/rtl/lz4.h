@@ -0,0 +1,18 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+/* Largest input of lz4_compress, so any match offset fits in 16 bits */
+#define LZ4_MAX_INPUT		0xFFFF
+
+/* Number of entries of the compressor hash table */
+#define LZ4_HASH_LOG		12
+
+/* Size of the work memory of lz4_compress */
+#define LZ4_WORKMEM_SIZE	((1 << LZ4_HASH_LOG) * sizeof(uint16_t))
+
+extern size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+			   size_t size, void *wrkmem);
+extern int lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+			  size_t size);
+
+#endif	/* __LZ4_H__ */
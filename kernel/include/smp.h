@@ -5,6 +5,8 @@
 
 typedef int (*smp_call_func_t)(void *ctx);
 
+struct mmu_gather;
+
 extern volatile uint32_t _smp_boot_status;
 
 /* Values for _smp_boot_status */
@@ -13,6 +15,8 @@ extern volatile uint32_t _smp_boot_status;
 #define SMP_BOOT_BOOTED		2	// AC has completed kmain_ac()
 #define SMP_BOOT_COMPLETE	3	// All ACs have been booted
 
+extern void smp_tlb_shootdown(u_long cores, struct mmu_gather *g);
+extern void smp_tlb_poll();
 extern void smp_ipi_handler();
 extern void init_smp();
 
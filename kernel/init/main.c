@@ -20,6 +20,10 @@
 #include "mm/malloc.h"
 #include "mm/slab.h"
 #include "mm/va.h"
+#include "mm/vmalloc.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
+#include "mm/ksm.h"
 #include "timer.h"
 #include "smp.h"
 #include "proc/process.h"
@@ -29,6 +33,7 @@
 #include "kd.h"
 #include "fs.h"
 #include "module.h"
+#include "elf.h"
 #include "platform.h"
 #include "symbol.h"
 #include "kstrdup.h"
@@ -96,6 +101,8 @@ int kmain(u_long addr, uint32_t initial_stack)
 	init_page();
 	kprintf("Page initialization... done.\n");
 
+	preinit_reclaim();
+
 	init_mmu();
 	kprintf("MMU initialization... done.\n");
 	
@@ -104,13 +111,22 @@ int kmain(u_long addr, uint32_t initial_stack)
 	
 	init_slab();
 	kprintf("Slab memory cache initialization... done.\n");
+
+	init_mmu_cache();
+	kprintf("MMU cache initialization... done.\n");
 	
 	init_malloc();
 	kprintf("Kernel memory allocator initialization... done.\n");
 
+	init_vmalloc();
+	kprintf("Kernel virtual range allocator initialization... done.\n");
+
 	init_va();
 	kprintf("Virtual address space manager initialization... done.\n");
 
+	init_swap();
+	kprintf("Swap initialization... done.\n");
+
 	/* Initialize our terminal */
 	init_terminal();
 	kprintf("Terminal initialization... done.\n");
@@ -146,6 +162,12 @@ int kmain(u_long addr, uint32_t initial_stack)
 	init_sched();
 	kprintf("Scheduler initialization... done.\n");
 
+	init_reclaim();
+	kprintf("Memory reclaim initialization... done.\n");
+
+	init_ksm();
+	kprintf("Same-page merging initialization... done.\n");
+
 	init_syscalls();
 	kprintf("System call initialization... done.\n");
 
@@ -253,6 +275,10 @@ void sys_init_thread(void *ctx)
 	init_module();
 	kprintf("Module system manager initialization... done.\n");
 
+	/* Bring up the executable image cache */
+	init_elf();
+	kprintf("Executable image cache initialization... done.\n");
+
 	/* Load the boot modules */
 	load_modules();
 	kprintf("Load boot modules... done.\n");
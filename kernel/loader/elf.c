@@ -1,10 +1,14 @@
 #include <types.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include "debug.h"
+#include "list.h"
+#include "mutex.h"
 #include "mm/page.h"
 #include "mm/malloc.h"
 #include "mm/va.h"
+#include "mm/reclaim.h"
 #include "proc/process.h"
 #include "proc/thread.h"
 #include "elf.h"
@@ -13,18 +17,37 @@
 #define ELF_ENDIAN	ELFDATA2LSB
 #define ELF_MACHINE	ELF_EM_386
 
-typedef Elf32_Ehdr elf_ehdr_t;
-typedef Elf32_Shdr elf_shdr_t;
+/* Maximum number of binaries kept in the image cache */
+#define ELF_IMAGE_CACHE_MAX	16
+
+/*
+ * Parsed headers of a binary kept in the image cache, the frames of its
+ * read-only segments are shared by all the processes running it
+ */
+struct elf_image {
+	struct list link;		// Link to the image cache
+	struct vfs_node *n;		// Node of the binary
+	elf_ehdr_t ehdr;		// ELF header
+	elf_phdr_t *phdrs;		// Program headers
+	struct va_cache **caches;	// Frame caches of the read-only segments
+};
 
 struct elf_binary {
-	elf_ehdr_t *ehdr;
+	ptr_t entry;
 	struct va_space *vas;
 	struct vfs_node *n;
 	ptr_t load_base;
-	size_t load_size;
 };
 typedef struct elf_binary elf_binary_t;
 
+/* Image cache, the most recently used image first */
+static struct list _elf_images = {
+	.prev = &_elf_images,
+	.next = &_elf_images
+};
+static size_t _nr_elf_images = 0;
+static struct mutex _elf_images_lock;
+
 boolean_t elf_ehdr_check(elf_ehdr_t *ehdr)
 {
 	boolean_t ret = FALSE;
@@ -61,78 +84,60 @@ boolean_t elf_ehdr_check(elf_ehdr_t *ehdr)
 
 ptr_t elf_finish_binary(void *data)
 {
-	int i = 0;
 	ptr_t entry;
 	elf_binary_t *bin;
-	elf_ehdr_t *ehdr;
-	elf_shdr_t *shdr;
-	uint32_t virt;
 
 	bin = (elf_binary_t *)data;
 
-	ehdr = bin->ehdr;
-
-	for (virt = 0; virt < (ehdr->e_shentsize * ehdr->e_shnum); virt += ehdr->e_shentsize, i++) {
-		shdr = (elf_shdr_t *)(((uint8_t *)ehdr) + (ehdr->e_shoff + virt));
-
-		if (shdr->sh_addr) {
-			switch (shdr->sh_type) {
-			case ELF_SHT_NOBITS:
-				/* Zero the .bss section */
-				memset((void *)(shdr->sh_addr), 0, shdr->sh_size);
-				DEBUG(DL_DBG, (".bss section zeroed.\n"));
-				break;	// Break out the switch
-			case ELF_SHT_PROGBITS:
-			case ELF_SHT_STRTAB:
-			case ELF_SHT_SYMTAB:
-				/* Copy the section into memory */
-				memcpy((void *)(shdr->sh_addr), (uint8_t *)ehdr + shdr->sh_offset,
-				       shdr->sh_size);
-				DEBUG(DL_DBG, ("section type %d copied.\n", shdr->sh_type));
-				break;	// Break out the switch
-			}
-		}
-	}
-
-	entry = ehdr->e_entry;
+	/* The segments are faulted in on demand, only the entry is needed */
+	entry = bin->entry;
 	DEBUG(DL_DBG, ("entry(%p).\n", entry));
 	
-	kfree(bin->ehdr);
 	kfree(bin);
 
 	return entry;
 }
 
-int elf_load_binary(struct vfs_node *n, struct va_space *vas, void **datap)
+static void elf_image_free(struct elf_image *image)
 {
-	int rc = -1, i;
-	size_t size, load_cnt;
-	elf_binary_t *bin;
-	ptr_t virt, base;
-	elf_shdr_t *shdr;
-	elf_ehdr_t *ehdr;
+	int i;
 
-	/* Allocate buffer to store the binary information */
-	bin = kmalloc(sizeof(elf_binary_t), 0);
-	if (!bin) {
-		DEBUG(DL_INF, ("kmalloc buffer for binary failed.\n"));
-		rc = -1;
-		goto out;
+	if (image->caches) {
+		for (i = 0; i < image->ehdr.e_phnum; i++) {
+			if (image->caches[i]) {
+				va_cache_put(image->caches[i]);
+			}
+		}
+		kfree(image->caches);
 	}
-	
-	bin->vas = vas;
-	bin->n = n;
+	if (image->phdrs) {
+		kfree(image->phdrs);
+	}
+	vfs_node_deref(image->n);
+	kfree(image);
+}
 
-	/* Allocate buffer to store the file content */
-	bin->ehdr = kmalloc(n->length, 0);
-	if (!bin->ehdr) {
-		DEBUG(DL_INF, ("kmalloc buffer for file failed.\n"));
+/* Read the headers of a binary and create the caches of its segments */
+static int elf_image_read(struct vfs_node *n, struct elf_image **imagep)
+{
+	int rc = -1, i;
+	size_t size;
+	uint32_t offset;
+	struct elf_image *image;
+	elf_phdr_t *phdr;
+
+	image = kmalloc(sizeof(struct elf_image), MM_ZERO);
+	if (!image) {
+		DEBUG(DL_INF, ("kmalloc buffer for image failed.\n"));
 		rc = -1;
 		goto out;
 	}
-	
-	/* Read in the executive content */
-	rc = vfs_read(n, 0, n->length, (uint8_t *)bin->ehdr);
+
+	vfs_node_refer(n);
+	image->n = n;
+
+	/* Only the headers are read in, the segments are mapped from the file */
+	rc = vfs_read(n, 0, sizeof(elf_ehdr_t), (uint8_t *)&image->ehdr);
 	if (rc == -1 || rc < sizeof(elf_ehdr_t)) {
 		DEBUG(DL_INF, ("read file failed, err(%x).\n", rc));
 		rc = -1;
@@ -140,82 +145,288 @@ int elf_load_binary(struct vfs_node *n, struct va_space *vas, void **datap)
 	}
 
 	/* Check whether it is valid ELF */
-	if (!elf_ehdr_check(bin->ehdr)) {
+	if (!elf_ehdr_check(&image->ehdr)) {
 		DEBUG(DL_INF, ("invalid ELF file.\n"));
 		rc = -1;
 		goto out;
 	}
 
-	ehdr = bin->ehdr;
-	base = ehdr->e_entry;
+	if ((image->ehdr.e_phentsize != sizeof(elf_phdr_t)) ||
+	    !image->ehdr.e_phnum) {
+		DEBUG(DL_INF, ("invalid program headers(%d:%d).\n",
+			       image->ehdr.e_phentsize, image->ehdr.e_phnum));
+		rc = -1;
+		goto out;
+	}
+
+	/* Read in the program headers */
+	size = image->ehdr.e_phnum * sizeof(elf_phdr_t);
+	image->phdrs = kmalloc(size, 0);
+	image->caches = kmalloc(image->ehdr.e_phnum * sizeof(struct va_cache *),
+				MM_ZERO);
+	if (!image->phdrs || !image->caches) {
+		DEBUG(DL_INF, ("kmalloc buffer for program headers failed.\n"));
+		rc = -1;
+		goto out;
+	}
+	
+	rc = vfs_read(n, image->ehdr.e_phoff, size, (uint8_t *)image->phdrs);
+	if (rc == -1 || rc < size) {
+		DEBUG(DL_INF, ("read program headers failed, err(%x).\n", rc));
+		rc = -1;
+		goto out;
+	}
+
+	/* The file pages of the read-only segments are shared */
+	for (i = 0; i < image->ehdr.e_phnum; i++) {
+		phdr = &image->phdrs[i];
+		if ((phdr->p_type != ELF_PT_LOAD) || !phdr->p_filesz ||
+		    FLAG_ON(phdr->p_flags, ELF_PF_W)) {
+			continue;
+		}
+
+		offset = ROUND_DOWN(phdr->p_offset, PAGE_SIZE);
+		image->caches[i] = va_cache_create(offset,
+			ROUND_UP(phdr->p_offset + phdr->p_filesz, PAGE_SIZE) - offset);
+		if (!image->caches[i]) {
+			rc = ENOMEM;
+			goto out;
+		}
+	}
+
+	*imagep = image;
+	rc = 0;
+
+ out:
+	if (rc != 0) {
+		if (image) {
+			elf_image_free(image);
+		}
+	}
+
+	return rc;
+}
+
+/* Get the image of a binary from the image cache, lock must be held */
+static int elf_image_get(struct vfs_node *n, struct elf_image **imagep)
+{
+	int rc;
+	struct list *l;
+	struct elf_image *image;
+
+	LIST_FOR_EACH(l, &_elf_images) {
+		image = LIST_ENTRY(l, struct elf_image, link);
+		if ((image->n->mount == n->mount) && (image->n->ino == n->ino)) {
+			list_del(&image->link);
+			list_add(&image->link, &_elf_images);
+			*imagep = image;
+			return 0;
+		}
+	}
+
+	rc = elf_image_read(n, &image);
+	if (rc != 0) {
+		return rc;
+	}
+
+	/* Drop the least recently used image if the cache is full */
+	if (_nr_elf_images >= ELF_IMAGE_CACHE_MAX) {
+		l = _elf_images.prev;
+		list_del(l);
+		elf_image_free(LIST_ENTRY(l, struct elf_image, link));
+		_nr_elf_images--;
+	}
+
+	LIST_INIT(&image->link);
+	list_add(&image->link, &_elf_images);
+	_nr_elf_images++;
+
+	DEBUG(DL_DBG, ("image of node(%s:%d) cached.\n", n->name, n->ino));
+	
+	*imagep = image;
+
+	return 0;
+}
+
+/* Map a loadable segment, the file data is mapped from the file and the
+ * rest of the segment is zero-filled on demand.
+ */
+static int elf_load_segment(elf_binary_t *bin, elf_phdr_t *phdr,
+			    struct va_cache *cache)
+{
+	int rc = -1, flags;
+	ptr_t start, file_end, end;
+	uint32_t offset;
+
+	/* The file offset and the address must have the same page offset so
+	 * that each page is backed by a single page of the file
+	 */
+	if ((((phdr->p_vaddr - phdr->p_offset) % PAGE_SIZE) != 0) ||
+	    (phdr->p_filesz > phdr->p_memsz) ||
+	    ((phdr->p_offset + phdr->p_filesz) > bin->n->length)) {
+		DEBUG(DL_DBG, ("invalid segment(%p), offset(%x).\n",
+			       phdr->p_vaddr, phdr->p_offset));
+		rc = EINVAL;
+		goto out;
+	}
+
+	flags = VA_MAP_FIXED;
+	if (FLAG_ON(phdr->p_flags, ELF_PF_R)) {
+		flags |= VA_MAP_READ;
+	}
+	/* Private copies of the data and the BSS are often identical between
+	 * the processes running a binary
+	 */
+	if (FLAG_ON(phdr->p_flags, ELF_PF_W)) {
+		flags |= VA_MAP_WRITE | VA_MAP_MERGE;
+	}
+	if (FLAG_ON(phdr->p_flags, ELF_PF_X)) {
+		flags |= VA_MAP_EXEC;
+	}
+
+	start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
+	offset = ROUND_DOWN(phdr->p_offset, PAGE_SIZE);
+	file_end = start;
+	end = ROUND_UP(phdr->p_vaddr + phdr->p_memsz, PAGE_SIZE);
+
+	if (phdr->p_filesz) {
+		file_end = ROUND_UP(phdr->p_vaddr + phdr->p_filesz, PAGE_SIZE);
+		rc = va_map_file(bin->vas, start, file_end - start, flags, bin->n,
+				 offset, phdr->p_vaddr + phdr->p_filesz - start,
+				 cache, NULL);
+		if (rc != 0) {
+			DEBUG(DL_WRN, ("va_map_file failed, err(%x).\n", rc));
+			goto out;
+		}
+	}
+
+	/* The BSS which does not share a page with the file data */
+	if (end > file_end) {
+		rc = va_map(bin->vas, file_end, end - file_end,
+			    flags | VA_MAP_ZERO, NULL);
+		if (rc != 0) {
+			DEBUG(DL_WRN, ("va_map failed, err(%x).\n", rc));
+			goto out;
+		}
+	}
+
+	DEBUG(DL_DBG, ("segment(%p-%p), file end(%p), flags(%x) mapped.\n",
+		       start, end, file_end, flags));
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+int elf_load_binary(struct vfs_node *n, struct va_space *vas, void **datap)
+{
+	int rc = -1, i;
+	size_t load_cnt;
+	elf_binary_t *bin;
+	elf_phdr_t *phdr;
+	struct elf_image *image;
+
+	/* Allocate buffer to store the binary information */
+	bin = kmalloc(sizeof(elf_binary_t), MM_ZERO);
+	if (!bin) {
+		DEBUG(DL_INF, ("kmalloc buffer for binary failed.\n"));
+		rc = -1;
+		goto out;
+	}
 	
-	/* Load the loadable segments from the executive to the address which was
-	 * specified in the ELF. For Matrix default is 0x20000000 which was specified
-	 * in the link script.
+	bin->vas = vas;
+	bin->n = n;
+
+	mutex_acquire(&_elf_images_lock);
+
+	/* Get the parsed headers of the binary from the image cache */
+	rc = elf_image_get(n, &image);
+	if (rc != 0) {
+		goto unlock;
+	}
+
+	/* Map the loadable segments to the address which was specified in the
+	 * ELF. For Matrix default is 0x20000000 which was specified in the link
+	 * script. Frames already in the caches of the image are mapped now.
 	 */
 	load_cnt = 0;
-	for (i = 0, virt = 0;
-	     virt < (ehdr->e_shentsize * ehdr->e_shnum);
-	     virt += ehdr->e_shentsize, i++) {
-
-		/* Read a section header */
-		shdr = (elf_shdr_t *)(((uint8_t *)ehdr) + (ehdr->e_shoff + virt));
-		DEBUG(DL_DBG, ("i(%d), sh_addr(0x%x), sh_size(0x%x), sh_type(%d)\n",
-			       i, shdr->sh_addr, shdr->sh_size, shdr->sh_type));
-		
-		if (shdr->sh_addr) {
-			size_t map_size;
-			
-			/* If this is a loadable section, load it */
-			if (shdr->sh_addr < base) {
-				/* If this is the lowest entry point, store it */
-				base = shdr->sh_addr;
-			}
+	for (i = 0; i < image->ehdr.e_phnum; i++) {
+		phdr = &image->phdrs[i];
+		DEBUG(DL_DBG, ("i(%d), p_vaddr(0x%x), p_memsz(0x%x), p_type(%d)\n",
+			       i, phdr->p_vaddr, phdr->p_memsz, phdr->p_type));
 
-			/* Update the section size we may needed */
-			if ((shdr->sh_addr + shdr->sh_size - base) > size) {
-				/* We also store the total size */
-				size = shdr->sh_addr + shdr->sh_size - base;
-			}
+		if ((phdr->p_type != ELF_PT_LOAD) || !phdr->p_memsz) {
+			continue;
+		}
 
-			/* Map address space for this section, this is where codes stored */
-			map_size = ROUND_UP(shdr->sh_size, PAGE_SIZE);
-			rc = va_map(vas, shdr->sh_addr, map_size,
-				    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_FIXED, NULL);
-			if (rc != 0) {
-				DEBUG(DL_WRN, ("va_map failed, err(%x).\n", rc));
-				goto out;
-			}
+		rc = elf_load_segment(bin, phdr, image->caches[i]);
+		if (rc != 0) {
+			goto unlock;
+		}
 
-			load_cnt++;
-			DEBUG(DL_DBG, ("i(%d), address space mapped.\n", i));
+		if (!load_cnt || (phdr->p_vaddr < bin->load_base)) {
+			bin->load_base = phdr->p_vaddr;
 		}
+		load_cnt++;
 	}
 
 	/* Check whether we actually loaded anything */
 	if (!load_cnt) {
 		rc = -1;
-		DEBUG(DL_WRN, ("binary do not have any loadable sections.\n"));
-		goto out;
+		DEBUG(DL_WRN, ("binary do not have any loadable segments.\n"));
+		goto unlock;
 	}
 
-	bin->load_base = base;
+	bin->entry = image->ehdr.e_entry;
 	
 	/* Save the entry point to the code segment */
 	*datap = bin;
-	DEBUG(DL_DBG, ("base(%p), datap (%p)\n", base, *datap));
+	DEBUG(DL_DBG, ("base(%p), datap (%p)\n", bin->load_base, *datap));
 
 	rc = 0;
 
-out:
+ unlock:
+	mutex_release(&_elf_images_lock);
+
+ out:
 	if (rc != 0) {
 		if (bin) {
-			if (bin->ehdr) {
-				kfree(bin->ehdr);
-			}
 			kfree(bin);
 		}
 	}
 	
 	return rc;
 }
+
+/*
+ * Shrinker of the image cache, the least recently used images are dropped
+ * with the frames of their read-only segments which are not mapped
+ */
+static size_t elf_image_shrink(size_t count)
+{
+	size_t freed = 0;
+	struct list *l;
+
+	mutex_acquire(&_elf_images_lock);
+	while (!LIST_EMPTY(&_elf_images) && (freed < count)) {
+		l = _elf_images.prev;
+		list_del(l);
+		elf_image_free(LIST_ENTRY(l, struct elf_image, link));
+		_nr_elf_images--;
+		freed++;
+	}
+	mutex_release(&_elf_images_lock);
+
+	return freed;
+}
+
+static struct shrinker _elf_image_shrinker = {
+	.name = "elf-image",
+	.shrink = elf_image_shrink
+};
+
+void init_elf()
+{
+	mutex_init(&_elf_images_lock, "elf-mutex", 0);
+	shrinker_register(&_elf_image_shrinker);
+}
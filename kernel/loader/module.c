@@ -26,6 +26,8 @@ extern int null_init(void);
 extern int null_unload(void);
 extern int zero_init(void);
 extern int zero_unload(void);
+extern int zram_init(void);
+extern int zram_unload(void);
 
 /* List of loaded modules */
 static struct list _module_list = {
@@ -88,6 +90,12 @@ static int load_module_stub(struct module *m)
 		m->init = zero_init;
 		m->unload = zero_unload;
 		break;
+	case KMOD_ZRAM:
+		m->name = "zram";
+		m->desc = "Compressed RAM disk driver";
+		m->init = zram_init;
+		m->unload = zram_unload;
+		break;
 	default:
 		DEBUG(DL_INF, ("unknown module(%s:%d).\n", m->name, m->handle));
 		rc = -1;
@@ -1,15 +1,48 @@
 #include <types.h>
 #include <stddef.h>
+#include <string.h>
 #include "hal/hal.h"
 #include "util.h"
-#include "vector.h"
+#include "bitops.h"
+#include "atomic.h"
+#include "hal/core.h"
+#include "hal/spinlock.h"
 #include "mm/mm.h"
 #include "mm/mlayout.h"
 #include "mm/mmu.h"
 #include "mm/kmem.h"
+#include "mm/vmalloc.h"
+#include "mm/reclaim.h"
 #include "matrix/matrix.h"
 #include "debug.h"
 
+/* Granularity of the block size, the returned addresses are 8 byte aligned */
+#define KMEM_ALIGN_SHIFT	3
+#define KMEM_ALIGN		(1 << KMEM_ALIGN_SHIFT)
+
+/* Number of second level free lists for each first level, in power of 2 */
+#define KMEM_SL_SHIFT		4
+#define KMEM_SL_COUNT		(1 << KMEM_SL_SHIFT)
+
+/* Holes smaller than KMEM_SMALL_BLOCK are all indexed by first level 0 */
+#define KMEM_FL_SHIFT		(KMEM_SL_SHIFT + KMEM_ALIGN_SHIFT)
+#define KMEM_SMALL_BLOCK	(1 << KMEM_FL_SHIFT)
+
+/* Number of first level free lists, enough to index a 256MB hole */
+#define KMEM_FL_COUNT		(28 - KMEM_FL_SHIFT + 1)
+
+/* Size of the chunks an arena gets from the global pool each time */
+#define KMEM_CHUNK_SIZE		(16 * PAGE_SIZE)
+
+/* Requests larger than this are served by the global pool directly */
+#define KMEM_ARENA_MAX_ALLOC	(KMEM_CHUNK_SIZE / 4)
+
+/* Maximum number of per-CORE arenas */
+#define KMEM_MAX_ARENAS		32
+
+/* Arena ID of the blocks which belongs to the global pool */
+#define KMEM_GLOBAL_ARENA	0xFF
+
 /*
  * Size information for a block
  */
@@ -17,6 +50,7 @@ struct header {
 	uint32_t magic;		// magic number, used for sanity check
 	uint32_t size;
 	uint8_t is_hole;
+	uint8_t arena;		// ID of the arena this block belongs to
 };
 
 struct footer {
@@ -24,9 +58,36 @@ struct footer {
 	struct header *hdr;
 };
 
-/* Structure describing a kernel memory pool */
+/*
+ * A free block. The links to the free list are stored in the space
+ * which would be returned to the caller if the block was allocated.
+ */
+struct hole {
+	struct header hdr;
+	struct hole *prev;	// Previous hole in the same size class
+	struct hole *next;	// Next hole in the same size class
+};
+
+/* Size of the fenceposts at both ends of a pool or chunk */
+#define KMEM_FENCE_SIZE		(sizeof(struct header) + sizeof(struct footer))
+
+/* Minimum size of a block, a hole must be able to hold its list links */
+#define KMEM_MIN_BLOCK		ROUND_UP(sizeof(struct hole) + sizeof(struct footer), KMEM_ALIGN)
+
+/*
+ * Two level segregated free lists of the holes. A bit is set in the bitmaps
+ * if the corresponding list is not empty.
+ */
+struct kmem_index {
+	u_long fl_bitmap;
+	u_long sl_bitmap[KMEM_FL_COUNT];
+	struct hole *holes[KMEM_FL_COUNT][KMEM_SL_COUNT];
+};
+
+/* Structure describing the global kernel memory pool */
 struct kmem_pool {
-	struct vector index;
+	struct kmem_index index;
+	
 	ptr_t start_addr;	// start of our allocated space
 	ptr_t end_addr;		// end of our allocated space
 	ptr_t max_addr;		// maximum address the pool can expand to
@@ -34,115 +95,376 @@ struct kmem_pool {
 	uint8_t readonly;
 };
 
+/*
+ * Per-CORE heap arena. An arena is only touched by its own CORE with
+ * interrupts disabled, so it needs no lock. Blocks freed by other COREs
+ * are pushed to the remote free stack and merged back by the owner.
+ */
+struct kmem_arena {
+	struct kmem_index index;
+	uint8_t id;		// Index in the arena table
+	size_t nr_chunks;	// Number of chunks got from the global pool
+	atomic_t remote_free;	// Stack of blocks freed by other COREs
+};
+
+static struct kmem_pool _kpool_struct;
 struct kmem_pool *_kpool = NULL;
-struct mutex _kmem_lock;	// Lock for the kernel memory pool
+struct spinlock _kmem_lock;	// Lock for the global kernel memory pool
 boolean_t _kmem_init_done = FALSE;
 
-static void expand(struct kmem_pool *pool, size_t new_size)
+/* Arena of the boot CORE, the heap is needed before other COREs exist */
+static struct kmem_arena _boot_arena;
+
+/* Table of the arenas, indexed by the arena ID in the block headers */
+static struct kmem_arena *_kmem_arenas[KMEM_MAX_ARENAS];
+static atomic_t _nr_arenas = 0;
+
+static INLINE struct footer *block_footer(struct header *hdr)
+{
+	return (struct footer *)((ptr_t)hdr + hdr->size - sizeof(struct footer));
+}
+
+static INLINE struct header *next_block(struct header *hdr)
+{
+	return (struct header *)((ptr_t)hdr + hdr->size);
+}
+
+static INLINE struct header *prev_block(struct header *hdr)
+{
+	struct footer *ftr;
+
+	ftr = (struct footer *)((ptr_t)hdr - sizeof(struct footer));
+	ASSERT(ftr->magic == POOL_MAGIC);
+	return ftr->hdr;
+}
+
+/* Write the header and footer of a block */
+static void set_block(struct header *hdr, size_t size, uint8_t is_hole)
+{
+	struct footer *ftr;
+	
+	hdr->magic = POOL_MAGIC;
+	hdr->size = size;
+	hdr->is_hole = is_hole;
+	
+	ftr = block_footer(hdr);
+	ftr->magic = POOL_MAGIC;
+	ftr->hdr = hdr;
+}
+
+/* Get the free list indices a hole of the specified size belongs to */
+static INLINE void mapping_insert(size_t size, int *fl, int *sl)
+{
+	int f;
+
+	if (size < KMEM_SMALL_BLOCK) {
+		*fl = 0;
+		*sl = size >> KMEM_ALIGN_SHIFT;
+	} else {
+		f = bitops_fls(size);
+		*sl = (size >> (f - KMEM_SL_SHIFT)) ^ KMEM_SL_COUNT;
+		*fl = f - (KMEM_FL_SHIFT - 1);
+	}
+}
+
+/* Get the first free list in which every hole can hold the size */
+static INLINE void mapping_search(size_t size, int *fl, int *sl)
+{
+	if (size >= KMEM_SMALL_BLOCK) {
+		size += (1 << (bitops_fls(size) - KMEM_SL_SHIFT)) - 1;
+	}
+	mapping_insert(size, fl, sl);
+}
+
+static void insert_hole(struct kmem_index *index, struct header *hdr)
+{
+	int fl, sl;
+	struct hole *h;
+
+	mapping_insert(hdr->size, &fl, &sl);
+	ASSERT(fl < KMEM_FL_COUNT);
+
+	h = (struct hole *)hdr;
+	h->prev = NULL;
+	h->next = index->holes[fl][sl];
+	if (h->next) {
+		h->next->prev = h;
+	}
+	index->holes[fl][sl] = h;
+	index->fl_bitmap |= (1UL << fl);
+	index->sl_bitmap[fl] |= (1UL << sl);
+
+	set_block(hdr, hdr->size, 1);
+}
+
+static void remove_hole(struct kmem_index *index, struct header *hdr)
+{
+	int fl, sl;
+	struct hole *h;
+
+	ASSERT(hdr->is_hole);
+	
+	mapping_insert(hdr->size, &fl, &sl);
+
+	h = (struct hole *)hdr;
+	if (h->next) {
+		h->next->prev = h->prev;
+	}
+	if (h->prev) {
+		h->prev->next = h->next;
+	} else {
+		index->holes[fl][sl] = h->next;
+		if (!h->next) {
+			index->sl_bitmap[fl] &= ~(1UL << sl);
+			if (!index->sl_bitmap[fl]) {
+				index->fl_bitmap &= ~(1UL << fl);
+			}
+		}
+	}
+
+	hdr->is_hole = 0;
+}
+
+/* Find a hole which is big enough for size, in constant time */
+static struct header *find_hole(struct kmem_index *index, size_t size)
+{
+	int fl, sl;
+	u_long map;
+
+	mapping_search(size, &fl, &sl);
+	if (fl >= KMEM_FL_COUNT) {
+		return NULL;
+	}
+
+	/* Search the second level lists in this first level first */
+	map = index->sl_bitmap[fl] & (~0UL << sl);
+	if (!map) {
+		/* No luck, use the smallest non-empty first level list */
+		map = index->fl_bitmap & (~0UL << (fl + 1));
+		if (!map) {
+			return NULL;	// No hole left for us
+		}
+		fl = bitops_ffs(map);
+		map = index->sl_bitmap[fl];
+	}
+	sl = bitops_ffs(map);
+
+	return &index->holes[fl][sl]->hdr;
+}
+
+/*
+ * Merge a block which is going to be a hole with its neighbours. The
+ * boundary tags tell us whether the neighbours are holes, the fenceposts
+ * at both ends of a pool or chunk are never holes.
+ */
+static struct header *merge_hole(struct kmem_index *index, struct header *hdr)
 {
+	size_t size;
+	struct header *other;
+
+	other = prev_block(hdr);
+	if (other->is_hole) {
+		remove_hole(index, other);
+		size = hdr->size;
+		hdr = other;
+		hdr->size += size;
+	}
+
+	other = next_block(hdr);
+	ASSERT(other->magic == POOL_MAGIC);
+	if (other->is_hole) {
+		remove_hole(index, other);
+		hdr->size += other->size;
+	}
+
+	return hdr;
+}
+
+/* Get the size of a block we need for the request */
+static INLINE size_t block_size(size_t size)
+{
+	size = ROUND_UP(size + sizeof(struct header) + sizeof(struct footer),
+			KMEM_ALIGN);
+	if (size < KMEM_MIN_BLOCK) {
+		size = KMEM_MIN_BLOCK;
+	}
+	return size;
+}
+
+/* Get the size of a hole which can hold an aligned block */
+static INLINE size_t search_size(size_t size, size_t align)
+{
+	if (align) {
+		ASSERT(((align & (align - 1)) == 0) && (align >= KMEM_ALIGN));
+		size += align + KMEM_MIN_BLOCK;
+	}
+	return size;
+}
+
+/*
+ * Allocate a block from a hole index
+ * @index	- the index to allocate from
+ * @size	- size of the block, including the header/footer
+ * @align	- alignment of the returned address, 0 if don't care
+ */
+static void *index_alloc(struct kmem_index *index, size_t size, size_t align)
+{
+	size_t gap;
+	struct header *hdr, *hole_hdr;
+	ptr_t data;
+
+	/* Find a hole that will fit */
+	hdr = find_hole(index, search_size(size, align));
+	if (!hdr) {
+		return NULL;
+	}
+
+	/* This hole was allocated, so just remove it */
+	remove_hole(index, hdr);
+
+	/* If we need to align the data, do it now and make a new hole
+	 * in front of our block
+	 */
+	if (align) {
+		data = ROUND_UP((ptr_t)hdr + sizeof(struct header), align);
+		gap = data - sizeof(struct header) - (ptr_t)hdr;
+		while (gap && (gap < KMEM_MIN_BLOCK)) {
+			gap += align;
+		}
+		
+		if (gap) {
+			hole_hdr = hdr;
+			hdr = (struct header *)((ptr_t)hole_hdr + gap);
+			hdr->size = hole_hdr->size - gap;
+			hdr->arena = hole_hdr->arena;
+			hole_hdr->size = gap;
+			insert_hole(index, hole_hdr);
+		}
+	}
+
+	/* Here we work out if we should split the hole we found into parts.
+	 * Just keep the whole hole if the rest is less than the overhead for
+	 * adding a new hole.
+	 */
+	if ((hdr->size - size) >= KMEM_MIN_BLOCK) {
+		hole_hdr = (struct header *)((ptr_t)hdr + size);
+		hole_hdr->size = hdr->size - size;
+		hole_hdr->arena = hdr->arena;
+		insert_hole(index, hole_hdr);
+		hdr->size = size;
+	}
+
+	set_block(hdr, hdr->size, 0);
+
+	/* Done! */
+	return (void *)((ptr_t)hdr + sizeof(struct header));
+}
+
+static boolean_t expand(struct kmem_pool *pool, size_t new_size)
+{
+	int rc;
 	struct page *p;
+	struct header *hdr;
+	ptr_t old_end;
 	size_t old_size, i;
 	
 	/* Sanity check */
 	ASSERT(new_size > (pool->end_addr - pool->start_addr));
 
-	/* Round up the new_size to PAGE_SIZE */
+	/* Round up the new_size to PAGE_SIZE, or to a large page step so
+	 * the pool is mapped by large pages.
+	 */
 	new_size = ROUND_UP(new_size, PAGE_SIZE);
+	if (_mmu_large_pages && !pool->supervisor &&
+	    ((pool->start_addr + ROUND_UP(new_size, LARGE_PAGE_SIZE)) < pool->max_addr)) {
+		new_size = ROUND_UP(new_size, LARGE_PAGE_SIZE);
+	}
 	
 	/* Make sure we're not overreaching ourselves */
-	ASSERT((pool->start_addr + new_size) < pool->max_addr);
+	if ((pool->start_addr + new_size) >= pool->max_addr) {
+		DEBUG(DL_WRN, ("pool(%p) exhausted, new_size(%x).\n", pool, new_size));
+		return FALSE;
+	}
 
+	old_end = pool->end_addr;
 	old_size = pool->end_addr - pool->start_addr;
 	i = old_size;
 
 	DEBUG(DL_DBG, ("pool(%p), new_size(%x).\n", pool, new_size));
 
-	while (i < new_size) {
-		p = mmu_get_page(&_kernel_mmu_ctx, pool->start_addr + i, TRUE, 0);
-		page_alloc(p, 0);
-		p->user = pool->supervisor ? TRUE : FALSE;
-		p->rw = pool->readonly ? FALSE : TRUE;
-		i += PAGE_SIZE;
+	/* Page tables come from the page allocator, so this will never call
+	 * back into the heap. The range is unmapped again if frames ran out.
+	 */
+	rc = mmu_map_range(&_kernel_mmu_ctx, pool->start_addr + i, 0,
+			   new_size - i, MMU_MAP_ALLOC |
+			   (pool->readonly ? 0 : MMU_MAP_WRITE) |
+			   (pool->supervisor ? 0 : MMU_MAP_LARGE));
+	if (rc != 0) {
+		DEBUG(DL_WRN, ("pool(%p) map failed, new_size(%x) err(%x).\n",
+			       pool, new_size, rc));
+		return FALSE;
+	}
+	if (pool->supervisor) {
+		for (; i < new_size; i += PAGE_SIZE) {
+			p = mmu_get_page(&_kernel_mmu_ctx, pool->start_addr + i,
+					 FALSE, 0);
+			p->user = TRUE;
+		}
 	}
 	
 	pool->end_addr = pool->start_addr + new_size;
+
+	/* The old end fencepost and the new space become a hole, and the
+	 * fencepost is moved to the new end of the pool.
+	 */
+	hdr = (struct header *)(old_end - KMEM_FENCE_SIZE);
+	set_block(hdr, pool->end_addr - old_end, 0);
+	hdr = (struct header *)(pool->end_addr - KMEM_FENCE_SIZE);
+	set_block(hdr, KMEM_FENCE_SIZE, 0);
+	hdr->arena = KMEM_GLOBAL_ARENA;
+	hdr = merge_hole(&pool->index, (struct header *)(old_end - KMEM_FENCE_SIZE));
+	insert_hole(&pool->index, hdr);
+
+	return TRUE;
 }
 
-static uint32_t contract(struct kmem_pool *pool, size_t new_size)
+static boolean_t contract(struct kmem_pool *pool, size_t new_size)
 {
-	struct page *p;
-	size_t old_size, i;
+	int rc;
 
 	/* Sanity check */
 	ASSERT(new_size < (pool->end_addr - pool->start_addr));
-
-	if (new_size & PAGE_SIZE) {
-		new_size &= PAGE_SIZE;
-		new_size += PAGE_SIZE;
-	}
-
-	/* Don't contract too much */
-	if (new_size < POOL_MIN_SIZE) {
-		new_size = POOL_MIN_SIZE;
-	}
-
-	old_size = pool->end_addr - pool->start_addr;
-	i = old_size - PAGE_SIZE;
+	ASSERT((new_size % PAGE_SIZE) == 0);
 
 	DEBUG(DL_DBG, ("pool(%p), new_size(%x).\n", pool, new_size));
 
-	while (new_size < i) {
-		p = mmu_get_page(&_kernel_mmu_ctx, pool->start_addr + i, FALSE, 0);
-		page_free(p);
-		i -= PAGE_SIZE;
+	/* Splitting a large page may fail, the pool keeps its size then */
+	rc = mmu_unmap_range(&_kernel_mmu_ctx, pool->start_addr + new_size,
+			     pool->end_addr - pool->start_addr - new_size, TRUE);
+	if (rc != 0) {
+		return FALSE;
 	}
 
 	pool->end_addr = pool->start_addr + new_size;
-	
-	return new_size;
-}
-
-static int8_t header_compare(void *x, void *y)
-{
-	struct header *a = (struct header *)x;
-	struct header *b = (struct header *)y;
 
-	if (a->size == b->size)
-		return 0;
-	else
-		return (a->size > b->size) ? 1 : 0;
+	return TRUE;
 }
 
 /*
  * create the pool
- * start - the address to place the pool index at
+ * start - the address the pool begins at
  */
 struct kmem_pool *create_pool(uint32_t start, uint32_t end, uint32_t max,
 			      uint8_t supervisor, uint8_t readonly)
 {
-	phys_addr_t addr;
 	struct kmem_pool *pool;
-	struct header *hole;
+	struct header *hdr;
 
 	ASSERT(start % PAGE_SIZE == 0);
 	ASSERT(end % PAGE_SIZE == 0);
 
-	page_early_alloc(&addr, sizeof(struct kmem_pool), 0);
-	ASSERT(addr != 0);
-	
-	pool = (struct kmem_pool *)addr;
-
-	/* Initialize the index of the pool, size of index is fixed */
-	place_vector(&pool->index, (void *)start, POOL_INDEX_SIZE, header_compare);
-
-	/* Shift the start address forward to resemble where we can start putting data */
-	start += (sizeof(type_t) * POOL_INDEX_SIZE);
-	
-	/* Make sure the start address is page-aligned */
-	if ((start & 0xFFF) != 0) {
-		start &= 0xFFFFF000;
-		start += PAGE_SIZE;
-	}
+	pool = &_kpool_struct;
+	memset(pool, 0, sizeof(struct kmem_pool));
 	
 	pool->start_addr = start;
 	pool->end_addr = end;
@@ -150,284 +472,234 @@ struct kmem_pool *create_pool(uint32_t start, uint32_t end, uint32_t max,
 	pool->supervisor = supervisor;
 	pool->readonly = readonly;
 
-	/* Initialize header of the first hole */
-	hole = (struct header *)start;
-	hole->size = end - start;
-	hole->magic = POOL_MAGIC;
-	hole->is_hole = 1;
+	/* Place the fenceposts at both ends of the pool, so we never merge
+	 * beyond the pool
+	 */
+	hdr = (struct header *)start;
+	set_block(hdr, KMEM_FENCE_SIZE, 0);
+	hdr->arena = KMEM_GLOBAL_ARENA;
+	hdr = (struct header *)(end - KMEM_FENCE_SIZE);
+	set_block(hdr, KMEM_FENCE_SIZE, 0);
+	hdr->arena = KMEM_GLOBAL_ARENA;
 
-	insert_vector(&pool->index, (void *)hole);
+	/* Initialize header of the first hole */
+	hdr = (struct header *)(start + KMEM_FENCE_SIZE);
+	hdr->size = end - start - 2 * KMEM_FENCE_SIZE;
+	hdr->arena = KMEM_GLOBAL_ARENA;
+	insert_hole(&pool->index, hdr);
 
 	return pool;
 }
 
-static uint32_t find_smallest_hole(struct kmem_pool *pool, size_t size, boolean_t page_align)
+/* Allocate a block from the global pool, expand the pool if necessary */
+static void *global_alloc(struct kmem_pool *pool, size_t size, size_t align)
 {
-	uint32_t iterator;
-	
-	/* Find the smallest hole that will fit */
-	iterator = 0;
-
-	while (iterator < pool->index.size) {
-		struct header *header;
-		header = (struct header *)lookup_vector(&pool->index, iterator);
-
-		/* If the user has requested the memory be page-aligned */
-		if (page_align) {
-			/* Page-align the starting point of this header */
-			uint32_t location;
-			int32_t offset = 0;
-			int32_t hole_size;
-
-			location = (uint32_t)header;
-			if (((location + sizeof(struct header)) & 0xFFF) != 0) {
-				offset = PAGE_SIZE - ((location + sizeof(struct header)) % PAGE_SIZE);
-			}
-			hole_size = (int32_t)header->size - offset;
-			
-			/* Can we fit now ? */
-			if (hole_size >= (int32_t)size) {
-				break;
-			}
-		} else if (header->size >= size) {
-			break;
+	void *ret;
+
+	size = block_size(size);
+
+	spinlock_acquire(&_kmem_lock);
+
+	ret = index_alloc(&pool->index, size, align);
+	if (!ret) {
+		/* We need to allocate more space */
+		if (expand(pool, (pool->end_addr - pool->start_addr) +
+			   search_size(size, align))) {
+			/* We have enough space now. */
+			ret = index_alloc(&pool->index, size, align);
 		}
-		
-		iterator++;
 	}
 
-	if (iterator == pool->index.size) {
-		return -1;	// No hole left for us
-	} else {
-		return iterator;
-	}
+	spinlock_release(&_kmem_lock);
+
+	return ret;
 }
 
-void *alloc(struct kmem_pool *pool, size_t size, boolean_t page_align)
+static void global_free(struct kmem_pool *pool, struct header *header)
 {
-	size_t new_size;
-	int32_t iterator;
-	struct header *orig_hole_hdr, *block_hdr;
-	struct footer *block_ftr;
-	uint32_t orig_hole_pos, orig_hole_size;
+	struct header *next;
+	ptr_t new_end, min_end;
 
-	/* Make sure we take the size of header/footer into account */
-	new_size = sizeof(struct header) + sizeof(struct footer) + size;
+	spinlock_acquire(&_kmem_lock);
 
-	/* Find the smallest hole that will fit */
-	iterator = find_smallest_hole(pool, new_size, page_align);
-	if (iterator == -1) {
-		size_t old_length = pool->end_addr - pool->start_addr;
-		size_t old_end_addr = pool->end_addr;
-		size_t new_length, idx, value;
-		struct header *header;
-		struct footer *footer;
+	/* Make us a hole, merging the neighbours if they are holes */
+	header = merge_hole(&pool->index, header);
 
-		/* We need to allocate more space */
-		expand(pool, old_length + new_size);
-		new_length = pool->end_addr - pool->start_addr;
-
-		/* Find the last header in location */
-		iterator = 0;
-		idx = -1;
-		value = 0;
-
-		while (iterator < pool->index.size) {
-			uint32_t tmp = (uint32_t)lookup_vector(&pool->index, iterator);
-			if (tmp > value) {
-				value = tmp;
-				idx = iterator;
-			}
-			iterator++;
-		}
+	/* If the hole is the last block of the pool, try to contract */
+	min_end = pool->start_addr + KERNEL_KMEM_SIZE;
+	if (((ptr_t)next_block(header) + KMEM_FENCE_SIZE == pool->end_addr) &&
+	    (pool->end_addr > min_end)) {
+		new_end = ROUND_UP((ptr_t)header + KMEM_MIN_BLOCK + KMEM_FENCE_SIZE,
+				   PAGE_SIZE);
+		new_end = MAX(new_end, min_end);
 
-		/* If we didn't find any headers we need to add one */
-		if (idx == -1) {
-			header = (struct header *)old_end_addr;
-			header->magic = POOL_MAGIC;
-			header->size = new_length - old_length;
-			header->is_hole = 1;
-			footer = (struct footer *)(old_end_addr + header->size - sizeof(struct footer));
-			footer->magic = POOL_MAGIC;
-			footer->hdr = header;
-			insert_vector(&pool->index, (void *)header);
-		} else {
-			/* The last header need adjusting */
-			header = lookup_vector(&pool->index, idx);
-			header->size += (new_length - old_length);
-			/* Rewrite the footer */
-			footer = (struct footer *)((uint32_t)header + header->size - sizeof(struct footer));
-			footer->hdr = header;
-			footer->magic = POOL_MAGIC;
+		/* Do not split the large pages of the pool */
+		if (_mmu_large_pages && !pool->supervisor) {
+			new_end = ROUND_UP(new_end, LARGE_PAGE_SIZE);
+		}
+		if ((new_end < pool->end_addr) &&
+		    contract(pool, new_end - pool->start_addr)) {
+			header->size = new_end - KMEM_FENCE_SIZE - (ptr_t)header;
+			next = (struct header *)(new_end - KMEM_FENCE_SIZE);
+			set_block(next, KMEM_FENCE_SIZE, 0);
+			next->arena = KMEM_GLOBAL_ARENA;
 		}
-
-		/* We have enough space now. Call alloc again. */
-		return alloc(pool, size, page_align);
 	}
 
-	orig_hole_hdr = (struct header *)lookup_vector(&pool->index, iterator);
-	orig_hole_pos = (uint32_t)orig_hole_hdr;
-	orig_hole_size = orig_hole_hdr->size;
+	insert_hole(&pool->index, header);
 
-	/* Here we work out if we should split the hole we found into parts
-	 * Is the original hole size - requested hole size less than the overhead
-	 * for adding a new hole?
-	 */
-	if ((orig_hole_size - new_size) < (sizeof(struct header) + sizeof(struct footer))) {
-		/* Then just increase the requested size to the hole we found */
-		size += (orig_hole_size - new_size);
-		new_size = orig_hole_size;
-	}
+	spinlock_release(&_kmem_lock);
+}
 
-	/* If we need to page-align the data, do it now and make a new hole
-	 * in front of our block
-	 */
-	if (page_align && ((orig_hole_pos + sizeof(struct header)) & 0xFFF)) {
-		uint32_t new_location;
-		struct header *hole_header;
-		struct footer *hole_footer;
-		/* The memory address returned to caller should be page-aligned */
-		new_location = orig_hole_pos + PAGE_SIZE - (orig_hole_pos & 0xFFF) - sizeof(struct header);
-		hole_header = (struct header *)orig_hole_pos;
-		hole_header->size = PAGE_SIZE - (orig_hole_pos & 0xFFF) - sizeof(struct header);
-		hole_header->magic = POOL_MAGIC;
-		hole_header->is_hole = 1;
-		hole_footer = (struct footer *)(new_location - sizeof(struct footer));
-		hole_footer->magic = POOL_MAGIC;
-		hole_footer->hdr = hole_header;
-		/* We have made a new hole so don't need to remove it from vector */
-		orig_hole_pos = new_location;
-		orig_hole_size = orig_hole_size - hole_header->size;
-	} else {
-		/* This hole was allocated, so just remove it */
-		remove_vector(&pool->index, iterator);
-	}
-
-	/* Overwrite the original header ... */
-	block_hdr = (struct header *)orig_hole_pos;
-	block_hdr->magic = POOL_MAGIC;
-	block_hdr->is_hole = 0;
-	block_hdr->size = new_size;
-
-	/* And the footer ... */
-	block_ftr = (struct footer *)(orig_hole_pos + sizeof(struct header) + size);
-	block_ftr->magic = POOL_MAGIC;
-	block_ftr->hdr = block_hdr;
-
-	/* We may need to write a new hole after the allocated block. */
-	if (orig_hole_size  > new_size) {
-		struct header *hole_hdr;
-		struct footer *hole_ftr;
-		hole_hdr = (struct header *)
-			(orig_hole_pos + sizeof(struct header) + size + sizeof(struct footer));
-		hole_hdr->magic = POOL_MAGIC;
-		hole_hdr->is_hole = 1;
-		hole_hdr->size = orig_hole_size - new_size;
-		hole_ftr = (struct footer *)
-			((uint32_t)hole_hdr + orig_hole_size - new_size - sizeof(struct footer));
-		if ((uint32_t)hole_ftr < pool->end_addr) {
-			hole_ftr->magic = POOL_MAGIC;
-			hole_ftr->hdr = hole_hdr;
-		}
+/*
+ * Get a chunk from the global pool and make it a hole of the arena. The
+ * chunk has a fencepost at each end so holes never merge across chunks.
+ */
+static boolean_t arena_refill(struct kmem_arena *arena, size_t size)
+{
+	ptr_t chunk;
+	struct header *hdr;
 
-		/* Insert the new hole into the index */
-		insert_vector(&pool->index, (void *)hole_hdr);
+	size = MAX(KMEM_CHUNK_SIZE, ROUND_UP(size + 2 * KMEM_FENCE_SIZE, PAGE_SIZE));
+	chunk = (ptr_t)global_alloc(_kpool, size, PAGE_SIZE);
+	if (!chunk) {
+		return FALSE;
 	}
 
-	/* Done! */
-	return (void *)((uint32_t)block_hdr + sizeof(struct header));
+	hdr = (struct header *)chunk;
+	set_block(hdr, KMEM_FENCE_SIZE, 0);
+	hdr->arena = arena->id;
+	hdr = (struct header *)(chunk + size - KMEM_FENCE_SIZE);
+	set_block(hdr, KMEM_FENCE_SIZE, 0);
+	hdr->arena = arena->id;
+
+	hdr = (struct header *)(chunk + KMEM_FENCE_SIZE);
+	hdr->size = size - 2 * KMEM_FENCE_SIZE;
+	hdr->arena = arena->id;
+	insert_hole(&arena->index, hdr);
+
+	arena->nr_chunks++;
+
+	DEBUG(DL_DBG, ("arena(%d) chunk(%p) size(%x) nr_chunks(%d).\n",
+		       arena->id, chunk, size, arena->nr_chunks));
+
+	return TRUE;
 }
 
-void free(struct kmem_pool *pool, void *p)
+/* Free a block of the arena, the caller must be the owner of the arena */
+static void arena_free(struct kmem_arena *arena, struct header *header)
 {
-	boolean_t do_add, do_contract;
-	struct header *header, *test_hdr;
-	struct footer *footer, *test_ftr;
-	uint32_t iterator;
-	
-	if (!p) {
+	struct header *prev, *next;
+
+	/* Make us a hole, merging the neighbours if they are holes */
+	header = merge_hole(&arena->index, header);
+
+	/* Give the chunk back to the global pool if it is entirely free and
+	 * it is not the last chunk of the arena
+	 */
+	prev = prev_block(header);
+	next = next_block(header);
+	if ((prev->size == KMEM_FENCE_SIZE) && (next->size == KMEM_FENCE_SIZE) &&
+	    (arena->nr_chunks > 1)) {
+		arena->nr_chunks--;
+		global_free(_kpool, (struct header *)((ptr_t)prev - sizeof(struct header)));
 		return;
 	}
 
-	header = (struct header *)((uint32_t)p - sizeof(struct header));
-	footer = (struct footer *)((uint32_t)header + header->size - sizeof(struct footer));
+	insert_hole(&arena->index, header);
+}
+
+/* Merge the blocks other COREs freed back into the arena */
+static void arena_drain(struct kmem_arena *arena)
+{
+	struct hole *h, *next;
 
-	/* Sanity check */
-	ASSERT(header->magic == POOL_MAGIC);
-	ASSERT(footer->magic == POOL_MAGIC);
+	/* Take the whole stack at once, so there is no ABA problem */
+	do {
+		h = (struct hole *)arena->remote_free;
+	} while (!atomic_tas(&arena->remote_free, (int32_t)h, 0));
+
+	while (h) {
+		next = h->next;
+		arena_free(arena, &h->hdr);
+		h = next;
+	}
+}
+
+/* Free a block of an arena which belongs to another CORE */
+static void arena_free_remote(struct kmem_arena *arena, struct header *header)
+{
+	struct hole *h;
 
-	/* Make us a hole */
-	header->is_hole = 1;
+	h = (struct hole *)header;
+	do {
+		h->next = (struct hole *)arena->remote_free;
+	} while (!atomic_tas(&arena->remote_free, (int32_t)h->next, (int32_t)h));
+}
 
-	/* Do we want to add this header into the 'free holes' index? */
-	do_add = TRUE;
+static void *arena_alloc(struct kmem_arena *arena, size_t size, size_t align)
+{
+	void *ret;
 
-	test_ftr = (struct footer *)((uint32_t)header - sizeof(struct footer));
-	if ((test_ftr->magic == POOL_MAGIC) &&
-	    (test_ftr->hdr->is_hole)) {
-		uint32_t cache_size = header->size;	// Cache our current size
-		header = test_ftr->hdr;
-		footer->hdr = header;
-		header->size += cache_size;
-		do_add = FALSE;
+	if (arena->remote_free) {
+		arena_drain(arena);
 	}
 
-	test_hdr = (struct header *)((uint32_t)footer + sizeof(struct footer));
-	if ((test_hdr->magic == POOL_MAGIC) &&
-	    (test_hdr->is_hole)) {
-		
-		header->size += test_hdr->size;		// Increase our size
-		test_ftr = (struct footer *)
-			((uint32_t)test_hdr + test_hdr->size - sizeof(struct footer));
-		footer = test_ftr;
-		/* Find and remove this header from the index */
-		iterator = 0;
-		while ((iterator < pool->index.size) &&
-		       (lookup_vector(&pool->index, iterator) != (void *)test_hdr)) {
-			iterator++;
-		}
+	size = block_size(size);
 
-		/* Make sure we actually find the item */
-		ASSERT(iterator < pool->index.size);
-		/* Remove it */
-		remove_vector(&pool->index, iterator);
-	}
-
-	/* If the footer location is end address, try to contract */
-	do_contract = pool->end_addr > (KERNEL_KMEM_START + KERNEL_KMEM_SIZE);
-	if (((uint32_t)footer + sizeof(struct footer) == pool->end_addr) &&
-	    do_contract) {
-		size_t old_length = pool->end_addr - pool->start_addr;
-		size_t new_length = contract(pool, (uint32_t)header - pool->start_addr);
-
-		if (header->size - (old_length - new_length) > 0) {
-			header->size -= (old_length - new_length);
-			footer = (struct footer *)((uint32_t)header + header->size -
-						   sizeof(struct footer));
-			footer->magic = POOL_MAGIC;
-			footer->hdr = header;
-		} else {
-
-			iterator = 0;
-			while ((iterator < pool->index.size) &&
-			       (lookup_vector(&pool->index, iterator) != (void *)test_hdr)) {
-				iterator++;
-			}
-			if (iterator < pool->index.size) {
-				remove_vector(&pool->index, iterator);
-			}
+	ret = index_alloc(&arena->index, size, align);
+	if (!ret) {
+		if (arena_refill(arena, search_size(size, align))) {
+			ret = index_alloc(&arena->index, size, align);
 		}
 	}
 
-	if (do_add) {
-		insert_vector(&pool->index, (void *)header);
+	return ret;
+}
+
+static void arena_init(struct kmem_arena *arena, uint8_t id)
+{
+	memset(arena, 0, sizeof(struct kmem_arena));
+	arena->id = id;
+	_kmem_arenas[id] = arena;
+}
+
+/* Get the arena of the current CORE, create it if this is the first time */
+static struct kmem_arena *arena_get()
+{
+	struct core *c;
+	struct kmem_arena *arena;
+	int32_t id;
+
+	c = CURR_CORE;
+	if (c->arena) {
+		return c->arena;
+	}
+
+	id = atomic_inc(&_nr_arenas);
+	if (id >= KMEM_MAX_ARENAS) {
+		/* Out of arenas, this CORE will use the global pool */
+		atomic_dec(&_nr_arenas);
+		return NULL;
+	}
+
+	arena = global_alloc(_kpool, sizeof(struct kmem_arena), 0);
+	if (!arena) {
+		return NULL;
 	}
+	arena_init(arena, id);
+	c->arena = arena;
+
+	DEBUG(DL_DBG, ("core(%d) arena(%d) created.\n", c->id, id));
+
+	return arena;
 }
 
 void *kmem_alloc(size_t size, int mmflag)
 {
 	void *ret = NULL;
-	boolean_t align;
+	boolean_t align, state;
+	struct kmem_arena *arena;
 
 	if (!_kpool) {
 		goto out;
@@ -435,8 +707,32 @@ void *kmem_alloc(size_t size, int mmflag)
 	
 	align = FLAG_ON(mmflag, MM_ALIGN) ? TRUE : FALSE;
 
-	/* Allocate virtual address from the kernel memory pool */
-	ret = alloc(_kpool, size, align);
+	while (TRUE) {
+		/* Allocate from the arena of the current CORE, the interrupts
+		 * are disabled so nothing else will touch the arena meanwhile.
+		 * Large requests go to the global pool directly.
+		 */
+		if (size <= KMEM_ARENA_MAX_ALLOC) {
+			state = local_irq_disable();
+			arena = arena_get();
+			if (arena) {
+				ret = arena_alloc(arena, size, align ? PAGE_SIZE : 0);
+			}
+			local_irq_restore(state);
+		}
+
+		if (!ret) {
+			ret = global_alloc(_kpool, size, align ? PAGE_SIZE : 0);
+		}
+
+		/* Out of frames, callers which may sleep wait for the reclaim
+		 * thread and try again
+		 */
+		if (ret || !FLAG_ON(mmflag, MM_WAIT) || !reclaim_wait()) {
+			break;
+		}
+	}
+
 	if (!ret) {
 		goto out;
 	}
@@ -451,74 +747,157 @@ void *kmem_alloc(size_t size, int mmflag)
 
 void kmem_free(void *p)
 {
-	free(_kpool, p);
+	struct header *header;
+	struct kmem_arena *arena;
+	boolean_t state;
+
+	if (!p) {
+		return;
+	}
+
+	header = (struct header *)((ptr_t)p - sizeof(struct header));
+
+	/* Sanity check */
+	ASSERT(header->magic == POOL_MAGIC);
+	ASSERT(block_footer(header)->magic == POOL_MAGIC);
+	ASSERT(!header->is_hole);
+
+	if (header->arena == KMEM_GLOBAL_ARENA) {
+		global_free(_kpool, header);
+		return;
+	}
+
+	ASSERT(header->arena < KMEM_MAX_ARENAS);
+	arena = _kmem_arenas[header->arena];
+	ASSERT(arena != NULL);
+
+	/* Blocks of our own arena are freed directly, others are queued to
+	 * the owner without taking any lock
+	 */
+	state = local_irq_disable();
+	if (arena == CURR_CORE->arena) {
+		arena_free(arena, header);
+	} else {
+		arena_free_remote(arena, header);
+	}
+	local_irq_restore(state);
 }
 
-void *kmem_map(phys_addr_t base, size_t size, int mmflag)
+/*
+ * Grow a block in place by absorbing the hole next to it, the rest of the
+ * hole is split off if it is big enough
+ */
+static boolean_t block_grow(struct kmem_index *index, struct header *header,
+			    size_t size)
 {
-	int rc;
-	size_t i;
-	ptr_t virt;
+	size_t total;
+	struct header *next;
 
-	ASSERT(((base % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
-	
-	rc = 0;
-	virt = base;	// FixMe: For now we just do the identical map (virt = base)
-	
-	for (i = 0; i < size; i += PAGE_SIZE) {
-		rc = mmu_map(&_kernel_mmu_ctx, virt + i, base + i,
-			     MMU_MAP_WRITE | MMU_MAP_EXEC);
-		if (rc != 0) {
-			virt = (ptr_t)NULL;
-			break;
-		}
+	if (size <= header->size) {
+		return TRUE;
 	}
 
-	if (rc != 0) {
-		/* Rollback the changes */
-		for (; i != 0; i -= PAGE_SIZE) {
-			mmu_unmap(&_kernel_mmu_ctx, virt + (i - PAGE_SIZE),
-				  TRUE, NULL);
+	next = next_block(header);
+	if (!next->is_hole || ((header->size + next->size) < size)) {
+		return FALSE;
+	}
+
+	remove_hole(index, next);
+	total = header->size + next->size;
+	if ((total - size) >= KMEM_MIN_BLOCK) {
+		next = (struct header *)((ptr_t)header + size);
+		next->size = total - size;
+		next->arena = header->arena;
+		insert_hole(index, next);
+		total = size;
+	}
+	set_block(header, total, 0);
+
+	return TRUE;
+}
+
+/*
+ * Try to resize an allocated block without moving it. A block of an arena
+ * can only be resized by the owner of the arena.
+ */
+boolean_t kmem_resize(void *p, size_t size)
+{
+	struct header *header;
+	struct kmem_arena *arena;
+	boolean_t state, ret = FALSE;
+
+	header = (struct header *)((ptr_t)p - sizeof(struct header));
+	ASSERT(header->magic == POOL_MAGIC);
+	ASSERT(!header->is_hole);
+
+	size = block_size(size);
+
+	if (header->arena == KMEM_GLOBAL_ARENA) {
+		spinlock_acquire(&_kmem_lock);
+		ret = block_grow(&_kpool->index, header, size);
+		spinlock_release(&_kmem_lock);
+	} else {
+		state = local_irq_disable();
+		arena = _kmem_arenas[header->arena];
+		if (arena == CURR_CORE->arena) {
+			ret = block_grow(&arena->index, header, size);
 		}
+		local_irq_restore(state);
 	}
 
-	DEBUG(DL_DBG, ("virt(%x) map range[%p, %p) rc(%x)\n",
-		       virt, base, base + size, rc));
+	return ret;
+}
+
+/* Get the usable size of an allocated block */
+size_t kmem_size(void *p)
+{
+	struct header *header;
+
+	header = (struct header *)((ptr_t)p - sizeof(struct header));
+	ASSERT(header->magic == POOL_MAGIC);
+	ASSERT(!header->is_hole);
 
-	return (void *)virt;
+	return header->size - sizeof(struct header) - sizeof(struct footer);
 }
 
-void kmem_unmap(void *addr, size_t size, boolean_t shared)
+void *kmem_map(phys_addr_t base, size_t size, int mmflag)
 {
-	int rc;
-	size_t i;
-	ptr_t virt;
-	phys_addr_t phys;
+	void *virt;
 
-	ASSERT((((ptr_t)addr % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
+	ASSERT(((base % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
 	
-	rc = 0;
-	virt = (ptr_t)addr;
+	/* The range is mapped in the kernel virtual range area */
+	virt = vm_map(base, size, MMU_MAP_WRITE | MMU_MAP_EXEC);
+
+	DEBUG(DL_DBG, ("virt(%p) map range[%llx, %llx)\n", virt, base, base + size));
+
+	return virt;
+}
+
+void kmem_unmap(void *addr, size_t size, boolean_t shared)
+{
+	ASSERT((((ptr_t)addr % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
 	
-	for (i = 0; i < size; i += PAGE_SIZE) {
-		rc = mmu_unmap(&_kernel_mmu_ctx, virt + i, shared, &phys);
-		if (rc != 0) {
-			PANIC("Unmapping page failed");
-		}
-	}
+	/* The frames are not ours, vfree only unmaps them */
+	vfree(addr);
 
-	DEBUG(DL_DBG, ("unmap range[%p, %p)\n", virt, virt + size));
+	DEBUG(DL_DBG, ("unmap range[%p, %p)\n", addr, (ptr_t)addr + size));
 }
 
 void init_kmem()
 {
 	/* Initialize the kernel memory pool lock */
-	mutex_init(&_kmem_lock, "kmem-mutex", 0);
+	spinlock_init(&_kmem_lock, "kmem-lock");
 	
 	/* Create kernel memory pool */
 	_kpool = create_pool(KERNEL_KMEM_START, KERNEL_KMEM_START + KERNEL_KMEM_SIZE,
-			     0xCFFFF000, FALSE, FALSE);
+			     KERNEL_KMEM_END, FALSE, FALSE);
 	ASSERT(_kpool != NULL);
+
+	/* The boot CORE uses the static arena */
+	_nr_arenas = 1;
+	arena_init(&_boot_arena, 0);
+	CURR_CORE->arena = &_boot_arena;
 	
 	_kmem_init_done = TRUE;
 }
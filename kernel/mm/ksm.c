@@ -0,0 +1,453 @@
+/*
+ * ksm.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "atomic.h"
+#include "debug.h"
+#include "mutex.h"
+#include "hal/spinlock.h"
+#include "mm/malloc.h"
+#include "mm/page.h"
+#include "mm/mmu.h"
+#include "mm/mlayout.h"
+#include "mm/va.h"
+#include "mm/ksm.h"
+#include "proc/thread.h"
+
+/*
+ * A frame of the stable or unstable table. Stable frames are mapped
+ * read-only by all the identical pages and the table holds a reference to
+ * each of them. Unstable frames are only hints found during the current
+ * pass, their contents may change at any time.
+ */
+struct ksm_item {
+	struct list link;	// Link to a bucket of a table
+	uint32_t hash;		// Hash of the contents of the frame
+	page_num_t pfn;		// Frame holding the contents
+};
+
+static struct list _ksm_stable[KSM_BUCKETS];
+static struct list _ksm_unstable[KSM_BUCKETS];
+
+/* Address spaces scanned for identical pages, the tables and the scan
+ * cursor are protected by the KSM lock too
+ */
+static struct list _ksm_spaces = {
+	.prev = &_ksm_spaces,
+	.next = &_ksm_spaces
+};
+static struct mutex _ksm_lock;
+static struct va_space *_ksm_scan_vas = NULL;
+static ptr_t _ksm_scan_addr = 0;
+
+static struct ksm_stats _ksm_stats;
+static struct thread *_ksm_thread = NULL;
+
+/* Hash the contents of a frame, returns TRUE if they are all zero */
+static boolean_t ksm_hash(page_num_t pfn, uint32_t *hashp)
+{
+	size_t i;
+	uint32_t *w, hash = 0, bits = 0;
+
+	w = (uint32_t *)(pfn * PAGE_SIZE);
+	for (i = 0; i < (PAGE_SIZE / sizeof(uint32_t)); i++) {
+		hash = (hash << 5) + hash + w[i];
+		bits |= w[i];
+	}
+	*hashp = hash;
+
+	return bits == 0;
+}
+
+static boolean_t ksm_same(page_num_t pfn, page_num_t other)
+{
+	return memcmp((void *)(pfn * PAGE_SIZE), (void *)(other * PAGE_SIZE),
+		      PAGE_SIZE) == 0;
+}
+
+static boolean_t ksm_zero(page_num_t pfn)
+{
+	uint32_t hash;
+
+	return ksm_hash(pfn, &hash);
+}
+
+/*
+ * Replace the frame and the protection of a page, the accessed and dirty
+ * bits may be set by the CORE meanwhile. A read-only page is copied on the
+ * first write. Address space lock must be held.
+ */
+static void ksm_set_pte(struct va_space *vas, ptr_t virt, struct page *p,
+			page_num_t pfn, boolean_t rw)
+{
+	union pte old, entry;
+
+	do {
+		old.value = mmu_pte_read(p);
+		entry.value = old.value;
+		mmu_pte_set_frame(&entry.page, pfn);
+		entry.page.rw = rw ? 1 : 0;
+		entry.page.cow = rw ? 0 : 1;
+	} while (!mmu_pte_tas(p, old.value, entry.value));
+	mmu_flush_range(vas->mmu, virt, PAGE_SIZE);
+}
+
+/* Determine if a page is a private anonymous page which may be merged */
+static boolean_t ksm_candidate(struct page *p)
+{
+	return p->present && p->rw && !p->cow && !p->swap &&
+		((phys_addr_t)mmu_pte_frame(p) * PAGE_SIZE < _mmu_phys_map_end) &&
+		(page_refcount(mmu_pte_frame(p)) == 1);
+}
+
+/* Find a frame of a table with the same contents as a frame */
+static struct ksm_item *ksm_lookup(struct list *table, page_num_t pfn,
+				   uint32_t hash)
+{
+	struct list *l;
+	struct ksm_item *it;
+
+	LIST_FOR_EACH(l, &table[hash % KSM_BUCKETS]) {
+		it = LIST_ENTRY(l, struct ksm_item, link);
+		if ((it->hash == hash) && (it->pfn != pfn) &&
+		    ksm_same(it->pfn, pfn)) {
+			return it;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Merge a page with an identical one found in the tables. The page is
+ * write-protected before the contents are compared for good, so they can
+ * not change under us. Address space lock must be held. Returns TRUE if
+ * the page should be added to the unstable table.
+ */
+static boolean_t ksm_merge_page(struct va_space *vas, ptr_t virt,
+				struct page *p, uint32_t *hashp)
+{
+	boolean_t zero;
+	page_num_t pfn, target;
+	struct ksm_item *it = NULL, *u = NULL;
+	struct page old;
+
+	pfn = mmu_pte_frame(p);
+	zero = ksm_hash(pfn, hashp);
+	if (zero) {
+		target = _zero_frame;
+	} else if ((it = ksm_lookup(_ksm_stable, pfn, *hashp)) != NULL) {
+		target = it->pfn;
+	} else if ((u = ksm_lookup(_ksm_unstable, pfn, *hashp)) != NULL) {
+		target = u->pfn;
+	} else {
+		return TRUE;
+	}
+
+	ksm_set_pte(vas, virt, p, pfn, FALSE);
+	if (zero ? !ksm_zero(pfn) : !ksm_same(target, pfn)) {
+		/* Written before it was protected, try again on the next pass */
+		ksm_set_pte(vas, virt, p, pfn, TRUE);
+		return FALSE;
+	}
+
+	if (u) {
+		/* The page becomes a stable frame, the other page is merged
+		 * with it when it is scanned again
+		 */
+		page_ref(pfn);
+		list_del(&u->link);
+		u->pfn = pfn;
+		list_add_tail(&u->link, &_ksm_stable[*hashp % KSM_BUCKETS]);
+		_ksm_stats.pages_shared++;
+		return FALSE;
+	}
+
+	page_ref(target);
+	ksm_set_pte(vas, virt, p, target, FALSE);
+
+	memset(&old, 0, sizeof(old));
+	old.present = 1;
+	mmu_pte_set_frame(&old, pfn);
+	page_free(&old);
+
+	if (zero) {
+		_ksm_stats.pages_zero++;
+	} else {
+		_ksm_stats.pages_sharing++;
+	}
+	vas->nr_merged++;
+
+	DEBUG(DL_DBG, ("vas(%p) page(%p) merged into frame(%x).\n",
+		       vas, virt, target));
+
+	return FALSE;
+}
+
+/*
+ * Finish a pass over the address spaces. The unstable table is rebuilt by
+ * the next pass and the stable frames no longer mapped are released.
+ * KSM lock must be held.
+ */
+static void ksm_pass_done()
+{
+	int i, ref;
+	size_t shared = 0, sharing = 0;
+	struct list *l, *n;
+	struct ksm_item *it;
+	struct page pg;
+
+	for (i = 0; i < KSM_BUCKETS; i++) {
+		LIST_FOR_EACH_SAFE(l, n, &_ksm_unstable[i]) {
+			it = LIST_ENTRY(l, struct ksm_item, link);
+			list_del(&it->link);
+			kfree(it);
+		}
+
+		LIST_FOR_EACH_SAFE(l, n, &_ksm_stable[i]) {
+			it = LIST_ENTRY(l, struct ksm_item, link);
+
+			/* Only our reference is left once all the pages
+			 * sharing the frame were written to or unmapped
+			 */
+			ref = page_refcount(it->pfn);
+			if (ref == 1) {
+				list_del(&it->link);
+				memset(&pg, 0, sizeof(pg));
+				pg.present = 1;
+				mmu_pte_set_frame(&pg, it->pfn);
+				page_free(&pg);
+				kfree(it);
+			} else {
+				shared++;
+				sharing += ref - 2;
+			}
+		}
+	}
+
+	_ksm_stats.pages_shared = shared;
+	_ksm_stats.pages_sharing = sharing;
+	_ksm_stats.full_scans++;
+}
+
+/* Move the scan cursor to the address space after vas, a pass is done
+ * after the last one. KSM lock must be held.
+ */
+static void ksm_scan_next(struct va_space *vas)
+{
+	if (vas->ksm_link.next == &_ksm_spaces) {
+		_ksm_scan_vas = NULL;
+		ksm_pass_done();
+	} else {
+		_ksm_scan_vas = LIST_ENTRY(vas->ksm_link.next, struct va_space,
+					   ksm_link);
+		_ksm_scan_addr = USER_START;
+	}
+}
+
+/* Determine if a region may have pages to merge. The pages of a file
+ * region only qualify once they are private copies, ksm_candidate checks
+ * each page.
+ */
+static boolean_t ksm_mergeable(struct va_region *r)
+{
+	return ((r->type == VA_REGION_ANON) || (r->type == VA_REGION_ZERO) ||
+		(r->type == VA_REGION_FILE)) &&
+		FLAG_ON(r->flags, VA_MAP_MERGE);
+}
+
+/*
+ * Scan at most count pages of an address space from the cursor, the
+ * address space lock is only held for a page at a time. KSM lock must be
+ * held. Returns the number of pages scanned.
+ */
+static size_t ksm_scan_space(struct va_space *vas, size_t count)
+{
+	size_t n = 0;
+	ptr_t virt;
+	uint32_t hash;
+	boolean_t insert;
+	struct list *l;
+	struct va_region *r;
+	struct page *p;
+	struct ksm_item *it;
+	page_num_t pfn = 0;
+
+	while ((n < count) && (_ksm_scan_addr < USER_END)) {
+		insert = FALSE;
+
+		spinlock_acquire(&vas->lock);
+
+		/* Skip to the next mergeable region */
+		r = NULL;
+		LIST_FOR_EACH(l, &vas->regions) {
+			r = LIST_ENTRY(l, struct va_region, link);
+			if ((r->end > _ksm_scan_addr) && ksm_mergeable(r)) {
+				break;
+			}
+			r = NULL;
+		}
+		if (!r) {
+			spinlock_release(&vas->lock);
+			_ksm_scan_addr = USER_END;
+			break;
+		}
+
+		virt = MAX(_ksm_scan_addr, r->start);
+		_ksm_scan_addr = virt + PAGE_SIZE;
+		n++;
+
+		p = mmu_get_page(vas->mmu, virt, FALSE, 0);
+		if (!p) {
+			/* Nothing is mapped by the whole page table */
+			_ksm_scan_addr = ROUND_DOWN(virt, LARGE_PAGE_SIZE) +
+				LARGE_PAGE_SIZE;
+		} else if (ksm_candidate(p)) {
+			pfn = mmu_pte_frame(p);
+			insert = ksm_merge_page(vas, virt, p, &hash);
+		}
+
+		spinlock_release(&vas->lock);
+
+		/* The frame is only a hint, it does not matter if it is freed */
+		if (insert) {
+			it = kmalloc(sizeof(struct ksm_item), 0);
+			if (it) {
+				it->hash = hash;
+				it->pfn = pfn;
+				list_add_tail(&it->link,
+					      &_ksm_unstable[hash % KSM_BUCKETS]);
+			}
+		}
+	}
+
+	_ksm_stats.pages_scanned += n;
+
+	return n;
+}
+
+/* Scan about count pages from the cursor, across address spaces */
+static void ksm_scan(size_t count)
+{
+	size_t n;
+
+	mutex_acquire(&_ksm_lock);
+	while (count && !LIST_EMPTY(&_ksm_spaces)) {
+		if (!_ksm_scan_vas) {
+			_ksm_scan_vas = LIST_ENTRY(_ksm_spaces.next,
+						   struct va_space, ksm_link);
+			_ksm_scan_addr = USER_START;
+		}
+
+		/* An address space without any page to scan still counts */
+		n = ksm_scan_space(_ksm_scan_vas, count);
+		count -= MIN(count, MAX(n, 1));
+
+		if (_ksm_scan_addr >= USER_END) {
+			ksm_scan_next(_ksm_scan_vas);
+		}
+	}
+	mutex_release(&_ksm_lock);
+}
+
+/**
+ * Run the scanner until the current pass is done
+ */
+void ksm_scan_pass()
+{
+	size_t scans;
+
+	scans = _ksm_stats.full_scans;
+	while (!LIST_EMPTY(&_ksm_spaces) && (_ksm_stats.full_scans == scans)) {
+		ksm_scan(KSM_SCAN_BATCH);
+	}
+}
+
+/**
+ * Add an address space to the ones scanned for identical pages
+ */
+void ksm_enter(struct va_space *vas)
+{
+	vas->nr_merged = 0;
+
+	mutex_acquire(&_ksm_lock);
+	list_add_tail(&vas->ksm_link, &_ksm_spaces);
+	mutex_release(&_ksm_lock);
+}
+
+/**
+ * Remove an address space before it is destroyed, waits for the scanner
+ * to be done with it
+ */
+void ksm_exit(struct va_space *vas)
+{
+	mutex_acquire(&_ksm_lock);
+	if (_ksm_scan_vas == vas) {
+		ksm_scan_next(vas);
+	}
+	list_del(&vas->ksm_link);
+	mutex_release(&_ksm_lock);
+}
+
+/**
+ * Get the global statistics of the same-page merging
+ */
+void ksm_get_stats(struct ksm_stats *st)
+{
+	mutex_acquire(&_ksm_lock);
+	memcpy(st, &_ksm_stats, sizeof(struct ksm_stats));
+	mutex_release(&_ksm_lock);
+}
+
+/**
+ * Get the number of pages of an address space merged so far. The address
+ * space may be gone already, it is only looked at if it is still scanned.
+ * Returns FALSE if it is not.
+ */
+boolean_t ksm_space_merged(struct va_space *vas, size_t *mergedp)
+{
+	boolean_t found = FALSE;
+	struct list *l;
+
+	mutex_acquire(&_ksm_lock);
+	LIST_FOR_EACH(l, &_ksm_spaces) {
+		if (l == &vas->ksm_link) {
+			*mergedp = vas->nr_merged;
+			found = TRUE;
+			break;
+		}
+	}
+	mutex_release(&_ksm_lock);
+
+	return found;
+}
+
+static void ksm_thread(void *ctx)
+{
+	while (TRUE) {
+		ksm_scan(KSM_SCAN_BATCH);
+		thread_sleep(NULL, KSM_SLEEP_USEC, "ksm", 0);
+	}
+}
+
+/* Initialize the tables and start the scanner thread */
+void init_ksm()
+{
+	int i, rc;
+
+	for (i = 0; i < KSM_BUCKETS; i++) {
+		LIST_INIT(&_ksm_stable[i]);
+		LIST_INIT(&_ksm_unstable[i]);
+	}
+	mutex_init(&_ksm_lock, "ksm-mutex", 0);
+	memset(&_ksm_stats, 0, sizeof(_ksm_stats));
+
+	rc = thread_create("ksm", NULL, 0, ksm_thread, NULL, &_ksm_thread);
+	ASSERT(rc == 0);
+	thread_run(_ksm_thread);
+}
@@ -1,21 +1,62 @@
+#include <types.h>
+#include <stddef.h>
 #include <string.h>
+#include <stdio.h>
+#include "matrix/matrix.h"
+#include "debug.h"
 #include "mm/malloc.h"
 #include "mm/kmem.h"
+#include "mm/slab.h"
 
-/* Tag for each allocation */
-struct alloc_tag {
-	size_t size;		// Size of the allocation
+/* Maximum size of the allocations served by the size class caches */
+#define KMALLOC_MAX_CACHE_SIZE	2048
+
+/* Granularity of the size class lookup table */
+#define KMALLOC_INDEX_SHIFT	3
+
+/* Size classes, power of two sizes with a 3/4 step between them */
+static size_t _kmalloc_sizes[] = {
+	16, 24, 32, 48, 64, 96, 128, 192,
+	256, 384, 512, 768, 1024, 1536, 2048
 };
 
+#define NR_KMALLOC_CACHES	(sizeof(_kmalloc_sizes) / sizeof(_kmalloc_sizes[0]))
+
+/* Caches for each size class */
+static slab_cache_t _kmalloc_caches[NR_KMALLOC_CACHES];
+
+/* Index of the size class cache for each 8 bytes of the size */
+static uint8_t _kmalloc_index[KMALLOC_MAX_CACHE_SIZE >> KMALLOC_INDEX_SHIFT];
+
+static boolean_t _kmalloc_init_done = FALSE;
+
+static INLINE slab_cache_t *kmalloc_cache(size_t size)
+{
+	if (!_kmalloc_init_done || (size == 0) || (size > KMALLOC_MAX_CACHE_SIZE)) {
+		return NULL;
+	}
+
+	return &_kmalloc_caches[_kmalloc_index[(size - 1) >> KMALLOC_INDEX_SHIFT]];
+}
+
 void *kmalloc(size_t size, int mmflag)
 {
 	void *addr;
+	slab_cache_t *cache;
 
-	addr = kmem_alloc(size, mmflag);
+	/* Small requests are served by the size class caches, page aligned
+	 * requests always go to the kernel memory pool
+	 */
+	cache = FLAG_ON(mmflag, MM_ALIGN) ? NULL : kmalloc_cache(size);
+	if (cache) {
+		addr = slab_cache_alloc(cache);
+	} else {
+		addr = kmem_alloc(size, mmflag);
+	}
 	if (!addr) {
 		goto out;
 	}
-	
+
 	if (mmflag & MM_ZERO) {
 		memset(addr, 0, size);
 	}
@@ -32,40 +73,96 @@ void *kcalloc(size_t nmemb, size_t size, int mmflag)
 void *krealloc(void *addr, size_t size, int mmflag)
 {
 	void *mem;
+	size_t old_size;
 
 	if (!addr) {
 		mem = kmalloc(size, mmflag);
 		goto out;
 	}
 
-	/* Make a new allocation */
-	mem = kmalloc(size, mmflag & ~MM_ZERO);
-	if (!mem) {
+	old_size = kmalloc_size(addr);
+	if (size <= old_size) {
+		/* The allocation is already big enough */
+		mem = addr;
 		goto out;
 	}
 
-	/* Copy the block data using the smallest of the two sizes */
-	//...
+	/* Try to grow a pool block in place first, if the alignment the
+	 * caller wants is not satisfied we need to move it anyway
+	 */
+	if (!slab_object_cache(addr) &&
+	    (!FLAG_ON(mmflag, MM_ALIGN) || (((ptr_t)addr % PAGE_SIZE) == 0)) &&
+	    kmem_resize(addr, size)) {
+		mem = addr;
+	} else {
+		/* Make a new allocation */
+		mem = kmalloc(size, mmflag & ~MM_ZERO);
+		if (!mem) {
+			goto out;
+		}
 
-	/* Zero any new space if needed */
-	//...
+		/* Copy the block data using the smallest of the two sizes */
+		memcpy(mem, addr, old_size);
+
+		/* Free the original allocation */
+		kfree(addr);
+	}
 
-	/* Free the original allocation */
-	kfree(addr);
+	/* Zero any new space if needed */
+	if (FLAG_ON(mmflag, MM_ZERO)) {
+		memset((u_char *)mem + old_size, 0, size - old_size);
+	}
 
  out:
 	return mem;
 }
 
+size_t kmalloc_size(void *addr)
+{
+	slab_cache_t *cache;
+
+	if (!addr) {
+		return 0;
+	}
+
+	cache = slab_object_cache(addr);
+	if (cache) {
+		return cache->obj_size;
+	}
+
+	return kmem_size(addr);
+}
+
 void kfree(void *addr)
 {
+	slab_cache_t *cache;
+
 	if (addr) {
-		kmem_free(addr);
+		cache = slab_object_cache(addr);
+		if (cache) {
+			slab_cache_free(cache, addr);
+		} else {
+			kmem_free(addr);
+		}
 	}
 }
 
 /* Initialize the allocator caches */
 void init_malloc()
 {
-	;
+	size_t i, j;
+	char name[SLAB_NAME_MAX];
+
+	for (i = 0, j = 0; i < NR_KMALLOC_CACHES; i++) {
+		snprintf(name, SLAB_NAME_MAX, "kmalloc-%d", _kmalloc_sizes[i]);
+		slab_cache_init(&_kmalloc_caches[i], name,
+				_kmalloc_sizes[i], NULL, NULL, 0);
+
+		/* Map each size to the smallest class which holds it */
+		for (; (j << KMALLOC_INDEX_SHIFT) < _kmalloc_sizes[i]; j++) {
+			_kmalloc_index[j] = i;
+		}
+	}
+
+	_kmalloc_init_done = TRUE;
 }
@@ -5,108 +5,348 @@
 #include <types.h>
 #include <string.h>	// memset
 #include <errno.h>
+#include "atomic.h"
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/isr.h"
+#include "bitops.h"
+#include "smp.h"
 #include "mm/mm.h"
 #include "mm/mlayout.h"
 #include "mm/mmu.h"
 #include "mm/kmem.h"
 #include "mm/malloc.h"
+#include "mm/slab.h"
+#include "mm/va.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
 #include "debug.h"
 #include "proc/process.h"
 #include "proc/thread.h"
 
+/* Number of entries of a page table and of the page directories */
+#define PTBL_ENTRIES	(LARGE_PAGE_SIZE / PAGE_SIZE)
+#define PDIR_ENTRIES	(_mmu_pae ? 2048 : 1024)
+
 /*
  * Page Table
- * Each page table has 1024 page table entries, actually each
- * page table entry is just a 32 bit integer for X86 arch
+ * Each page table has 512 page table entries of 64 bits in PAE mode, or
+ * 1024 entries of 32 bits otherwise, so the entries are reached with
+ * PTBL_PTE.
  */
-struct ptbl {
-	struct page pte[1024];
-};
+struct ptbl;
 
 /*
  * Page Directory
- * Each page directory has 1024 pointers to its page table entry
+ * The 4 page directories of PAE mode are allocated together, so they are
+ * indexed as a single directory of 2048 entries. The page directory pointer
+ * table loaded into CR3 points at them, it is allocated on its own. Without
+ * PAE there is a single page directory of 1024 entries of 32 bits, it is
+ * loaded into CR3 itself. The page tables are allocated in the physical map
+ * area, so they are reached at the physical address in the entry.
  */
 struct pdir {
-	/* Page directory entry for the page table below, this must be
-	 * page aligned.
-	 */
-	uint32_t pde[1024];
-
-	/* Page tables for this page directory */
-	struct ptbl *ptbl[1024];
+	uint64_t pde[2048];
 };
 
+/* Size of the page directories of a context */
+#define PDIR_SIZE	(_mmu_pae ? sizeof(struct pdir) : PAGE_SIZE)
+
+/* Number of entries of a page directory pointer table */
+#define PDPT_ENTRIES	4
+
+/* Page table entry of a page table */
+#define PTBL_PTE(ptbl, i)	MMU_PTE((struct page *)(ptbl), i)
+
+/* Above this number of pages a TLB flush reloads CR3 instead of invlpg */
+#define MMU_INVLPG_MAX	32
+
+/* Unmapped frames and swap slots released together after a TLB flush */
+#define MMU_FREE_BATCH	32
+
+/* Page directory entry flags */
+#define PDE_PRESENT	(1ULL<<0)
+#define PDE_WRITE	(1ULL<<1)
+#define PDE_USER	(1ULL<<2)
+#define PDE_ACCESSED	(1ULL<<5)	// Set by the CORE, not by software
+#define PDE_LARGE	(1ULL<<7)	// The entry maps a large page
+#define PDE_GLOBAL	(1ULL<<8)	// The large page is global, needs CR4.PGE
+#define PDE_NX		(1ULL<<63)	// The large page is not executable
+
+/* Physical address bits of a page directory entry */
+#define PDE_ADDR_MASK	0x0000000FFFFFF000ULL
+
+/* Determine if a page directory entry maps a large page */
+#define PDE_IS_LARGE(pde)	\
+	(((pde) & (PDE_PRESENT | PDE_LARGE)) == (PDE_PRESENT | PDE_LARGE))
+
+/* Physical address of the large page of a page directory entry */
+#define PDE_LARGE_FRAME(pde)	\
+	((pde) & PDE_ADDR_MASK & ~((phys_addr_t)LARGE_PAGE_SIZE - 1))
+
+/* Page table of a page directory entry, in the physical map area */
+#define PDE_PTBL(pde)		((struct ptbl *)(ptr_t)((pde) & PDE_ADDR_MASK))
+
+/* Page directory pointer table entry flags */
+#define PDPTE_PRESENT	(1ULL<<0)
+
 struct mmu_ctx _kernel_mmu_ctx;
 
-extern uint32_t _placement_addr;
+/* Whether the page tables are in PAE format, the CORE supports PAE */
+boolean_t _mmu_pae = FALSE;
+
+/* Whether kernel mappings use large pages */
+boolean_t _mmu_large_pages = FALSE;
+
+/* Whether pages may be made not executable, EFER.NXE is set */
+boolean_t _mmu_nx = FALSE;
+
+/* End of the physical map area, physical memory below it is mapped at
+ * the same virtual address
+ */
+phys_addr_t _mmu_phys_map_end = 0;
+
+/* Page tables come from the page allocator once it is initialized */
+static boolean_t _mmu_page_ready = FALSE;
+
+/* The page directory pointer tables are 32 bytes aligned and below 4GB, the
+ * slabs of their cache are in the physical map area. The table of the
+ * kernel context is in the kernel image, which is mapped the same way.
+ */
+static slab_cache_t _mmu_pdpt_cache;
+static uint64_t _kernel_pdpt[PDPT_ENTRIES]__attribute__((aligned(32)));
+
+/* Contexts which share the kernel page directory entries */
+static struct list _mmu_ctx_list = {
+	.prev = &_mmu_ctx_list,
+	.next = &_mmu_ctx_list
+};
+static struct spinlock _mmu_ctx_lock;
+
+extern phys_addr_t _placement_addr;
 extern isr_t _isr_table[];
 
-static void *alloc_structure(size_t size, phys_addr_t *phys, int mmflag)
+/* Get a page directory entry, the non-PAE entries are 32 bits wide */
+static INLINE uint64_t mmu_get_pde(struct pdir *pdir, uint32_t dir_idx)
 {
-	void *ret;
+	return _mmu_pae ? pdir->pde[dir_idx] : ((uint32_t *)pdir->pde)[dir_idx];
+}
 
-	/* Try to allocate from kernel memory pool first, if failed then do
-	 * page early alloc
-	 */
-	if (_kmem_init_done) {
-		ret = kmem_alloc(size, mmflag);
-		if (ret) {
-			struct page *page;
-			page = mmu_get_page(&_kernel_mmu_ctx, (uint32_t)ret, FALSE, 0);
-			ASSERT(page != NULL);
-			(*phys) = page->frame * PAGE_SIZE + ((uint32_t)ret & 0xFFF);
+/* Set a page directory entry, the PAE entries are written at once */
+static INLINE void mmu_set_pde(struct pdir *pdir, uint32_t dir_idx, uint64_t pde)
+{
+	if (_mmu_pae) {
+		atomic_set64((atomic64_t *)&pdir->pde[dir_idx], pde);
+	} else {
+		((volatile uint32_t *)pdir->pde)[dir_idx] = (uint32_t)pde;
+	}
+}
+
+/* CR4 flags of the paging mode, kernel pages are global */
+static INLINE uint32_t mmu_cr4_flags()
+{
+	if (_mmu_pae) {
+		return X86_CR4_PAE | X86_CR4_PGE;
+	}
+	return _mmu_large_pages ? (X86_CR4_PSE | X86_CR4_PGE) : X86_CR4_PGE;
+}
+
+/*
+ * Allocate a page table or the page directories in the physical map area,
+ * they are reached at their physical address
+ */
+static void *mmu_alloc_table(phys_addr_t *phys, size_t size)
+{
+	int rc;
+
+	if (_mmu_page_ready) {
+		rc = phys_alloc(size, 0, 0, _mmu_phys_map_end, MM_ZERO, phys);
+		if (rc != 0) {
+			return NULL;
 		}
 	} else {
-		page_early_alloc(phys, size, IS_FLAG_ON(mmflag, MM_ALIGN));
-		ret = (void *)(*phys);
-		ASSERT(ret != NULL);
+		page_early_alloc(phys, size, TRUE);
+		ASSERT((*phys) != 0);
+		memset((void *)(ptr_t)(*phys), 0, size);
 	}
-	
-	if (FLAG_ON(mmflag, MM_ALIGN)) {
-		ASSERT((((ptr_t)ret) % PAGE_SIZE) == 0);
+
+	return (void *)(ptr_t)(*phys);
+}
+
+/* Free a page table or the page directories allocated by mmu_alloc_table */
+static void mmu_free_table(void *table, size_t size)
+{
+	phys_free((ptr_t)table, size);
+}
+
+/* Allocate the page directories of a context and with PAE point the page
+ * directory pointer table at them, *phys is set to the address loaded into CR3
+ */
+static struct pdir *mmu_alloc_pdir(struct mmu_ctx *ctx, phys_addr_t *phys)
+{
+	int i;
+	struct pdir *pdir;
+
+	ctx->pdpt = NULL;
+	if (_mmu_pae) {
+		if (IS_KERNEL_CTX(ctx)) {
+			ctx->pdpt = _kernel_pdpt;
+		} else {
+			ctx->pdpt = slab_cache_alloc(&_mmu_pdpt_cache);
+			if (!ctx->pdpt) {
+				return NULL;
+			}
+		}
 	}
-	
+
+	pdir = mmu_alloc_table(phys, PDIR_SIZE);
+	if (!pdir) {
+		if (ctx->pdpt && !IS_KERNEL_CTX(ctx)) {
+			slab_cache_free(&_mmu_pdpt_cache, ctx->pdpt);
+		}
+		return NULL;
+	}
+
+	if (_mmu_pae) {
+		for (i = 0; i < PDPT_ENTRIES; i++) {
+			ctx->pdpt[i] = ((*phys) + i * PAGE_SIZE) | PDPTE_PRESENT;
+		}
+		*phys = (ptr_t)ctx->pdpt;
+	}
+
+	return pdir;
+}
+
+/*
+ * Set a page directory entry of the kernel context if it was not changed
+ * meanwhile. Other contexts copied the kernel entries when they were
+ * cloned, so the entry is updated in the contexts still sharing it too.
+ * The accessed bit is set by the CORE in each copy, it is not compared.
+ * The entries are written at once so no CORE walks a half written one.
+ */
+static boolean_t mmu_set_kernel_pde(uint32_t dir_idx, uint64_t old, uint64_t pde)
+{
+	struct list *l;
+	struct mmu_ctx *ctx;
+	struct pdir *krn_dir;
+	boolean_t ret = FALSE;
+
+	krn_dir = _kernel_mmu_ctx.pdir;
+	old &= ~PDE_ACCESSED;
+
+	spinlock_acquire(&_mmu_ctx_lock);
+	if ((mmu_get_pde(krn_dir, dir_idx) & ~PDE_ACCESSED) == old) {
+		LIST_FOR_EACH(l, &_mmu_ctx_list) {
+			ctx = LIST_ENTRY(l, struct mmu_ctx, link);
+			if ((mmu_get_pde(ctx->pdir, dir_idx) & ~PDE_ACCESSED) ==
+			    old) {
+				mmu_set_pde(ctx->pdir, dir_idx, pde);
+			}
+		}
+		mmu_set_pde(krn_dir, dir_idx, pde);
+		ret = TRUE;
+	}
+	spinlock_release(&_mmu_ctx_lock);
+
 	return ret;
 }
 
-static struct ptbl *clone_ptbl(struct ptbl *src, phys_addr_t *phys_addr)
+/*
+ * Clone a page table, the writable frames are write protected in both
+ * tables and *protectedp is set if any entry of the source was.
+ */
+static int clone_ptbl(struct ptbl *src, phys_addr_t *phys_addr,
+		      boolean_t *protectedp)
 {
 	int i;
 	struct ptbl *ptbl;
+	struct page *s, *d;
+	page_num_t frame;
 	
-	/* Make a new page table, which is page aligned */
-	ptbl = (struct ptbl *)alloc_structure(sizeof(struct ptbl), phys_addr,
-					      MM_ALIGN);
-	
-	/* Clear the content of the new page table */
-	memset(ptbl, 0, sizeof(struct ptbl));
+	/* Make a new page table, which is page aligned and cleared */
+	ptbl = mmu_alloc_table(phys_addr, PAGE_SIZE);
+	if (!ptbl) {
+		return ENOMEM;
+	}
+
+	/* Share each of the page frames with the source */
+	for (i = 0; i < PTBL_ENTRIES; i++) {
+		s = PTBL_PTE(src, i);
+		d = PTBL_PTE(ptbl, i);
+		frame = mmu_pte_frame(s);
 
-	/* Clone each of the page frames */
-	for (i = 0; i < 1024; i++) {
 		/* If the source entry has a frame associated with it */
-		if (src->pte[i].frame) {
+		if (frame) {
+
+			/* Clone the entry from source to destination */
+			memcpy(d, s, MMU_PTE_SIZE);
+
+			/* A swapped out page shares the slot */
+			if (s->swap) {
+				swap_dup(frame);
+				continue;
+			}
+
+			/* Frames not from the page allocator are always shared */
+			if (!page_refcount(frame)) {
+				continue;
+			}
+			page_ref(frame);
+
+			/* Write protect the frame in both contexts, the first
+			 * write to it will make a private copy
+			 */
+			if (s->rw) {
+				s->rw = 0;
+				s->cow = 1;
+				d->rw = 0;
+				d->cow = 1;
+				*protectedp = TRUE;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Get the page table for a directory entry, make a new one if needed */
+static struct ptbl *mmu_get_ptbl(struct mmu_ctx *ctx, uint32_t dir_idx,
+				 boolean_t make)
+{
+	phys_addr_t tmp;
+	struct pdir *pdir;
+	struct ptbl *ptbl;
+	uint64_t pde;
 
-			/* Get a new frame */
-			page_alloc(&(ptbl->pte[i]), 0);
+	/* Get the page directory from the context */
+	pdir = ctx->pdir;
+	pde = mmu_get_pde(pdir, dir_idx);
 
-			/* Clone the flags from source to destination */
-			if (src->pte[i].present) ptbl->pte[i].present = 1;
-			if (src->pte[i].rw) ptbl->pte[i].rw = 1;
-			if (src->pte[i].user) ptbl->pte[i].user = 1;
-			if (src->pte[i].accessed) ptbl->pte[i].accessed = 1;
-			if (src->pte[i].dirty) ptbl->pte[i].dirty = 1;
+	/* A large page has no page table */
+	if (PDE_IS_LARGE(pde)) {
+		return NULL;
+	}
+
+	if (!FLAG_ON(pde, PDE_PRESENT) && make) {
+		/* Allocate a new page table */
+		ptbl = mmu_alloc_table(&tmp, PAGE_SIZE);
+		if (!ptbl) {
+			return NULL;
+		}
 
-			/* Physically copy the data accross */
-			page_copy(ptbl->pte[i].frame * 0x1000, 
-				  src->pte[i].frame * 0x1000);
+		/* Set the content of the page table, the kernel page tables
+		 * are shared by all the contexts.
+		 */
+		if (!IS_KERNEL_CTX(ctx)) {
+			mmu_set_pde(pdir, dir_idx, tmp | 0x7);	// PRESENT, RW, US.
+		} else if (!mmu_set_kernel_pde(dir_idx, pde, tmp | 0x7)) {
+			/* Another CORE made the page table first */
+			mmu_free_table(ptbl, PAGE_SIZE);
 		}
+		pde = mmu_get_pde(pdir, dir_idx);
 	}
 
-	return ptbl;
+	return FLAG_ON(pde, PDE_PRESENT) ? PDE_PTBL(pde) : NULL;
 }
 
 /**
@@ -120,33 +360,17 @@ struct page *mmu_get_page(struct mmu_ctx *ctx, ptr_t virt, boolean_t make, int m
 {
 	struct page *page;
 	uint32_t dir_idx, tbl_idx;
-	struct pdir *pdir;
+	struct ptbl *ptbl;
 
 	ASSERT(ctx != NULL);
 
 	/* Calculate the page table index and page directory index */
-	tbl_idx = (virt / PAGE_SIZE) % 1024;
-	dir_idx = (virt / PAGE_SIZE) / 1024;
-
-	/* Get the page directory from the context */
-	pdir = ctx->pdir;
+	tbl_idx = (virt / PAGE_SIZE) % PTBL_ENTRIES;
+	dir_idx = virt / LARGE_PAGE_SIZE;
 
-	if (pdir->ptbl[dir_idx]) {	// The page table already assigned
-		page = &pdir->ptbl[dir_idx]->pte[tbl_idx];
-	} else if (make) {		// Make a new page table
-		phys_addr_t tmp;
-		
-		/* Allocate a new page table */
-		pdir->ptbl[dir_idx] = (struct ptbl *)
-			alloc_structure(sizeof(struct ptbl), &tmp, MM_ALIGN);
-		
-		/* Clear the content of the page table */
-		memset(pdir->ptbl[dir_idx], 0, sizeof(struct ptbl));
-
-		/* Set the content of the page table */
-		pdir->pde[dir_idx] = tmp | 0x7;	// PRESENT, RW, US.
-		
-		page = &pdir->ptbl[dir_idx]->pte[tbl_idx];
+	ptbl = mmu_get_ptbl(ctx, dir_idx, make);
+	if (ptbl) {
+		page = PTBL_PTE(ptbl, tbl_idx);
 	} else {
 		DEBUG(DL_INF, ("no page for addr(0x%08x) in mmu ctx(0x%08x)\n",
 			       virt, ctx));
@@ -156,41 +380,588 @@ struct page *mmu_get_page(struct mmu_ctx *ctx, ptr_t virt, boolean_t make, int m
 	return page;
 }
 
-int mmu_map(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t phys, int flags)
+/**
+ * Translate a virtual address of the specified mmu context
+ * @ctx		- mmu context
+ * @virt	- virtual address to translate
+ * @physp	- where to store the physical address
+ */
+int mmu_translate(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t *physp)
 {
 	int rc;
+	uint64_t pde;
 	struct page *p;
 
-	ASSERT((phys % PAGE_SIZE) == 0);
-	
-	/* Get a page from the specified MMU context */
-	p = mmu_get_page(ctx, virt, TRUE, flags);
-	if (!p) {
-		DEBUG(DL_WRN, ("get page failed, ctx(%p) virt(%x)\n", ctx, virt));
+	pde = mmu_get_pde(ctx->pdir, virt / LARGE_PAGE_SIZE);
+	if (PDE_IS_LARGE(pde)) {
+		*physp = PDE_LARGE_FRAME(pde) + (virt % LARGE_PAGE_SIZE);
+		rc = 0;
+		goto out;
+	}
+
+	p = mmu_get_page(ctx, virt, FALSE, 0);
+	if (!p || !p->present) {
+		rc = EFAULT;
+		goto out;
+	}
+	*physp = (phys_addr_t)mmu_pte_frame(p) * PAGE_SIZE + (virt % PAGE_SIZE);
+
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/*
+ * Map a large page sized chunk of the kernel context with a large page, the
+ * chunk must not have a page table yet
+ */
+static int mmu_map_large(struct mmu_ctx *ctx, uint32_t dir_idx, phys_addr_t phys,
+			 int flags)
+{
+	int rc;
+	uint64_t pde;
+
+	if (!_mmu_large_pages || !IS_KERNEL_CTX(ctx)) {
 		rc = EINVAL;
 		goto out;
 	}
 
-	/* The page should not be present */
-	if (p->present) {
-		DEBUG(DL_WRN, ("Mapping already mapped address(%x) ctx(%p)\n",
-			       virt, ctx));
+	if (FLAG_ON(mmu_get_pde(ctx->pdir, dir_idx), PDE_PRESENT)) {
 		rc = EMAPPED;
 		goto out;
 	}
 
-	/* Set the page table entry */
-	p->frame = phys / PAGE_SIZE;
-	p->present = 1;
-	p->user = IS_KERNEL_CTX(ctx) ? FALSE : TRUE;
-	p->rw = FLAG_ON(flags, MMU_MAP_WRITE) ? TRUE : FALSE;
-	
+	if (FLAG_ON(flags, MMU_MAP_ALLOC)) {
+		rc = phys_alloc(LARGE_PAGE_SIZE, LARGE_PAGE_SIZE, 0, 0, 0, &phys);
+		if (rc != 0) {
+			goto out;
+		}
+	} else if (phys % LARGE_PAGE_SIZE) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	pde = phys | PDE_PRESENT | PDE_LARGE | PDE_GLOBAL;
+	if (FLAG_ON(flags, MMU_MAP_WRITE)) {
+		pde |= PDE_WRITE;
+	}
+	if (_mmu_nx && !FLAG_ON(flags, MMU_MAP_EXEC)) {
+		pde |= PDE_NX;
+	}
+	if (!mmu_set_kernel_pde(dir_idx, 0, pde)) {
+		if (FLAG_ON(flags, MMU_MAP_ALLOC)) {
+			phys_free(phys, LARGE_PAGE_SIZE);
+		}
+		rc = EMAPPED;
+		goto out;
+	}
+
+	rc = 0;
+
+ out:
+	return rc;
+}
+
+/* Split a large page into a page table which maps the same frames */
+static int mmu_split_large(struct mmu_ctx *ctx, uint32_t dir_idx)
+{
+	boolean_t set;
+	uint64_t pde;
+	uint32_t i;
+	phys_addr_t phys;
+	struct ptbl *ptbl;
+	struct page *p;
+
+	pde = mmu_get_pde(ctx->pdir, dir_idx);
+	ASSERT(IS_KERNEL_CTX(ctx) && PDE_IS_LARGE(pde));
+
+	ptbl = mmu_alloc_table(&phys, PAGE_SIZE);
+	if (!ptbl) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < PTBL_ENTRIES; i++) {
+		p = PTBL_PTE(ptbl, i);
+		mmu_pte_set_frame(p, PDE_LARGE_FRAME(pde) / PAGE_SIZE + i);
+		p->present = 1;
+		p->rw = FLAG_ON(pde, PDE_WRITE) ? 1 : 0;
+		p->global = FLAG_ON(pde, PDE_GLOBAL) ? 1 : 0;
+		mmu_pte_set_nx(p, FLAG_ON(pde, PDE_NX));
+	}
+
+	set = mmu_set_kernel_pde(dir_idx, pde, phys | 0x7);	// PRESENT, RW, US.
+	ASSERT(set);
+
+	return 0;
+}
+
+/* Determine if the TLB may hold entries of an mmu context */
+static INLINE boolean_t mmu_ctx_loaded(struct mmu_ctx *ctx)
+{
+	/* The kernel part is shared by all the contexts */
+	return IS_KERNEL_CTX(ctx) || (x86_read_cr3() == ctx->pdbr);
+}
+
+/**
+ * Flush the gathered ranges from the TLB of this CORE, invalidating each
+ * page is cheaper than reloading CR3 only for small ranges
+ * @g		- gathered ranges, a NULL context means the loaded one
+ */
+void mmu_flush_local(struct mmu_gather *g)
+{
+	size_t i, pages;
+	ptr_t virt, end;
+	uint32_t cr4;
+
+	if (g->ctx && !mmu_ctx_loaded(g->ctx)) {
+		return;
+	}
+
+	for (i = 0, pages = 0; i < g->nr; i++) {
+		pages += g->range[i].size / PAGE_SIZE;
+	}
+
+	if ((FLAG_ON(g->flags, MMU_FLUSH_ALL) || (pages > MMU_INVLPG_MAX)) &&
+	    FLAG_ON(g->flags, MMU_FLUSH_GLOBAL)) {
+		/* Reloading CR3 keeps the global pages, toggle CR4.PGE */
+		cr4 = x86_read_cr4();
+		x86_write_cr4(cr4 & ~X86_CR4_PGE);
+		x86_write_cr4(cr4);
+	} else if (FLAG_ON(g->flags, MMU_FLUSH_ALL) || (pages > MMU_INVLPG_MAX)) {
+		x86_write_cr3(x86_read_cr3());
+	} else {
+		for (i = 0; i < g->nr; i++) {
+			virt = g->range[i].virt;
+			end = virt + g->range[i].size;
+			for (; virt < end; virt += PAGE_SIZE) {
+				x86_invlpg(virt);
+			}
+		}
+	}
+}
+
+/* Start gathering TLB invalidations of a context */
+void mmu_gather_init(struct mmu_gather *g, struct mmu_ctx *ctx, int flags)
+{
+	g->ctx = ctx;
+	g->flags = flags;
+	g->nr = 0;
+
+	/* Kernel pages are global, they survive CR3 reloads */
+	if (ctx && IS_KERNEL_CTX(ctx)) {
+		g->flags |= MMU_FLUSH_GLOBAL;
+	}
+}
+
+/* Add a range to the gathered invalidations */
+void mmu_gather_add(struct mmu_gather *g, ptr_t virt, size_t size)
+{
+	if (g->nr < MMU_GATHER_MAX) {
+		g->range[g->nr].virt = virt;
+		g->range[g->nr].size = size;
+		g->nr++;
+	} else {
+		g->flags |= MMU_FLUSH_ALL;
+	}
+}
+
+/*
+ * Get the other COREs which must flush their TLB for a context. COREs in
+ * lazy TLB mode are dropped from the context instead of being interrupted,
+ * they flush their TLB when they switch back to it.
+ */
+static u_long mmu_shootdown_cores(struct mmu_gather *g)
+{
+	u_long cores, ret;
+	struct list *l;
+	struct core *c;
+	int id;
+
+	ret = 0;
+
+	/* The kernel part is shared by all the contexts, and no CORE may
+	 * keep using a context which is being dropped.
+	 */
+	if (IS_KERNEL_CTX(g->ctx) || FLAG_ON(g->flags, MMU_FLUSH_DROP)) {
+		LIST_FOR_EACH(l, &_running_cores) {
+			c = LIST_ENTRY(l, struct core, link);
+			ret |= (1UL << c->id);
+		}
+		goto out;
+	}
+
+	cores = g->ctx->cores;
+	while (cores) {
+		id = bitops_ffs(cores);
+		cores &= ~(1UL << id);
+		if (_cores[id]->tlb_lazy) {
+			bitops_test_and_clear(&g->ctx->cores, id);
+
+			/* It left lazy mode before seeing the cleared bit */
+			if (_cores[id]->tlb_lazy) {
+				continue;
+			}
+		}
+		ret |= (1UL << id);
+	}
+
+ out:
+	return ret & ~(1UL << CURR_CORE->id);
+}
+
+/**
+ * Flush the gathered ranges from the TLB of every CORE using the context
+ * @g		- gathered ranges, reset for reuse when done
+ */
+void mmu_gather_flush(struct mmu_gather *g)
+{
+	boolean_t state;
+	u_long cores;
+
+	state = local_irq_disable();
+
+	mmu_flush_local(g);
+
+	cores = mmu_shootdown_cores(g);
+	if (cores) {
+		smp_tlb_shootdown(cores, g);
+	}
+
+	local_irq_restore(state);
+
+	g->flags &= ~MMU_FLUSH_ALL;
+	g->nr = 0;
+}
+
+/**
+ * Flush the TLB entries of a range on every CORE using the context
+ * @ctx		- mmu context
+ * @virt	- start of the range
+ * @size	- size of the range
+ */
+void mmu_flush_range(struct mmu_ctx *ctx, ptr_t virt, size_t size)
+{
+	struct mmu_gather g;
+
+	mmu_gather_init(&g, ctx, 0);
+	mmu_gather_add(&g, virt, size);
+	mmu_gather_flush(&g);
+}
+
+/**
+ * Map a frame at a temporary mapping slot of this CORE. Interrupts stay
+ * disabled until the frame is unmapped, so nothing else on this CORE can
+ * reuse the slot and no other CORE ever caches its translation. Frames
+ * above the physical map area, also those above 4GB, are reached this way.
+ * @phys	- physical address of the frame
+ * @slot	- slot of this CORE, less than MMU_KMAP_SLOTS
+ * @statep	- where to save the interrupt state
+ */
+void *mmu_kmap(phys_addr_t phys, int slot, boolean_t *statep)
+{
+	ptr_t virt;
+	struct page *p;
+
+	ASSERT(slot < MMU_KMAP_SLOTS);
+
+	*statep = local_irq_disable();
+
+	virt = KERNEL_KMAP_START +
+		(CURR_CORE->id * MMU_KMAP_SLOTS + slot) * PAGE_SIZE;
+	ASSERT(virt < KERNEL_KMAP_END);
+
+	/* The page table of the slots was made at boot */
+	p = mmu_get_page(&_kernel_mmu_ctx, virt, FALSE, 0);
+	mmu_pte_set_frame(p, phys / PAGE_SIZE);
+	p->rw = TRUE;
+	mmu_pte_set_nx(p, _mmu_nx);
+	p->present = TRUE;
+
+	return (void *)virt;
+}
+
+/**
+ * Unmap a temporary mapping slot of this CORE, only the local TLB has
+ * the translation
+ * @virt	- address returned by mmu_kmap
+ * @state	- interrupt state saved by mmu_kmap
+ */
+void mmu_kunmap(void *virt, boolean_t state)
+{
+	struct page *p;
+
+	p = mmu_get_page(&_kernel_mmu_ctx, (ptr_t)virt, FALSE, 0);
+	p->present = FALSE;
+	mmu_pte_set_frame(p, 0);
+	x86_invlpg((ptr_t)virt);
+
+	local_irq_restore(state);
+}
+
+/**
+ * Switch this CORE to a context, the CORE leaves lazy TLB mode
+ * @prev	- context which is loaded, may be NULL for the kernel context
+ * @next	- context to load
+ */
+void mmu_switch_ctx(struct mmu_ctx *prev, struct mmu_ctx *next)
+{
+	core_id_t id;
+
+	id = CURR_CORE->id;
+
+	/* The locked bit operations order this against the shootdowns */
+	CURR_CORE->tlb_lazy = FALSE;
+
+	if (prev != next) {
+		if (prev) {
+			bitops_test_and_clear(&prev->cores, id);
+		}
+		bitops_test_and_set(&next->cores, id);
+		mmu_load_ctx(next);
+	} else if (!bitops_test_and_set(&next->cores, id)) {
+		/* Shootdowns were skipped while this CORE was lazy */
+		x86_write_cr3(next->pdbr);
+	}
+}
+
+/* Keep the loaded context in lazy TLB mode while running kernel threads */
+void mmu_lazy_ctx()
+{
+	CURR_CORE->tlb_lazy = TRUE;
+}
+
+/**
+ * Map a range of the specified mmu context, each page table is only
+ * walked once
+ * @ctx		- mmu context
+ * @virt	- start of the range
+ * @phys	- physical address to map the range to, not used with
+ *		  MMU_MAP_ALLOC
+ * @size	- size of the range
+ * @flags	- map flags
+ */
+int mmu_map_range(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t phys, size_t size,
+		  int flags)
+{
+	int rc = 0;
+	uint32_t dir_idx, tbl_idx, i, count;
+	size_t done;
+	struct ptbl *ptbl;
+	struct page *p, *pte;
+
+	ASSERT(((virt % PAGE_SIZE) == 0) && ((phys % PAGE_SIZE) == 0) &&
+	       ((size % PAGE_SIZE) == 0));
+
+	for (done = 0; done < size; done += (count * PAGE_SIZE)) {
+		/* Calculate the part of the range in this page table */
+		tbl_idx = ((virt + done) / PAGE_SIZE) % PTBL_ENTRIES;
+		dir_idx = (virt + done) / LARGE_PAGE_SIZE;
+		count = MIN(PTBL_ENTRIES - tbl_idx, (size - done) / PAGE_SIZE);
+
+		if (PDE_IS_LARGE(mmu_get_pde(ctx->pdir, dir_idx))) {
+			DEBUG(DL_WRN, ("Mapping already mapped address(%x) ctx(%p)\n",
+				       virt + done, ctx));
+			rc = EMAPPED;
+			break;
+		}
+
+		/* Whole chunks may be mapped by a large page */
+		if (FLAG_ON(flags, MMU_MAP_LARGE) && (count == PTBL_ENTRIES) &&
+		    (mmu_map_large(ctx, dir_idx, phys + done, flags) == 0)) {
+			continue;
+		}
+
+		ptbl = mmu_get_ptbl(ctx, dir_idx, TRUE);
+		if (!ptbl) {
+			DEBUG(DL_WRN, ("get page table failed, ctx(%p) virt(%x)\n",
+				       ctx, virt + done));
+			rc = ENOMEM;
+			break;
+		}
+
+		/* None of the pages should be present */
+		p = PTBL_PTE(ptbl, tbl_idx);
+		for (i = 0; i < count; i++) {
+			if (MMU_PTE(p, i)->present) {
+				DEBUG(DL_WRN, ("Mapping already mapped address(%x) ctx(%p)\n",
+					       virt + done + (i * PAGE_SIZE), ctx));
+				rc = EMAPPED;
+				break;
+			}
+		}
+		if (rc != 0) {
+			break;
+		}
+
+		/* Set the page table entries */
+		if (FLAG_ON(flags, MMU_MAP_ALLOC)) {
+			rc = page_alloc_batch(p, count,
+					      FLAG_ON(flags, MMU_MAP_ZERO) ? MM_ZERO : 0);
+			if (rc != 0) {
+				break;
+			}
+		}
+		for (i = 0; i < count; i++) {
+			pte = MMU_PTE(p, i);
+			if (!FLAG_ON(flags, MMU_MAP_ALLOC)) {
+				mmu_pte_set_frame(pte, (phys + done) / PAGE_SIZE + i);
+				pte->present = 1;
+			}
+			pte->user = IS_KERNEL_CTX(ctx) ? FALSE : TRUE;
+			pte->rw = FLAG_ON(flags, MMU_MAP_WRITE) ? TRUE : FALSE;
+			pte->pcd = FLAG_ON(flags, MMU_MAP_NOCACHE) ? TRUE : FALSE;
+			pte->pwt = pte->pcd;
+			mmu_pte_set_nx(pte, _mmu_nx && !FLAG_ON(flags, MMU_MAP_EXEC));
+
+			/* Kernel pages are the same in all the contexts */
+			pte->global = IS_KERNEL_CTX(ctx) ? TRUE : FALSE;
+		}
+	}
+
+	/* Rollback the page tables mapped before the failure */
+	if ((rc != 0) && done) {
+		mmu_unmap_range(ctx, virt, done, FLAG_ON(flags, MMU_MAP_ALLOC));
+	}
+
+	return rc;
+}
+
+/*
+ * Flush the gathered ranges, then release the frames and swap slots their
+ * pages used. No CORE can reach a frame through a stale TLB entry once it
+ * is reused.
+ */
+static void mmu_unmap_release(struct mmu_gather *g, struct page *batch,
+			      size_t *nrp)
+{
+	size_t i;
+
+	if (g->nr || FLAG_ON(g->flags, MMU_FLUSH_ALL)) {
+		mmu_gather_flush(g);
+	}
+
+	for (i = 0; i < *nrp; i++) {
+		if (batch[i].swap) {
+			swap_free(mmu_pte_frame(&batch[i]));
+		} else {
+			page_free(&batch[i]);
+		}
+	}
+	*nrp = 0;
+}
+
+/**
+ * Unmap a range of the specified mmu context, each page table is only
+ * walked once. The frames are released after the TLB is flushed, in
+ * batches of MMU_FREE_BATCH. Nothing is unmapped if a large page partly in
+ * the range can not be split.
+ * @ctx		- mmu context
+ * @virt	- start of the range
+ * @size	- size of the range
+ * @free	- free the frames which belong to the page allocator
+ */
+int mmu_unmap_range(struct mmu_ctx *ctx, ptr_t virt, size_t size, boolean_t free)
+{
+	int rc;
+	uint32_t dir_idx, tbl_idx, i, count;
+	uint64_t pde;
+	size_t done, nr = 0;
+	ptr_t start, end;
+	struct ptbl *ptbl;
+	struct page *p, *pte;
+	struct page batch[MMU_FREE_BATCH];
+	struct mmu_gather g;
+
+	ASSERT(((virt % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
+
+	/* Split the large pages at both ends of the range before anything is
+	 * unmapped, only they may be partly unmapped
+	 */
+	if (size && ((virt % LARGE_PAGE_SIZE) || (size < LARGE_PAGE_SIZE)) &&
+	    PDE_IS_LARGE(mmu_get_pde(ctx->pdir, virt / LARGE_PAGE_SIZE))) {
+		rc = mmu_split_large(ctx, virt / LARGE_PAGE_SIZE);
+		if (rc != 0) {
+			goto out;
+		}
+	}
+	if (((virt + size) % LARGE_PAGE_SIZE) &&
+	    PDE_IS_LARGE(mmu_get_pde(ctx->pdir, (virt + size) / LARGE_PAGE_SIZE))) {
+		rc = mmu_split_large(ctx, (virt + size) / LARGE_PAGE_SIZE);
+		if (rc != 0) {
+			goto out;
+		}
+	}
+
+	mmu_gather_init(&g, ctx, 0);
+	for (done = 0; done < size; done += (count * PAGE_SIZE)) {
+		tbl_idx = ((virt + done) / PAGE_SIZE) % PTBL_ENTRIES;
+		dir_idx = (virt + done) / LARGE_PAGE_SIZE;
+		count = MIN(PTBL_ENTRIES - tbl_idx, (size - done) / PAGE_SIZE);
+
+		/* A large page left in the range is unmapped at once */
+		pde = mmu_get_pde(ctx->pdir, dir_idx);
+		if (PDE_IS_LARGE(pde)) {
+			ASSERT(IS_KERNEL_CTX(ctx) && (count == PTBL_ENTRIES));
+			mmu_set_kernel_pde(dir_idx, pde, 0);
+			mmu_gather_add(&g, virt + done, LARGE_PAGE_SIZE);
+			if (free) {
+				mmu_unmap_release(&g, batch, &nr);
+				phys_free(PDE_LARGE_FRAME(pde), LARGE_PAGE_SIZE);
+			}
+			continue;
+		}
+
+		/* No page table, skip to the next one */
+		ptbl = mmu_get_ptbl(ctx, dir_idx, FALSE);
+		if (!ptbl) {
+			continue;
+		}
+
+		/* Pages which are not present may still have a frame */
+		p = PTBL_PTE(ptbl, tbl_idx);
+		start = virt + done;
+		for (i = 0; i < count; i++) {
+			pte = MMU_PTE(p, i);
+			if (!mmu_pte_frame(pte)) {
+				continue;
+			}
+			if (pte->swap ||
+			    (free && page_refcount(mmu_pte_frame(pte)))) {
+				memset(&batch[nr], 0, sizeof(struct page));
+				batch[nr].present = 1;
+				batch[nr].swap = pte->swap;
+				mmu_pte_set_frame(&batch[nr], mmu_pte_frame(pte));
+				nr++;
+			}
+			memset(pte, 0, MMU_PTE_SIZE);
+
+			/* The batch is full, flush the pages cleared so far */
+			if (nr == MMU_FREE_BATCH) {
+				end = virt + done + (i + 1) * PAGE_SIZE;
+				mmu_gather_add(&g, start, end - start);
+				mmu_unmap_release(&g, batch, &nr);
+				start = end;
+			}
+		}
+		end = virt + done + count * PAGE_SIZE;
+		if (end > start) {
+			mmu_gather_add(&g, start, end - start);
+		}
+	}
+
+	mmu_unmap_release(&g, batch, &nr);
 	rc = 0;
 
  out:
 	return rc;
 }
 
+int mmu_map(struct mmu_ctx *ctx, ptr_t virt, phys_addr_t phys, int flags)
+{
+	return mmu_map_range(ctx, virt, phys, PAGE_SIZE, flags);
+}
+
 int mmu_unmap(struct mmu_ctx *ctx, ptr_t virt, boolean_t shared, phys_addr_t *physp)
 {
 	int rc;
@@ -213,9 +984,10 @@ int mmu_unmap(struct mmu_ctx *ctx, ptr_t virt, boolean_t shared, phys_addr_t *ph
 		goto out;
 	}
 
-	entry = p->frame;
-	p->frame = 0;
+	entry = (phys_addr_t)mmu_pte_frame(p) * PAGE_SIZE;
+	mmu_pte_set_frame(p, 0);
 	p->present = 0;
+	mmu_flush_range(ctx, virt, PAGE_SIZE);
 
 	if (physp) {
 		*physp = entry;
@@ -229,12 +1001,82 @@ int mmu_unmap(struct mmu_ctx *ctx, ptr_t virt, boolean_t shared, phys_addr_t *ph
 
 void mmu_load_ctx(struct mmu_ctx *ctx)
 {
-	ASSERT((ctx->pdbr % PAGE_SIZE) == 0);
+	/* The page directory pointer table is 32 byte aligned below 4GB, the
+	 * non-PAE page directory is page aligned.
+	 */
+	ASSERT(((ctx->pdbr % 32) == 0) && (ctx->pdbr < _mmu_phys_map_end));
 
-	/* Set CR3 register */
+	/* Set CR3 register, with PAE the CORE loads the 4 page directory
+	 * pointers.
+	 */
 	x86_write_cr3(ctx->pdbr);
 }
 
+/* Handle a write to a copy-on-write page, user is TRUE for a write from
+ * user mode
+ */
+static int mmu_cow_fault(struct mmu_ctx *ctx, ptr_t virt, boolean_t user)
+{
+	int rc, ref;
+	page_num_t pfn;
+	struct page *p, old;
+
+	/* User mode may never write to a supervisor page */
+	p = mmu_get_page(ctx, virt, FALSE, 0);
+	if (!p || !p->present || (user && !p->user)) {
+		rc = EFAULT;
+		goto out;
+	}
+
+	/* The TLB of this CORE may have been stale before the shootdown of
+	 * another CORE which already resolved the fault.
+	 */
+	if (!p->cow) {
+		rc = p->rw ? 0 : EFAULT;
+		goto out;
+	}
+
+	/* If the frame is still shared, copy it to a new frame. Frames not
+	 * owned by the page allocator are always copied, the zero page is
+	 * replaced by a zeroed frame.
+	 */
+	pfn = mmu_pte_frame(p);
+	ref = page_refcount(pfn);
+	if (ref != 1) {
+		mmu_pte_set_frame(p, 0);
+		rc = page_alloc(p, (pfn == _zero_frame) ? MM_ZERO : 0);
+		if (rc != 0) {
+			mmu_pte_set_frame(p, pfn);
+			goto out;
+		}
+		if (pfn != _zero_frame) {
+			page_copy((phys_addr_t)mmu_pte_frame(p) * PAGE_SIZE,
+				  (phys_addr_t)pfn * PAGE_SIZE);
+		}
+	}
+
+	/* We are the only user of the frame now, it may be swapped out */
+	p->cow = 0;
+	p->rw = 1;
+	if (!IS_KERNEL_CTX(ctx) && (virt >= USER_START) && (virt < USER_END)) {
+		swap_lru_add(mmu_pte_frame(p), CURR_ASPACE, ROUND_DOWN(virt, PAGE_SIZE));
+	}
+	mmu_flush_range(ctx, ROUND_DOWN(virt, PAGE_SIZE), PAGE_SIZE);
+
+	/* Drop our reference to the shared frame, no TLB maps it for us now */
+	if ((ref != 1) && ref) {
+		memset(&old, 0, sizeof(old));
+		old.present = 1;
+		mmu_pte_set_frame(&old, pfn);
+		page_free(&old);
+	}
+
+	rc = 0;
+
+ out:
+	return rc;
+}
+
 /*
  * We don't call local_irq_done here, check this when we implementing
  * the paging feature of our kernel.
@@ -246,6 +1088,9 @@ void page_fault(struct registers *regs)
 	int rw;
 	int us;
 	int reserved;
+	int rc, retries;
+	struct mmu_ctx *ctx;
+	struct va_space *vas;
 
 	/* A page fault has occurred. The CR2 register
 	 * contains the faulting address.
@@ -257,6 +1102,58 @@ void page_fault(struct registers *regs)
 	us = regs->err_code & 0x4;
 	reserved = regs->err_code & 0x8;
 
+	for (retries = 0; retries <= RECLAIM_RETRIES; retries++) {
+		rc = EFAULT;
+		if (present) {
+			/* Write to a present page may be a copy-on-write fault,
+			 * user pages are serialized with the KSM scanner
+			 */
+			vas = CURR_ASPACE;
+			ctx = vas ? vas->mmu : &_kernel_mmu_ctx;
+			if (rw && !reserved && vas &&
+			    (faulting_addr >= USER_START) &&
+			    (faulting_addr < USER_END)) {
+				spinlock_acquire(&vas->lock);
+				rc = mmu_cow_fault(ctx, faulting_addr,
+						   us ? TRUE : FALSE);
+				spinlock_release(&vas->lock);
+			} else if (rw && !reserved) {
+				rc = mmu_cow_fault(ctx, faulting_addr,
+						   us ? TRUE : FALSE);
+			}
+		} else if (CURR_ASPACE) {
+			/* Pages of the address space are allocated on first touch */
+			rc = va_fault(CURR_ASPACE, faulting_addr,
+				      rw ? VA_MAP_WRITE : VA_MAP_READ);
+		}
+
+		if (rc == 0) {
+			return;
+		} else if ((rc != ENOMEM) || !reclaim_wait()) {
+			break;
+		}
+	}
+
+	/* A faulting user process is terminated instead of the system. The
+	 * fault came from user mode, so this thread holds no kernel lock and
+	 * the address space lock was released above. It is the same state as
+	 * a sys_exit, which also gets here through isr_handler from an
+	 * interrupt gate, and thread_exit never returns to the faulting code.
+	 */
+	if (us) {
+		if (rc == ENOMEM) {
+			kprintf("Out of memory, process(%s:%d) killed.\n",
+				CURR_PROC->name, CURR_PROC->id);
+		} else {
+			kprintf("Page fault(%s%s) at 0x%x - EIP: 0x%x, "
+				"process(%s:%d) killed.\n",
+				present ? "present " : "non-present ",
+				rw ? "write" : "read", faulting_addr, regs->eip,
+				CURR_PROC->name, CURR_PROC->id);
+		}
+		process_exit(rc);
+	}
+
 	dump_registers(regs);
 
 	/* Print an error message */
@@ -271,10 +1168,13 @@ void page_fault(struct registers *regs)
 	PANIC("Page fault");
 }
 
-void mmu_clone_ctx(struct mmu_ctx *dst, struct mmu_ctx *src)
+int mmu_clone_ctx(struct mmu_ctx *dst, struct mmu_ctx *src)
 {
-	int i;
+	int rc = 0, i, j;
+	phys_addr_t pde;
 	struct pdir *dst_dir, *src_dir, *krn_dir;
+	struct mmu_gather g;
+	boolean_t protected = FALSE;
 
 	dst_dir = dst->pdir;
 	src_dir = src->pdir;
@@ -283,28 +1183,62 @@ void mmu_clone_ctx(struct mmu_ctx *dst, struct mmu_ctx *src)
 	/* For each page table, if the page table is in the kernel directory,
 	 * do not make a new copy.
 	 */
-	for (i = 0; i < 1024; i++) {
-		if (!src_dir->ptbl[i]) {
-			/* Already allocated */
+	for (i = 0; i < PDIR_ENTRIES; i++) {
+		if (!FLAG_ON(mmu_get_pde(src_dir, i), PDE_PRESENT) ||
+		    FLAG_ON(mmu_get_pde(krn_dir, i), PDE_PRESENT)) {
+			/* Not allocated or belongs to the kernel */
 			continue;
 		}
-		
-		if (krn_dir->ptbl[i] == src_dir->ptbl[i]) {
-			/* It's in the kernel, so just use the same page table
-			 * and page directory entry
-			 */
-			dst_dir->ptbl[i] = src_dir->ptbl[i];
-			dst_dir->pde[i] = src_dir->pde[i];
-		} else {
-			/* Physically clone the page table if it's not kernel stuff */
-			uint32_t pde;
 
-			DEBUG(DL_DBG, ("dst(0x%x), src(0x%x), addr(0x%x).\n",
-				       dst, src, i * 1024 * PAGE_SIZE));
-			dst_dir->ptbl[i] = clone_ptbl(src_dir->ptbl[i], &pde);
-			dst_dir->pde[i] = pde | 0x07;
+		/* Physically clone the page table if it's not kernel stuff */
+		DEBUG(DL_DBG, ("dst(0x%x), src(0x%x), addr(0x%x).\n",
+			       dst, src, i * LARGE_PAGE_SIZE));
+		rc = clone_ptbl(PDE_PTBL(mmu_get_pde(src_dir, i)), &pde, &protected);
+		if (rc != 0) {
+			break;
 		}
+		mmu_set_pde(dst_dir, i, pde | 0x07);
+	}
+
+	/* Out of memory, drop the references taken by the tables cloned so
+	 * far. The source frames stay copy-on-write, the first write finds
+	 * them unshared and makes them writable again.
+	 */
+	if (rc != 0) {
+		for (j = 0; j < i; j++) {
+			if (!FLAG_ON(mmu_get_pde(dst_dir, j), PDE_PRESENT)) {
+				continue;
+			}
+			mmu_unmap_range(dst, j * LARGE_PAGE_SIZE, LARGE_PAGE_SIZE,
+					TRUE);
+			mmu_free_table(PDE_PTBL(mmu_get_pde(dst_dir, j)), PAGE_SIZE);
+			mmu_set_pde(dst_dir, j, 0);
+		}
+		goto out;
+	}
+
+	/* It's in the kernel, so just use the same page table or large page.
+	 * The kernel entries must not change while they are copied.
+	 */
+	spinlock_acquire(&_mmu_ctx_lock);
+	for (i = 0; i < PDIR_ENTRIES; i++) {
+		if (FLAG_ON(mmu_get_pde(krn_dir, i), PDE_PRESENT)) {
+			mmu_set_pde(dst_dir, i, mmu_get_pde(krn_dir, i));
+		}
+	}
+	spinlock_release(&_mmu_ctx_lock);
+
+ out:
+	/* If source pages were write protected, flush the stale writable
+	 * translations from the COREs using the source context. Cloning the
+	 * kernel context changes nothing that may be cached.
+	 */
+	if (protected && !IS_KERNEL_CTX(src)) {
+		mmu_gather_init(&g, src, MMU_FLUSH_ALL);
+		mmu_gather_flush(&g);
 	}
+
+	return rc;
 }
 
 struct mmu_ctx *mmu_create_ctx()
@@ -317,16 +1251,21 @@ struct mmu_ctx *mmu_create_ctx()
 		goto out;
 	}
 
-	ctx->pdir = alloc_structure(sizeof(struct pdir), &pdbr, MM_ALIGN);
+	ctx->pdir = mmu_alloc_pdir(ctx, &pdbr);
 	if (!ctx->pdir) {
 		kmem_free(ctx);
+		ctx = NULL;
 		goto out;
 	}
-	memset(ctx->pdir, 0, sizeof(struct pdir));
 	ctx->pdbr = pdbr;
-	ASSERT((ctx->pdbr % PAGE_SIZE) == 0);
 
 	mutex_init(&ctx->lock, "mmu-mutex", 0);	// TODO: flags need to be confirmed
+	ctx->cores = 0;
+
+	/* Kernel page directory entries changed later are propagated */
+	spinlock_acquire(&_mmu_ctx_lock);
+	list_add_tail(&ctx->link, &_mmu_ctx_list);
+	spinlock_release(&_mmu_ctx_lock);
 
  out:
 	return ctx;
@@ -334,67 +1273,130 @@ struct mmu_ctx *mmu_create_ctx()
 
 void mmu_destroy_ctx(struct mmu_ctx *ctx)
 {
+	int i;
+	struct pdir *krn_dir;
+
 	ASSERT(!IS_KERNEL_CTX(ctx));
 
-	kmem_free(ctx->pdir);
+	spinlock_acquire(&_mmu_ctx_lock);
+	list_del(&ctx->link);
+	spinlock_release(&_mmu_ctx_lock);
+
+	/* Free the page tables which are not shared with the kernel */
+	krn_dir = _kernel_mmu_ctx.pdir;
+	for (i = 0; i < PDIR_ENTRIES; i++) {
+		if (FLAG_ON(mmu_get_pde(ctx->pdir, i), PDE_PRESENT) &&
+		    !FLAG_ON(mmu_get_pde(krn_dir, i), PDE_PRESENT)) {
+			mmu_free_table(PDE_PTBL(mmu_get_pde(ctx->pdir, i)), PAGE_SIZE);
+		}
+	}
+
+	mmu_free_table(ctx->pdir, PDIR_SIZE);
+	if (ctx->pdpt) {
+		slab_cache_free(&_mmu_pdpt_cache, ctx->pdpt);
+	}
 	kmem_free(ctx);
 }
 
 void init_mmu_percore()
 {
+	/* The paging mode must be set before the kernel context is loaded, the
+	 * kernel pages are global so CR3 reloads do not flush them.
+	 */
+	x86_write_cr4(x86_read_cr4() | mmu_cr4_flags());
+	if (_mmu_nx) {
+		x86_write_msr(X86_MSR_EFER,
+			      x86_read_msr(X86_MSR_EFER) | X86_EFER_NXE);
+	}
+
 	/* Load kernel mmu context into this core */
 	mmu_load_ctx(&_kernel_mmu_ctx);
 	
-	/* Enable paging */
-	x86_write_cr0(x86_read_cr0() | X86_CR0_PG);
+	/* Enable paging, write protect also applies to supervisor mode so
+	 * the kernel also faults on copy-on-write pages.
+	 */
+	x86_write_cr0(x86_read_cr0() | X86_CR0_PG | X86_CR0_WP);
 }
 
 void init_mmu()
 {
-	phys_addr_t i;
+	int rc;
+	phys_addr_t i, large_end;
 	phys_addr_t pdbr;
 	struct page *page;
 
+	spinlock_init(&_mmu_ctx_lock, "mmu-ctx-lock");
+
+	/* Page tables are in PAE format if the CORE supports it, otherwise the
+	 * two level 32-bit format is used. The 2MB pages of PAE mode need no
+	 * CR4.PSE, the 4MB pages of 32-bit mode do. Kernel pages are global.
+	 */
+	_mmu_pae = _core_features.pae;
+	_mmu_large_pages = _mmu_pae || _core_features.pse;
+	x86_write_cr4(x86_read_cr4() | mmu_cr4_flags());
+
+	/* Pages which are not executable are marked if the CORE supports it,
+	 * only PAE entries have the NX bit.
+	 */
+	if (_mmu_pae && _core_features.xd) {
+		_mmu_nx = TRUE;
+		x86_write_msr(X86_MSR_EFER,
+			      x86_read_msr(X86_MSR_EFER) | X86_EFER_NXE);
+	}
+
+	/* Physical memory below the user part of the address spaces is mapped
+	 * at the same virtual address, page tables and directories are
+	 * allocated there so they are reached at their physical address.
+	 */
+	_mmu_phys_map_end = MIN((phys_addr_t)page_total() * PAGE_SIZE,
+				KERNEL_PHYS_MAP_END);
+	ASSERT(_mmu_phys_map_end > _placement_addr);
+
 	/* Initialize the kernel MMU context structure */
-	_kernel_mmu_ctx.pdir = alloc_structure(sizeof(struct pdir), &pdbr, MM_ALIGN);
+	_kernel_mmu_ctx.pdir = mmu_alloc_pdir(&_kernel_mmu_ctx, &pdbr);
 	_kernel_mmu_ctx.pdbr = pdbr;
-	memset(_kernel_mmu_ctx.pdir, 0, sizeof(struct pdir));
 	
-	DEBUG(DL_DBG, ("kernel MMU context(%p), pdbr(%p), core(%p)\n",
-		       &_kernel_mmu_ctx, _kernel_mmu_ctx.pdbr, CURR_CORE));
+	DEBUG(DL_DBG, ("kernel MMU context(%p), pdbr(%x), core(%p)\n",
+		       &_kernel_mmu_ctx, (uint32_t)_kernel_mmu_ctx.pdbr, CURR_CORE));
 
-	/* Allocate some pages in the kernel pool area. Here we call mmu_get_page
-	 * but we do not call page_alloc. this cause the page tables to be created
-	 * when necessary. We cannot allocate pages yet because they need to be
-	 * identity mapped first.
+	/* Map the physical map area. The large page sized chunks are mapped
+	 * by large pages if the CORE has them, they need no page table.
 	 */
-	for (i = KERNEL_KMEM_START;
-	     i < (KERNEL_KMEM_START + KERNEL_KMEM_SIZE);
-	     i += PAGE_SIZE) {
-		mmu_get_page(&_kernel_mmu_ctx, i, TRUE, 0);
+	large_end = _mmu_large_pages ?
+		ROUND_DOWN(_mmu_phys_map_end, LARGE_PAGE_SIZE) : 0;
+	for (i = 0; i < large_end; i += LARGE_PAGE_SIZE) {
+		mmu_set_pde(_kernel_mmu_ctx.pdir, i / LARGE_PAGE_SIZE,
+			    i | PDE_PRESENT | PDE_WRITE | PDE_LARGE | PDE_GLOBAL);
 	}
-
-	/* Do identity map (physical addr == virtual addr) for the memory we
-	 * have used.
-	 */
-	for (i = 0; i < (_placement_addr + PAGE_SIZE); i += PAGE_SIZE) {
-		/* Kernel code is readable but not writable from user-mode */
+	for (i = large_end; i < _mmu_phys_map_end; i += PAGE_SIZE) {
+		/* Kernel memory is not accessible from user-mode, it must be
+		 * writable as write protect applies to supervisor mode too.
+		 */
 		page = mmu_get_page(&_kernel_mmu_ctx, i, TRUE, 0);
-		page_alloc(page, 0);
+		page->present = 1;
+		mmu_pte_set_frame(page, i / PAGE_SIZE);
 		page->user = FALSE;
-		page->rw = FALSE;
+		page->rw = TRUE;
+		page->global = TRUE;
 	}
 
+	/* The placement address will not move any more, give the rest of the
+	 * physical memory to the page allocator. Page tables come from it from
+	 * now on.
+	 */
+	page_init_free(ROUND_UP(_placement_addr, PAGE_SIZE));
+	_mmu_page_ready = TRUE;
+
 	/* Allocate those pages we mapped for kernel pool area */
-	for (i = KERNEL_KMEM_START;
-	     i < (KERNEL_KMEM_START + KERNEL_KMEM_SIZE);
-	     i += PAGE_SIZE) {
-		page = mmu_get_page(&_kernel_mmu_ctx, i, FALSE, 0);
-		ASSERT(page != NULL);
-		page_alloc(page, 0);
-		page->user = FALSE;
-		page->rw = FALSE;
-	}
+	rc = mmu_map_range(&_kernel_mmu_ctx, KERNEL_KMEM_START, 0, KERNEL_KMEM_SIZE,
+			   MMU_MAP_ALLOC | MMU_MAP_WRITE | MMU_MAP_LARGE);
+	ASSERT(rc == 0);
+
+	/* The temporary mapping slots share a page table made now, mapping a
+	 * frame there never allocates memory
+	 */
+	page = mmu_get_page(&_kernel_mmu_ctx, KERNEL_KMAP_START, TRUE, 0);
+	ASSERT(page != NULL);
 
 	/* Before we enable paging, we must register our page fault handler */
 	_isr_table[X86_TRAP_PF] = page_fault;
@@ -404,6 +1406,20 @@ void init_mmu()
 	 */
 	mmu_load_ctx(&_kernel_mmu_ctx);
 
-	/* Enable paging */
-	x86_write_cr0(x86_read_cr0() | X86_CR0_PG);
+	/* Enable paging, write protect also applies to supervisor mode so
+	 * the kernel also faults on copy-on-write pages.
+	 */
+	x86_write_cr0(x86_read_cr0() | X86_CR0_PG | X86_CR0_WP);
+}
+
+/* Create the cache of the page directory pointer tables, it is called once
+ * the slab allocator is initialized
+ */
+void init_mmu_cache()
+{
+	if (_mmu_pae) {
+		slab_cache_init(&_mmu_pdpt_cache, "pdpt-cache",
+				PDPT_ENTRIES * sizeof(uint64_t), NULL, NULL,
+				SLAB_ALIGN_SIZE);
+	}
 }
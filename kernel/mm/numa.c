@@ -0,0 +1,201 @@
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "hal/core.h"
+#include "mm/page.h"
+#include "mm/numa.h"
+#include "debug.h"
+
+/*
+ * A range of physical memory local to a node
+ */
+struct numa_range {
+	uint64_t base;		// Start address of the range
+	uint64_t end;		// End address of the range
+	int node;		// Node the range belongs to
+};
+
+/* Number of memory nodes, all memory is on node 0 without an SRAT */
+size_t _nr_numa_nodes = 1;
+
+/* Proximity domains of the nodes found in the SRAT */
+static uint32_t _numa_domains[NUMA_MAX_NODES];
+static size_t _nr_numa_domains = 0;
+
+/* Memory ranges of the nodes */
+static struct numa_range _numa_ranges[NUMA_MAX_RANGES];
+static size_t _nr_numa_ranges = 0;
+
+/* Node of each CORE, indexed by the local APIC ID */
+static uint8_t _numa_core_nodes[NUMA_MAX_CORES];
+
+/* Distances between the nodes, 0 if the SLIT did not tell us */
+static uint8_t _numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/* Nodes sorted by their distance from each node, the node itself first */
+static uint8_t _numa_fallback[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+/* Get the node of a proximity domain, -1 if the domain is unknown */
+static int numa_domain_node(uint32_t domain)
+{
+	size_t i;
+
+	for (i = 0; i < _nr_numa_domains; i++) {
+		if (_numa_domains[i] == domain) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/* Get the node of a proximity domain, the node is created if needed */
+int numa_node_add(uint32_t domain)
+{
+	int node;
+
+	node = numa_domain_node(domain);
+	if ((node < 0) && (_nr_numa_domains < NUMA_MAX_NODES)) {
+		node = _nr_numa_domains;
+		_numa_domains[_nr_numa_domains++] = domain;
+	}
+
+	return node;
+}
+
+/* Add a range of memory of a proximity domain */
+int numa_add_memory(uint32_t domain, uint64_t base, uint64_t size)
+{
+	int node;
+
+	node = numa_node_add(domain);
+	if ((node < 0) || (_nr_numa_ranges >= NUMA_MAX_RANGES)) {
+		DEBUG(DL_WRN, ("too many nodes, domain(%d) base(%llx).\n",
+			       domain, base));
+		return ENOMEM;
+	}
+
+	_numa_ranges[_nr_numa_ranges].base = base;
+	_numa_ranges[_nr_numa_ranges].end = base + size;
+	_numa_ranges[_nr_numa_ranges].node = node;
+	_nr_numa_ranges++;
+
+	return 0;
+}
+
+/* Add a CORE of a proximity domain */
+int numa_add_core(uint32_t domain, uint32_t apic_id)
+{
+	int node;
+
+	if (apic_id >= NUMA_MAX_CORES) {
+		return EINVAL;
+	}
+
+	node = numa_node_add(domain);
+	if (node < 0) {
+		DEBUG(DL_WRN, ("too many nodes, domain(%d) core(%d).\n",
+			       domain, apic_id));
+		return ENOMEM;
+	}
+
+	_numa_core_nodes[apic_id] = node;
+
+	return 0;
+}
+
+/* Set the distance between two proximity domains, unknown ones are ignored */
+void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance)
+{
+	int f, t;
+
+	f = numa_domain_node(from);
+	t = numa_domain_node(to);
+	if ((f >= 0) && (t >= 0)) {
+		_numa_distances[f][t] = distance;
+	}
+}
+
+/* Get the node a physical address is on */
+int numa_phys_node(phys_addr_t addr)
+{
+	size_t i;
+
+	for (i = 0; i < _nr_numa_ranges; i++) {
+		if ((addr >= _numa_ranges[i].base) &&
+		    (addr < _numa_ranges[i].end)) {
+			return _numa_ranges[i].node;
+		}
+	}
+
+	/* Memory the SRAT did not mention is put on the first node */
+	return 0;
+}
+
+/* Get the node a CORE is on */
+int numa_core_node(uint32_t apic_id)
+{
+	return (apic_id < NUMA_MAX_CORES) ? _numa_core_nodes[apic_id] : 0;
+}
+
+/* Get the relative distance between two nodes */
+uint8_t numa_distance(int from, int to)
+{
+	if (from == to) {
+		return NUMA_LOCAL_DISTANCE;
+	} else if (_numa_distances[from][to]) {
+		return _numa_distances[from][to];
+	}
+
+	return NUMA_REMOTE_DISTANCE;
+}
+
+/* Get the _nr_numa_nodes nodes in the order a node falls back on them */
+const uint8_t *numa_fallback(int node)
+{
+	ASSERT(node < _nr_numa_nodes);
+	return _numa_fallback[node];
+}
+
+/*
+ * Set up the nodes registered from the SRAT, nothing is done on a system
+ * with a single node.
+ */
+void init_numa()
+{
+	size_t i, j, k;
+	uint8_t n;
+
+	if (_nr_numa_domains <= 1) {
+		return;
+	}
+
+	_nr_numa_nodes = _nr_numa_domains;
+
+	/* Sort the other nodes by distance, the nearest ones come first */
+	for (i = 0; i < _nr_numa_nodes; i++) {
+		for (j = 0; j < _nr_numa_nodes; j++) {
+			n = j;
+			for (k = j; (k > 0) &&
+				     (numa_distance(i, _numa_fallback[i][k - 1]) >
+				      numa_distance(i, n)); k--) {
+				_numa_fallback[i][k] = _numa_fallback[i][k - 1];
+			}
+			_numa_fallback[i][k] = n;
+		}
+	}
+
+	for (i = 0; i < _nr_numa_ranges; i++) {
+		kprintf("numa: node %d domain %d memory [%llx, %llx)\n",
+			_numa_ranges[i].node, _numa_domains[_numa_ranges[i].node],
+			_numa_ranges[i].base, _numa_ranges[i].end);
+	}
+
+	/* COREs registered later pick up their node when created */
+	CURR_CORE->node = numa_core_node(CURR_CORE->id);
+
+	/* Move the free frames to the zones of their nodes */
+	page_init_zones();
+}
@@ -1,66 +1,188 @@
 #include <types.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "hal/core.h"
+#include "mm/mm.h"
+#include "mm/mlayout.h"
 #include "mm/page.h"
 #include "mm/kmem.h"
+#include "mm/mmu.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
+#include "mm/numa.h"
 #include "multiboot.h"
 #include "debug.h"
 
-#define INDEX_FROM_BIT(a)	((a)/(8*4))
-#define OFFSET_FROM_BIT(a)	((a)%(8*4))
-
 /* Placement address indicates the end of the physical memory */
 phys_addr_t _placement_addr = 0;
 
 /* Total physical pages */
 static page_num_t _nr_total_pages = 0;
 
-/* Bitmap for all pages */
-static uint32_t *_pages = NULL;
+/* Number of free pages in the buddy allocator */
+static page_num_t _nr_free_pages = 0;
+
+/* Watermarks of the free pages, the reclaim thread is woken up below the
+ * low one and reclaims until the high one is reached
+ */
+page_num_t _page_wmark_low = 0;
+page_num_t _page_wmark_high = 0;
+
+/* Descriptors of all pages */
+static struct frame *_frames = NULL;
+
+/*
+ * Free frames of a NUMA node. Buddies are only merged within a zone, so a
+ * free block never spans two nodes.
+ */
+struct page_zone {
+	struct list free_areas[PAGE_MAX_ORDER];	// List n holds free blocks of 2^n pages
+	page_num_t nr_free;			// Number of free pages in the zone
+};
+
+/* Zones of the buddy allocator, one for each NUMA node */
+static struct page_zone _zones[NUMA_MAX_NODES];
 static struct spinlock _pages_lock;
 
-static void set_frame(uint32_t frame_addr)
+/* Whether the free frames were given to the buddy allocator */
+static boolean_t _page_init_done = FALSE;
+
+/* Pool of pre-zeroed frames in the physical map area */
+static struct list _zero_pool = {
+	.prev = &_zero_pool,
+	.next = &_zero_pool
+};
+static page_num_t _nr_zero_frames = 0;
+static struct spinlock _zero_pool_lock;
+
+/* Add a free block to the free list, merging it with its buddies */
+static void buddy_free(page_num_t pfn, int order)
 {
-	uint32_t frame = frame_addr / 0x1000;
-	uint32_t idx = INDEX_FROM_BIT(frame);
-	uint32_t off = OFFSET_FROM_BIT(frame);
+	page_num_t buddy;
+	struct page_zone *z;
+
+	z = &_zones[_frames[pfn].node];
+	z->nr_free += (1 << order);
+
+	while (order < (PAGE_MAX_ORDER - 1)) {
+		buddy = pfn ^ (1 << order);
+		if ((buddy >= _nr_total_pages) ||
+		    !FLAG_ON(_frames[buddy].flags, FRAME_FREE) ||
+		    (_frames[buddy].order != order) ||
+		    (_frames[buddy].node != _frames[pfn].node)) {
+			break;
+		}
 
-	_pages[idx] |= (0x1 << off);
+		/* Our buddy is free, merge with it */
+		list_del(&_frames[buddy].link);
+		_frames[buddy].flags &= ~FRAME_FREE;
+		pfn &= ~(1 << order);
+		order++;
+	}
+
+	_frames[pfn].flags |= FRAME_FREE;
+	_frames[pfn].order = order;
+	list_add(&_frames[pfn].link, &z->free_areas[order]);
 }
 
-static void clear_frame(uint32_t frame_addr)
+/* Take a free block off the free list */
+static void buddy_take(page_num_t pfn)
 {
-	uint32_t frame = frame_addr / 0x1000;
-	uint32_t idx = INDEX_FROM_BIT(frame);
-	uint32_t off = OFFSET_FROM_BIT(frame);
-
-	_pages[idx] &= ~(0x1 << off);
+	ASSERT(FLAG_ON(_frames[pfn].flags, FRAME_FREE));
+	list_del(&_frames[pfn].link);
+	_frames[pfn].flags &= ~FRAME_FREE;
+	_zones[_frames[pfn].node].nr_free -= (1 << _frames[pfn].order);
 }
 
-static uint32_t first_frame()
+/*
+ * Split the free block [pfn, pfn + 2^order) until we get the block of
+ * 2^want pages starting at target. The other halves go back to the free
+ * lists.
+ */
+static void buddy_split(page_num_t pfn, int order, page_num_t target, int want)
 {
-	uint32_t i, j, frame;
+	page_num_t half;
+
+	while (order > want) {
+		order--;
+		half = 1 << order;
+		if (target < (pfn + half)) {
+			buddy_free(pfn + half, order);
+		} else {
+			buddy_free(pfn, order);
+			pfn += half;
+		}
+	}
 
-	frame = 0;
+	ASSERT(pfn == target);
+}
 
-	for (i = 0; i < INDEX_FROM_BIT(_nr_total_pages); i++) {
-		if (_pages[i] != 0xFFFFFFFF) {
-			for (j = 0; j < 32; j++) {
-				uint32_t to_test = 0x1 << j;
-				if (!(_pages[i] & to_test)) {
-					frame = i * 4 * 8 + j;
-					goto out;
-				}
+/*
+ * Allocate a block of 2^order pages of a zone which lies in [minpfn, maxpfn),
+ * return the first page number or 0 if we failed.
+ */
+static page_num_t buddy_alloc(struct page_zone *z, int order,
+			      page_num_t minpfn, page_num_t maxpfn)
+{
+	int i;
+	struct list *l;
+	page_num_t pfn, start, size;
+
+	size = 1 << order;
+
+	for (i = order; i < PAGE_MAX_ORDER; i++) {
+		LIST_FOR_EACH(l, &z->free_areas[i]) {
+			pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+
+			/* Find an aligned block of our size inside this block
+			 * which satisfies the range constraints
+			 */
+			start = MAX(pfn, ROUND_UP(minpfn, size));
+			if (((start + size) > (pfn + (1 << i))) ||
+			    ((start + size) > maxpfn)) {
+				continue;
 			}
+
+			buddy_take(pfn);
+			buddy_split(pfn, i, start, order);
+			_nr_free_pages -= size;
+
+			return start;
 		}
 	}
 
- out:
-	return frame;
+	return 0;
+}
+
+/*
+ * Allocate a block from the zone of a node, the zones of the other nodes
+ * are tried from the nearest to the farthest when it runs out.
+ */
+static page_num_t buddy_alloc_node(int node, int order, page_num_t minpfn,
+				   page_num_t maxpfn)
+{
+	size_t i;
+	page_num_t pfn = 0;
+	const uint8_t *fallback;
+
+	fallback = numa_fallback(node);
+	for (i = 0; (i < _nr_numa_nodes) && !pfn; i++) {
+		pfn = buddy_alloc(&_zones[fallback[i]], order, minpfn, maxpfn);
+	}
+
+	return pfn;
 }
 
 void page_early_alloc(phys_addr_t *phys, size_t size, boolean_t align)
 {
+	/* The memory after the placement address belongs to the buddy
+	 * allocator now
+	 */
+	ASSERT(!_page_init_done);
+
 	/* If the address is not already page-aligned */
 	if ((align) && (_placement_addr & 0xFFF)) {
 		/* Align the placement address */
@@ -75,71 +197,650 @@ void page_early_alloc(phys_addr_t *phys, size_t size, boolean_t align)
 	_placement_addr += size;
 }
 
-void page_alloc(struct page *p, int flags)
+/*
+ * Refill the frame cache of the current CORE from the buddy allocator, the
+ * frames come from the node of the CORE if possible. Cache lock must be held.
+ */
+static void page_cache_refill(struct page_cache *pc)
+{
+	int i;
+	page_num_t pfn;
+
+	spinlock_acquire(&_pages_lock);
+	for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+		pfn = buddy_alloc_node(CURR_CORE->node, 0, 0, _nr_total_pages);
+		if (!pfn) {
+			break;
+		}
+		_frames[pfn].flags |= FRAME_CACHED;
+		list_add_tail(&_frames[pfn].link, &pc->cold);
+		pc->count++;
+	}
+	spinlock_release(&_pages_lock);
+}
+
+/*
+ * Give the frames of a frame cache back to the buddy allocator until the
+ * count drops to the specified number, the cold frames go first. Cache
+ * lock must be held.
+ */
+static void page_cache_drain(struct page_cache *pc, page_num_t count)
+{
+	struct list *l;
+	page_num_t pfn;
+
+	spinlock_acquire(&_pages_lock);
+	while (pc->count > count) {
+		l = LIST_EMPTY(&pc->cold) ? pc->hot.prev : pc->cold.prev;
+		list_del(l);
+		pc->count--;
+
+		pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+		_frames[pfn].flags &= ~FRAME_CACHED;
+		buddy_free(pfn, 0);
+		_nr_free_pages++;
+	}
+	spinlock_release(&_pages_lock);
+}
+
+void page_cache_init(struct page_cache *pc)
+{
+	spinlock_init(&pc->lock, "pcache-lock");
+	LIST_INIT(&pc->hot);
+	LIST_INIT(&pc->cold);
+	pc->count = 0;
+}
+
+/* Trim the frame cache of the current CORE, called when the CORE is idle */
+void page_drain_percore()
+{
+	struct page_cache *pc;
+
+	pc = &CURR_CORE->page_cache;
+	if (pc->count > PAGE_CACHE_BATCH) {
+		spinlock_acquire(&pc->lock);
+		page_cache_drain(pc, PAGE_CACHE_BATCH);
+		spinlock_release(&pc->lock);
+	}
+}
+
+/*
+ * Zero a frame. Frames in the physical map area are written directly, the
+ * others through the temporary mapping slot of this CORE. Non-temporal
+ * stores are used if the CORE has them so the zeroed frame does not evict
+ * the working set from the cache.
+ */
+static void page_zero_frame(page_num_t pfn)
 {
-	uint32_t idx;
+	ptr_t addr;
+	uint32_t n;
+	phys_addr_t phys;
+	void *virt = NULL;
+	boolean_t state = FALSE;
+
+	phys = (phys_addr_t)pfn * PAGE_SIZE;
+	if ((phys + PAGE_SIZE) > _mmu_phys_map_end) {
+		virt = mmu_kmap(phys, 0, &state);
+		addr = (ptr_t)virt;
+	} else {
+		addr = (ptr_t)phys;
+	}
+
+	if (_core_features.sse2) {
+		n = PAGE_SIZE / 16;
+		asm volatile("1:\n\t"
+			     "movnti %2, 0(%0)\n\t"
+			     "movnti %2, 4(%0)\n\t"
+			     "movnti %2, 8(%0)\n\t"
+			     "movnti %2, 12(%0)\n\t"
+			     "addl $16, %0\n\t"
+			     "decl %1\n\t"
+			     "jnz 1b\n\t"
+			     "sfence"
+			     : "+r"(addr), "+r"(n)
+			     : "r"(0)
+			     : "memory", "cc");
+	} else {
+		memset((void *)addr, 0, PAGE_SIZE);
+	}
+
+	if (virt) {
+		mmu_kunmap(virt, state);
+	}
+}
+
+/* Take a frame from the pre-zeroed pool, 0 if the pool is empty */
+static page_num_t page_zero_get()
+{
+	struct list *l;
+	page_num_t pfn = 0;
+
+	spinlock_acquire(&_zero_pool_lock);
+	if (!LIST_EMPTY(&_zero_pool)) {
+		l = _zero_pool.next;
+		list_del(l);
+		_nr_zero_frames--;
+
+		pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+		_frames[pfn].flags &= ~FRAME_ZEROED;
+		_frames[pfn].ref = 1;
+	}
+	spinlock_release(&_zero_pool_lock);
+
+	return pfn;
+}
+
+/*
+ * Top up the pre-zeroed pool, called by the idle threads. Only a batch is
+ * zeroed each time so the CORE gets back to the run queue quickly, and
+ * nothing is done when memory is low.
+ */
+void page_zero_refill()
+{
+	int i;
+	phys_addr_t phys;
+	page_num_t pfn;
+
+	for (i = 0; i < PAGE_ZERO_BATCH; i++) {
+		if ((_nr_zero_frames >= PAGE_ZERO_HIGH) ||
+		    (_nr_free_pages < _page_wmark_high)) {
+			break;
+		}
+
+		if (phys_alloc(PAGE_SIZE, 0, 0, _mmu_phys_map_end, 0, &phys) != 0) {
+			break;
+		}
+		pfn = phys / PAGE_SIZE;
+		page_zero_frame(pfn);
+
+		spinlock_acquire(&_zero_pool_lock);
+		_frames[pfn].flags |= FRAME_ZEROED;
+		list_add_tail(&_frames[pfn].link, &_zero_pool);
+		_nr_zero_frames++;
+		spinlock_release(&_zero_pool_lock);
+	}
+}
+
+/* Give the frames cached by all COREs back, called when memory is low */
+void page_drain_all()
+{
+	struct list *l;
+	struct core *c;
+	page_num_t pfn;
+
+	LIST_FOR_EACH(l, &_running_cores) {
+		c = LIST_ENTRY(l, struct core, link);
+		spinlock_acquire(&c->page_cache.lock);
+		page_cache_drain(&c->page_cache, 0);
+		spinlock_release(&c->page_cache.lock);
+	}
+
+	/* The pre-zeroed frames are free memory too */
+	while ((pfn = page_zero_get()) != 0) {
+		phys_free((phys_addr_t)pfn * PAGE_SIZE, PAGE_SIZE);
+	}
+}
+
+/**
+ * Allocate frames for a run of page table entries, the cache of this CORE
+ * is only locked once for the whole run
+ * @p		- first page table entry
+ * @count	- number of entries
+ * @flags	- allocation flags
+ * Returns ENOMEM with none of the entries set if the frames ran out.
+ */
+int page_alloc_batch(struct page *p, size_t count, int flags)
+{
+	size_t i, zeroed = 0;
+	page_num_t pfn;
+	struct list *l;
+	struct page_cache *pc;
 	
 	ASSERT(p != NULL);
 
-	if (p->frame != 0) {
-		DEBUG(DL_WRN, ("page(%p), frame(%x), flags(%d)\n",
-			       p, p->frame, flags));
-		PANIC("alloc page in use");
-	} else {
-		spinlock_acquire(&_pages_lock);
-		/* Get the first free frame from our global frame set */
-		idx = first_frame();
-		if (idx == (uint32_t)(-1)) {
-			PANIC("No free frames!\n");
+	for (i = 0; i < count; i++) {
+		if (mmu_pte_frame(MMU_PTE(p, i)) != 0) {
+			DEBUG(DL_WRN, ("page(%p), frame(%x), flags(%d)\n",
+				       MMU_PTE(p, i), mmu_pte_frame(MMU_PTE(p, i)),
+				       flags));
+			PANIC("alloc page in use");
 		}
-		/* Mark the frame address as being used */
-		set_frame(idx * PAGE_SIZE);
-		spinlock_release(&_pages_lock);
+	}
 
-		p->present = 1;
-		p->frame = idx;
+	if (_nr_free_pages < _page_wmark_low) {
+		reclaim_wakeup();
+	}
+
+	/* Zeroed frames are taken from the pre-zeroed pool first */
+	if (FLAG_ON(flags, MM_ZERO)) {
+		for (; zeroed < count; zeroed++) {
+			pfn = page_zero_get();
+			if (!pfn) {
+				break;
+			}
+			MMU_PTE(p, zeroed)->present = 1;
+			mmu_pte_set_frame(MMU_PTE(p, zeroed), pfn);
+		}
+	}
+
+	/* Get free frames from the cache of this CORE, prefer the hot ones */
+	pc = &CURR_CORE->page_cache;
+	spinlock_acquire(&pc->lock);
+	for (i = zeroed; i < count; i++) {
+		if (!pc->count) {
+			page_cache_refill(pc);
+			if (!pc->count) {
+				/* Take back the frames cached by other COREs */
+				spinlock_release(&pc->lock);
+				page_drain_all();
+				spinlock_acquire(&pc->lock);
+				page_cache_refill(pc);
+			}
+			if (!pc->count) {
+				break;
+			}
+		}
+		l = LIST_EMPTY(&pc->hot) ? pc->cold.next : pc->hot.next;
+		list_del(l);
+		pc->count--;
+
+		pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+		_frames[pfn].flags &= ~FRAME_CACHED;
+		_frames[pfn].ref = 1;
+
+		MMU_PTE(p, i)->present = 1;
+		mmu_pte_set_frame(MMU_PTE(p, i), pfn);
+	}
+	spinlock_release(&pc->lock);
+
+	/* Give back the frames we got, the reclaim thread frees some more */
+	if (i < count) {
+		DEBUG(DL_WRN, ("no free frames, count(%d).\n", count));
+		while (i > 0) {
+			page_free(MMU_PTE(p, --i));
+		}
+		reclaim_wakeup();
+		return ENOMEM;
+	}
+
+	/* The pool ran dry, zero the rest of the frames here */
+	if (FLAG_ON(flags, MM_ZERO)) {
+		for (i = zeroed; i < count; i++) {
+			page_zero_frame(mmu_pte_frame(MMU_PTE(p, i)));
+		}
 	}
 
 #ifdef _DEBUG_MM
-	DEBUG(DL_DBG, ("page(%p), frame(%x).\n", p, p->frame));
+	DEBUG(DL_DBG, ("page(%p), frame(%x), count(%d).\n",
+		       p, mmu_pte_frame(p), count));
 #endif	/* _DEBUG_MM */
+
+	return 0;
+}
+
+int page_alloc(struct page *p, int flags)
+{
+	return page_alloc_batch(p, 1, flags);
 }
 
 void page_free(struct page *p)
 {
-	uint32_t frame;
+	page_num_t pfn;
+	boolean_t last;
+	struct page_cache *pc;
 
 	ASSERT(p != NULL);
 
 #ifdef _DEBUG_MM
-	DEBUG(DL_DBG, ("page(%p), frame(%x).\n", p, p->frame));
+	DEBUG(DL_DBG, ("page(%p), frame(%x).\n", p, mmu_pte_frame(p)));
 #endif	/* _DEBUG_MM */
 	
-	if (!(frame = p->frame)) {
+	if (!(pfn = mmu_pte_frame(p))) {
 		DEBUG(DL_WRN, ("free page(%p) not allocated.\n", p));
 		PANIC("free page not allocated");
 	} else {
-		spinlock_acquire(&_pages_lock);
-		clear_frame(frame);
-		spinlock_release(&_pages_lock);
+		ASSERT(pfn < _nr_total_pages);
+		ASSERT(!FLAG_ON(_frames[pfn].flags,
+				FRAME_FREE | FRAME_RESERVED | FRAME_CACHED));
+		ASSERT(_frames[pfn].ref > 0);
+
+		/* Only free the frame when its last mapping goes away, frames
+		 * known to the swapper are released under the LRU lock
+		 */
+		if (FLAG_ON(_frames[pfn].flags, FRAME_LRU | FRAME_ISOLATED)) {
+			last = swap_lru_put(&_frames[pfn]);
+		} else {
+			last = (atomic_dec(&_frames[pfn].ref) == 1);
+		}
+		if (last) {
+			/* The frame is hot, put it at the head of the cache */
+			pc = &CURR_CORE->page_cache;
+			spinlock_acquire(&pc->lock);
+			_frames[pfn].flags |= FRAME_CACHED;
+			list_add(&_frames[pfn].link, &pc->hot);
+			pc->count++;
+			if (pc->count > PAGE_CACHE_HIGH) {
+				page_cache_drain(pc, PAGE_CACHE_HIGH - PAGE_CACHE_BATCH);
+			}
+			spinlock_release(&pc->lock);
+		}
 		
-		p->frame = 0;
+		mmu_pte_set_frame(p, 0);
 		p->present = 0;
 	}
 }
 
-void phys_alloc(phys_size_t size, phys_addr_t align, phys_addr_t minaddr,
-		phys_addr_t maxaddr, int flags, phys_addr_t *basep)
+/* Take another reference to an allocated frame which is mapped again */
+void page_ref(page_num_t pfn)
+{
+	ASSERT(pfn < _nr_total_pages);
+	ASSERT(!FLAG_ON(_frames[pfn].flags,
+			FRAME_FREE | FRAME_RESERVED | FRAME_CACHED));
+	ASSERT(_frames[pfn].ref > 0);
+
+	/* A shared frame is not swapped out */
+	if (FLAG_ON(_frames[pfn].flags, FRAME_LRU | FRAME_ISOLATED)) {
+		swap_lru_ref(&_frames[pfn]);
+	} else {
+		atomic_inc(&_frames[pfn].ref);
+	}
+}
+
+/* Get the number of free frames in the buddy allocator */
+page_num_t page_free_count()
+{
+	return _nr_free_pages;
+}
+
+/* Get the number of free frames in the zone of a NUMA node */
+page_num_t page_node_free_count(int node)
 {
+	ASSERT(node < _nr_numa_nodes);
+	return _zones[node].nr_free;
+}
+
+/* Get the number of physical frames in the system */
+page_num_t page_total()
+{
+	return _nr_total_pages;
+}
+
+/* Get the descriptor of an allocated frame */
+struct frame *page_frame(page_num_t pfn)
+{
+	ASSERT(pfn < _nr_total_pages);
+	return &_frames[pfn];
+}
+
+/* Get the number of mappings of a frame, 0 if the frame is not allocated */
+int page_refcount(page_num_t pfn)
+{
+	if ((pfn >= _nr_total_pages) ||
+	    FLAG_ON(_frames[pfn].flags,
+		    FRAME_FREE | FRAME_RESERVED | FRAME_CACHED | FRAME_ZEROED)) {
+		return 0;
+	}
+
+	return _frames[pfn].ref;
+}
+
+/*
+ * Copy the contents of a frame to another one. Frames are reached through
+ * the temporary mapping slots of this CORE, they may be above 4GB.
+ */
+void page_copy(phys_addr_t dst, phys_addr_t src)
+{
+	void *d, *s;
+	boolean_t dstate, sstate;
+
+	d = mmu_kmap(dst, 0, &dstate);
+	s = mmu_kmap(src, 1, &sstate);
+
+	memcpy(d, s, PAGE_SIZE);
+
+	/* Unmapped in reverse order, the first slot restores the interrupts */
+	mmu_kunmap(s, sstate);
+	mmu_kunmap(d, dstate);
+}
+
+/*
+ * Allocate a range of contiguous physical memory
+ * @size	- size of the range
+ * @align	- alignment of the range, 0 if don't care
+ * @minaddr	- lowest address of the range
+ * @maxaddr	- highest address the range may end at, 0 if no limit
+ * @flags	- allocation behaviour flags, MM_ZERO to zero the range
+ * @basep	- where to store the base address of the range
+ */
+int phys_alloc(phys_size_t size, phys_addr_t align, phys_addr_t minaddr,
+	       phys_addr_t maxaddr, int flags, phys_addr_t *basep)
+{
+	int rc = 0, order;
+	page_num_t pfn, count, i;
+
 	ASSERT(basep != NULL);
+	ASSERT((align & (align - 1)) == 0);
+
+	count = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+	if (!count) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	/* The blocks of the buddy allocator are aligned to their size */
+	for (order = 0;
+	     ((1 << order) < count) || (((phys_addr_t)PAGE_SIZE << order) < align);
+	     order++) ;
+	if (order >= PAGE_MAX_ORDER) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	/* A single zeroed frame is taken from the pre-zeroed pool first, the
+	 * frames of the pool are all in the physical map area
+	 */
+	if (FLAG_ON(flags, MM_ZERO) && (count == 1) && (align <= PAGE_SIZE) &&
+	    !minaddr && (!maxaddr || (maxaddr >= _mmu_phys_map_end))) {
+		pfn = page_zero_get();
+		if (pfn) {
+			(*basep) = (phys_addr_t)pfn * PAGE_SIZE;
+			goto out;
+		}
+	}
+
+	spinlock_acquire(&_pages_lock);
+
+	pfn = buddy_alloc_node(CURR_CORE->node, order,
+			       ROUND_UP(minaddr, PAGE_SIZE) / PAGE_SIZE,
+			       maxaddr ? (maxaddr / PAGE_SIZE) : _nr_total_pages);
+	if (pfn) {
+		/* Give back the pages we don't need at the tail of the block */
+		for (i = count; i < (1 << order); i++) {
+			buddy_free(pfn + i, 0);
+			_nr_free_pages++;
+		}
+	}
+
+	spinlock_release(&_pages_lock);
+
+	if (!pfn) {
+		DEBUG(DL_WRN, ("no free range, size(%x) align(%llx) range[%llx, %llx).\n",
+			       size, align, minaddr, maxaddr));
+		rc = ENOMEM;
+		goto out;
+	}
+
+	/* Each frame has a reference so it can also be freed by page_free */
+	for (i = 0; i < count; i++) {
+		_frames[pfn + i].ref = 1;
+		if (FLAG_ON(flags, MM_ZERO)) {
+			page_zero_frame(pfn + i);
+		}
+	}
+
+	(*basep) = (phys_addr_t)pfn * PAGE_SIZE;
+
+ out:
+	return rc;
+}
+
+/*
+ * Free a range of physical memory allocated by phys_alloc
+ */
+void phys_free(phys_addr_t base, phys_size_t size)
+{
+	page_num_t pfn, i;
+
+	ASSERT((base % PAGE_SIZE) == 0);
+
+	pfn = base / PAGE_SIZE;
+
+	spinlock_acquire(&_pages_lock);
+	for (i = 0; i < (ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE); i++) {
+		ASSERT(!FLAG_ON(_frames[pfn + i].flags,
+				FRAME_FREE | FRAME_RESERVED | FRAME_CACHED));
+		_frames[pfn + i].ref = 0;
+		buddy_free(pfn + i, 0);
+		_nr_free_pages++;
+	}
+	spinlock_release(&_pages_lock);
+}
+
+/* Check whether a frame holds the boot information we still need */
+static boolean_t page_boot_frame(page_num_t pfn)
+{
+	uint32_t i;
+	struct multiboot_mod_list *mod;
+
+#define FRAME_IN(start, end)	\
+	((pfn >= ((start) / PAGE_SIZE)) && (pfn <= (((end) - 1) / PAGE_SIZE)))
 
-	(*basep) = 0x00090000;
+	if (FRAME_IN((ptr_t)_mbi, (ptr_t)_mbi + sizeof(*_mbi)) ||
+	    FRAME_IN(_mbi->mmap_addr, _mbi->mmap_addr + _mbi->mmap_length) ||
+	    FRAME_IN(_mbi->mods_addr, _mbi->mods_addr +
+		     _mbi->mods_count * sizeof(struct multiboot_mod_list))) {
+		return TRUE;
+	}
+
+	mod = (struct multiboot_mod_list *)_mbi->mods_addr;
+	for (i = 0; i < _mbi->mods_count; i++) {
+		if (FRAME_IN(mod[i].mod_start, mod[i].mod_end)) {
+			return TRUE;
+		}
+	}
+
+#undef FRAME_IN
+
+	return FALSE;
+}
+
+/*
+ * Give the free frames to the buddy allocator. Memory in [1MB, end) holds
+ * the kernel and the structures allocated from the placement address, the
+ * usable memory below 1MB is free except for the boot information.
+ */
+void page_init_free(phys_addr_t end)
+{
+	ptr_t addr;
+	uint64_t start, last;
+	page_num_t pfn;
+	struct multiboot_mmap_entry *mmap;
+
+	ASSERT(!_page_init_done);
+
+	for (addr = _mbi->mmap_addr;
+	     addr < (_mbi->mmap_addr + _mbi->mmap_length);
+	     addr += (mmap->size + sizeof(mmap->size))) {
+		mmap = (struct multiboot_mmap_entry *)addr;
+		if (mmap->type != MULTIBOOT_MEMORY_AVAILABLE) {
+			continue;
+		}
+
+		start = ROUND_UP(mmap->addr, PAGE_SIZE) / PAGE_SIZE;
+		last = ROUND_DOWN(mmap->addr + mmap->len, PAGE_SIZE) / PAGE_SIZE;
+		last = MIN(last, _nr_total_pages);
+
+		for (pfn = start; pfn < last; pfn++) {
+			/* Frame 0 is never allocated, a zero frame means the
+			 * page is not present
+			 */
+			if ((pfn == 0) ||
+			    ((pfn >= (0x100000 / PAGE_SIZE)) && (pfn < (end / PAGE_SIZE))) ||
+			    page_boot_frame(pfn)) {
+				continue;
+			}
+
+			_frames[pfn].flags &= ~FRAME_RESERVED;
+			buddy_free(pfn, 0);
+			_nr_free_pages++;
+		}
+	}
+
+	_page_init_done = TRUE;
+
+	/* Keep about 1/64 of the memory free, reclaim twice as much */
+	_page_wmark_low = MAX(_nr_free_pages / 64, PAGE_CACHE_HIGH);
+	_page_wmark_high = _page_wmark_low * 2;
+
+	kprintf("page: %d of %d pages are free.\n", _nr_free_pages, _nr_total_pages);
+}
+
+/*
+ * Move the free frames to the zones of their NUMA nodes, called once the
+ * nodes are known. All the frames were on node 0 until then.
+ */
+void page_init_zones()
+{
+	int i;
+	page_num_t pfn, count, n;
+	struct list blocks, *l;
+
+	LIST_INIT(&blocks);
+
+	spinlock_acquire(&_pages_lock);
+
+	/* Take all the free blocks off the lists of node 0 */
+	for (i = 0; i < PAGE_MAX_ORDER; i++) {
+		while (!LIST_EMPTY(&_zones[0].free_areas[i])) {
+			l = _zones[0].free_areas[i].next;
+			pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+			buddy_take(pfn);
+			list_add_tail(&_frames[pfn].link, &blocks);
+		}
+	}
+	ASSERT(_zones[0].nr_free == 0);
+
+	/* Frames in use or cached by a CORE go to their zone when freed */
+	for (pfn = 0; pfn < _nr_total_pages; pfn++) {
+		_frames[pfn].node = numa_phys_node((phys_addr_t)pfn * PAGE_SIZE);
+	}
+
+	/* Free the blocks a frame at a time, the frames merge into blocks of
+	 * their own zones again
+	 */
+	while (!LIST_EMPTY(&blocks)) {
+		l = blocks.next;
+		list_del(l);
+		pfn = LIST_ENTRY(l, struct frame, link) - _frames;
+		count = 1 << _frames[pfn].order;
+		for (n = 0; n < count; n++) {
+			buddy_free(pfn + n, 0);
+		}
+	}
+
+	spinlock_release(&_pages_lock);
+
+	for (i = 0; i < _nr_numa_nodes; i++) {
+		kprintf("page: node %d has %d free pages.\n", i, _zones[i].nr_free);
+	}
 }
 
 void init_page()
 {
+	int i, j;
 	phys_addr_t addr;
-	phys_size_t mem_size = 0;
+	uint64_t mem_end = 0;
+	size_t size;
 	struct multiboot_mmap_entry *mmap;
 	
 	/* As we have only one module loaded, so the end of the module is our
@@ -147,35 +848,56 @@ void init_page()
 	 */
 	_placement_addr = *((uint32_t *)(_mbi->mods_addr + 4));
 
-	kprintf("page: placement address at 0x%x\n", _placement_addr);
+	kprintf("page: placement address at 0x%llx\n", _placement_addr);
 	
-	/* Detect the amount of physical memory by parse the memory map entry */
+	/* Detect the end of physical memory by parse the memory map entry */
 	for (addr = _mbi->mmap_addr;
 	     addr < (_mbi->mmap_addr + _mbi->mmap_length);
 	     addr += (mmap->size + sizeof(mmap->size))) {
-		mmap = (struct multiboot_mmap_entry *)addr;
+		mmap = (struct multiboot_mmap_entry *)(ptr_t)addr;
 		DEBUG(DL_DBG, ("mmap type(%d) addr(%llx) len(%llx)\n",
 			       mmap->type, mmap->addr, mmap->len));
-		mem_size += mmap->len;
+		if ((mmap->type == MULTIBOOT_MEMORY_AVAILABLE) &&
+		    ((mmap->addr + mmap->len) > mem_end)) {
+			mem_end = mmap->addr + mmap->len;
+		}
 	}
 
+	/* PAE page table entries address the first 64GB, the others only the
+	 * first 4GB. The frame descriptors are allocated below the user part
+	 * of the address spaces, they may take half of it.
+	 */
+	mem_end = MIN(mem_end, _core_features.pae ? 0x1000000000ULL :
+		      0x100000000ULL);
+	mem_end = MIN(mem_end, (uint64_t)((USER_START / 2) /
+					  sizeof(struct frame)) * PAGE_SIZE);
+
 	kprintf("page: available physical memory size: %uMB.\n",
-		mem_size / (1024 * 1024));
+		(uint32_t)(mem_end / (1024 * 1024)));
 
 	spinlock_init(&_pages_lock, "pages-lock");
+	spinlock_init(&_zero_pool_lock, "zero-pool-lock");
 
 	/* Calculate how many pages we have in the system */
-	_nr_total_pages = mem_size / PAGE_SIZE;
+	_nr_total_pages = mem_end / PAGE_SIZE;
 
-	/* Allocate the bitmap for the physical pages */
-	page_early_alloc(&addr, _nr_total_pages/(4*8), FALSE);
+	/* Allocate the descriptors for the physical pages, all the pages are
+	 * reserved until page_init_free was called.
+	 */
+	size = _nr_total_pages * sizeof(struct frame);
+	page_early_alloc(&addr, size, FALSE);
 	ASSERT(addr != 0);
 
-	_pages = (uint32_t *)addr;
+	_frames = (struct frame *)(ptr_t)addr;
+	memset(_frames, 0, size);
+	for (i = 0; i < _nr_total_pages; i++) {
+		LIST_INIT(&_frames[i].link);
+		_frames[i].flags = FRAME_RESERVED;
+	}
 
-	/* Clear the pages bitmap. The identity map we done in init_mmu will
-	 * consume the pages we already used. So don't need to do anything
-	 * here.
-	 */
-	memset(_pages, 0, _nr_total_pages/(4*8));
+	for (i = 0; i < NUMA_MAX_NODES; i++) {
+		for (j = 0; j < PAGE_MAX_ORDER; j++) {
+			LIST_INIT(&_zones[i].free_areas[j]);
+		}
+	}
 }
@@ -6,12 +6,11 @@
 #include "mm/mlayout.h"
 #include "mm/page.h"
 #include "mm/kmem.h"
-
-extern uint32_t _placement_addr;
+#include "mm/mmu.h"
 
 #define PMAP_CONTAINS(addr, size)		\
 	((addr >= PAGE_SIZE) &&			\
-	 ((addr + size) <= _placement_addr))
+	 ((addr + size) <= _mmu_phys_map_end))
 
 void *phys_map(phys_addr_t addr, size_t size, int mmflag)
 {
@@ -29,7 +28,7 @@ void *phys_map(phys_addr_t addr, size_t size, int mmflag)
 	 * information please refer to the memory layout of our system.
 	 */
 	if (PMAP_CONTAINS(addr, size)) {
-		ret = (void *)addr;
+		ret = (void *)(ptr_t)addr;
 		goto out;
 	}
 
@@ -43,7 +42,7 @@ void *phys_map(phys_addr_t addr, size_t size, int mmflag)
 		ret = (char *)ret + (addr - base);	// Don't miss the offset
 	}
 	
-	DEBUG(DL_DBG, ("addr(%x), size(%x), ret(%p).\n", addr, size, ret));
+	DEBUG(DL_DBG, ("addr(%llx), size(%x), ret(%p).\n", addr, size, ret));
 
  out:
 	return ret;
@@ -57,7 +56,7 @@ void phys_unmap(void *addr, size_t size, boolean_t shared)
 	/* If the memory range lies within the physical map area, we don't
 	 * need to do anything. Otherwise, unmap and free the kernel memory.
 	 */
-	if (((uint32_t)addr < PAGE_SIZE) || ((uint32_t)addr > _placement_addr)) {
+	if (((uint32_t)addr < PAGE_SIZE) || ((uint32_t)addr >= _mmu_phys_map_end)) {
 		base = ROUND_DOWN((ptr_t)addr, PAGE_SIZE);
 		end = ROUND_UP((ptr_t)addr + size, PAGE_SIZE);
 
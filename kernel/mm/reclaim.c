@@ -0,0 +1,185 @@
+/*
+ * reclaim.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "bitops.h"
+#include "debug.h"
+#include "semaphore.h"
+#include "hal/core.h"
+#include "hal/spinlock.h"
+#include "mm/page.h"
+#include "mm/reclaim.h"
+#include "proc/thread.h"
+
+/* Registered shrinkers */
+static struct list _shrinkers = {
+	.prev = &_shrinkers,
+	.next = &_shrinkers
+};
+static struct spinlock _shrinkers_lock;
+
+/* Reclaim thread and the threads waiting for it to finish a pass */
+static struct thread *_reclaim_thread = NULL;
+static struct semaphore _reclaim_sem;
+static struct semaphore _reclaim_done_sem;
+static struct spinlock _reclaim_lock;
+static size_t _nr_reclaim_waiters = 0;
+static u_long _reclaim_pending = 0;
+
+/**
+ * Register a shrinker, it may be called as soon as it is registered
+ */
+void shrinker_register(struct shrinker *s)
+{
+	ASSERT(s->shrink != NULL);
+
+	LIST_INIT(&s->link);
+	s->busy = 0;
+
+	spinlock_acquire(&_shrinkers_lock);
+	list_add_tail(&s->link, &_shrinkers);
+	spinlock_release(&_shrinkers_lock);
+}
+
+/**
+ * Unregister a shrinker, waits for the shrink calls in progress
+ */
+void shrinker_unregister(struct shrinker *s)
+{
+	spinlock_acquire(&_shrinkers_lock);
+	while (s->busy) {
+		spinlock_release(&_shrinkers_lock);
+		core_spin_hint();
+		spinlock_acquire(&_shrinkers_lock);
+	}
+	list_del(&s->link);
+	spinlock_release(&_shrinkers_lock);
+}
+
+/**
+ * Ask each shrinker to free at most count objects, the caller must be able
+ * to sleep. Returns the number of objects freed.
+ */
+size_t reclaim_shrink(size_t count)
+{
+	size_t freed = 0, n;
+	struct list *l;
+	struct shrinker *s;
+
+	spinlock_acquire(&_shrinkers_lock);
+	LIST_FOR_EACH(l, &_shrinkers) {
+		s = LIST_ENTRY(l, struct shrinker, link);
+
+		/* The shrinker can not go away while it is busy, so the list
+		 * can be walked on from it after the lock is taken again
+		 */
+		s->busy++;
+		spinlock_release(&_shrinkers_lock);
+
+		n = s->shrink(count);
+		DEBUG(DL_DBG, ("shrinker(%s) freed %d objects.\n", s->name, n));
+		freed += n;
+
+		spinlock_acquire(&_shrinkers_lock);
+		s->busy--;
+	}
+	spinlock_release(&_shrinkers_lock);
+
+	return freed;
+}
+
+/**
+ * Wake up the reclaim thread, called when free frames drop below the low
+ * watermark
+ */
+void reclaim_wakeup()
+{
+	if (!_reclaim_thread) {
+		return;
+	}
+
+	/* Only post once until the thread starts its next pass */
+	if (!bitops_test_and_set(&_reclaim_pending, 0)) {
+		semaphore_up(&_reclaim_sem, 1);
+	}
+}
+
+/**
+ * Wait for the reclaim thread to finish a pass after an allocation failed.
+ * The caller must not hold any lock. Returns FALSE if nobody can reclaim
+ * for the caller.
+ */
+boolean_t reclaim_wait()
+{
+	if (!_reclaim_thread || (CURR_THREAD == _reclaim_thread)) {
+		return FALSE;
+	}
+
+	spinlock_acquire(&_reclaim_lock);
+	_nr_reclaim_waiters++;
+	spinlock_release(&_reclaim_lock);
+
+	reclaim_wakeup();
+	semaphore_down(&_reclaim_done_sem);
+
+	return TRUE;
+}
+
+static void reclaim_thread(void *ctx)
+{
+	size_t n;
+	page_num_t nr_free;
+
+	while (TRUE) {
+		semaphore_down(&_reclaim_sem);
+
+		/* Shrink the caches until the high watermark is reached or
+		 * they have nothing more to give
+		 */
+		page_drain_all();
+		while ((nr_free = page_free_count()) < _page_wmark_high) {
+			if (!reclaim_shrink(_page_wmark_high - nr_free)) {
+				break;
+			}
+			page_drain_all();
+		}
+
+		DEBUG(DL_DBG, ("reclaim pass done, free frames(%d).\n",
+			       page_free_count()));
+
+		/* Wakeups after this point start another pass */
+		spinlock_acquire(&_reclaim_lock);
+		_reclaim_pending = 0;
+		n = _nr_reclaim_waiters;
+		_nr_reclaim_waiters = 0;
+		spinlock_release(&_reclaim_lock);
+
+		if (n) {
+			semaphore_up(&_reclaim_done_sem, n);
+		}
+	}
+}
+
+/* Initialize the shrinker list, caches register their shrinkers early */
+void preinit_reclaim()
+{
+	spinlock_init(&_shrinkers_lock, "shrinkers-lock");
+	spinlock_init(&_reclaim_lock, "reclaim-lock");
+	semaphore_init(&_reclaim_sem, "reclaim-sem", 0);
+	semaphore_init(&_reclaim_done_sem, "reclaim-done-sem", 0);
+}
+
+/* Start the reclaim thread */
+void init_reclaim()
+{
+	int rc;
+
+	rc = thread_create("reclaim", NULL, 0, reclaim_thread, NULL,
+			   &_reclaim_thread);
+	ASSERT(rc == 0);
+	thread_run(_reclaim_thread);
+}
@@ -4,24 +4,57 @@
 #include "matrix/matrix.h"
 #include "debug.h"
 #include "hal/hal.h"
+#include "hal/core.h"
 #include "mm/mm.h"
-#include "mm/kmem.h"
+#include "mm/mlayout.h"
+#include "mm/page.h"
+#include "mm/mmu.h"
 #include "mm/malloc.h"
 #include "mm/slab.h"
+#include "mm/reclaim.h"
 
 struct slab;
 
-/* Slab structure */
+/*
+ * Slab structure. It is placed at the start of the slab and followed by
+ * the objects, the free objects are linked through their first word.
+ */
 struct slab {
 	uint32_t magic;
 	struct list link;		// Link to appropriate slab list in cache
 	slab_cache_t *parent;		// Cache containing the slab
-	void *base;			// Base address of allocation
+	void *base;			// Address of the first object
+	void *free;			// List of free objects in this slab
+	size_t ref;			// Number of objects allocated
 };
 typedef struct slab slab_t;
 
 #define SLAB_MAGIC	0x42414C53	// 'BALS'
 
+/* Step of the cache coloring, size of a cache line */
+#define SLAB_COLOR_ALIGN	64
+
+/* Alignment of the objects */
+#define SLAB_OBJ_ALIGN		8
+
+/* A slab is made big enough to hold at least this number of objects */
+#define SLAB_MIN_OBJS		8
+
+/* Maximum size of a slab */
+#define SLAB_MAX_SIZE		(8 * PAGE_SIZE)
+
+/* Maximum number of free slabs kept by a cache */
+#define SLAB_FREE_MAX		1
+
+/* Number of pages in the physical map area, where the slabs live */
+#define SLAB_NR_PAGES		(KERNEL_PHYS_MAP_END / PAGE_SIZE)
+
+/* For each page in the physical map area, the index of the page in its
+ * slab plus 1, or 0 if the page does not belong to a slab. This lets us
+ * find the slab of an object.
+ */
+static uint8_t _slab_pages[SLAB_NR_PAGES];
+
 /* List of all slab caches */
 static struct list _slab_caches = {
 	.prev = &_slab_caches,
@@ -29,20 +62,93 @@ static struct list _slab_caches = {
 };
 static struct spinlock _slab_caches_lock;
 
-static slab_t *slab_create(slab_cache_t *cache, int mmflag)
+/* Drain requests of the shrinker. A magazine is flushed by its CORE once
+ * it sees a new request, the other COREs may not touch it.
+ */
+static volatile uint32_t _slab_drain_gen = 0;
+static uint32_t _slab_core_drain[SLAB_MAX_CORES];
+
+/* Size of the slab header, the first object follows it */
+static INLINE size_t slab_hdr_size(slab_cache_t *cache)
 {
+	return ROUND_UP(sizeof(slab_t),
+			FLAG_ON(cache->flags, SLAB_ALIGN_SIZE) ?
+			cache->obj_size : SLAB_OBJ_ALIGN);
+}
+
+static slab_t *slab_lookup(void *obj)
+{
+	size_t i;
 	slab_t *slab;
 
-	/* Allocate a new slab */
-	slab = (slab_t *)kmalloc(cache->obj_size + sizeof(slab_t), mmflag);
+	if ((ptr_t)obj >= _mmu_phys_map_end) {
+		return NULL;
+	}
+
+	i = (ptr_t)obj / PAGE_SIZE;
+	if (!_slab_pages[i]) {
+		return NULL;
+	}
+
+	slab = (slab_t *)(ROUND_DOWN((ptr_t)obj, PAGE_SIZE) -
+			  (_slab_pages[i] - 1) * PAGE_SIZE);
+	ASSERT(slab->magic == SLAB_MAGIC);
+
+	return slab;
+}
+
+static void slab_mark_pages(slab_t *slab, size_t size, boolean_t set)
+{
+	size_t i, first;
+
+	first = (ptr_t)slab / PAGE_SIZE;
+	for (i = 0; i < size / PAGE_SIZE; i++) {
+		_slab_pages[first + i] = set ? (i + 1) : 0;
+	}
+}
+
+static slab_t *slab_create(slab_cache_t *cache, int mmflag)
+{
+	size_t i;
+	slab_t *slab = NULL;
+	u_char *obj;
+	uint16_t color;
+	phys_addr_t phys;
+
+	/* Allocate a new slab from whole frames of the physical map area, so
+	 * it needs no heap header and is always mapped
+	 */
+	if (phys_alloc(cache->slab_size, 0, 0, _mmu_phys_map_end, 0, &phys) == 0) {
+		slab = (slab_t *)(ptr_t)phys;
+	}
 	if (slab) {
 		slab->magic = SLAB_MAGIC;
 		LIST_INIT(&slab->link);
 		slab->parent = cache;
-		slab->base = ((u_char *)slab) + sizeof(slab_t);
+		slab->ref = 0;
+
+		/* Give each slab a different offset to its objects so the
+		 * objects of different slabs use different cache lines
+		 */
 		spinlock_acquire(&cache->lock);
-		cache->nr_slabs++;
+		color = cache->color_next;
+		cache->color_next += SLAB_COLOR_ALIGN;
+		if (cache->color_next > cache->color_max) {
+			cache->color_next = 0;
+		}
 		spinlock_release(&cache->lock);
+
+		slab->base = ((u_char *)slab) + slab_hdr_size(cache) + color;
+
+		/* Link all the objects to the free list */
+		slab->free = NULL;
+		for (i = cache->obj_count; i > 0; i--) {
+			obj = (u_char *)slab->base + (i - 1) * cache->obj_size;
+			*((void **)obj) = slab->free;
+			slab->free = obj;
+		}
+
+		slab_mark_pages(slab, cache->slab_size, TRUE);
 	}
 
 	return slab;
@@ -51,101 +157,253 @@ static slab_t *slab_create(slab_cache_t *cache, int mmflag)
 static void slab_destroy(slab_cache_t *cache, slab_t *slab)
 {
 	ASSERT(slab->magic == SLAB_MAGIC);
+	ASSERT(slab->ref == 0);
+
 	/* Free an allocated slab */
-	list_del(&slab->link);
+	slab_mark_pages(slab, cache->slab_size, FALSE);
+	slab->magic = 0;
+	phys_free((phys_addr_t)(ptr_t)slab, cache->slab_size);
+}
+
+/* Take at most count objects from the slabs, cache lock must be held */
+static size_t slab_take(slab_cache_t *cache, void **objs, size_t count)
+{
+	size_t n = 0;
+	slab_t *slab;
+
+	while (n < count) {
+		if (!LIST_EMPTY(&cache->slab_partial)) {
+			slab = LIST_ENTRY(cache->slab_partial.next, slab_t, link);
+		} else if (!LIST_EMPTY(&cache->slab_free)) {
+			slab = LIST_ENTRY(cache->slab_free.next, slab_t, link);
+			cache->nr_free--;
+		} else {
+			break;
+		}
+
+		while (slab->free && (n < count)) {
+			objs[n++] = slab->free;
+			slab->free = *((void **)slab->free);
+			slab->ref++;
+		}
+
+		if (slab->free) {
+			list_move(&slab->link, &cache->slab_partial);
+		} else {
+			list_move(&slab->link, &cache->slab_full);
+		}
+	}
+
+	return n;
+}
+
+/* Put an object back to its slab, cache lock must be held */
+static void slab_put(slab_cache_t *cache, void *obj)
+{
+	slab_t *slab;
+
+	slab = slab_lookup(obj);
+	ASSERT(slab != NULL);
+	ASSERT(slab->parent == cache);
+	ASSERT(slab->ref != 0);
+
+	*((void **)obj) = slab->free;
+	slab->free = obj;
+	slab->ref--;
+
+	if (slab->ref == 0) {
+		if (cache->nr_free < SLAB_FREE_MAX) {
+			list_move(&slab->link, &cache->slab_free);
+			cache->nr_free++;
+		} else {
+			list_del(&slab->link);
+			cache->nr_slabs--;
+			slab_destroy(cache, slab);
+		}
+	} else if (slab->ref == (cache->obj_count - 1)) {
+		/* The slab was full */
+		list_move(&slab->link, &cache->slab_partial);
+	}
+}
+
+/* Get at most count objects, create a new slab if the cache is empty */
+static size_t slab_get(slab_cache_t *cache, void **objs, size_t count)
+{
+	size_t n;
+	slab_t *slab;
+
 	spinlock_acquire(&cache->lock);
-	cache->nr_slabs--;
+	n = slab_take(cache, objs, count);
 	spinlock_release(&cache->lock);
-	kfree(slab);
+
+	if (n == 0) {
+		slab = slab_create(cache, 0);
+		if (slab) {
+			spinlock_acquire(&cache->lock);
+			list_add(&slab->link, &cache->slab_free);
+			cache->nr_free++;
+			cache->nr_slabs++;
+			n = slab_take(cache, objs, count);
+			spinlock_release(&cache->lock);
+			DEBUG(DL_INF, ("allocated slab %p for cache %s.\n",
+				       slab, cache->name));
+		}
+	}
+
+	return n;
+}
+
+/* Get the magazine of the current CORE, interrupts must be disabled */
+static INLINE struct slab_magazine *slab_magazine(slab_cache_t *cache)
+{
+	core_id_t id;
+
+	id = CURR_CORE->id;
+	return (id < SLAB_MAX_CORES) ? &cache->magazines[id] : NULL;
+}
+
+/* Put all the objects of a magazine back, the cache must be locked */
+static void slab_magazine_flush(slab_cache_t *cache, struct slab_magazine *mag)
+{
+	while (mag->rounds) {
+		slab_put(cache, mag->objs[--mag->rounds]);
+	}
+	mag->drain = _slab_drain_gen;
 }
 
 void *slab_cache_alloc(slab_cache_t *cache)
 {
-	slab_t *slab;
-	struct list *l;
+	boolean_t state;
+	struct slab_magazine *mag;
 	void *obj = NULL;
 
 	ASSERT(cache != NULL);
 
-	spinlock_acquire(&cache->lock);
-	if (!LIST_EMPTY(&cache->slab_head)) {
-		/* Pop the last entry from the slab list */
-		l = cache->slab_head.prev;
-		list_del(l);
-		cache->color_next--;
-		spinlock_release(&cache->lock);
-		slab = LIST_ENTRY(l, slab_t, link);
-		ASSERT(slab->magic == SLAB_MAGIC);
-		obj = slab->base;
-	} else {
-		spinlock_release(&cache->lock);
-	}
+	/* Nothing else runs on this CORE while the interrupts are disabled,
+	 * so the magazine of this CORE needs no lock.
+	 */
+	state = local_irq_disable();
 
-	if (obj == NULL) {
-		slab = slab_create(cache, 0);
-		if (slab) {
-			obj = slab->base;
-			DEBUG(DL_INF, ("allocated %p from cache %s.\n",
-				       obj, cache->name));
+	mag = slab_magazine(cache);
+	if (mag) {
+		if (!mag->rounds) {
+			/* Refill half of the magazine from the slabs */
+			mag->rounds = slab_get(cache, mag->objs, SLAB_MAGAZINE_SIZE / 2);
 		}
+		if (mag->rounds) {
+			obj = mag->objs[--mag->rounds];
+		}
+	} else {
+		slab_get(cache, &obj, 1);
 	}
 
+	local_irq_restore(state);
+
 	if (obj && cache->ctor) {
 		cache->ctor(obj);
 	}
-	
+
 	return obj;
 }
 
 void slab_cache_free(slab_cache_t *cache, void *obj)
 {
-	slab_t *slab;
-	
+	boolean_t state;
+	struct slab_magazine *mag;
+
 	ASSERT(cache != NULL && obj != NULL);
 
 	if (cache->dtor) {
 		cache->dtor(obj);
 	}
 
-	slab = (slab_t *)(((u_char *)obj) - sizeof(slab_t));
-	ASSERT(slab->magic == SLAB_MAGIC);
+	state = local_irq_disable();
 
-	spinlock_acquire(&cache->lock);
-	
-	if (cache->color_next < cache->color_max) {
-		ASSERT(LIST_EMPTY(&slab->link));
-		list_add_tail(&slab->link, &cache->slab_head);
-		cache->color_next++;
-		spinlock_release(&cache->lock);
+	mag = slab_magazine(cache);
+	if (mag) {
+		if (mag->drain != _slab_drain_gen) {
+			/* The shrinker wants the cached objects back */
+			spinlock_acquire(&cache->lock);
+			slab_magazine_flush(cache, mag);
+			spinlock_release(&cache->lock);
+		} else if (mag->rounds == SLAB_MAGAZINE_SIZE) {
+			/* Flush half of the magazine back to the slabs */
+			spinlock_acquire(&cache->lock);
+			while (mag->rounds > (SLAB_MAGAZINE_SIZE / 2)) {
+				slab_put(cache, mag->objs[--mag->rounds]);
+			}
+			spinlock_release(&cache->lock);
+		}
+		mag->objs[mag->rounds++] = obj;
 	} else {
+		spinlock_acquire(&cache->lock);
+		slab_put(cache, obj);
 		spinlock_release(&cache->lock);
-		
-		slab_destroy(cache, slab);
-		DEBUG(DL_INF, ("freed %p to cache %s.\n",
-			       obj, cache->name));
 	}
+
+	local_irq_restore(state);
+}
+
+/* Get the cache of an object, NULL if the object is not from a slab */
+slab_cache_t *slab_object_cache(void *obj)
+{
+	slab_t *slab;
+
+	slab = slab_lookup(obj);
+	return slab ? slab->parent : NULL;
 }
 
 void slab_cache_init(slab_cache_t *cache, const char *name, size_t size,
 		     slab_ctor_t ctor, slab_dtor_t dtor, int flags)
 {
+	size_t hdr_size, i;
+
 	ASSERT(size);
 
-	LIST_INIT(&cache->slab_head);
+	LIST_INIT(&cache->slab_partial);
+	LIST_INIT(&cache->slab_full);
+	LIST_INIT(&cache->slab_free);
 	LIST_INIT(&cache->link);
+	memset(cache->magazines, 0, sizeof(cache->magazines));
+	for (i = 0; i < SLAB_MAX_CORES; i++) {
+		cache->magazines[i].drain = _slab_drain_gen;
+	}
 
-	cache->obj_size = size;
+	/* Each free object holds the link to the next free object */
+	cache->obj_size = ROUND_UP(MAX(size, sizeof(void *)), SLAB_OBJ_ALIGN);
 	cache->nr_slabs = 0;
-	
+	cache->nr_free = 0;
+	cache->flags = flags;
+
+	/* Objects aligned to their size keep the alignment across the cache
+	 * colors, so their size is a power of 2 up to the color step
+	 */
+	if (FLAG_ON(flags, SLAB_ALIGN_SIZE)) {
+		ASSERT(((cache->obj_size & (cache->obj_size - 1)) == 0) &&
+		       (cache->obj_size <= SLAB_COLOR_ALIGN));
+	}
+
+	/* Make the slab big enough for a reasonable number of objects */
+	hdr_size = slab_hdr_size(cache);
+	cache->slab_size = PAGE_SIZE;
+	while ((((cache->slab_size - hdr_size) / cache->obj_size) < SLAB_MIN_OBJS) &&
+	       (cache->slab_size < SLAB_MAX_SIZE)) {
+		cache->slab_size <<= 1;
+	}
+	ASSERT((cache->slab_size - hdr_size) >= cache->obj_size);
+	cache->obj_count = (cache->slab_size - hdr_size) / cache->obj_size;
+
 	strncpy(cache->name, name, SLAB_NAME_MAX);
 	cache->name[SLAB_NAME_MAX - 1] = 0;
 
-	cache->flags = flags;
 	cache->ctor = ctor;
 	cache->dtor = dtor;
 
+	/* The space left in a slab is used for cache coloring */
 	cache->color_next = 0;
-	cache->color_max = 256;
+	cache->color_max = ROUND_DOWN(cache->slab_size - hdr_size -
+				      cache->obj_count * cache->obj_size,
+				      SLAB_COLOR_ALIGN);
 
 	spinlock_init(&cache->lock, "slabs-lock");
 
@@ -153,42 +411,136 @@ void slab_cache_init(slab_cache_t *cache, const char *name, size_t size,
 	list_add(&cache->link, &_slab_caches);
 	spinlock_release(&_slab_caches_lock);
 
-	DEBUG(DL_DBG, ("cache created %s\n", cache->name));
+	DEBUG(DL_DBG, ("cache created %s, obj_size(%d) slab_size(%x) obj_count(%d).\n",
+		       cache->name, cache->obj_size, cache->slab_size, cache->obj_count));
 }
 
 void slab_cache_delete(slab_cache_t *cache)
 {
+	size_t i;
 	slab_t *slab;
 	struct list *l;
-	
+	struct slab_magazine *mag;
+
 	ASSERT(cache);
-	
-	while (TRUE) {
-		spinlock_acquire(&cache->lock);
 
-		if (LIST_EMPTY(&cache->slab_head)) {
-			ASSERT(cache->color_next == 0);
-			spinlock_release(&cache->lock);
-			break;
+	spinlock_acquire(&cache->lock);
+
+	/* Flush the magazines of all COREs */
+	for (i = 0; i < SLAB_MAX_CORES; i++) {
+		mag = &cache->magazines[i];
+		while (mag->rounds) {
+			slab_put(cache, mag->objs[--mag->rounds]);
 		}
-		
-		l = cache->slab_head.next;
+	}
+
+	/* All objects should have been freed */
+	ASSERT(LIST_EMPTY(&cache->slab_partial) && LIST_EMPTY(&cache->slab_full));
+
+	while (!LIST_EMPTY(&cache->slab_free)) {
+		l = cache->slab_free.next;
 		list_del(l);
-		cache->color_next--;
-		spinlock_release(&cache->lock);
-		
+		cache->nr_free--;
+		cache->nr_slabs--;
+
 		slab = LIST_ENTRY(l, slab_t, link);
 		ASSERT(slab->parent == cache);
 		slab_destroy(cache, slab);
 	}
 
+	spinlock_release(&cache->lock);
+
 	spinlock_acquire(&_slab_caches_lock);
 	list_del(&cache->link);
 	spinlock_release(&_slab_caches_lock);
 }
 
+/*
+ * Flush the magazines of this CORE if the shrinker asked for it since the
+ * last time, called when the CORE is idle
+ */
+void slab_drain_percore()
+{
+	core_id_t id;
+	uint32_t gen;
+	struct list *l;
+	slab_cache_t *cache;
+	struct slab_magazine *mag;
+
+	id = CURR_CORE->id;
+	gen = _slab_drain_gen;
+	if ((id >= SLAB_MAX_CORES) || (_slab_core_drain[id] == gen)) {
+		return;
+	}
+
+	spinlock_acquire(&_slab_caches_lock);
+	LIST_FOR_EACH(l, &_slab_caches) {
+		cache = LIST_ENTRY(l, slab_cache_t, link);
+		mag = &cache->magazines[id];
+		if (mag->drain != gen) {
+			spinlock_acquire(&cache->lock);
+			slab_magazine_flush(cache, mag);
+			spinlock_release(&cache->lock);
+		}
+	}
+	spinlock_release(&_slab_caches_lock);
+
+	_slab_core_drain[id] = gen;
+}
+
+/*
+ * Shrinker of the slab caches. The objects in the magazines of this CORE
+ * go back to their slabs, and free slabs are destroyed until enough were
+ * freed. The other COREs flush their magazines when they are idle or free
+ * an object to the cache, the slabs freed by them go on a later pass.
+ */
+static size_t slab_shrink(size_t count)
+{
+	size_t freed = 0;
+	slab_t *slab;
+	struct list *l;
+	slab_cache_t *cache;
+	struct slab_magazine *mag;
+
+	_slab_drain_gen++;
+
+	spinlock_acquire(&_slab_caches_lock);
+	LIST_FOR_EACH(l, &_slab_caches) {
+		cache = LIST_ENTRY(l, slab_cache_t, link);
+
+		spinlock_acquire(&cache->lock);
+
+		mag = slab_magazine(cache);
+		if (mag) {
+			slab_magazine_flush(cache, mag);
+		}
+
+		while (!LIST_EMPTY(&cache->slab_free) && (freed < count)) {
+			slab = LIST_ENTRY(cache->slab_free.next, slab_t, link);
+			list_del(&slab->link);
+			cache->nr_free--;
+			cache->nr_slabs--;
+			slab_destroy(cache, slab);
+			freed++;
+		}
+
+		spinlock_release(&cache->lock);
+	}
+	spinlock_release(&_slab_caches_lock);
+
+	return freed;
+}
+
+static struct shrinker _slab_shrinker = {
+	.name = "slab",
+	.shrink = slab_shrink
+};
+
 /* Initialize the slab allocator */
 void init_slab()
 {
 	spinlock_init(&_slab_caches_lock, "cache-lock");
+
+	/* Free slabs are given back when memory runs low */
+	shrinker_register(&_slab_shrinker);
 }
@@ -0,0 +1,595 @@
+/*
+ * swap.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "atomic.h"
+#include "bitops.h"
+#include "debug.h"
+#include "device.h"
+#include "hal/core.h"
+#include "hal/spinlock.h"
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/mmu.h"
+#include "mm/va.h"
+#include "mm/vmalloc.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
+
+/* Bits of a page table entry set by the CORE */
+#define PTE_ACCESSED	5
+#define PTE_DIRTY	6
+
+/*
+ * Swap area on a block device, each slot holds a page. The map counts the
+ * swap entries referring to each slot, slot 0 is never used.
+ */
+struct swap_area {
+	struct spinlock lock;	// Lock for the slot map
+	struct dev *dev;	// Device the pages are written to
+	uint32_t nr_slots;	// Number of slots on the device
+	uint32_t nr_free;	// Number of free slots
+	uint32_t next;		// Slot the next search starts at
+	uint16_t *map;		// Number of swap entries of each slot
+};
+
+static struct swap_area _swap;
+
+/* LRU lists of the anonymous frames mapped by a single page. Frames start
+ * on the active list, the cold ones are moved to the inactive list and are
+ * written out from its tail.
+ */
+static struct list _lru_active = {
+	.prev = &_lru_active,
+	.next = &_lru_active
+};
+static struct list _lru_inactive = {
+	.prev = &_lru_inactive,
+	.next = &_lru_inactive
+};
+static page_num_t _nr_lru_active = 0;
+static page_num_t _nr_lru_inactive = 0;
+static struct spinlock _lru_lock;
+
+/* Take a frame off its LRU list, LRU lock must be held */
+static void swap_lru_del(struct frame *f)
+{
+	list_del(&f->link);
+	if (FLAG_ON(f->flags, FRAME_ACTIVE)) {
+		_nr_lru_active--;
+	} else {
+		_nr_lru_inactive--;
+	}
+	f->flags &= ~(FRAME_LRU | FRAME_ACTIVE);
+}
+
+/* Put a frame at the head of the active list, LRU lock must be held */
+static void swap_lru_activate(struct frame *f)
+{
+	f->flags |= FRAME_LRU | FRAME_ACTIVE;
+	list_add(&f->link, &_lru_active);
+	_nr_lru_active++;
+}
+
+/**
+ * Add a private frame of an address space to the LRU lists, so it can be
+ * swapped out. Frames which are shared or already on a list are skipped.
+ */
+void swap_lru_add(page_num_t pfn, struct va_space *vas, ptr_t virt)
+{
+	struct frame *f;
+
+	if (page_refcount(pfn) != 1) {
+		return;
+	}
+
+	f = page_frame(pfn);
+
+	spinlock_acquire(&_lru_lock);
+	if (!FLAG_ON(f->flags, FRAME_LRU | FRAME_ISOLATED) && (f->ref == 1)) {
+		f->vas = vas;
+		f->virt = virt;
+		swap_lru_activate(f);
+	}
+	spinlock_release(&_lru_lock);
+}
+
+/* Drop a reference to a frame known to the swapper, returns TRUE if it was
+ * the last one
+ */
+boolean_t swap_lru_put(struct frame *f)
+{
+	boolean_t last;
+
+	spinlock_acquire(&_lru_lock);
+	if (FLAG_ON(f->flags, FRAME_LRU)) {
+		swap_lru_del(f);
+	}
+	last = (atomic_dec(&f->ref) == 1);
+	spinlock_release(&_lru_lock);
+
+	return last;
+}
+
+/* Take another reference to a frame known to the swapper, a shared frame
+ * leaves the LRU lists
+ */
+void swap_lru_ref(struct frame *f)
+{
+	spinlock_acquire(&_lru_lock);
+	if (FLAG_ON(f->flags, FRAME_LRU)) {
+		swap_lru_del(f);
+	}
+	atomic_inc(&f->ref);
+	spinlock_release(&_lru_lock);
+}
+
+/* Get the page table entry mapping an LRU frame, the address space can not
+ * go away while the frame is on a list. LRU lock must be held.
+ */
+static struct page *swap_lru_pte(struct frame *f)
+{
+	struct page *p;
+
+	p = mmu_get_page(f->vas->mmu, f->virt, FALSE, 0);
+	if (!p || !p->present || (mmu_pte_frame(p) != (f - page_frame(0)))) {
+		return NULL;
+	}
+
+	return p;
+}
+
+/*
+ * Move the cold frames at the tail of the active list to the inactive list
+ * until both have about the same length, referenced frames go around the
+ * active list again. LRU lock must be held.
+ */
+static void swap_lru_age(size_t count)
+{
+	struct frame *f;
+	struct page *p;
+
+	while (count-- && (_nr_lru_inactive < _nr_lru_active)) {
+		f = LIST_ENTRY(_lru_active.prev, struct frame, link);
+		list_del(&f->link);
+
+		p = swap_lru_pte(f);
+		if (p && bitops_test_and_clear((volatile u_long *)p, PTE_ACCESSED)) {
+			list_add(&f->link, &_lru_active);
+			continue;
+		}
+
+		f->flags &= ~FRAME_ACTIVE;
+		list_add(&f->link, &_lru_inactive);
+		_nr_lru_active--;
+		_nr_lru_inactive++;
+	}
+}
+
+/*
+ * Take a frame off the LRU lists to write it out. The swapper holds a
+ * reference until it is done, and the dirty bit is cleared so a write
+ * during the transfer is noticed. LRU lock must be held.
+ */
+static void swap_lru_isolate(struct frame *f, struct page *p)
+{
+	swap_lru_del(f);
+	f->flags |= FRAME_ISOLATED;
+	atomic_inc(&f->ref);
+
+	bitops_test_and_clear((volatile u_long *)p, PTE_DIRTY);
+	mmu_flush_range(f->vas->mmu, f->virt, PAGE_SIZE);
+}
+
+/*
+ * Pick the coldest frame of the inactive list and isolate it, referenced
+ * frames are moved back to the active list. LRU lock must be held.
+ * Returns 0 if there is no frame to write out.
+ */
+static page_num_t swap_lru_victim()
+{
+	page_num_t nr_scan;
+	struct frame *f;
+	struct page *p;
+
+	for (nr_scan = _nr_lru_inactive; nr_scan; nr_scan--) {
+		f = LIST_ENTRY(_lru_inactive.prev, struct frame, link);
+		p = swap_lru_pte(f);
+		if (!p) {
+			/* Pages made inaccessible keep their frame for now */
+			list_del(&f->link);
+			list_add(&f->link, &_lru_inactive);
+		} else if (bitops_test_and_clear((volatile u_long *)p,
+						PTE_ACCESSED)) {
+			/* Referenced since it was deactivated */
+			swap_lru_del(f);
+			swap_lru_activate(f);
+		} else {
+			swap_lru_isolate(f, p);
+			return mmu_pte_frame(p);
+		}
+	}
+
+	return 0;
+}
+
+/* Allocate a free slot of the swap area, returns 0 if it is full */
+static uint32_t swap_slot_alloc()
+{
+	uint32_t i, slot = 0;
+
+	spinlock_acquire(&_swap.lock);
+	if (_swap.dev && _swap.nr_free) {
+		for (i = 0; i < _swap.nr_slots; i++) {
+			if (!_swap.map[_swap.next]) {
+				slot = _swap.next;
+				_swap.map[slot] = 1;
+				_swap.nr_free--;
+				break;
+			}
+			_swap.next = (_swap.next + 1) % _swap.nr_slots;
+		}
+	}
+	spinlock_release(&_swap.lock);
+
+	return slot;
+}
+
+/**
+ * Take another reference to a slot, for a swap entry copied to another
+ * address space
+ */
+void swap_dup(uint32_t slot)
+{
+	spinlock_acquire(&_swap.lock);
+	ASSERT((slot > 0) && (slot < _swap.nr_slots));
+	ASSERT(_swap.map[slot] && (_swap.map[slot] < SWAP_MAP_MAX));
+	_swap.map[slot]++;
+	spinlock_release(&_swap.lock);
+}
+
+/**
+ * Drop a reference to a slot, the slot is free when no swap entry refers
+ * to it anymore
+ */
+void swap_free(uint32_t slot)
+{
+	spinlock_acquire(&_swap.lock);
+	ASSERT((slot > 0) && (slot < _swap.nr_slots));
+	ASSERT(_swap.map[slot]);
+	if (--_swap.map[slot] == 0) {
+		_swap.nr_free++;
+	}
+	spinlock_release(&_swap.lock);
+}
+
+/* Transfer a frame from or to its slot on the swap device */
+static int swap_io(uint32_t slot, page_num_t pfn, boolean_t write)
+{
+	int rc;
+	uint8_t *buf;
+	phys_addr_t phys;
+
+	phys = (phys_addr_t)pfn * PAGE_SIZE;
+
+	/* Frames above the physical map area are mapped for the transfer */
+	if ((phys + PAGE_SIZE) <= _mmu_phys_map_end) {
+		buf = (uint8_t *)(ptr_t)phys;
+	} else {
+		buf = vm_map(phys, PAGE_SIZE, MMU_MAP_WRITE);
+		if (!buf) {
+			return ENOMEM;
+		}
+	}
+
+	if (write) {
+		rc = dev_write(_swap.dev, slot * PAGE_SIZE, PAGE_SIZE, buf);
+	} else {
+		rc = dev_read(_swap.dev, slot * PAGE_SIZE, PAGE_SIZE, buf);
+	}
+	if (rc != 0) {
+		DEBUG(DL_WRN, ("%s slot(%x) failed, err(%x).\n",
+			       write ? "write" : "read", slot, rc));
+		rc = EIO;
+	}
+
+	if ((ptr_t)buf != phys) {
+		vfree(buf);
+	}
+
+	return rc;
+}
+
+/*
+ * Write an isolated frame out and replace its mapping by a swap entry. The
+ * page stays mapped during the transfer, it is kept if it was written to
+ * meanwhile. Returns 0 if the frame was freed.
+ */
+static int swap_writepage(page_num_t pfn)
+{
+	int rc;
+	uint32_t slot;
+	boolean_t locked = FALSE, freed = FALSE;
+	struct frame *f;
+	struct va_space *vas;
+	struct page *p, pg;
+	union pte old, entry;
+
+	f = page_frame(pfn);
+	vas = f->vas;
+
+	slot = swap_slot_alloc();
+	if (!slot) {
+		rc = ENOSPC;
+	} else {
+		rc = swap_io(slot, pfn, TRUE);
+	}
+
+	/* If the owner unmapped the page meanwhile only our reference is
+	 * left, otherwise its address space is still there. The address space
+	 * lock is taken after the LRU lock here, so it can only be tried.
+	 */
+	while (TRUE) {
+		spinlock_acquire(&_lru_lock);
+		if (f->ref == 1) {
+			freed = TRUE;
+			break;
+		}
+		if (rc != 0) {
+			break;
+		}
+		if (spinlock_try_acquire(&vas->lock)) {
+			locked = TRUE;
+			break;
+		}
+		spinlock_release(&_lru_lock);
+		core_spin_hint();
+	}
+
+	if (locked) {
+		p = mmu_get_page(vas->mmu, f->virt, FALSE, 0);
+		if ((f->ref == 2) && p && p->present && (mmu_pte_frame(p) == pfn) &&
+		    !p->dirty) {
+			memset(&entry, 0, sizeof(entry));
+			entry.page.swap = 1;
+			mmu_pte_set_frame(&entry.page, slot);
+			do {
+				old.value = mmu_pte_read(p);
+			} while (!mmu_pte_tas(p, old.value, entry.value));
+			mmu_flush_range(vas->mmu, f->virt, PAGE_SIZE);
+
+			/* A write which got in before the flush wins */
+			if (old.page.dirty) {
+				mmu_pte_tas(p, entry.value, old.value);
+				rc = EAGAIN;
+			} else {
+				atomic_dec(&f->ref);
+				slot = 0;
+				freed = TRUE;
+			}
+		} else {
+			rc = EAGAIN;
+		}
+		spinlock_release(&vas->lock);
+	}
+
+	/* A page still mapped by its owner only goes back to the LRU */
+	f->flags &= ~FRAME_ISOLATED;
+	if ((rc != 0) && (f->ref == 2)) {
+		swap_lru_activate(f);
+	}
+	spinlock_release(&_lru_lock);
+
+	if (slot) {
+		swap_free(slot);
+	}
+
+	/* Drop our reference, the frame is freed if the page went out */
+	memset(&pg, 0, sizeof(pg));
+	pg.present = 1;
+	mmu_pte_set_frame(&pg, pfn);
+	page_free(&pg);
+
+	return freed ? 0 : rc;
+}
+
+/**
+ * Write out the page mapped at an address of an address space, if it is a
+ * private page on the LRU lists
+ */
+int swap_out_page(struct va_space *vas, ptr_t virt)
+{
+	struct page *p;
+	struct frame *f = NULL;
+	page_num_t pfn = 0;
+
+	spinlock_acquire(&_lru_lock);
+	p = mmu_get_page(vas->mmu, virt, FALSE, 0);
+	if (p && p->present && page_refcount(mmu_pte_frame(p))) {
+		pfn = mmu_pte_frame(p);
+		f = page_frame(pfn);
+		if (FLAG_ON(f->flags, FRAME_LRU) && (f->vas == vas) &&
+		    (f->virt == virt)) {
+			swap_lru_isolate(f, p);
+		} else {
+			f = NULL;
+		}
+	}
+	spinlock_release(&_lru_lock);
+
+	if (!f) {
+		return EINVAL;
+	}
+
+	return swap_writepage(pfn);
+}
+
+/**
+ * Read a swapped out page into a new frame, the slot is not released
+ * @slot	- slot of the page
+ * @pfnp	- where to store the frame
+ */
+int swap_in(uint32_t slot, page_num_t *pfnp)
+{
+	int rc;
+	struct page pg;
+
+	memset(&pg, 0, sizeof(pg));
+	rc = page_alloc(&pg, 0);
+	if (rc != 0) {
+		goto out;
+	}
+
+	rc = swap_io(slot, mmu_pte_frame(&pg), FALSE);
+	if (rc != 0) {
+		page_free(&pg);
+		goto out;
+	}
+
+	*pfnp = mmu_pte_frame(&pg);
+
+ out:
+	return rc;
+}
+
+/*
+ * Shrinker of the anonymous memory, the cold pages are written out to the
+ * swap area. It is called from the reclaim thread.
+ */
+static size_t swap_shrink(size_t count)
+{
+	size_t freed = 0;
+	page_num_t pfn, nr_scan;
+
+	if (!_swap.dev) {
+		return 0;
+	}
+
+	nr_scan = _nr_lru_active + _nr_lru_inactive;
+	while ((freed < count) && nr_scan-- && _swap.nr_free) {
+		spinlock_acquire(&_lru_lock);
+		swap_lru_age(SWAP_AGE_BATCH);
+		pfn = swap_lru_victim();
+		spinlock_release(&_lru_lock);
+
+		if (!pfn) {
+			break;
+		}
+		if (swap_writepage(pfn) == 0) {
+			freed++;
+		}
+	}
+
+	DEBUG(DL_DBG, ("active(%d) inactive(%d) free slots(%d).\n",
+		       _nr_lru_active, _nr_lru_inactive, _swap.nr_free));
+
+	return freed;
+}
+
+static struct shrinker _swap_shrinker = {
+	.name = "swap",
+	.shrink = swap_shrink
+};
+
+/**
+ * Use a block device as the swap area
+ * @dev		- device registered by its driver
+ * @size	- size of the area on the device
+ */
+int swap_on(dev_t dev, size_t size)
+{
+	int rc;
+	uint32_t nr_slots;
+	uint16_t *map;
+	struct dev *d = NULL;
+
+	nr_slots = MIN(size / PAGE_SIZE, SWAP_MAX_SLOTS);
+	if (nr_slots < 2) {
+		rc = EINVAL;
+		goto out;
+	}
+
+	rc = dev_create(dev, 0, NULL, &d);
+	if (rc != 0) {
+		DEBUG(DL_WRN, ("open swap dev(%x) failed, err(%x).\n", dev, rc));
+		goto out;
+	}
+
+	map = vmalloc(nr_slots * sizeof(uint16_t), MM_ZERO);
+	if (!map) {
+		dev_close(d);
+		rc = ENOMEM;
+		goto out;
+	}
+	map[0] = SWAP_MAP_MAX;	// Slot 0 is never used
+
+	spinlock_acquire(&_swap.lock);
+	if (_swap.dev) {
+		spinlock_release(&_swap.lock);
+		vfree(map);
+		dev_close(d);
+		rc = EBUSY;
+		goto out;
+	}
+	_swap.map = map;
+	_swap.nr_slots = nr_slots;
+	_swap.nr_free = nr_slots - 1;
+	_swap.next = 1;
+	_swap.dev = d;
+	spinlock_release(&_swap.lock);
+
+	kprintf("swap: dev(%x) with %d slots on.\n", dev, nr_slots);
+
+ out:
+	return rc;
+}
+
+/**
+ * Stop using the swap area, fails if pages are still swapped out to it
+ */
+int swap_off()
+{
+	int rc;
+	uint16_t *map = NULL;
+	struct dev *d = NULL;
+
+	spinlock_acquire(&_swap.lock);
+	if (!_swap.dev) {
+		rc = EINVAL;
+	} else if (_swap.nr_free != (_swap.nr_slots - 1)) {
+		rc = EBUSY;
+	} else {
+		map = _swap.map;
+		d = _swap.dev;
+		_swap.dev = NULL;
+		_swap.map = NULL;
+		_swap.nr_slots = 0;
+		_swap.nr_free = 0;
+		rc = 0;
+	}
+	spinlock_release(&_swap.lock);
+
+	if (map) {
+		vfree(map);
+	}
+	if (d) {
+		dev_close(d);
+	}
+
+	return rc;
+}
+
+void init_swap()
+{
+	spinlock_init(&_lru_lock, "lru-lock");
+	spinlock_init(&_swap.lock, "swap-lock");
+	_swap.dev = NULL;
+
+	shrinker_register(&_swap_shrinker);
+}
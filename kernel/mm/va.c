@@ -1,100 +1,1145 @@
 #include <types.h>
 #include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "bitops.h"
 #include "debug.h"
 #include "hal/core.h"
 #include "mm/page.h"
 #include "mm/kmem.h"
 #include "mm/malloc.h"
+#include "mm/mmu.h"
+#include "mm/vmalloc.h"
+#include "mm/mlayout.h"
 #include "mm/va.h"
+#include "mm/swap.h"
+#include "mm/ksm.h"
+#include "proc/thread.h"
+#include "fs.h"
+
+/* Frame of the page shared by all the zero-fill regions */
+page_num_t _zero_frame = 0;
+
+/* Number of spare regions an operation may need, to split the regions at
+ * both ends of a range and to hold the file of a region being unmapped
+ */
+#define VA_SPARE_REGIONS	3
+
+/* Pages of a region which is not executable, such as stacks and data, are
+ * marked no execute if the CORE supports it
+ */
+static INLINE uint32_t va_page_nx(struct va_region *r)
+{
+	return (_mmu_nx && !FLAG_ON(r->flags, VA_MAP_EXEC)) ? 1 : 0;
+}
+
+static INLINE int va_freelist_index(size_t size)
+{
+	return bitops_fls(size / PAGE_SIZE);
+}
+
+static void va_free_insert(struct va_space *vas, struct va_region *r)
+{
+	ASSERT(r->type == VA_REGION_FREE);
+	list_add_tail(&r->free_link,
+		      &vas->free[va_freelist_index(r->end - r->start)]);
+}
+
+static void va_free_remove(struct va_region *r)
+{
+	ASSERT(r->type == VA_REGION_FREE);
+	list_del(&r->free_link);
+}
+
+/* Link a region to the region list after the specified entry and to the tree */
+static void va_region_link(struct va_space *vas, struct va_region *r,
+			   struct list *after)
+{
+	list_add(&r->link, after);
+	avl_tree_insert_node(&vas->tree, &r->tree_link, r->start, r);
+}
+
+static void va_region_unlink(struct va_space *vas, struct va_region *r)
+{
+	list_del(&r->link);
+	avl_tree_remove_node(&vas->tree, &r->tree_link);
+}
+
+static struct va_region *va_region_next(struct va_space *vas, struct va_region *r)
+{
+	if (r->link.next == &vas->regions) {
+		return NULL;
+	}
+	return LIST_ENTRY(r->link.next, struct va_region, link);
+}
+
+static struct va_region *va_region_prev(struct va_space *vas, struct va_region *r)
+{
+	if (r->link.prev == &vas->regions) {
+		return NULL;
+	}
+	return LIST_ENTRY(r->link.prev, struct va_region, link);
+}
+
+static void va_region_free(struct va_region *r)
+{
+	if (r->node) {
+		vfs_node_deref(r->node);
+	}
+	if (r->cache) {
+		va_cache_put(r->cache);
+	}
+	kfree(r);
+}
+
+/* Free the regions unmapped while the lock was held, lock must not be held */
+static void va_region_free_list(struct list *dead)
+{
+	struct list *l, *n;
+
+	LIST_FOR_EACH_SAFE(l, n, dead) {
+		list_del(l);
+		va_region_free(LIST_ENTRY(l, struct va_region, link));
+	}
+}
+
+/* Create a cache for the frames of a page aligned range of a file */
+struct va_cache *va_cache_create(uint32_t offset, size_t size)
+{
+	struct va_cache *cache;
+
+	ASSERT(((offset % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0));
+
+	cache = kmalloc(sizeof(struct va_cache), 0);
+	if (!cache) {
+		goto out;
+	}
+
+	cache->frames = kmalloc((size / PAGE_SIZE) * sizeof(page_num_t), MM_ZERO);
+	if (!cache->frames) {
+		kfree(cache);
+		cache = NULL;
+		goto out;
+	}
+
+	spinlock_init(&cache->lock, "va-cache-lock");
+	cache->ref = 1;
+	cache->offset = offset;
+	cache->nr_pages = size / PAGE_SIZE;
+
+ out:
+	return cache;
+}
+
+void va_cache_get(struct va_cache *cache)
+{
+	atomic_inc(&cache->ref);
+}
+
+/* Drop a reference to a cache, the frames are freed with the last one */
+void va_cache_put(struct va_cache *cache)
+{
+	size_t i;
+	struct page p;
+
+	if (atomic_dec(&cache->ref) != 1) {
+		return;
+	}
+
+	memset(&p, 0, sizeof(struct page));
+	for (i = 0; i < cache->nr_pages; i++) {
+		if (cache->frames[i] && page_refcount(cache->frames[i])) {
+			mmu_pte_set_frame(&p, cache->frames[i]);
+			page_free(&p);
+		}
+	}
+
+	kfree(cache->frames);
+	kfree(cache);
+}
+
+/*
+ * Get the slot of the cache for a page of a file region, only whole pages
+ * of the file are cached.
+ */
+static page_num_t *va_cache_slot(struct va_region *r, ptr_t virt)
+{
+	uint32_t pos, index;
+
+	pos = virt - r->start;
+	if (!r->cache || ((pos + PAGE_SIZE) > r->file_size) ||
+	    ((r->offset + pos) < r->cache->offset)) {
+		return NULL;
+	}
+
+	index = (r->offset + pos - r->cache->offset) / PAGE_SIZE;
+	if (index >= r->cache->nr_pages) {
+		return NULL;
+	}
+
+	return &r->cache->frames[index];
+}
+
+/* Get the cached frame for a page of a file region, 0 if not cached */
+static page_num_t va_cache_lookup(struct va_region *r, ptr_t virt)
+{
+	page_num_t *slot, frame = 0;
+
+	slot = va_cache_slot(r, virt);
+	if (slot) {
+		spinlock_acquire(&r->cache->lock);
+		frame = *slot;
+		spinlock_release(&r->cache->lock);
+	}
+
+	return frame;
+}
+
+/* Add the frame of a page of a file region to the cache */
+static void va_cache_insert(struct va_region *r, ptr_t virt, page_num_t frame)
+{
+	page_num_t *slot;
+
+	slot = va_cache_slot(r, virt);
+	if (!slot) {
+		return;
+	}
+
+	spinlock_acquire(&r->cache->lock);
+	if (!*slot) {
+		if (page_refcount(frame)) {
+			page_ref(frame);
+		}
+		*slot = frame;
+	}
+	spinlock_release(&r->cache->lock);
+}
 
 struct va_space *va_create()
 {
+	int i;
 	struct va_space *vas;
+	struct va_region *r;
 
 	vas = kmalloc(sizeof(struct va_space), 0);
-	if (vas) {
-		vas->mmu = mmu_create_ctx();
-		if (!vas->mmu) {
-			kfree(vas);
-			vas = NULL;
-		}
+	if (!vas) {
+		goto out;
+	}
+
+	/* The whole user part of the address space is free */
+	r = kmalloc(sizeof(struct va_region), MM_ZERO);
+	if (!r) {
+		kfree(vas);
+		vas = NULL;
+		goto out;
 	}
-	
+
+	vas->mmu = mmu_create_ctx();
+	if (!vas->mmu) {
+		kfree(r);
+		kfree(vas);
+		vas = NULL;
+		goto out;
+	}
+
+	spinlock_init(&vas->lock, "va-lock");
+	LIST_INIT(&vas->regions);
+	avl_tree_init(&vas->tree);
+	for (i = 0; i < VA_FREELISTS; i++) {
+		LIST_INIT(&vas->free[i]);
+	}
+
+	r->start = USER_START;
+	r->end = USER_END;
+	r->type = VA_REGION_FREE;
+	va_region_link(vas, r, &vas->regions);
+	va_free_insert(vas, r);
+
+	ksm_enter(vas);
+
+ out:
 	return vas;
 }
 
-int va_map(struct va_space *vas, ptr_t start, size_t size, int flags, ptr_t *addrp)
+/* Allocate the spare regions for an operation before taking the lock */
+static int va_spare_alloc(struct va_region **spare)
 {
-	int rc;
-	int pflag = 0;
-	struct page *p;
-	ptr_t virt;
+	int i;
 
-	if (!size || (size % PAGE_SIZE)) {
-		DEBUG(DL_DBG, ("size (%x) invalid.\n", size));
-		rc = -1;
-		goto out;
+	for (i = 0; i < VA_SPARE_REGIONS; i++) {
+		spare[i] = kmalloc(sizeof(struct va_region), 0);
+		if (!spare[i]) {
+			while (i--) {
+				kfree(spare[i]);
+			}
+			return ENOMEM;
+		}
 	}
-	
-	if (flags & VA_MAP_FIXED) {
-		if (start % PAGE_SIZE) {
-			DEBUG(DL_DBG, ("start(%p) not aligned.\n", start));
-			rc = -1;
-			goto out;
+
+	return 0;
+}
+
+static struct va_region *va_spare_get(struct va_region **spare)
+{
+	int i;
+	struct va_region *r;
+
+	for (i = 0; i < VA_SPARE_REGIONS; i++) {
+		if (spare[i]) {
+			r = spare[i];
+			spare[i] = NULL;
+			return r;
 		}
-	} else /*if (!addrp)*/ {
-		/* We didn't support this yet. */
-		DEBUG(DL_DBG, ("non-fixed map not support yet.\n"));
-		rc = -1;
-		goto out;
 	}
 
-	DEBUG(DL_DBG, ("vas(%p) start(%p), size(%x).\n", vas, start, size));
-	
-	for (virt = start; virt < (start + size); virt += PAGE_SIZE) {
+	PANIC("va: out of spare regions");
+	return NULL;
+}
+
+static void va_spare_free(struct va_region **spare)
+{
+	int i;
+
+	for (i = 0; i < VA_SPARE_REGIONS; i++) {
+		if (spare[i]) {
+			kfree(spare[i]);
+		}
+	}
+}
+
+/* Move the start of a region up to the specified address */
+static void va_region_trim_start(struct va_region *r, ptr_t start)
+{
+	size_t delta;
+
+	delta = start - r->start;
+	r->offset += delta;
+	r->file_size = (r->file_size > delta) ? (r->file_size - delta) : 0;
+	r->start = start;
+}
+
+/* Move the end of a region down to the specified address */
+static void va_region_trim_end(struct va_region *r, ptr_t end)
+{
+	r->file_size = MIN(r->file_size, end - r->start);
+	r->end = end;
+}
+
+/*
+ * Split a region at the address and return the new region holding the
+ * upper part, the free lists are not touched. Lock must be held.
+ */
+static struct va_region *va_region_split(struct va_space *vas, struct va_region *r,
+					 ptr_t addr, struct va_region **spare)
+{
+	struct va_region *upper;
+
+	upper = va_spare_get(spare);
+	*upper = *r;
+	va_region_trim_start(upper, addr);
+	va_region_trim_end(r, addr);
+	if (upper->node) {
+		vfs_node_refer(upper->node);
+	}
+	if (upper->cache) {
+		va_cache_get(upper->cache);
+	}
+	va_region_link(vas, upper, &r->link);
+
+	return upper;
+}
+
+/* Find the region containing the address, lock must be held */
+static struct va_region *va_region_find(struct va_space *vas, ptr_t addr)
+{
+	struct avl_tree_node *node;
+	struct va_region *r;
+
+	node = vas->tree.root;
+	while (node) {
+		r = AVL_TREE_ENTRY(node, struct va_region);
+		if (addr < r->start) {
+			node = node->left;
+		} else if (addr >= r->end) {
+			node = node->right;
+		} else {
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+/* Find a free region of at least the specified size, lock must be held */
+static struct va_region *va_free_find(struct va_space *vas, size_t size)
+{
+	int i, first;
+	struct list *l;
+	struct va_region *r;
+
+	/* Every region in the list of a power of two size is big enough, and
+	 * so is every region in the lists above it.
+	 */
+	first = va_freelist_index(size);
+	i = ((size / PAGE_SIZE) & ((size / PAGE_SIZE) - 1)) ? (first + 1) : first;
+	for (; i < VA_FREELISTS; i++) {
+		if (!LIST_EMPTY(&vas->free[i])) {
+			return LIST_ENTRY(vas->free[i].next, struct va_region,
+					  free_link);
+		}
+	}
+
+	/* Search the list of the size for a region big enough */
+	LIST_FOR_EACH(l, &vas->free[first]) {
+		r = LIST_ENTRY(l, struct va_region, free_link);
+		if ((r->end - r->start) >= size) {
+			return r;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Carve the range out of a free region and return the region covering
+ * exactly the range. Lock must be held.
+ */
+static struct va_region *va_free_carve(struct va_space *vas, struct va_region *f,
+				       ptr_t start, ptr_t end,
+				       struct va_region **spare)
+{
+	struct va_region *r;
+
+	va_free_remove(f);
+
+	if (f->start < start) {
+		r = va_region_split(vas, f, start, spare);
+		va_free_insert(vas, f);
+		f = r;
+	}
+
+	if (f->end > end) {
+		r = va_region_split(vas, f, end, spare);
+		va_free_insert(vas, r);
+	}
+
+	return f;
+}
+
+/*
+ * Turn a region into free space and merge it with the free regions around
+ * it, the resulting free region is returned. The file and the cache of the
+ * region are put on the dead list, to be dropped by va_region_free_list
+ * once the lock is released. A region merged away carries them itself,
+ * otherwise a spare region does. Lock must be held.
+ */
+static struct va_region *va_region_release(struct va_space *vas, struct va_region *r,
+					   struct va_region **spare,
+					   struct list *dead)
+{
+	struct va_region *n;
+
+	r->type = VA_REGION_FREE;
+	r->flags = 0;
+	r->offset = 0;
+	r->file_size = 0;
+
+	n = va_region_prev(vas, r);
+	if (n && (n->type == VA_REGION_FREE)) {
+		va_free_remove(n);
+		n->end = r->end;
+		va_region_unlink(vas, r);
+		if (r->node || r->cache) {
+			list_add(&r->link, dead);
+		} else {
+			kfree(r);
+		}
+		r = n;
+	} else if (r->node || r->cache) {
+		n = va_spare_get(spare);
+		n->node = r->node;
+		n->cache = r->cache;
+		list_add(&n->link, dead);
+		r->node = NULL;
+		r->cache = NULL;
+	}
+
+	n = va_region_next(vas, r);
+	if (n && (n->type == VA_REGION_FREE)) {
+		va_free_remove(n);
+		r->end = n->end;
+		va_region_unlink(vas, n);
+		kfree(n);
+	}
+
+	va_free_insert(vas, r);
+
+	return r;
+}
+
+/* Free the frames mapped in a range, lock must be held */
+static void va_free_pages(struct va_space *vas, ptr_t start, ptr_t end)
+{
+	/* Pages of inaccessible regions have a frame but are not present,
+	 * frames of the file data kept in memory are not freed.
+	 */
+	mmu_unmap_range(vas->mmu, start, end - start, TRUE);
+}
+
+/*
+ * Unmap the regions in a range of the address space, the regions which are
+ * dropped once the lock is released are put on the dead list. Only the
+ * first region released may have no free region before it, so a single
+ * spare region holds a file. Lock must be held.
+ */
+static void va_unmap_range(struct va_space *vas, ptr_t start, ptr_t end,
+			   struct va_region **spare, struct list *dead)
+{
+	struct va_region *r;
+
+	r = va_region_find(vas, start);
+	while (r && (r->start < end)) {
+		if (r->type != VA_REGION_FREE) {
+			if (r->start < start) {
+				r = va_region_split(vas, r, start, spare);
+			}
+			if (r->end > end) {
+				va_region_split(vas, r, end, spare);
+			}
+			va_free_pages(vas, r->start, r->end);
+			r = va_region_release(vas, r, spare, dead);
+		}
+		r = va_region_next(vas, r);
+	}
+}
+
+/* Map a frame shared with a file or a cache to a page of a region */
+static void va_share_frame(struct va_space *vas, struct va_region *r,
+			   struct page *p, page_num_t frame)
+{
+	/* Take a reference if the frame belongs to the page allocator */
+	if (page_refcount(frame)) {
+		page_ref(frame);
+	}
+
+	mmu_pte_set_frame(p, frame);
+	p->present = 1;
+	p->rw = 0;
+	p->cow = FLAG_ON(r->flags, VA_MAP_WRITE) ? 1 : 0;
+	p->user = IS_KERNEL_CTX(vas->mmu) ? FALSE : TRUE;
+	mmu_pte_set_nx(p, va_page_nx(r));
+}
+
+/* Map the frames already in the cache of a new region, lock must be held */
+static void va_cache_populate(struct va_space *vas, struct va_region *r)
+{
+	ptr_t virt;
+	page_num_t frame;
+	struct page *p;
+
+	if (!FLAG_ON(r->flags, VA_MAP_PROT)) {
+		return;
+	}
+
+	for (virt = r->start; virt < r->end; virt += PAGE_SIZE) {
+		frame = va_cache_lookup(r, virt);
+		if (!frame) {
+			continue;
+		}
+
 		p = mmu_get_page(vas->mmu, virt, TRUE, 0);
 		if (!p) {
-			DEBUG(DL_DBG, ("mmu_get_page failed, addr(%p).\n", virt));
-			rc = -1;
+			/* The page will be faulted in */
+			break;
+		}
+		ASSERT(!mmu_pte_frame(p));
+		va_share_frame(vas, r, p, frame);
+	}
+}
+
+static int va_region_add(struct va_space *vas, ptr_t start, size_t size,
+			 int type, int flags, struct vfs_node *n,
+			 uint32_t offset, size_t file_size,
+			 struct va_cache *cache, ptr_t *addrp)
+{
+	int rc;
+	boolean_t replace;
+	struct va_region *r, *spare[VA_SPARE_REGIONS];
+	struct va_region *unmap_spare[VA_SPARE_REGIONS];
+	struct list dead;
+
+	if (!size || (size % PAGE_SIZE) || (start % PAGE_SIZE) ||
+	    ((start + size) < start)) {
+		DEBUG(DL_DBG, ("start(%p) size(%x) invalid.\n", start, size));
+		rc = EINVAL;
+		goto out;
+	}
+
+	replace = FLAG_ON(flags, VA_MAP_REPLACE) ? TRUE : FALSE;
+	ASSERT(!replace || FLAG_ON(flags, VA_MAP_FIXED));
+	flags &= ~VA_MAP_REPLACE;
+
+	rc = va_spare_alloc(spare);
+	if (rc != 0) {
+		goto out;
+	}
+	if (replace) {
+		rc = va_spare_alloc(unmap_spare);
+		if (rc != 0) {
+			va_spare_free(spare);
 			goto out;
 		}
-		
-		DEBUG(DL_DBG, ("mmu(%p) page(%p) frame(%x).\n", vas->mmu, p, p->frame));
-		page_alloc(p, pflag);
-		p->user = IS_KERNEL_CTX(vas->mmu) ? FALSE : TRUE;
-		p->rw = FLAG_ON(flags, VA_MAP_WRITE) ? TRUE : FALSE;
 	}
 
-	rc = 0;
-	
+	LIST_INIT(&dead);
+	spinlock_acquire(&vas->lock);
+
+	/* The mappings in the way are only removed once the range is known
+	 * to be inside the address space, nothing can fail after that.
+	 */
+	if (replace) {
+		if (!va_region_find(vas, start) ||
+		    !va_region_find(vas, start + size - 1)) {
+			DEBUG(DL_DBG, ("range(%p-%p) invalid.\n",
+				       start, start + size));
+			rc = EINVAL;
+			goto unlock;
+		}
+		va_unmap_range(vas, start, start + size, unmap_spare, &dead);
+	}
+
+	/* Use the specified address if the range is free, it is a must for
+	 * fixed mappings.
+	 */
+	r = start ? va_region_find(vas, start) : NULL;
+	if (!r || (r->type != VA_REGION_FREE) || ((start + size) > r->end)) {
+		if (FLAG_ON(flags, VA_MAP_FIXED)) {
+			DEBUG(DL_DBG, ("range(%p-%p) not available.\n",
+				       start, start + size));
+			rc = r ? EMAPPED : EINVAL;
+			goto unlock;
+		}
+
+		r = va_free_find(vas, size);
+		if (!r) {
+			DEBUG(DL_DBG, ("no free space for size(%x).\n", size));
+			rc = ENOMEM;
+			goto unlock;
+		}
+		start = r->start;
+	}
+
+	r = va_free_carve(vas, r, start, start + size, spare);
+	r->type = type;
+	r->flags = flags;
+	r->node = n;
+	r->offset = offset;
+	r->file_size = MIN(file_size, size);
+	r->cache = cache;
+	if (n) {
+		vfs_node_refer(n);
+	}
+	if (cache) {
+		va_cache_get(cache);
+		va_cache_populate(vas, r);
+	}
+
+	if (addrp) {
+		*addrp = start;
+	}
+
+	DEBUG(DL_DBG, ("vas(%p) start(%p), size(%x), type(%d).\n",
+		       vas, start, size, type));
+
+ unlock:
+	spinlock_release(&vas->lock);
+	va_region_free_list(&dead);
+	va_spare_free(spare);
+	if (replace) {
+		va_spare_free(unmap_spare);
+	}
+
  out:
 	return rc;
 }
 
+/*
+ * Map a range of the address space, the frames are allocated when the
+ * pages are first touched. Without VA_MAP_FIXED, start is only a hint.
+ */
+int va_map(struct va_space *vas, ptr_t start, size_t size, int flags, ptr_t *addrp)
+{
+	int type;
+
+	if (FLAG_ON(flags, VA_MAP_GUARD)) {
+		type = VA_REGION_GUARD;
+	} else if (FLAG_ON(flags, VA_MAP_ZERO)) {
+		type = VA_REGION_ZERO;
+	} else {
+		type = VA_REGION_ANON;
+	}
+
+	return va_region_add(vas, start, size, type, flags, NULL, 0, 0, NULL,
+			     addrp);
+}
+
+/*
+ * Map a range of the address space to a file. The first file_size bytes
+ * of the range are read from the file at offset when touched, the rest of
+ * the range is zeroed. If a cache is specified, the frames of the file are
+ * shared with the other regions using the cache.
+ */
+int va_map_file(struct va_space *vas, ptr_t start, size_t size, int flags,
+		struct vfs_node *n, uint32_t offset, size_t file_size,
+		struct va_cache *cache, ptr_t *addrp)
+{
+	ASSERT(n != NULL);
+
+	return va_region_add(vas, start, size, VA_REGION_FILE, flags, n,
+			     offset, file_size, cache, addrp);
+}
+
 int va_unmap(struct va_space *vas, ptr_t start, size_t size)
 {
 	int rc;
-	ptr_t virt;
-	struct page *p;
+	ptr_t end;
+	struct va_region *spare[VA_SPARE_REGIONS];
+	struct list dead;
+
+	if (!size || (start % PAGE_SIZE) || (size % PAGE_SIZE) ||
+	    ((start + size) < start)) {
+		rc = EINVAL;
+		goto out;
+	}
+	end = start + size;
 
-	if (!size || (start % PAGE_SIZE) || (size % PAGE_SIZE)) {
-		rc = -1;
+	/* Only the regions at both ends of the range may need to be split */
+	rc = va_spare_alloc(spare);
+	if (rc != 0) {
 		goto out;
 	}
 
-	for (virt = start; virt < start + size; virt += PAGE_SIZE) {
+	LIST_INIT(&dead);
+	spinlock_acquire(&vas->lock);
+
+	if (!va_region_find(vas, start)) {
+		rc = EINVAL;
+		goto unlock;
+	}
+
+	va_unmap_range(vas, start, end, spare, &dead);
+
+ unlock:
+	spinlock_release(&vas->lock);
+	va_region_free_list(&dead);
+	va_spare_free(spare);
+
+ out:
+	return rc;
+}
+
+/*
+ * Apply the protection of a region to its present pages, the range to flush
+ * is gathered. Lock must be held.
+ */
+static void va_protect_pages(struct va_space *vas, struct va_region *r,
+			     struct mmu_gather *g)
+{
+	ptr_t virt;
+	struct page *p;
+
+	for (virt = r->start; virt < r->end; virt += PAGE_SIZE) {
 		p = mmu_get_page(vas->mmu, virt, FALSE, 0);
 		if (!p) {
-			rc = -1;
+			virt = ROUND_DOWN(virt, LARGE_PAGE_SIZE) +
+				(LARGE_PAGE_SIZE - PAGE_SIZE);
+			continue;
+		}
+		/* Swapped out pages get the protection when read back */
+		if (!mmu_pte_frame(p) || p->swap) {
+			continue;
+		}
+
+		mmu_pte_set_nx(p, va_page_nx(r));
+		if (!FLAG_ON(r->flags, VA_MAP_PROT)) {
+			/* Keep the frame but make the page inaccessible */
+			p->present = 0;
+		} else if (FLAG_ON(r->flags, VA_MAP_WRITE)) {
+			/* Shared frames are copied on the first write */
+			p->present = 1;
+			if (page_refcount(mmu_pte_frame(p)) != 1) {
+				p->rw = 0;
+				p->cow = 1;
+			} else {
+				p->rw = 1;
+				p->cow = 0;
+			}
+		} else {
+			p->present = 1;
+			p->rw = 0;
+			p->cow = 0;
+		}
+	}
+
+	mmu_gather_add(g, r->start, r->end - r->start);
+}
+
+/* Change the protection of a mapped range of the address space */
+int va_protect(struct va_space *vas, ptr_t start, size_t size, int flags)
+{
+	int rc;
+	ptr_t end;
+	struct va_region *r, *spare[VA_SPARE_REGIONS];
+	struct mmu_gather g;
+
+	if (!size || (start % PAGE_SIZE) || (size % PAGE_SIZE) ||
+	    ((start + size) < start)) {
+		rc = EINVAL;
+		goto out;
+	}
+	end = start + size;
+
+	rc = va_spare_alloc(spare);
+	if (rc != 0) {
+		goto out;
+	}
+
+	spinlock_acquire(&vas->lock);
+
+	/* The whole range must be mapped */
+	for (r = va_region_find(vas, start); r; r = va_region_next(vas, r)) {
+		if (r->type == VA_REGION_FREE) {
+			break;
+		}
+		if (r->end >= end) {
+			break;
+		}
+	}
+	if (!r || (r->type == VA_REGION_FREE)) {
+		DEBUG(DL_DBG, ("range(%p-%p) not mapped.\n", start, end));
+		rc = ENOMEM;
+		goto unlock;
+	}
+
+	mmu_gather_init(&g, vas->mmu, 0);
+	r = va_region_find(vas, start);
+	while (r && (r->start < end)) {
+		if (r->start < start) {
+			r = va_region_split(vas, r, start, spare);
+		}
+		if (r->end > end) {
+			va_region_split(vas, r, end, spare);
+		}
+		r->flags = (r->flags & ~VA_MAP_PROT) | (flags & VA_MAP_PROT);
+		va_protect_pages(vas, r, &g);
+		r = va_region_next(vas, r);
+	}
+
+	/* All the regions are flushed with one shootdown */
+	mmu_gather_flush(&g);
+
+ unlock:
+	spinlock_release(&vas->lock);
+	va_spare_free(spare);
+
+ out:
+	return rc;
+}
+
+/*
+ * Grow the stack region above a free region down to the address, at least
+ * one free page is kept below the stack. Lock must be held.
+ */
+static struct va_region *va_stack_grow(struct va_space *vas, struct va_region *f,
+				       ptr_t virt)
+{
+	struct va_region *r;
+
+	r = va_region_next(vas, f);
+	if (!r || !FLAG_ON(r->flags, VA_MAP_STACK) ||
+	    ((r->end - virt) > USTACK_MAX_SIZE) || (virt <= f->start)) {
+		return NULL;
+	}
+
+	DEBUG(DL_DBG, ("stack region(%p-%p) grows to %p.\n",
+		       r->start, r->end, virt));
+
+	va_free_remove(f);
+	f->end = virt;
+	va_free_insert(vas, f);
+
+	if (CURR_THREAD->ustack == (void *)r->start) {
+		CURR_THREAD->ustack_size += (r->start - virt);
+		CURR_THREAD->ustack = (void *)virt;
+	}
+
+	avl_tree_remove_node(&vas->tree, &r->tree_link);
+	r->start = virt;
+	avl_tree_insert_node(&vas->tree, &r->tree_link, r->start, r);
+
+	return r;
+}
+
+/* Fill a new frame with file data, the rest of the page is zeroed */
+static int va_fill_frame(struct vfs_node *n, off_t off, size_t len,
+			 page_num_t pfn)
+{
+	int rc;
+	size_t count = 0;
+	uint8_t *buf;
+	phys_addr_t phys;
+
+	phys = (phys_addr_t)pfn * PAGE_SIZE;
+
+	/* Frames above the physical map area are mapped for the read */
+	if ((phys + PAGE_SIZE) <= _mmu_phys_map_end) {
+		buf = (uint8_t *)(ptr_t)phys;
+	} else {
+		buf = vm_map(phys, PAGE_SIZE, MMU_MAP_WRITE);
+		if (!buf) {
+			return ENOMEM;
+		}
+	}
+
+	if (len) {
+		rc = vfs_read(n, off, len, buf);
+		if (rc > 0) {
+			count = rc;
+		} else {
+			DEBUG(DL_WRN, ("read node(%p) failed, err(%x).\n", n, rc));
+		}
+	}
+	memset(buf + count, 0, PAGE_SIZE - count);
+
+	if ((ptr_t)buf != phys) {
+		vfree(buf);
+	}
+
+	return 0;
+}
+
+/*
+ * Read a page of a file region into a new private frame. The lock is
+ * dropped during the read, if the entry was filled or the region unmapped
+ * meanwhile the new frame is dropped and the access is retried. Lock must
+ * be held, it is released on return so the file is dropped without it.
+ */
+static int va_file_page(struct va_space *vas, struct va_region *r, ptr_t virt)
+{
+	int rc;
+	uint32_t pos;
+	off_t off;
+	size_t len;
+	struct page entry, *p;
+	struct vfs_node *n;
+
+	memset(&entry, 0, sizeof(entry));
+	if (page_alloc(&entry, 0) != 0) {
+		spinlock_release(&vas->lock);
+		return ENOMEM;
+	}
+
+	/* The region may go away while the lock is dropped */
+	pos = virt - r->start;
+	n = r->node;
+	off = r->offset + pos;
+	len = (pos < r->file_size) ? MIN(r->file_size - pos, PAGE_SIZE) : 0;
+	vfs_node_refer(n);
+
+	spinlock_release(&vas->lock);
+	rc = va_fill_frame(n, off, len, mmu_pte_frame(&entry));
+	spinlock_acquire(&vas->lock);
+	if (rc != 0) {
+		page_free(&entry);
+		goto out;
+	}
+
+	r = va_region_find(vas, virt);
+	p = mmu_get_page(vas->mmu, virt, FALSE, 0);
+	if (!r || (r->type != VA_REGION_FILE) || (r->node != n) ||
+	    ((r->offset + virt - r->start) != off) ||
+	    !p || p->present || p->swap) {
+		page_free(&entry);
+		goto out;
+	}
+
+	mmu_pte_set_frame(p, mmu_pte_frame(&entry));
+	p->present = 1;
+
+	/* Read-only file pages are shared through the cache */
+	if (FLAG_ON(r->flags, VA_MAP_WRITE)) {
+		p->rw = 1;
+		swap_lru_add(mmu_pte_frame(p), vas, virt);
+	} else {
+		p->rw = 0;
+		va_cache_insert(r, virt, mmu_pte_frame(p));
+	}
+	p->user = IS_KERNEL_CTX(vas->mmu) ? FALSE : TRUE;
+	mmu_pte_set_nx(p, va_page_nx(r));
+	x86_invlpg(virt);
+
+ out:
+	spinlock_release(&vas->lock);
+	vfs_node_deref(n);
+
+	return rc;
+}
+
+/* Map a page of a file region to the cached frame, or straight onto the
+ * file data if the file system keeps it in memory. The page is copied on
+ * the first write.
+ */
+static boolean_t va_share_page(struct va_space *vas, struct va_region *r,
+			       ptr_t virt, struct page *p)
+{
+	uint32_t pos;
+	phys_addr_t phys;
+	page_num_t frame;
+
+	pos = virt - r->start;
+	if ((r->type != VA_REGION_FILE) || ((pos + PAGE_SIZE) > r->file_size)) {
+		return FALSE;
+	}
+
+	frame = va_cache_lookup(r, virt);
+	if (!frame) {
+		if (vfs_map(r->node, r->offset + pos, &phys) != 0) {
+			return FALSE;
+		}
+		frame = phys / PAGE_SIZE;
+		va_cache_insert(r, virt, frame);
+	}
+
+	va_share_frame(vas, r, p, frame);
+
+	return TRUE;
+}
+
+/*
+ * Read a swapped out page back into a new frame. The lock is dropped during
+ * the transfer, if the entry was changed meanwhile the new frame is dropped
+ * and the access is retried. Lock must be held.
+ */
+static int va_swap_page(struct va_space *vas, ptr_t virt, struct page *p)
+{
+	int rc;
+	struct page entry;
+	struct va_region *r;
+	page_num_t slot, frame;
+
+	slot = mmu_pte_frame(p);
+	spinlock_release(&vas->lock);
+	rc = swap_in(slot, &frame);
+	spinlock_acquire(&vas->lock);
+	if (rc != 0) {
+		return rc;
+	}
+
+	r = va_region_find(vas, virt);
+	p = mmu_get_page(vas->mmu, virt, FALSE, 0);
+	if (!r || !p || !p->swap || (mmu_pte_frame(p) != slot)) {
+		memset(&entry, 0, sizeof(entry));
+		mmu_pte_set_frame(&entry, frame);
+		page_free(&entry);
+		return 0;
+	}
+
+	swap_free(slot);
+	memset(p, 0, MMU_PTE_SIZE);
+	mmu_pte_set_frame(p, frame);
+	p->present = FLAG_ON(r->flags, VA_MAP_PROT) ? 1 : 0;
+	p->rw = FLAG_ON(r->flags, VA_MAP_WRITE) ? 1 : 0;
+	p->user = IS_KERNEL_CTX(vas->mmu) ? FALSE : TRUE;
+	mmu_pte_set_nx(p, va_page_nx(r));
+	swap_lru_add(frame, vas, virt);
+	x86_invlpg(virt);
+
+	return 0;
+}
+
+/**
+ * Handle a fault on a page which is not present
+ * @vas		- address space, must be the current one
+ * @addr	- faulting address
+ * @access	- VA_MAP_WRITE for a write access, VA_MAP_READ otherwise
+ */
+int va_fault(struct va_space *vas, ptr_t addr, int access)
+{
+	int rc;
+	ptr_t virt;
+	struct page *p;
+	struct va_region *r;
+
+	ASSERT(vas == CURR_ASPACE);
+
+	virt = ROUND_DOWN(addr, PAGE_SIZE);
+
+	spinlock_acquire(&vas->lock);
+
+	r = va_region_find(vas, virt);
+	if (r && (r->type == VA_REGION_FREE)) {
+		r = va_stack_grow(vas, r, virt);
+	}
+	if (!r) {
+		rc = EFAULT;
+		goto unlock;
+	}
+
+	if ((r->type == VA_REGION_GUARD) || !FLAG_ON(r->flags, VA_MAP_PROT) ||
+	    (FLAG_ON(access, VA_MAP_WRITE) && !FLAG_ON(r->flags, VA_MAP_WRITE))) {
+		DEBUG(DL_DBG, ("access(%x) to region(%p-%p) flags(%x) denied.\n",
+			       access, r->start, r->end, r->flags));
+		rc = EACCESS;
+		goto unlock;
+	}
+
+	p = mmu_get_page(vas->mmu, virt, TRUE, 0);
+	if (!p) {
+		rc = ENOMEM;
+		goto unlock;
+	}
+
+	if (p->swap) {
+		rc = va_swap_page(vas, virt, p);
+		goto unlock;
+	}
+
+	if (!p->present) {
+		if ((r->type == VA_REGION_ZERO) && !FLAG_ON(access, VA_MAP_WRITE)) {
+			/* Share the zero page until the first write */
+			page_ref(_zero_frame);
+			mmu_pte_set_frame(p, _zero_frame);
+			p->present = 1;
+			p->rw = 0;
+			p->cow = FLAG_ON(r->flags, VA_MAP_WRITE) ? 1 : 0;
+		} else if (r->type != VA_REGION_FILE) {
+			/* Anonymous memory gets a frame from the zeroed pool */
+			if (page_alloc(p, MM_ZERO) != 0) {
+				rc = ENOMEM;
+				goto unlock;
+			}
+			p->rw = FLAG_ON(r->flags, VA_MAP_WRITE) ? 1 : 0;
+			swap_lru_add(mmu_pte_frame(p), vas, virt);
+		} else if (FLAG_ON(access, VA_MAP_WRITE) ||
+			   !va_share_page(vas, r, virt, p)) {
+			/* The file is read without the lock held, the
+			 * lock is released on return
+			 */
+			rc = va_file_page(vas, r, virt);
 			goto out;
 		}
-		
-		DEBUG(DL_DBG, ("mmu(%p) page(%p) frame(%x).\n", vas->mmu, p, p->frame));
-		page_free(p);
+		p->user = IS_KERNEL_CTX(vas->mmu) ? FALSE : TRUE;
+		mmu_pte_set_nx(p, va_page_nx(r));
+		x86_invlpg(virt);
 	}
 
 	rc = 0;
 
+ unlock:
+	spinlock_release(&vas->lock);
+
  out:
 	return rc;
 }
@@ -103,43 +1148,138 @@ void va_switch(struct va_space *vas)
 {
 	boolean_t state;
 
+	state = local_irq_disable();
+
 	/* The kernel process does not have an address space. When switching
 	 * to one of its threads, it is not necessary to switch to the kernel
 	 * address space, as all mappings in the kernel context are visible in
 	 * all address spaces. Kernel threads should never touch the userspace
-	 * portion of the address space.
+	 * portion of the address space, so the current one is kept in lazy TLB
+	 * mode and this CORE is not interrupted for its shootdowns.
 	 */
-	if (vas && (vas != CURR_ASPACE)) {
+	if (!vas) {
+		mmu_lazy_ctx();
+	} else {
 #ifdef _DEBUG_MM
-		DEBUG(DL_DBG, ("new vas(%p), current vas(%p), core(%d).\n",
-			       vas, CURR_ASPACE, CURR_CORE->id));
+		if (vas != CURR_ASPACE) {
+			DEBUG(DL_DBG, ("new vas(%p), current vas(%p), core(%d).\n",
+				       vas, CURR_ASPACE, CURR_CORE->id));
+		}
 #endif	/* _DEBUG_MM */
 
-		state = local_irq_disable();
-
 		/* Update the current mmu context */
+		mmu_switch_ctx(CURR_ASPACE ? CURR_ASPACE->mmu : NULL, vas->mmu);
 		CURR_ASPACE = vas;
-
-		/* Load the page directory base */
-		mmu_load_ctx(vas->mmu);
-
-		local_irq_restore(state);
 	}
+
+	local_irq_restore(state);
 }
 
-void va_clone(struct va_space *dst, struct va_space *src)
+/*
+ * Clone the regions of an address space, the frames are copy-on-write. On
+ * failure the regions cloned so far are left for va_destroy of the new one.
+ */
+int va_clone(struct va_space *dst, struct va_space *src)
 {
-	;
+	int rc = 0;
+	struct list *l, *n;
+	struct va_region *r, *region;
+
+	/* Drop the initial regions of the new address space */
+	LIST_FOR_EACH_SAFE(l, n, &dst->regions) {
+		r = LIST_ENTRY(l, struct va_region, link);
+		if (r->type == VA_REGION_FREE) {
+			va_free_remove(r);
+		}
+		va_region_unlink(dst, r);
+		va_region_free(r);
+	}
+
+	spinlock_acquire(&src->lock);
+
+	LIST_FOR_EACH(l, &src->regions) {
+		r = LIST_ENTRY(l, struct va_region, link);
+		region = kmalloc(sizeof(struct va_region), 0);
+		if (!region) {
+			rc = ENOMEM;
+			goto out;
+		}
+		*region = *r;
+		va_region_link(dst, region, dst->regions.prev);
+		if (region->type == VA_REGION_FREE) {
+			va_free_insert(dst, region);
+		}
+		if (region->node) {
+			vfs_node_refer(region->node);
+		}
+		if (region->cache) {
+			va_cache_get(region->cache);
+		}
+	}
+
+	rc = mmu_clone_ctx(dst->mmu, src->mmu);
+
+ out:
+	spinlock_release(&src->lock);
+
+	return rc;
 }
 
 void va_destroy(struct va_space *vas)
 {
+	struct list *l, *n;
+	struct list dead;
+	struct va_region *r;
+	struct mmu_gather g;
+	boolean_t state;
+
+	/* The scanner must be done with it before the pages go away */
+	ksm_exit(vas);
+
+	/* Free the regions and the frames mapped for them, the swapper may
+	 * still try to lock the address space for one of its frames. The
+	 * files are dropped once the lock is released.
+	 */
+	LIST_INIT(&dead);
+	spinlock_acquire(&vas->lock);
+	LIST_FOR_EACH_SAFE(l, n, &vas->regions) {
+		r = LIST_ENTRY(l, struct va_region, link);
+		if (r->type != VA_REGION_FREE) {
+			va_free_pages(vas, r->start, r->end);
+		}
+		list_del(&r->link);
+		list_add_tail(&r->link, &dead);
+	}
+	spinlock_release(&vas->lock);
+	va_region_free_list(&dead);
+
+	/* No CORE may keep the context loaded once it is freed */
+	state = local_irq_disable();
+	if (CURR_ASPACE == vas) {
+		CURR_ASPACE = NULL;
+		mmu_load_ctx(&_kernel_mmu_ctx);
+	}
+	local_irq_restore(state);
+	mmu_gather_init(&g, vas->mmu, MMU_FLUSH_DROP);
+	mmu_gather_flush(&g);
+
 	mmu_destroy_ctx(vas->mmu);
 	kfree(vas);
 }
 
 void init_va()
 {
-	;
-}
+	int rc;
+	void *zero;
+	phys_addr_t phys;
+
+	/* The zero page is never freed, so its frame is never reused */
+	zero = kmem_alloc(PAGE_SIZE, MM_ALIGN);
+	ASSERT(zero != NULL);
+	memset(zero, 0, PAGE_SIZE);
 
+	/* The heap may be mapped by large pages */
+	rc = mmu_translate(&_kernel_mmu_ctx, (ptr_t)zero, &phys);
+	ASSERT(rc == 0);
+	_zero_frame = phys / PAGE_SIZE;
+}
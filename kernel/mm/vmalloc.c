@@ -0,0 +1,307 @@
+/*
+ * vmalloc.c
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include "matrix/matrix.h"
+#include "list.h"
+#include "debug.h"
+#include "hal/spinlock.h"
+#include "rtl/avltree.h"
+#include "mm/mm.h"
+#include "mm/page.h"
+#include "mm/mmu.h"
+#include "mm/malloc.h"
+#include "mm/mlayout.h"
+#include "mm/vmalloc.h"
+
+/* Range flags */
+#define VM_RANGE_FREE	(1<<0)	// Range is not allocated
+#define VM_RANGE_ALLOC	(1<<1)	// Frames of the range belong to it
+
+/*
+ * A range of the kernel virtual range area. Free ranges are kept in a
+ * tree keyed by size so the best fit is found quickly, allocated ones in
+ * a tree keyed by address.
+ */
+struct vm_range {
+	struct list link;		// Link to the range list, ordered by address
+	struct avl_tree_node tree_link;	// Link to the free or the used tree
+	ptr_t start;			// Start address of the range
+	ptr_t end;			// End address of the range
+	int flags;			// Flags of the range
+};
+
+/* Key of a free range, the size first and the address for ties */
+#define VM_FREE_KEY(r)	((((key_t)((r)->end - (r)->start)) << 32) | (r)->start)
+
+/* All the ranges of the area ordered by address */
+static struct list _vm_ranges = {
+	.prev = &_vm_ranges,
+	.next = &_vm_ranges
+};
+static struct avl_tree _vm_free_tree;
+static struct avl_tree _vm_used_tree;
+static struct spinlock _vm_lock;
+
+static void vm_free_insert(struct vm_range *r)
+{
+	r->flags = VM_RANGE_FREE;
+	avl_tree_insert_node(&_vm_free_tree, &r->tree_link, VM_FREE_KEY(r), r);
+}
+
+/* Find the smallest free range of at least the specified size, lock must
+ * be held
+ */
+static struct vm_range *vm_free_find(size_t size)
+{
+	struct avl_tree_node *node;
+	struct vm_range *r = NULL;
+
+	node = _vm_free_tree.root;
+	while (node) {
+		if (node->key >= (((key_t)size) << 32)) {
+			r = AVL_TREE_ENTRY(node, struct vm_range);
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	return r;
+}
+
+/* Merge a free range with the next one if it is free too */
+static struct vm_range *vm_range_merge(struct vm_range *r)
+{
+	struct vm_range *n;
+
+	if (r->link.next == &_vm_ranges) {
+		return NULL;
+	}
+
+	n = LIST_ENTRY(r->link.next, struct vm_range, link);
+	if (!FLAG_ON(n->flags, VM_RANGE_FREE)) {
+		return NULL;
+	}
+
+	avl_tree_remove_node(&_vm_free_tree, &n->tree_link);
+	list_del(&n->link);
+	r->end = n->end;
+
+	return n;
+}
+
+/*
+ * Allocate a range of the kernel virtual range area, an unmapped guard
+ * page is left after it
+ */
+static struct vm_range *vm_range_alloc(size_t size, int flags)
+{
+	struct vm_range *r, *spare;
+
+	spare = kmalloc(sizeof(struct vm_range), 0);
+	if (!spare) {
+		return NULL;
+	}
+
+	spinlock_acquire(&_vm_lock);
+
+	r = vm_free_find(size + PAGE_SIZE);
+	if (!r) {
+		spinlock_release(&_vm_lock);
+		kfree(spare);
+		DEBUG(DL_WRN, ("no kernel virtual range of size(%x).\n", size));
+		return NULL;
+	}
+
+	/* Give back the rest of the free range */
+	avl_tree_remove_node(&_vm_free_tree, &r->tree_link);
+	if ((r->end - r->start) > (size + PAGE_SIZE)) {
+		spare->start = r->start + size + PAGE_SIZE;
+		spare->end = r->end;
+		r->end = spare->start;
+		list_add(&spare->link, &r->link);
+		vm_free_insert(spare);
+		spare = NULL;
+	}
+
+	r->flags = flags;
+	avl_tree_insert_node(&_vm_used_tree, &r->tree_link, r->start, r);
+
+	spinlock_release(&_vm_lock);
+
+	if (spare) {
+		kfree(spare);
+	}
+
+	return r;
+}
+
+/* Return a range to the free ranges and merge it with its neighbours */
+static void vm_range_free(struct vm_range *r)
+{
+	struct vm_range *prev, *n[2];
+
+	spinlock_acquire(&_vm_lock);
+
+	avl_tree_remove_node(&_vm_used_tree, &r->tree_link);
+
+	n[0] = NULL;
+	if (r->link.prev != &_vm_ranges) {
+		prev = LIST_ENTRY(r->link.prev, struct vm_range, link);
+		if (FLAG_ON(prev->flags, VM_RANGE_FREE)) {
+			avl_tree_remove_node(&_vm_free_tree, &prev->tree_link);
+			list_del(&r->link);
+			prev->end = r->end;
+			n[0] = r;
+			r = prev;
+		}
+	}
+	n[1] = vm_range_merge(r);
+	vm_free_insert(r);
+
+	spinlock_release(&_vm_lock);
+
+	if (n[0]) {
+		kfree(n[0]);
+	}
+	if (n[1]) {
+		kfree(n[1]);
+	}
+}
+
+/**
+ * Allocate a virtually contiguous kernel buffer, the frames backing it
+ * are allocated one by one so they need not be physically contiguous
+ * @size	- size of the buffer
+ * @mmflag	- memory manager flags
+ */
+void *vmalloc(size_t size, int mmflag)
+{
+	int rc;
+	struct vm_range *r;
+
+	if (!size) {
+		return NULL;
+	}
+
+	size = ROUND_UP(size, PAGE_SIZE);
+	r = vm_range_alloc(size, VM_RANGE_ALLOC);
+	if (!r) {
+		return NULL;
+	}
+
+	rc = mmu_map_range(&_kernel_mmu_ctx, r->start, 0, size,
+			   MMU_MAP_ALLOC | MMU_MAP_WRITE |
+			   (FLAG_ON(mmflag, MM_ZERO) ? MMU_MAP_ZERO : 0));
+	if (rc != 0) {
+		vm_range_free(r);
+		return NULL;
+	}
+
+	DEBUG(DL_DBG, ("range[%p, %p) allocated.\n", r->start, r->start + size));
+
+	return (void *)r->start;
+}
+
+/**
+ * Map a physical range into the kernel virtual range area
+ * @phys	- page aligned physical address
+ * @size	- page aligned size of the range
+ * @flags	- MMU mapping flags
+ */
+void *vm_map(phys_addr_t phys, size_t size, int flags)
+{
+	int rc;
+	struct vm_range *r;
+
+	ASSERT(((phys % PAGE_SIZE) == 0) && ((size % PAGE_SIZE) == 0) && size);
+	ASSERT(!FLAG_ON(flags, MMU_MAP_ALLOC));
+
+	r = vm_range_alloc(size, 0);
+	if (!r) {
+		return NULL;
+	}
+
+	rc = mmu_map_range(&_kernel_mmu_ctx, r->start, phys, size, flags);
+	if (rc != 0) {
+		vm_range_free(r);
+		return NULL;
+	}
+
+	DEBUG(DL_DBG, ("phys[%llx, %llx) mapped to %p.\n", phys, phys + size,
+		       r->start));
+
+	return (void *)r->start;
+}
+
+/**
+ * Unmap a range allocated by vmalloc or vm_map, the frames are freed if
+ * they were allocated by vmalloc
+ */
+void vfree(void *addr)
+{
+	struct vm_range *r;
+
+	spinlock_acquire(&_vm_lock);
+	r = avl_tree_lookup(&_vm_used_tree, (ptr_t)addr);
+	spinlock_release(&_vm_lock);
+
+	if (!r) {
+		PANIC("vfree of an unallocated range");
+	}
+
+	/* The guard page after the range was never mapped */
+	mmu_unmap_range(&_kernel_mmu_ctx, r->start, r->end - r->start - PAGE_SIZE,
+			FLAG_ON(r->flags, VM_RANGE_ALLOC));
+
+	DEBUG(DL_DBG, ("range[%p, %p) freed.\n", r->start, r->end));
+
+	vm_range_free(r);
+}
+
+/**
+ * Map a device memory range uncached, the physical address need not be
+ * page aligned
+ */
+void *ioremap(phys_addr_t phys, size_t size)
+{
+	phys_addr_t base;
+	void *ret;
+
+	base = ROUND_DOWN(phys, PAGE_SIZE);
+	ret = vm_map(base, ROUND_UP(phys + size, PAGE_SIZE) - base,
+		     MMU_MAP_WRITE | MMU_MAP_NOCACHE);
+	if (ret) {
+		ret = (char *)ret + (phys - base);	// Don't miss the offset
+	}
+
+	return ret;
+}
+
+void iounmap(void *addr)
+{
+	vfree((void *)ROUND_DOWN((ptr_t)addr, PAGE_SIZE));
+}
+
+void init_vmalloc()
+{
+	struct vm_range *r;
+
+	spinlock_init(&_vm_lock, "vm-lock");
+	avl_tree_init(&_vm_free_tree);
+	avl_tree_init(&_vm_used_tree);
+
+	/* The whole area is one free range at first */
+	r = kmalloc(sizeof(struct vm_range), 0);
+	ASSERT(r != NULL);
+
+	r->start = KERNEL_VMAP_START;
+	r->end = KERNEL_VMAP_END;
+	list_add_tail(&r->link, &_vm_ranges);
+	vm_free_insert(r);
+}
@@ -63,25 +63,20 @@ static pid_t id_alloc()
 /* Move stack to a new position */
 static void relocate_stack(uint32_t new_stack, uint32_t size)
 {
+	int rc;
 	uint32_t i, pd_addr;
 	uint32_t old_esp, old_ebp;
 	uint32_t new_esp, new_ebp;
 	uint32_t offset;
-	struct page *p;
 	ptr_t start;
-	ptr_t virt;
 	ptr_t end;
 
 	/* Map some pages to the specified virtual address */
 	start = new_stack - size;
 	end = start + size + PAGE_SIZE;
-	for (virt = start; virt < end; virt += PAGE_SIZE) {
-		p = mmu_get_page(&_kernel_mmu_ctx, virt, TRUE, 0);
-		ASSERT(p != NULL);
-		page_alloc(p, 0);
-		p->user = FALSE;
-		p->rw = TRUE;
-	}
+	rc = mmu_map_range(&_kernel_mmu_ctx, start, 0, end - start,
+			   MMU_MAP_ALLOC | MMU_MAP_WRITE);
+	ASSERT(rc == 0);
 	
 	/* Flush the TLB by reading and writing the page directory address again */
 	asm volatile("mov %%cr3, %0" : "=r"(pd_addr));
@@ -251,7 +246,7 @@ static int process_alloc(const char *name, struct process *parent, struct va_spa
 out:
 	if (rc != 0) {
 		if (p) {
-			kfree(p);
+			slab_cache_free(&_proc_cache, p);
 		}
 	}
 	
@@ -272,6 +267,21 @@ struct process *process_lookup(pid_t pid)
 	return proc;
 }
 
+/**
+ * Call a function for each process. The process tree is locked meanwhile,
+ * so the function must not create or destroy a process.
+ */
+void process_walk(process_walk_func_t func, void *ctx)
+{
+	struct avl_tree_node *node;
+
+	mutex_acquire(&_proc_tree_lock);
+	AVL_TREE_FOR_EACH(node, &_proc_tree) {
+		func(AVL_TREE_ENTRY(node, struct process), ctx);
+	}
+	mutex_release(&_proc_tree_lock);
+}
+
 /**
  * Attach a thread to a process
  */
@@ -348,7 +358,11 @@ static int create_aspace(struct process_creation *info)
 		rc = -1;
 		goto out;
 	}
-	mmu_clone_ctx(vas->mmu, &_kernel_mmu_ctx);
+	rc = mmu_clone_ctx(vas->mmu, &_kernel_mmu_ctx);
+	if (rc != 0) {
+		DEBUG(DL_INF, ("mmu_clone_ctx failed, err(%x).\n", rc));
+		goto out;
+	}
 
 	/* Lookup the file from the file system */
 	n = vfs_lookup(info->argv[0], VFS_FILE);
@@ -360,6 +374,9 @@ static int create_aspace(struct process_creation *info)
 
 	/* Load the ELF file into this process */
 	rc = elf_load_binary(n, vas, &data);
+
+	/* The regions mapped from the file hold their own reference */
+	vfs_node_deref(n);
 	if (rc != 0) {
 		DEBUG(DL_DBG, ("elf_load_binary failed, err(%x).\n", rc));
 		goto out;
@@ -374,17 +391,27 @@ static int create_aspace(struct process_creation *info)
 	size = ROUND_UP(size, PAGE_SIZE);
 	info->argc = i;
 
-	/* Map some pages for the user mode stack from the new mmu context */
+	/* Map some pages for the user mode stack from the new mmu context, it
+	 * grows down below USTACK_BOTTOM when needed. Stack pages which are
+	 * left zeroed may be merged by KSM.
+	 */
 	rc = va_map(vas, USTACK_BOTTOM, USTACK_SIZE,
-		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_FIXED, NULL);
+		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_FIXED|VA_MAP_STACK|
+		    VA_MAP_MERGE, NULL);
 	if (rc != 0) {
 		DEBUG(DL_DBG, ("va_map for ustack failed, err(%x).\n", rc));
 		goto out;
 	}
 
-	/* Map some pages for the arguments block after the stack, leave one page
-	 * non-allocated to probe stack underflow
-	 */
+	/* Leave one guard page after the stack to probe stack underflow */
+	rc = va_map(vas, USTACK_BOTTOM + USTACK_SIZE, PAGE_SIZE,
+		    VA_MAP_FIXED|VA_MAP_GUARD, NULL);
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("va_map for guard page failed, err(%x).\n", rc));
+		goto out;
+	}
+
+	/* Map some pages for the arguments block after the guard page */
 	info->args = USTACK_BOTTOM + USTACK_SIZE + PAGE_SIZE;
 	rc = va_map(vas, info->args, size,
 		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_FIXED, NULL);
@@ -400,6 +427,10 @@ static int create_aspace(struct process_creation *info)
 
  out:
 	if (rc != 0) {
+		/* Release the binary information, the entry is not needed */
+		if (data) {
+			elf_finish_binary(data);
+		}
 		if (vas) {
 			va_destroy(vas);
 		}
@@ -442,7 +473,7 @@ static void process_entry_thread(void *ctx)
 	/* Copy the arguments */
 	copy_process_args(info->argv, info->argc, args);
 
-	/* Get the ELF loader to clear BSS and get the entry pointer */
+	/* Get the entry pointer from the ELF loader */
 	entry = elf_finish_binary(info->data);
 
 	CURR_THREAD->ustack = (void *)info->ustack;
@@ -9,6 +9,9 @@
 #include "bitops.h"
 #include "mm/malloc.h"
 #include "mm/mmu.h"
+#include "mm/page.h"
+#include "mm/slab.h"
+#include "mm/numa.h"
 #include "mm/va.h"
 #include "sys/time.h"
 #include "debug.h"
@@ -57,14 +60,22 @@ static struct list _dead_threads = {
 static struct spinlock _dead_threads_lock;
 static struct semaphore _dead_threads_sem;
 
-/* Allocate a CORE for a thread to run on */
+/*
+ * Allocate a CORE for a thread to run on. Of the COREs with less than the
+ * average load, the one nearest to the node the thread last ran on is
+ * picked, as the memory of the thread was most likely allocated there.
+ */
 static struct core *sched_alloc_core(struct thread *t)
 {
 	size_t load, average, total;
+	int node;
+	uint8_t dist, best;
 	struct core *core, *other;
 	struct list *l;
 
 	core = CURR_CORE;
+	node = t->core ? t->core->node : CURR_CORE->node;
+	best = 0xFF;
 	
 	/* On UP systems, the only choice is current CORE */
 	if (_nr_cores == 1) {
@@ -81,9 +92,17 @@ static struct core *sched_alloc_core(struct thread *t)
 	LIST_FOR_EACH(l, &_running_cores) {
 		other = LIST_ENTRY(l, struct core, link);
 		load = other->sched->total;
-		if (load < average) {
+		if (load >= average) {
+			continue;
+		}
+
+		dist = numa_distance(node, other->node);
+		if (dist < best) {
 			core = other;
-			break;
+			best = dist;
+			if (dist == NUMA_LOCAL_DISTANCE) {
+				break;
+			}
 		}
 	}
 
@@ -392,6 +411,13 @@ static void sched_idle_thread(void *ctx)
 	while (TRUE) {
 		spinlock_acquire_noirq(&CURR_THREAD->lock);
 		sched_reschedule(FALSE);
+
+		/* Give the frames and objects cached by this CORE back while
+		 * idle, and zero some frames ahead for the zero-fill allocations
+		 */
+		page_drain_percore();
+		slab_drain_percore();
+		page_zero_refill();
 		
 		core_idle();
 	}
@@ -330,7 +330,7 @@ int thread_create(const char *name, struct process *owner, int flags,
 out:
 	if (rc != 0) {
 		if (t) {
-			kfree(t);
+			slab_cache_free(&_thread_cache, t);
 		}
 	}
 	
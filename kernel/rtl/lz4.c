@@ -0,0 +1,243 @@
+/*
+ * lz4.c
+ *
+ * LZ4 block format compression. A block is a list of sequences, each is a
+ * token with the lengths of its literals and of its match, the literals,
+ * and the offset of the match back in the output. The last sequence only
+ * has literals.
+ */
+
+#include <types.h>
+#include <stddef.h>
+#include <string.h>
+#include "debug.h"
+#include "rtl/lz4.h"
+
+#define LZ4_MINMATCH		4	// Shortest match
+#define LZ4_LASTLITERALS	5	// The last bytes are always literals
+#define LZ4_MFLIMIT		12	// The last match starts before this
+#define LZ4_RUN_MASK		0x0F	// Length in a token, 15 means more bytes
+
+/* The CORE allows unaligned loads */
+static INLINE uint32_t lz4_read32(const uint8_t *p)
+{
+	return *((const uint32_t *)p);
+}
+
+static INLINE uint32_t lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write the rest of a length which does not fit in its token */
+static INLINE uint8_t *lz4_write_length(uint8_t *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (uint8_t)len;
+
+	return op;
+}
+
+/* Write a sequence, match_len is 0 for the last one. Returns NULL if the
+ * output buffer is too small.
+ */
+static uint8_t *lz4_write_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			      size_t lit_len, size_t offset, size_t match_len)
+{
+	uint8_t *token;
+
+	/* Token, literal length, literals, offset and match length */
+	if ((size_t)(oend - op) <
+	    (1 + (lit_len / 255) + 1 + lit_len + 2 + (match_len / 255) + 1)) {
+		return NULL;
+	}
+
+	token = op++;
+	if (lit_len >= LZ4_RUN_MASK) {
+		*token = LZ4_RUN_MASK << 4;
+		op = lz4_write_length(op, lit_len - LZ4_RUN_MASK);
+	} else {
+		*token = (uint8_t)(lit_len << 4);
+	}
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	if (match_len) {
+		*op++ = (uint8_t)offset;
+		*op++ = (uint8_t)(offset >> 8);
+		match_len -= LZ4_MINMATCH;
+		if (match_len >= LZ4_RUN_MASK) {
+			*token |= LZ4_RUN_MASK;
+			op = lz4_write_length(op, match_len - LZ4_RUN_MASK);
+		} else {
+			*token |= (uint8_t)match_len;
+		}
+	}
+
+	return op;
+}
+
+/**
+ * Compress a buffer with a greedy match search
+ * @src		- data to compress, at most LZ4_MAX_INPUT bytes
+ * @dst		- where to store the compressed data
+ * @size	- size of the output buffer
+ * @wrkmem	- LZ4_WORKMEM_SIZE bytes for the hash table
+ * Returns the compressed size, or 0 if it does not fit in the output buffer
+ */
+size_t lz4_compress(const uint8_t *src, size_t len, uint8_t *dst,
+		    size_t size, void *wrkmem)
+{
+	uint16_t *table = wrkmem;
+	uint32_t h;
+	size_t match_len;
+	const uint8_t *ip, *ref, *anchor, *iend, *mflimit, *matchlimit;
+	uint8_t *op, *oend;
+
+	ASSERT(len <= LZ4_MAX_INPUT);
+
+	ip = anchor = src;
+	iend = src + len;
+	op = dst;
+	oend = dst + size;
+
+	if (len < (LZ4_MFLIMIT + 1)) {
+		goto last;
+	}
+
+	/* Stale entries point at the start of the input, so every entry
+	 * is a valid position and only has to be checked for a match
+	 */
+	memset(table, 0, LZ4_WORKMEM_SIZE);
+	mflimit = iend - LZ4_MFLIMIT;
+	matchlimit = iend - LZ4_LASTLITERALS;
+
+	for (ip++; ip < mflimit; ) {
+		h = lz4_hash(lz4_read32(ip));
+		ref = src + table[h];
+		table[h] = (uint16_t)(ip - src);
+		if (lz4_read32(ref) != lz4_read32(ip)) {
+			ip++;
+			continue;
+		}
+
+		/* Extend the match backwards over the pending literals */
+		while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+			ip--;
+			ref--;
+		}
+
+		match_len = LZ4_MINMATCH;
+		while (((ip + match_len) < matchlimit) &&
+		       (ip[match_len] == ref[match_len])) {
+			match_len++;
+		}
+
+		op = lz4_write_seq(op, oend, anchor, ip - anchor, ip - ref,
+				   match_len);
+		if (!op) {
+			return 0;
+		}
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+ last:
+	op = lz4_write_seq(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op) {
+		return 0;
+	}
+
+	return op - dst;
+}
+
+/* Read the rest of a length which does not fit in its token */
+static INLINE int lz4_read_length(const uint8_t **ip, const uint8_t *iend,
+				  size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend) {
+			return -1;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/**
+ * Decompress a block, malformed input is never read or written past the
+ * end of the buffers
+ * @src		- compressed data
+ * @dst		- where to store the data
+ * @size	- size of the output buffer
+ * Returns the decompressed size, or -1 if the block is malformed
+ */
+int lz4_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t size)
+{
+	uint8_t token;
+	size_t lit_len, match_len, offset;
+	const uint8_t *ip, *iend, *ref;
+	uint8_t *op, *oend;
+
+	ip = src;
+	iend = src + len;
+	op = dst;
+	oend = dst + size;
+
+	while (ip < iend) {
+		token = *ip++;
+
+		lit_len = token >> 4;
+		if ((lit_len == LZ4_RUN_MASK) &&
+		    (lz4_read_length(&ip, iend, &lit_len) != 0)) {
+			return -1;
+		}
+		if ((lit_len > (size_t)(iend - ip)) ||
+		    (lit_len > (size_t)(oend - op))) {
+			return -1;
+		}
+		memcpy(op, ip, lit_len);
+		op += lit_len;
+		ip += lit_len;
+
+		/* The last sequence has no match */
+		if (ip == iend) {
+			break;
+		}
+
+		if ((iend - ip) < 2) {
+			return -1;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || (offset > (size_t)(op - dst))) {
+			return -1;
+		}
+
+		match_len = token & LZ4_RUN_MASK;
+		if ((match_len == LZ4_RUN_MASK) &&
+		    (lz4_read_length(&ip, iend, &match_len) != 0)) {
+			return -1;
+		}
+		match_len += LZ4_MINMATCH;
+		if (match_len > (size_t)(oend - op)) {
+			return -1;
+		}
+
+		/* The match may overlap the output, copy it a byte at a time */
+		ref = op - offset;
+		while (match_len--) {
+			*op++ = *ref++;
+		}
+	}
+
+	return op - dst;
+}
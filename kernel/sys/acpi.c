@@ -11,6 +11,9 @@
 
 STATIC_ASSERT(sizeof(struct acpi_rsdp) == 36);
 STATIC_ASSERT(sizeof(struct acpi_header) == 36);
+STATIC_ASSERT(sizeof(struct acpi_srat_core) == 16);
+STATIC_ASSERT(sizeof(struct acpi_srat_memory) == 40);
+STATIC_ASSERT(sizeof(struct acpi_srat_x2apic) == 24);
 
 /* Pointers to copies of ACPI tables */
 static struct acpi_header **_acpi_tables = NULL;
@@ -27,7 +30,7 @@ static struct acpi_rsdp *acpi_find_rsdp(phys_addr_t start, size_t size)
 	for (i = 0; i < size; i+= 16) {
 
 		/* We have identity mapped the region before */
-		rsdp = (struct acpi_rsdp *)(start + i);
+		rsdp = (struct acpi_rsdp *)(ptr_t)(start + i);
 
 		/* Check if the signature and checksum are correct */
 		if (strncmp((char *)rsdp->signature, ACPI_RSDP_SIGNATURE, 8) != 0) {
@@ -78,7 +81,7 @@ static void acpi_copy_table(phys_addr_t addr, struct acpi_header **h)
 		/* If map failed, then the page must already be mapped, so
 		 * just access it directly.
 		 */
-		hdr = (struct acpi_header *)addr;
+		hdr = (struct acpi_header *)(ptr_t)addr;
 	}
 
 	/* Sanity check */
@@ -88,7 +91,7 @@ static void acpi_copy_table(phys_addr_t addr, struct acpi_header **h)
 		goto out;
 	}
 
-	kprintf("acpi: table %x %.4s V%d %.6s %.8s %d\n",
+	kprintf("acpi: table %llx %.4s V%d %.6s %.8s %d\n",
 		addr, hdr->signature, hdr->revision, hdr->oem_id,
 		hdr->oem_table_id, hdr->oem_revision);
 
@@ -241,7 +244,7 @@ void init_acpi()
 	mapping = (uint16_t *)0x40e;
 	ebda = (*mapping) << 4;
 	
-	kprintf("acpi: Extended BIOS Data Area at %p\n", ebda);
+	kprintf("acpi: Extended BIOS Data Area at %llx\n", ebda);
 
 	/* Search for the RSDP */
 	if (!(rsdp = acpi_find_rsdp(ebda, 0x400))) {
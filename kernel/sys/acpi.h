@@ -22,6 +22,14 @@
 #define ACPI_MADT_LAPIC		0		// Core Local APIC
 #define ACPI_MADT_IOAPIC	1		// I/O APIC
 
+/* SRAT affinity structure types */
+#define ACPI_SRAT_CORE		0		// Core Local APIC affinity
+#define ACPI_SRAT_MEMORY	1		// Memory affinity
+#define ACPI_SRAT_X2APIC	2		// Core Local x2APIC affinity
+
+/* SRAT affinity flags */
+#define ACPI_SRAT_ENABLED	(1<<0)		// Structure is in use
+
 /* Root System Description Pointer (RSDP) */
 struct acpi_rsdp {
 	uint8_t signature[8];			// Signature (ACPI_RSDP_SIGNATURE)
@@ -76,6 +84,58 @@ struct acpi_madt_lapic {
 	uint32_t flags;
 };
 
+/* System Resource Affinity Table (SRAT) */
+struct acpi_srat {
+	struct acpi_header header;
+	uint32_t reserved1;			// Reserved, must be 1
+	uint64_t reserved2;			// Reserved
+	uint8_t affinity_structures[];
+} __attribute__((packed));
+
+/* SRAT Processor local APIC affinity structure */
+struct acpi_srat_core {
+	uint8_t type;
+	uint8_t length;
+	uint8_t domain_lo;			// Bits [7:0] of the proximity domain
+	uint8_t lapic_id;
+	uint32_t flags;
+	uint8_t lsapic_eid;
+	uint8_t domain_hi[3];			// Bits [31:8] of the proximity domain
+	uint32_t clock_domain;
+} __attribute__((packed));
+
+/* SRAT Memory affinity structure */
+struct acpi_srat_memory {
+	uint8_t type;
+	uint8_t length;
+	uint32_t domain;			// Proximity domain
+	uint16_t reserved1;
+	uint64_t base;				// Base address of the range
+	uint64_t size;				// Length of the range
+	uint32_t reserved2;
+	uint32_t flags;
+	uint64_t reserved3;
+} __attribute__((packed));
+
+/* SRAT Processor local x2APIC affinity structure */
+struct acpi_srat_x2apic {
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved1;
+	uint32_t domain;			// Proximity domain
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t reserved2;
+} __attribute__((packed));
+
+/* System Locality Distance Information Table (SLIT) */
+struct acpi_slit {
+	struct acpi_header header;
+	uint64_t nr_localities;			// Number of system localities
+	uint8_t entry[];			// Distances, a row for each locality
+} __attribute__((packed));
+
 extern boolean_t _acpi_supported;
 
 extern struct acpi_header *acpi_find_table(const char *signature);
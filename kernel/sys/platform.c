@@ -4,6 +4,7 @@
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/lapic.h"
+#include "mm/numa.h"
 #include "acpi.h"
 #include "pit.h"
 #include "platform.h"
@@ -11,10 +12,135 @@
 /* Whether ACPI is supported */
 boolean_t _acpi_supported = FALSE;
 
+/* Register the distances between the proximity domains found in the SLIT */
+static void platform_detect_distance()
+{
+	struct acpi_slit *slit;
+	uint32_t nr, i, j;
+
+	slit = (struct acpi_slit *)acpi_find_table(ACPI_SLIT_SIGNATURE);
+	if (!slit) {
+		return;
+	}
+
+	if (slit->header.length < sizeof(struct acpi_slit)) {
+		kprintf("platform: SLIT truncated\n");
+		return;
+	}
+
+	/* The number of localities is 64 bits wide, it is bounded before its
+	 * square is taken
+	 */
+	if (slit->nr_localities > NUMA_MAX_NODES) {
+		kprintf("platform: SLIT of %d localities not supported\n",
+			(uint32_t)slit->nr_localities);
+		return;
+	}
+
+	nr = (uint32_t)slit->nr_localities;
+	if ((nr * nr) > (slit->header.length - sizeof(struct acpi_slit))) {
+		kprintf("platform: SLIT of %d localities truncated\n", nr);
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < nr; j++) {
+			numa_set_distance(i, j, slit->entry[i * nr + j]);
+		}
+	}
+}
+
+/*
+ * Find the NUMA nodes of the memory and the COREs in the SRAT, the system
+ * has a single node if there is no SRAT.
+ */
+static void platform_detect_numa()
+{
+	struct acpi_srat *srat;
+	struct acpi_srat_core *core;
+	struct acpi_srat_memory *mem;
+	struct acpi_srat_x2apic *x2apic;
+	uint8_t *entry;
+	size_t len, i;
+	uint32_t domain;
+
+	if (!_acpi_supported) {
+		return;
+	}
+
+	srat = (struct acpi_srat *)acpi_find_table(ACPI_SRAT_SIGNATURE);
+	if (!srat) {
+		DEBUG(DL_DBG, ("platform: no SRAT, single memory node\n"));
+		return;
+	}
+
+	if (srat->header.length < sizeof(struct acpi_srat)) {
+		kprintf("platform: SRAT truncated\n");
+		return;
+	}
+
+	/* Each entry must lie in the table and be as long as its type says */
+	len = srat->header.length - sizeof(struct acpi_srat);
+	for (i = 0; (i + 2) <= len; i += entry[1]) {
+		entry = srat->affinity_structures + i;
+		if ((entry[1] < 2) || ((i + entry[1]) > len)) {
+			kprintf("platform: SRAT entry at %d malformed\n", i);
+			break;
+		}
+
+		switch (entry[0]) {
+		case ACPI_SRAT_CORE:
+			if (entry[1] < sizeof(struct acpi_srat_core)) {
+				continue;
+			}
+			core = (struct acpi_srat_core *)entry;
+			if (!FLAG_ON(core->flags, ACPI_SRAT_ENABLED)) {
+				continue;
+			}
+			domain = core->domain_lo |
+				((uint32_t)core->domain_hi[0] << 8) |
+				((uint32_t)core->domain_hi[1] << 16) |
+				((uint32_t)core->domain_hi[2] << 24);
+			numa_add_core(domain, core->lapic_id);
+			break;
+		case ACPI_SRAT_MEMORY:
+			if (entry[1] < sizeof(struct acpi_srat_memory)) {
+				continue;
+			}
+			mem = (struct acpi_srat_memory *)entry;
+			if (!FLAG_ON(mem->flags, ACPI_SRAT_ENABLED) || !mem->size) {
+				continue;
+			}
+			numa_add_memory(mem->domain, mem->base, mem->size);
+			break;
+		case ACPI_SRAT_X2APIC:
+			if (entry[1] < sizeof(struct acpi_srat_x2apic)) {
+				continue;
+			}
+			x2apic = (struct acpi_srat_x2apic *)entry;
+			if (!FLAG_ON(x2apic->flags, ACPI_SRAT_ENABLED)) {
+				continue;
+			}
+			numa_add_core(x2apic->domain, x2apic->x2apic_id);
+			break;
+		default:
+			break;
+		}
+	}
+
+	platform_detect_distance();
+
+	init_numa();
+	kprintf("platform: %d NUMA node(s) detected\n", _nr_numa_nodes);
+}
+
 void init_platform()
 {
 	init_acpi();
 
+	/* The nodes must be known before the other COREs are registered */
+	platform_detect_numa();
+
 	/* If the LAPIC is not available, we must use the PIT as the timer */
 	if (!lapic_enabled()) {
 		init_pit();
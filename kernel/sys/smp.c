@@ -3,6 +3,7 @@
 #include <string.h>
 #include "debug.h"
 #include "list.h"
+#include "bitops.h"
 #include "hal/hal.h"
 #include "hal/core.h"
 #include "hal/lapic.h"
@@ -28,12 +29,27 @@ struct smp_call {
 	int ref_count;		// Reference count
 };
 
+/*
+ * TLB invalidations pending on a CORE. The ranges of all the senders are
+ * merged, so a CORE flushes them on a single IPI.
+ */
+struct smp_tlb {
+	struct spinlock lock;	// Lock for the pending ranges
+	struct mmu_gather pending; // Pending ranges of any context
+	atomic_t req;		// Number of shootdowns requested
+	atomic_t done;		// Number of shootdowns completed
+	boolean_t busy;		// The CORE is flushing the pending ranges
+};
+
 /* Page reserved to copy the AC bootstrap code to */
 static phys_addr_t _ac_bootstrap_page = 0;
 
 static struct smp_call *_smp_call_pool = NULL;
 static boolean_t _smp_call_enabled = FALSE;
 
+/* Pending TLB invalidations of each CORE */
+static struct smp_tlb *_smp_tlb = NULL;
+
 /* Variable used to synchronize the stages of the SMP boot process */
 volatile uint32_t _smp_boot_status = 0;
 
@@ -42,6 +58,7 @@ extern void kmain_ac(struct core *c);
 
 void arch_smp_boot_prepare()
 {
+	int rc;
 	void *mapping;
 	size_t s;
 	
@@ -49,12 +66,15 @@ void arch_smp_boot_prepare()
 	 * the application core is in real mode and only can access memory
 	 * lower than 1MB. Also the AC will start execution from 0x000VV000.
 	 */
-	phys_alloc(PAGE_SIZE, 0, 0, 0x100000, 0, &_ac_bootstrap_page);
+	rc = phys_alloc(PAGE_SIZE, 0, 0, 0x100000, 0, &_ac_bootstrap_page);
+	if (rc != 0) {
+		PANIC("No low memory for AP trampoline");
+	}
 
 	/* As we have already identity mapped the pages we required, so just
 	 * access it directly. You should find a better way to do this.
 	 */
-	mapping = (void *)_ac_bootstrap_page;
+	mapping = (void *)(ptr_t)_ac_bootstrap_page;
 
 	s = __ac_trampoline_end - __ac_trampoline_start;
 	ASSERT((s > 0) && (s < PAGE_SIZE));
@@ -159,11 +179,115 @@ void smp_boot_cores()
 	local_irq_restore(state);
 }
 
+/* Flush the TLB invalidations pending on this CORE */
+static void smp_tlb_process()
+{
+	struct smp_tlb *t;
+	struct mmu_gather g;
+	int32_t req;
+
+	t = &_smp_tlb[CURR_CORE->id];
+
+	/* Taking the lock below may spin and poll for shootdowns again */
+	if (t->busy) {
+		return;
+	}
+	t->busy = TRUE;
+
+	spinlock_acquire_noirq(&t->lock);
+	g = t->pending;
+	req = t->req;
+	mmu_gather_init(&t->pending, NULL, 0);
+	spinlock_release_noirq(&t->lock);
+
+	if (g.nr || FLAG_ON(g.flags, MMU_FLUSH_ALL)) {
+		mmu_flush_local(&g);
+	}
+
+	/* A dropped context may be borrowed by the kernel thread running on
+	 * this CORE, switch to the kernel context before it is freed.
+	 */
+	if (FLAG_ON(g.flags, MMU_FLUSH_DROP) && CURR_CORE->tlb_lazy &&
+	    CURR_ASPACE) {
+		CURR_ASPACE = NULL;
+		mmu_load_ctx(&_kernel_mmu_ctx);
+	}
+
+	t->done = req;
+	t->busy = FALSE;
+}
+
+/*
+ * Flush the TLB invalidations pending on this CORE while it spins with
+ * interrupts disabled. The CORE holding the lock may be waiting for this
+ * CORE to acknowledge a shootdown, which the IPI can not deliver.
+ */
+void smp_tlb_poll()
+{
+	struct smp_tlb *t;
+
+	if (!_smp_tlb) {
+		return;
+	}
+
+	t = &_smp_tlb[CURR_CORE->id];
+	if (t->done != t->req) {
+		smp_tlb_process();
+	}
+}
+
+/**
+ * Flush gathered TLB invalidations on other COREs and wait for them. Must
+ * be called with interrupts disabled.
+ * @cores	- bitmap of the destination COREs
+ * @g		- gathered ranges
+ */
+void smp_tlb_shootdown(u_long cores, struct mmu_gather *g)
+{
+	struct smp_tlb *t;
+	int32_t ticket[sizeof(u_long) * 8];
+	size_t i;
+	int id;
+	u_long sent;
+
+	ASSERT(_smp_tlb != NULL);
+
+	/* Queue the ranges on each destination and kick it */
+	for (sent = cores; sent; sent &= ~(1UL << id)) {
+		id = bitops_ffs(sent);
+		t = &_smp_tlb[id];
+
+		spinlock_acquire_noirq(&t->lock);
+		t->pending.flags |= g->flags;
+		for (i = 0; i < g->nr; i++) {
+			mmu_gather_add(&t->pending, g->range[i].virt,
+				       g->range[i].size);
+		}
+		ticket[id] = atomic_inc(&t->req) + 1;
+		spinlock_release_noirq(&t->lock);
+
+		lapic_ipi(LAPIC_IPI_DEST_SINGLE, id, LAPIC_IPI_FIXED,
+			  LAPIC_VECT_IPI);
+	}
+
+	/* Wait for the destinations to flush, our own pending ranges are
+	 * flushed meanwhile as the sender may be shooting us down too.
+	 */
+	for (sent = cores; sent; sent &= ~(1UL << id)) {
+		id = bitops_ffs(sent);
+		t = &_smp_tlb[id];
+		while ((t->done - ticket[id]) < 0) {
+			smp_tlb_process();
+			core_spin_hint();
+		}
+	}
+}
+
 void smp_ipi_handler()
 {
 	ASSERT(_smp_call_enabled);
 
-	DEBUG(DL_DBG, ("received IPI.\n"));
+	smp_tlb_process();
 }
 
 void init_smp()
@@ -195,6 +319,20 @@ void init_smp()
 		_smp_call_pool = &calls[i];
 	}
 
+	/* The COREs using an MMU context are tracked in a bitmap */
+	ASSERT(_highest_core_id < (sizeof(u_long) * 8));
+	_smp_tlb = kmalloc((_highest_core_id + 1) * sizeof(struct smp_tlb), 0);
+	if (!_smp_tlb) {
+		goto out;
+	}
+	for (i = 0; i <= _highest_core_id; i++) {
+		spinlock_init(&_smp_tlb[i].lock, "tlb-lock");
+		mmu_gather_init(&_smp_tlb[i].pending, NULL, 0);
+		_smp_tlb[i].req = 0;
+		_smp_tlb[i].done = 0;
+		_smp_tlb[i].busy = FALSE;
+	}
+
 	_smp_call_enabled = TRUE;
 
 	/* Boot all the application COREs in the system */
@@ -10,6 +10,8 @@
 #include "hal/isr.h"
 #include "mm/malloc.h"
 #include "mm/slab.h"
+#include "mm/va.h"
+#include "sys/mman.h"
 #include "util.h"
 #include "dirent.h"
 #include "sys/stat.h"
@@ -626,6 +628,115 @@ int sys_ioctl(int d, int request, void *input, void *output)
 	return rc;
 }
 
+/* Convert the protection and map flags of mmap to the va_map flags */
+static int mmap_flags(int flags)
+{
+	int ret = 0;
+
+	if (FLAG_ON(flags, PROT_READ)) {
+		ret |= VA_MAP_READ;
+	}
+	if (FLAG_ON(flags, PROT_WRITE)) {
+		ret |= VA_MAP_WRITE;
+	}
+	if (FLAG_ON(flags, PROT_EXEC)) {
+		ret |= VA_MAP_EXEC;
+	}
+	/* A fixed mapping replaces the mappings in its way, they are only
+	 * removed once the new mapping can be created
+	 */
+	if (FLAG_ON(flags, MAP_FIXED)) {
+		ret |= VA_MAP_FIXED | VA_MAP_REPLACE;
+	}
+
+	return ret;
+}
+
+/*
+ * Map memory or a file into the address space of the current process, the
+ * flags holds both the protection and the map flags.
+ */
+int sys_mmap(void *start, size_t size, int flags, int fd, off_t offset)
+{
+	int rc = -1;
+	ptr_t addr = 0;
+	struct vfs_node *n = NULL;
+
+	size = ROUND_UP(size, PAGE_SIZE);
+	if (!size || ((ptr_t)start % PAGE_SIZE) || (offset % PAGE_SIZE)) {
+		DEBUG(DL_DBG, ("invalid arguments, start(%p) size(%x) offset(%x).\n",
+			       start, size, offset));
+		goto out;
+	}
+
+	/* Exactly one of MAP_PRIVATE and MAP_SHARED must be given. We have no
+	 * page cache and anonymous memory is not shared between processes, so
+	 * only private mappings are supported. This is EINVAL, reported as -1
+	 * like the other errors.
+	 */
+	if (!FLAG_ON(flags, MAP_PRIVATE) || FLAG_ON(flags, MAP_SHARED)) {
+		DEBUG(DL_DBG, ("invalid map flags(%x).\n", flags));
+		goto out;
+	}
+
+	if (!FLAG_ON(flags, MAP_ANONYMOUS)) {
+		n = fd_2_vfs_node(NULL, fd);
+		if (!n || (n->type != VFS_FILE)) {
+			DEBUG(DL_DBG, ("invalid fd(%d).\n", fd));
+			goto out;
+		}
+	}
+
+	if (n) {
+		rc = va_map_file(CURR_PROC->vas, (ptr_t)start, size,
+				 mmap_flags(flags), n, offset,
+				 (offset < n->length) ? (n->length - offset) : 0,
+				 NULL, &addr);
+	} else {
+		/* Anonymous pages may be merged with identical ones */
+		rc = va_map(CURR_PROC->vas, (ptr_t)start, size,
+			    mmap_flags(flags) | VA_MAP_ZERO | VA_MAP_MERGE,
+			    &addr);
+	}
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("map failed, err(%x).\n", rc));
+		rc = -1;
+		goto out;
+	}
+
+	rc = (int)addr;
+
+ out:
+	return rc;
+}
+
+int sys_munmap(void *start, size_t size)
+{
+	int rc;
+
+	rc = va_unmap(CURR_PROC->vas, (ptr_t)start, ROUND_UP(size, PAGE_SIZE));
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("va_unmap failed, err(%x).\n", rc));
+		rc = -1;
+	}
+
+	return rc;
+}
+
+int sys_mprotect(void *start, size_t size, int prot)
+{
+	int rc;
+
+	rc = va_protect(CURR_PROC->vas, (ptr_t)start, ROUND_UP(size, PAGE_SIZE),
+			mmap_flags(prot));
+	if (rc != 0) {
+		DEBUG(DL_DBG, ("va_protect failed, err(%x).\n", rc));
+		rc = -1;
+	}
+
+	return rc;
+}
+
 /*
  * NOTE: When adding a system call, please add the following items:
  *   [1] _syscalls - the array which contains pointers to the system calls
@@ -668,6 +779,9 @@ static void *_syscalls[] = {
 	sys_query_module,
 	sys_delete_module,
 	sys_ioctl,
+	sys_mmap,
+	sys_munmap,
+	sys_mprotect,
 	NULL
 };
 
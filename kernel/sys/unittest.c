@@ -2,12 +2,23 @@
 #include <stddef.h>
 #include <string.h>
 #include <limit.h>
+#include <errno.h>
 #include "matrix/matrix.h"
 #include "mm/malloc.h"
+#include "mm/kmem.h"
+#include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/va.h"
+#include "mm/mlayout.h"
+#include "mm/phys.h"
+#include "mm/vmalloc.h"
+#include "mm/reclaim.h"
+#include "mm/swap.h"
+#include "mm/ksm.h"
+#include "mm/numa.h"
 #include "debug.h"
 #include "kd.h"
+#include "device.h"
 #include "mutex.h"
 #include "semaphore.h"
 #include "proc/thread.h"
@@ -15,7 +26,9 @@
 #include "rtl/bitmap.h"
 #include "rtl/fsrtl.h"
 #include "rtl/hashtable.h"
+#include "rtl/lz4.h"
 #include "kstrdup.h"
+#include "elf.h"
 
 #define NR_AVL_NODES	13
 struct avl_tree_node _avl_nodes[NR_AVL_NODES];
@@ -64,6 +77,93 @@ static int test_compare(void *key, void *entry)
 	return strcmp((char *)k, w->str);
 }
 
+/* RAM disk the swap test writes pages to */
+#define UT_RAMDISK_MAJOR	0x7F
+#define UT_RAMDISK_SIZE		(8 * PAGE_SIZE)
+
+static uint8_t *_ut_ramdisk = NULL;
+
+static int ut_ramdisk_read(struct dev *d, off_t off, size_t size, uint8_t *buf)
+{
+	if ((off + size) > UT_RAMDISK_SIZE) {
+		return EINVAL;
+	}
+	memcpy(buf, _ut_ramdisk + off, size);
+	return 0;
+}
+
+static int ut_ramdisk_write(struct dev *d, off_t off, size_t size, uint8_t *buf)
+{
+	if ((off + size) > UT_RAMDISK_SIZE) {
+		return EINVAL;
+	}
+	memcpy(_ut_ramdisk + off, buf, size);
+	return 0;
+}
+
+static struct dev_ops _ut_ramdisk_ops = {
+	.read = ut_ramdisk_read,
+	.write = ut_ramdisk_write
+};
+
+static size_t _ut_shrink_count = 0;
+
+static size_t test_shrink(size_t count)
+{
+	_ut_shrink_count = count;
+	return 0;
+}
+
+static struct shrinker _ut_shrinker = {
+	.name = "ut-shrinker",
+	.shrink = test_shrink
+};
+
+static volatile boolean_t _ut_heap_stop = FALSE;
+
+/* Keep the global heap lock busy, most likely from another CORE */
+static void ut_heap_thread(void *ctx)
+{
+	void *p;
+
+	while (!_ut_heap_stop) {
+		p = kmalloc(8 * PAGE_SIZE, 0);
+		if (p) {
+			kfree(p);
+		}
+	}
+	semaphore_up((struct semaphore *)ctx, 1);
+}
+
+/* Rewrite the first byte of every page of the mergeable regions of an
+ * address space, so each of these pages becomes a private copy
+ */
+static void ut_touch_space(struct va_space *vas)
+{
+	boolean_t state;
+	struct va_space *old;
+	struct va_region *r;
+	struct list *l;
+	ptr_t virt;
+
+	/* Stay on this CORE while the address space is switched */
+	state = local_irq_disable();
+	old = CURR_ASPACE;
+	va_switch(vas);
+	LIST_FOR_EACH(l, &vas->regions) {
+		r = LIST_ENTRY(l, struct va_region, link);
+		if ((r->type == VA_REGION_FREE) ||
+		    !FLAG_ON(r->flags, VA_MAP_MERGE)) {
+			continue;
+		}
+		for (virt = r->start; virt < r->end; virt += PAGE_SIZE) {
+			*((volatile u_char *)virt) = *((volatile u_char *)virt);
+		}
+	}
+	va_switch(old);
+	local_irq_restore(state);
+}
+
 static void unit_test_thread(void *ctx)
 {
 	struct semaphore *sem;
@@ -80,7 +180,7 @@ int sys_unit_test(uint32_t round)
 	void *obj[4];
 	struct spinlock lock;
 	void *buf_ptr[32];
-	ptr_t start;
+	ptr_t start, virt;
 	size_t size;
 	struct bitmap bm;
 	u_long *bm_buf;
@@ -94,6 +194,25 @@ int sys_unit_test(uint32_t round)
 	struct word w1, w2, w3, *ht_val = NULL;
 	void *buckets = NULL;
 	struct semaphore sem;
+	struct page pg, *pp;
+	struct mmu_ctx *mmu;
+	page_num_t frame;
+	struct vfs_node *n;
+	struct va_cache *cache;
+	struct mmu_gather g;
+	phys_addr_t phys, phys2;
+	u_char *buf;
+	boolean_t state;
+	struct dev *d;
+	dev_t devno;
+	struct ksm_stats ks;
+	size_t merged;
+	boolean_t swapped;
+	void *wrkmem;
+	struct va_space *ut_vas[2];
+	struct va_region *reg;
+	struct list *l;
+	void *data;
 
 	/* String function test */
 	ASSERT(strncmp(str1, str2, 4) == 0);
@@ -114,6 +233,7 @@ int sys_unit_test(uint32_t round)
 			DEBUG(DL_DBG, ("malloc from kernel pool failed.\n"));
 			goto out;
 		} else {
+			ASSERT(kmalloc_size(buf_ptr[i]) >= s);
 			memset(buf_ptr[i], 0, s);
 		}
 	}
@@ -121,9 +241,77 @@ int sys_unit_test(uint32_t round)
 		ASSERT(buf_ptr[i] != NULL);
 		kfree(buf_ptr[i]);
 	}
+	buf_ptr[0] = kmalloc(100, 0);
+	memset(buf_ptr[0], 0xAB, 100);
+	buf_ptr[0] = krealloc(buf_ptr[0], 5000, MM_ZERO);
+	ASSERT(buf_ptr[0] != NULL);
+	ASSERT((((u_char *)buf_ptr[0])[99] == 0xAB) &&
+	       (((u_char *)buf_ptr[0])[4999] == 0));
+	kfree(buf_ptr[0]);
+	/* Blocks of the kernel memory pool are 8 byte aligned */
+	for (i = 1; i < 32; i += 5) {
+		buf_ptr[i] = kmem_alloc(i, 0);
+		ASSERT((buf_ptr[i] != NULL) && (((ptr_t)buf_ptr[i] % 8) == 0));
+	}
+	for (i = 1; i < 32; i += 5) {
+		kmem_free(buf_ptr[i]);
+	}
 	DEBUG(DL_DBG, ("memory pool test finished.\n"));
 
 
+	/* Page frame cache test, a freed frame is hot and reused first */
+	memset(&pg, 0, sizeof(pg));
+	page_alloc(&pg, 0);
+	frame = mmu_pte_frame(&pg);
+	page_free(&pg);
+	page_alloc(&pg, 0);
+	ASSERT(mmu_pte_frame(&pg) == frame);
+	page_free(&pg);
+	/* Frames are copied wherever they are, also above 4GB */
+	if (phys_alloc(PAGE_SIZE, 0, 0, 0, 0, &phys) == 0) {
+		buf = mmu_kmap(phys, 0, &state);
+		ASSERT(((ptr_t)buf >= KERNEL_KMAP_START) &&
+		       ((ptr_t)buf < KERNEL_KMAP_END));
+		buf[PAGE_SIZE - 1] = 0x5A;
+		mmu_kunmap(buf, state);
+		if (phys_alloc(PAGE_SIZE, 0, 0, 0, 0, &phys2) == 0) {
+			page_copy(phys2, phys);
+			buf = mmu_kmap(phys2, 1, &state);
+			ASSERT(buf[PAGE_SIZE - 1] == 0x5A);
+			mmu_kunmap(buf, state);
+			phys_free(phys2, PAGE_SIZE);
+		}
+		phys_free(phys, PAGE_SIZE);
+	}
+	/* Zeroed frames come from the pre-zeroed pool or are zeroed inline */
+	page_zero_refill();
+	page_alloc(&pg, MM_ZERO);
+	if (((phys_addr_t)mmu_pte_frame(&pg) * PAGE_SIZE) < _mmu_phys_map_end) {
+		ASSERT(((u_long *)((ptr_t)mmu_pte_frame(&pg) * PAGE_SIZE))[PAGE_SIZE / 8] == 0);
+	}
+	page_free(&pg);
+	/* Ranges come from the node of this CORE while it has free frames */
+	ASSERT(numa_fallback(CURR_CORE->node)[0] == CURR_CORE->node);
+	ASSERT(numa_distance(CURR_CORE->node, CURR_CORE->node) ==
+	       NUMA_LOCAL_DISTANCE);
+	if (phys_alloc(PAGE_SIZE, 0, 0, 0, 0, &phys) == 0) {
+		ASSERT((page_frame(phys / PAGE_SIZE)->node == CURR_CORE->node) ||
+		       !page_node_free_count(CURR_CORE->node));
+		phys_free(phys, PAGE_SIZE);
+	}
+	/* A frame mapped at a temporary slot is the one in the physical map */
+	if (phys_alloc(PAGE_SIZE, 0, 0, _mmu_phys_map_end, 0, &phys) == 0) {
+		buf = mmu_kmap(phys, 0, &state);
+		ASSERT(((ptr_t)buf >= KERNEL_KMAP_START) &&
+		       ((ptr_t)buf < KERNEL_KMAP_END));
+		buf[PAGE_SIZE - 1] = 0x5A;
+		mmu_kunmap(buf, state);
+		ASSERT(((u_char *)(ptr_t)phys)[PAGE_SIZE - 1] == 0x5A);
+		phys_free(phys, PAGE_SIZE);
+	}
+	DEBUG(DL_DBG, ("page frame cache test finished.\n"));
+
+
 	/* Memory map test */
 	start = 0x40000000;
 	size = 0x4000;
@@ -133,10 +321,243 @@ int sys_unit_test(uint32_t round)
 		DEBUG(DL_DBG, ("va_map failed.\n"));
 		goto out;
 	} else {
+		/* Frames are allocated on first touch */
+		pp = mmu_get_page(CURR_PROC->vas->mmu, start, FALSE, 0);
+		ASSERT(!pp || !pp->present);
 		memset((void *)start, 0, size);
+		pp = mmu_get_page(CURR_PROC->vas->mmu, start, FALSE, 0);
+		ASSERT(pp && pp->present);
+		/* Data is not executable if the CORE supports no execute */
+		ASSERT(!_mmu_nx || pp->nx);
+
+		/* The cloned pages are shared until the first write */
+		mmu = mmu_create_ctx();
+		ASSERT(mmu != NULL);
+		rc = mmu_clone_ctx(mmu, CURR_PROC->vas->mmu);
+		ASSERT(rc == 0);
+		pp = mmu_get_page(mmu, start, FALSE, 0);
+		ASSERT(pp->cow && (page_refcount(mmu_pte_frame(pp)) == 2));
+		*((volatile int *)start) = 1;
+		ASSERT(page_refcount(mmu_pte_frame(pp)) == 1);
+		ASSERT(*((int *)start) == 1);
+		/* Drop the references the clone took on every user page, the
+		 * pages of this process become writable again on first write
+		 */
+		frame = mmu_pte_frame(mmu_get_page(mmu, start + PAGE_SIZE,
+						   FALSE, 0));
+		ASSERT(page_refcount(frame) == 2);
+		mmu_unmap_range(mmu, USER_START, USER_END - USER_START, TRUE);
+		ASSERT(page_refcount(frame) == 1);
+		mmu_destroy_ctx(mmu);
+		
 		rc = va_unmap(CURR_PROC->vas, start, size);
 		ASSERT(rc == 0);
 	}
+	/* Mappings without a fixed address are placed in free space */
+	rc = va_map(CURR_PROC->vas, 0, 2 * PAGE_SIZE, VA_MAP_READ|VA_MAP_WRITE,
+		    &start);
+	ASSERT((rc == 0) && (start >= USER_START));
+	rc = va_protect(CURR_PROC->vas, start, PAGE_SIZE, VA_MAP_READ);
+	ASSERT(rc == 0);
+	ASSERT(*((volatile int *)start) == 0);
+	rc = va_unmap(CURR_PROC->vas, start, 2 * PAGE_SIZE);
+	ASSERT(rc == 0);
+	/* Ranges are mapped and unmapped a page table at a time */
+	start = 0x503FE000;
+	rc = mmu_map_range(CURR_PROC->vas->mmu, start, 0, 4 * PAGE_SIZE,
+			   MMU_MAP_ALLOC | MMU_MAP_WRITE);
+	ASSERT(rc == 0);
+	pp = mmu_get_page(CURR_PROC->vas->mmu, start + 3 * PAGE_SIZE, FALSE, 0);
+	ASSERT(pp && pp->present && pp->rw);
+	/* Only the kernel pages are global */
+	ASSERT(!pp->global && FLAG_ON(x86_read_cr4(), X86_CR4_PGE));
+	*((volatile int *)(start + 3 * PAGE_SIZE)) = 1;
+	rc = mmu_map_range(CURR_PROC->vas->mmu, start, 0, PAGE_SIZE,
+			   MMU_MAP_ALLOC);
+	ASSERT(rc == EMAPPED);
+	mmu_unmap_range(CURR_PROC->vas->mmu, start, 4 * PAGE_SIZE, TRUE);
+	ASSERT(!pp->present && !mmu_pte_frame(pp));
+	/* Aligned kernel ranges are mapped by large pages */
+	if (_mmu_large_pages) {
+		virt = KERNEL_KMEM_END - (KERNEL_KMEM_END % LARGE_PAGE_SIZE) -
+			LARGE_PAGE_SIZE;
+		rc = mmu_map_range(&_kernel_mmu_ctx, virt, 0, LARGE_PAGE_SIZE,
+				   MMU_MAP_READ | MMU_MAP_LARGE);
+		ASSERT(rc == 0);
+		ASSERT(mmu_get_page(&_kernel_mmu_ctx, virt, FALSE, 0) == NULL);
+		rc = mmu_translate(CURR_PROC->vas->mmu, virt + 0x1234, &phys);
+		ASSERT((rc == 0) && (phys == 0x1234));
+		/* A partly unmapped large page is split first */
+		rc = mmu_unmap_range(&_kernel_mmu_ctx, virt + PAGE_SIZE,
+				     PAGE_SIZE, FALSE);
+		ASSERT(rc == 0);
+		ASSERT(mmu_translate(&_kernel_mmu_ctx, virt + PAGE_SIZE,
+				     &phys) == EFAULT);
+		rc = mmu_translate(&_kernel_mmu_ctx, virt + 2 * PAGE_SIZE, &phys);
+		ASSERT((rc == 0) && (phys == 2 * PAGE_SIZE));
+		mmu_unmap_range(&_kernel_mmu_ctx, virt, LARGE_PAGE_SIZE, FALSE);
+		rc = mmu_translate(&_kernel_mmu_ctx, virt, &phys);
+		ASSERT(rc == EFAULT);
+	}
+	/* Page directories are reached through the physical map area */
+	ASSERT(CURR_PROC->vas->mmu->pdbr < _mmu_phys_map_end);
+	ASSERT(phys_map(CURR_PROC->vas->mmu->pdbr, PAGE_SIZE, 0) ==
+	       (void *)(ptr_t)CURR_PROC->vas->mmu->pdbr);
+	/* Kernel buffers and device windows come from the virtual range area */
+	buf = vmalloc(3 * PAGE_SIZE, MM_ZERO);
+	ASSERT(((ptr_t)buf >= KERNEL_VMAP_START) && ((ptr_t)buf < KERNEL_VMAP_END));
+	ASSERT(buf[3 * PAGE_SIZE - 1] == 0);
+	ASSERT(mmu_get_page(&_kernel_mmu_ctx, (ptr_t)buf + 3 * PAGE_SIZE, FALSE,
+			    0)->present == 0);
+	vfree(buf);
+	buf = ioremap(0xB8004, PAGE_SIZE);
+	ASSERT((buf != NULL) && (((ptr_t)buf % PAGE_SIZE) == 4));
+	ASSERT(mmu_get_page(&_kernel_mmu_ctx, (ptr_t)buf, FALSE, 0)->pcd);
+	iounmap(buf);
+	/* The context tracks this CORE, too many ranges flush everything */
+	ASSERT(CURR_PROC->vas->mmu->cores & (1UL << CURR_CORE->id));
+	mmu_gather_init(&g, CURR_PROC->vas->mmu, 0);
+	for (i = 0; i <= MMU_GATHER_MAX; i++) {
+		mmu_gather_add(&g, start + i * PAGE_SIZE, PAGE_SIZE);
+	}
+	ASSERT((g.nr == MMU_GATHER_MAX) && FLAG_ON(g.flags, MMU_FLUSH_ALL));
+	mmu_gather_flush(&g);
+	ASSERT((g.nr == 0) && (g.flags == 0));
+	/* Read-only file pages are shared through the frame cache */
+	n = vfs_lookup("/init", VFS_FILE);
+	cache = va_cache_create(0, PAGE_SIZE);
+	if (n && cache) {
+		rc = va_map_file(CURR_PROC->vas, 0, PAGE_SIZE, VA_MAP_READ, n,
+				 0, PAGE_SIZE, cache, &start);
+		ASSERT(rc == 0);
+		ASSERT(*((volatile u_char *)start) == 0x7F);
+		rc = va_map_file(CURR_PROC->vas, 0, PAGE_SIZE, VA_MAP_READ, n,
+				 0, PAGE_SIZE, cache, &virt);
+		ASSERT(rc == 0);
+		pp = mmu_get_page(CURR_PROC->vas->mmu, virt, FALSE, 0);
+		ASSERT(pp && pp->present);
+		ASSERT(mmu_pte_frame(pp) ==
+		       mmu_pte_frame(mmu_get_page(CURR_PROC->vas->mmu, start,
+						  FALSE, 0)));
+		va_unmap(CURR_PROC->vas, start, PAGE_SIZE);
+		va_unmap(CURR_PROC->vas, virt, PAGE_SIZE);
+	}
+	if (cache) {
+		va_cache_put(cache);
+	}
+	if (n) {
+		vfs_node_deref(n);
+	}
+	/* A page written out to swap is read back on the next touch */
+	devno = MKDEV(UT_RAMDISK_MAJOR, 0);
+	if (!_ut_ramdisk) {
+		_ut_ramdisk = vmalloc(UT_RAMDISK_SIZE, 0);
+		ASSERT(_ut_ramdisk != NULL);
+		rc = dev_register(UT_RAMDISK_MAJOR, "ut-ram");
+		ASSERT(rc == 0);
+		rc = dev_create(devno, DEV_CREATE, NULL, &d);
+		ASSERT(rc == 0);
+		d->ops = &_ut_ramdisk_ops;
+	}
+	/* Swap may already be on the compressed RAM disk */
+	rc = swap_on(devno, UT_RAMDISK_SIZE);
+	swapped = (rc == 0);
+	if (swapped || (rc == EBUSY)) {
+		rc = va_map(CURR_PROC->vas, 0, PAGE_SIZE, VA_MAP_READ|VA_MAP_WRITE,
+			    &start);
+		ASSERT(rc == 0);
+		memset((void *)start, 0x5A, PAGE_SIZE);
+		rc = swap_out_page(CURR_PROC->vas, start);
+		ASSERT(rc == 0);
+		pp = mmu_get_page(CURR_PROC->vas->mmu, start, FALSE, 0);
+		ASSERT(!pp->present && pp->swap);
+		ASSERT(((volatile u_char *)start)[PAGE_SIZE - 1] == 0x5A);
+		ASSERT(pp->present && !pp->swap);
+		rc = va_unmap(CURR_PROC->vas, start, PAGE_SIZE);
+		ASSERT(rc == 0);
+		if (swapped) {
+			rc = swap_off();
+			ASSERT(rc == 0);
+		}
+	}
+	/* Identical mergeable pages share a frame until one is written, the
+	 * pages are merged after two full passes over the address spaces
+	 */
+	rc = va_map(CURR_PROC->vas, 0, 2 * PAGE_SIZE,
+		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_MERGE, &start);
+	ASSERT(rc == 0);
+	memset((void *)start, 0xA5, 2 * PAGE_SIZE);
+	for (i = 0; i < 3; i++) {
+		ksm_scan_pass();
+	}
+	pp = mmu_get_page(CURR_PROC->vas->mmu, start, FALSE, 0);
+	frame = mmu_pte_frame(mmu_get_page(CURR_PROC->vas->mmu,
+					   start + PAGE_SIZE, FALSE, 0));
+	ASSERT(pp->present && pp->cow && !pp->rw && (mmu_pte_frame(pp) == frame));
+	ksm_get_stats(&ks);
+	ASSERT((ks.pages_shared >= 1) && (ks.full_scans >= 3));
+	ASSERT(ksm_space_merged(CURR_PROC->vas, &merged) && (merged >= 1));
+	*((volatile u_char *)start) = 0;
+	ASSERT(pp->rw && (mmu_pte_frame(pp) != frame));
+	ASSERT(((u_char *)start)[PAGE_SIZE] == 0xA5);
+	rc = va_unmap(CURR_PROC->vas, start, 2 * PAGE_SIZE);
+	ASSERT(rc == 0);
+	/* Two processes running the same binary share the frames of their
+	 * private data and BSS pages once these were merged
+	 */
+	n = vfs_lookup("/init", VFS_FILE);
+	if (n) {
+		for (i = 0; i < 2; i++) {
+			ut_vas[i] = va_create();
+			ASSERT(ut_vas[i] != NULL);
+			rc = elf_load_binary(n, ut_vas[i], &data);
+			ASSERT(rc == 0);
+			elf_finish_binary(data);
+			ut_touch_space(ut_vas[i]);
+		}
+		for (i = 0; i < 3; i++) {
+			ksm_scan_pass();
+		}
+		r = 0;
+		LIST_FOR_EACH(l, &ut_vas[0]->regions) {
+			reg = LIST_ENTRY(l, struct va_region, link);
+			if ((reg->type == VA_REGION_FREE) ||
+			    !FLAG_ON(reg->flags, VA_MAP_MERGE)) {
+				continue;
+			}
+			for (virt = reg->start; virt < reg->end;
+			     virt += PAGE_SIZE) {
+				pp = mmu_get_page(ut_vas[0]->mmu, virt, FALSE, 0);
+				ASSERT(pp && pp->present && pp->cow);
+				frame = mmu_pte_frame(pp);
+				pp = mmu_get_page(ut_vas[1]->mmu, virt, FALSE, 0);
+				ASSERT(pp && pp->present && pp->cow);
+				ASSERT(mmu_pte_frame(pp) == frame);
+			}
+			r++;
+		}
+		ASSERT(r >= 1);
+		for (i = 0; i < 2; i++) {
+			va_destroy(ut_vas[i]);
+		}
+		vfs_node_deref(n);
+	}
+	/* A replacing fixed mapping keeps the old one if it cannot be made */
+	rc = va_map(CURR_PROC->vas, 0, PAGE_SIZE, VA_MAP_READ|VA_MAP_WRITE,
+		    &start);
+	ASSERT(rc == 0);
+	*((volatile u_char *)start) = 0x3C;
+	rc = va_map(CURR_PROC->vas, start, USER_END - start + PAGE_SIZE,
+		    VA_MAP_READ|VA_MAP_FIXED|VA_MAP_REPLACE, NULL);
+	ASSERT(rc == EINVAL);
+	ASSERT(*((volatile u_char *)start) == 0x3C);
+	rc = va_map(CURR_PROC->vas, start, PAGE_SIZE,
+		    VA_MAP_READ|VA_MAP_WRITE|VA_MAP_ZERO|VA_MAP_FIXED|VA_MAP_REPLACE,
+		    NULL);
+	ASSERT(rc == 0);
+	ASSERT(*((volatile u_char *)start) == 0);
+	rc = va_unmap(CURR_PROC->vas, start, PAGE_SIZE);
+	ASSERT(rc == 0);
 	DEBUG(DL_DBG, ("memory map test finished.\n"));
 	
 
@@ -191,8 +612,24 @@ int sys_unit_test(uint32_t round)
 			break;
 		}
 	}
+	/* Objects freed on this CORE come back first from its magazine */
+	obj[0] = slab_cache_alloc(&ut_cache);
+	ASSERT(obj[0] != NULL);
+	slab_cache_free(&ut_cache, obj[0]);
+	ASSERT(slab_cache_alloc(&ut_cache) == obj[0]);
 	DEBUG(DL_DBG, ("slab cache test finished with round %d.\n", round));
 
+	/* Registered shrinkers are asked to free objects on memory pressure */
+	ASSERT(_page_wmark_low < _page_wmark_high);
+	shrinker_register(&_ut_shrinker);
+	reclaim_shrink(1);
+	ASSERT(_ut_shrink_count == 1);
+	/* The magazine of this CORE was flushed, the others are when idle */
+	ASSERT((CURR_CORE->id >= SLAB_MAX_CORES) ||
+	       (ut_cache.magazines[CURR_CORE->id].rounds == 0));
+	shrinker_unregister(&_ut_shrinker);
+	DEBUG(DL_DBG, ("reclaim test finished.\n"));
+
 	/* Test fsrtl functions */
 	rc = split_path(path, &dir, &name, 0);
 	if (rc == 0) {
@@ -250,6 +687,29 @@ int sys_unit_test(uint32_t round)
 	}
 	kfree(buckets);
 
+	/* A compressed page decompresses to the same data */
+	buf = kmalloc(3 * PAGE_SIZE, 0);
+	wrkmem = kmalloc(LZ4_WORKMEM_SIZE, 0);
+	if (buf && wrkmem) {
+		for (i = 0; i < PAGE_SIZE; i++) {
+			buf[i] = (u_char)((i % 61) ^ (i / 256));
+		}
+		size = lz4_compress(buf, PAGE_SIZE, buf + PAGE_SIZE, PAGE_SIZE,
+				    wrkmem);
+		ASSERT((size != 0) && (size < PAGE_SIZE));
+		rc = lz4_decompress(buf + PAGE_SIZE, size, buf + 2 * PAGE_SIZE,
+				    PAGE_SIZE);
+		ASSERT(rc == PAGE_SIZE);
+		ASSERT(memcmp(buf, buf + 2 * PAGE_SIZE, PAGE_SIZE) == 0);
+		rc = 0;
+	}
+	if (buf) {
+		kfree(buf);
+	}
+	if (wrkmem) {
+		kfree(wrkmem);
+	}
+
 
 	/* Multi-thread test */
 	semaphore_init(&sem, "unit-test-sem", 0);
@@ -260,6 +720,25 @@ int sys_unit_test(uint32_t round)
 	semaphore_down(&sem);
 	DEBUG(DL_DBG, ("Woke up by unittest.\n"));
 
+	/* Shrinking the heap shoots down the TLB of the COREs spinning on
+	 * the heap lock, they must flush it while they wait for the lock.
+	 */
+	if (_nr_cores > 1) {
+		_ut_heap_stop = FALSE;
+		semaphore_init(&sem, "ut-heap-sem", 0);
+		rc = thread_create("ut-heap", NULL, 0, ut_heap_thread, &sem, NULL);
+		ASSERT(rc == 0);
+		for (i = 0; i < 16; i++) {
+			buf = kmalloc(KERNEL_KMEM_SIZE, 0);
+			if (buf) {
+				kfree(buf);
+			}
+		}
+		_ut_heap_stop = TRUE;
+		semaphore_down(&sem);
+		DEBUG(DL_DBG, ("heap shootdown test finished.\n"));
+	}
+
  out:
 	for (i = 0; i < 4; i++) {
 		if (obj[i]) {
@@ -0,0 +1,27 @@
+#ifndef __SYS_MMAN_H__
+#define __SYS_MMAN_H__
+
+#include <types.h>
+
+/* Protection flags, they do not overlap with the map flags */
+#define PROT_NONE	0x00	// Pages may not be accessed
+#define PROT_READ	0x01	// Pages may be read
+#define PROT_WRITE	0x02	// Pages may be written
+#define PROT_EXEC	0x04	// Pages may be executed
+
+/* Map flags */
+#define MAP_SHARED	0x10	// Share changes
+#define MAP_PRIVATE	0x20	// Changes are private
+#define MAP_FIXED	0x40	// Map at exactly the specified address
+#define MAP_ANONYMOUS	0x80	// Map zero-filled memory, not a file
+
+#define MAP_FAILED	((void *)-1)
+
+#ifndef __KERNEL__
+extern void *mmap(void *start, size_t length, int prot, int flags, int fd,
+		  off_t offset);
+extern int munmap(void *start, size_t length);
+extern int mprotect(void *start, size_t length, int prot);
+#endif	/* No __KERNEL__ */
+
+#endif	/* __SYS_MMAN_H__ */
@@ -89,6 +89,9 @@ DECL_SYSCALL1(create_module, int);
 DECL_SYSCALL2(query_module, const char *, void *);
 DECL_SYSCALL1(delete_module, const char *);
 DECL_SYSCALL4(ioctl, int, int, void *, void *);
+DECL_SYSCALL5(mmap, void *, size_t, int, int, off_t);
+DECL_SYSCALL2(munmap, void *, size_t);
+DECL_SYSCALL3(mprotect, void *, size_t, int);
 /* System call declaration end */
 
 #endif	/* __SYSCALL_H__ */
@@ -25,7 +25,7 @@ typedef unsigned long u_long;
 typedef unsigned char u_char;
 
 /* Physical address type and memory size definition */
-typedef uint32_t phys_addr_t;
+typedef uint64_t phys_addr_t;
 typedef uint32_t phys_size_t;
 
 typedef int ptrdiff_t;
@@ -7,6 +7,7 @@
 #include <dirent.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 /* Definition of the system calls */
 DEFN_SYSCALL0(null, 0)
@@ -44,6 +45,9 @@ DEFN_SYSCALL1(create_module, 31, int)
 DEFN_SYSCALL2(query_module, 32, const char *, void *)
 DEFN_SYSCALL1(delete_module, 33, const char *)
 DEFN_SYSCALL4(ioctl, 34, int, int, void *, void *)
+DEFN_SYSCALL5(mmap, 35, void *, size_t, int, int, off_t)
+DEFN_SYSCALL2(munmap, 36, void *, size_t)
+DEFN_SYSCALL3(mprotect, 37, void *, size_t, int)
 
 int null()
 {
@@ -227,3 +231,19 @@ int ioctl(int d, int request, void *input, void *output)
 {
 	return mtx_ioctl(d, request, input, output);
 }
+
+void *mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	/* Protection and map flags do not overlap, pass them together */
+	return (void *)mtx_mmap(start, length, prot | flags, fd, offset);
+}
+
+int munmap(void *start, size_t length)
+{
+	return mtx_munmap(start, length);
+}
+
+int mprotect(void *start, size_t length, int prot)
+{
+	return mtx_mprotect(start, length, prot);
+}
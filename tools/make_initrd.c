@@ -4,6 +4,10 @@
 
 #define INITRD_MAGIC	0xBF
 
+/* File data is page aligned so the kernel can map it without copying */
+#define INITRD_ALIGN	4096
+#define INITRD_ROUND_UP(x)	(((x) + INITRD_ALIGN - 1) & ~(INITRD_ALIGN - 1))
+
 struct initrd_header {
 	unsigned char magic;
 	char name[64];
@@ -36,6 +40,7 @@ void main(int argc, char **argv)
 		FILE *fp;
 
 		headers[i].magic = INITRD_MAGIC;
+		off = INITRD_ROUND_UP(off);
 		
 		printf("writing file %s->%s at 0x%x\n", argv[i*2+1], argv[i*2+2], off);
 		strcpy(headers[i].name, argv[i*2+2]);
@@ -67,6 +72,11 @@ void main(int argc, char **argv)
 		FILE *fp = fopen(argv[i*2+1], "r");
 		unsigned char *buf = malloc(headers[i].length);
 
+		/* Pad up to the start of the file data */
+		while (ftell(wfp) < headers[i].offset) {
+			fputc(0, wfp);
+		}
+
 		fread(buf, 1, headers[i].length, fp);
 		fwrite(buf, 1, headers[i].length, wfp);
 		fclose(fp);
@@ -151,6 +151,14 @@ void load_modules()
 	} else {
 		printf("init: zero module loaded successfully.\n");
 	}
+
+	handle = 9;
+	rc = create_module(handle);
+	if (rc != 0) {
+		printf("init: load zram module failed.\n");
+	} else {
+		printf("init: zram module loaded successfully.\n");
+	}
 }
 
 void make_nodes()